@@ -29,34 +29,49 @@ class ProtoRegexEngine:
         SS_Full = "full memoization"
         SS_InDeg = "selective: indeg>1"
         SS_Loop = "selective: loop"
+        SS_Adaptive = "selective: adaptive"
 
         scheme2cox = {
             SS_None: "none",
             SS_Full: "full",
             SS_InDeg: "indeg",
             SS_Loop: "loop",
+            SS_Adaptive: "adaptive",
         }
 
         all = scheme2cox.keys()
-        allMemo = [ SS_Full, SS_InDeg, SS_Loop ]
+        allMemo = [ SS_Full, SS_InDeg, SS_Loop, SS_Adaptive ]
 
     class ENCODING_SCHEME:
         ES_None = "no encoding"
         ES_Negative = "negative encoding"
         ES_RLE = "RLE"
         ES_RLE_TUNED = "RLE-tuned"
+        ES_Bitset = "bitset"
 
         scheme2cox = {
             ES_None: "none",
             ES_Negative: "neg",
             ES_RLE: "rle",
             ES_RLE_TUNED: "rle-tuned", # TODO Work out the right math here
+            ES_Bitset: "bitset",
         }
 
         all = scheme2cox.keys()
 
+    class ENGINE:
+        EN_Backtrack = "backtracking"
+        EN_Pike = "Pike VM" # No memo table, no backreferences, no statistics
+
+        engine2cox = {
+            EN_Backtrack: "backtrack",
+            EN_Pike: "pike",
+        }
+
+        all = engine2cox.keys()
+
     @staticmethod
-    def buildQueryFile(pattern, input, filePrefix="protoRegexEngineQueryFile-", rleKValue=1):
+    def buildQueryFile(pattern, input, filePrefix="protoRegexEngineQueryFile-", rleKValue=0):
         """Build a query file
         
         pattern: string
@@ -76,19 +91,22 @@ class ProtoRegexEngine:
         return name
 
     @staticmethod
-    def query(selectionScheme, encodingScheme, queryFile, timeout=None):
+    def query(selectionScheme, encodingScheme, queryFile, timeout=None, engine=ENGINE.EN_Backtrack, flags=[]):
         """Query the engine
 
         selectionScheme: SELECTION_SCHEME
         encodingScheme: ENCODING_SCHEME
         queryFile: file path
         timeout: integer seconds before raising subprocess.TimeoutExpired
+        engine: ENGINE. The Pike VM has no statistics, so its EngineMeasurements has only the match.
+        flags: str[] of further options, e.g. [ '--memo-budget', '1' ]
 
         returns: EngineMeasurements
         raises: on rc != 0, or on timeout
         """
         rc, stdout, stderr = libLF.runcmd_OutAndErr(
             args= [ ProtoRegexEngine.CLI,
+              '--engine', ProtoRegexEngine.ENGINE.engine2cox[engine] ] + flags + [
               ProtoRegexEngine.SELECTION_SCHEME.scheme2cox[selectionScheme],
               ProtoRegexEngine.ENCODING_SCHEME.scheme2cox[encodingScheme],
               '-f', queryFile ],
@@ -104,8 +122,41 @@ class ProtoRegexEngine:
         if res:
           libLF.log("Wished for {} bits".format(res.group(1)))
         # libLF.log("stderr: <" + stderr + ">")
-        return ProtoRegexEngine.EngineMeasurements(stderr.strip(), "-no match-" in stdout)
+        res = re.search(r"^(match.*|-no match-|-budget exceeded-)$", stdout, re.MULTILINE)
+        return ProtoRegexEngine.EngineMeasurements(stderr.strip(), "-no match-" in stdout, res.group(1) if res else None)
     
+    @staticmethod
+    def batch(selectionScheme, encodingScheme, patternArgs, lines, flags=[], timeout=None):
+        """Match each of lines with re --batch
+
+        selectionScheme: SELECTION_SCHEME
+        encodingScheme: ENCODING_SCHEME
+        patternArgs: str[], e.g. [ pattern ] or [ '-s', patternsFile ]
+        lines: str[], one input (or NDJSON record) each
+        flags: str[] of options, e.g. [ '--ndjson', '--jobs', '4' ]
+        timeout: integer seconds before raising subprocess.TimeoutExpired
+
+        returns: str[], the result line for each of lines
+        raises: on rc != 0, or on timeout
+        """
+        fd, inputsFile = tempfile.mkstemp(suffix=".txt", prefix="protoRegexEngineBatchInputs-")
+        with os.fdopen(fd, 'w') as outStream:
+            for line in lines:
+                outStream.write(line + "\n")
+        try:
+            rc, stdout, stderr = libLF.runcmd_OutAndErr(
+                args= [ ProtoRegexEngine.CLI, '--batch' ] + flags + [
+                  ProtoRegexEngine.SELECTION_SCHEME.scheme2cox[selectionScheme],
+                  ProtoRegexEngine.ENCODING_SCHEME.scheme2cox[encodingScheme]
+                ] + patternArgs + [ inputsFile ],
+                timeout=timeout
+            )
+        finally:
+            os.unlink(inputsFile)
+        if rc != 0:
+            raise BaseException('Invocation failed; rc {} stdout\n  {}\n\nstderr\n  {}'.format(rc, stdout, stderr))
+        return stdout.splitlines()
+
     class EngineMeasurements:
         """Engine measurements
         
@@ -113,12 +164,15 @@ class ProtoRegexEngine:
         emitted by the regex engine.
         It offers some assurance of type safety.
         """
-        def __init__(self, measAsJSON, misMatched):
-            obj = json.loads(measAsJSON)
-            self._unpackInputInfo(obj['inputInfo'])
-            self._unpackMemoizationInfo(obj['memoizationInfo'])
-            self._unpackSimulationInfo(obj['simulationInfo'])
+        def __init__(self, measAsJSON, misMatched, matchLine=None):
+            # Empty without statistics (the Pike VM)
+            if measAsJSON:
+                obj = json.loads(measAsJSON)
+                self._unpackInputInfo(obj['inputInfo'])
+                self._unpackMemoizationInfo(obj['memoizationInfo'])
+                self._unpackSimulationInfo(obj['simulationInfo'])
             self.matched = not misMatched
+            self.matchLine = matchLine # "match (0,3) (1,2)", with the captures, "-no match-", or "-budget exceeded-"
         
         def _unpackInputInfo(self, dict):
             self.ii_lenW = int(dict['lenW'])
@@ -155,7 +209,7 @@ class SimpleRegex:
   def __init__(self):
     self.pattern = None
     self.evilInputs = []
-    self.rleKValue = 1
+    self.rleKValue = 0 # 0: the engine picks the RLE-tuned run lengths
     return
   
   def initFromNDJSON(self, line):
@@ -23,6 +23,7 @@ import itertools
 
 DEFAULT_SEMANTIC_TEST_SUITE = os.path.join(os.environ['MEMOIZATION_PROJECT_ROOT'], 'src-simple', 'test', 'semantic-behav.txt')
 DEFAULT_PERF_TEST_SUITE = os.path.join(os.environ['MEMOIZATION_PROJECT_ROOT'], 'src-simple', 'test', 'perf-behav.txt')
+DEFAULT_BUDGET_TEST_SUITE = os.path.join(os.environ['MEMOIZATION_PROJECT_ROOT'], 'src-simple', 'test', 'budget-behav.txt')
 
 shellDeps = [ libMemo.ProtoRegexEngine.CLI ]
 
@@ -42,6 +43,15 @@ class TestResult:
 
 class TestCase:
   """Test case"""
+  # The MEMO piece of the perf and budget suites
+  MEMO2SS = {
+    "NONE": libMemo.ProtoRegexEngine.SELECTION_SCHEME.SS_None,
+    "FULL": libMemo.ProtoRegexEngine.SELECTION_SCHEME.SS_Full,
+    "INDEG": libMemo.ProtoRegexEngine.SELECTION_SCHEME.SS_InDeg,
+    "ANCESTOR": libMemo.ProtoRegexEngine.SELECTION_SCHEME.SS_Loop,
+    "ADAPTIVE": libMemo.ProtoRegexEngine.SELECTION_SCHEME.SS_Adaptive,
+  }
+
   def __init__(self):
     assert(False) # Use factory method
   
@@ -51,6 +61,8 @@ class TestCase:
       return SemanticTestCase(pieces)
     elif testType == TestSuite.PERF_TEST:
       return PerformanceTestCase(pieces)
+    elif testType == TestSuite.BUDGET_TEST:
+      return BudgetTestCase(pieces)
     assert(False)
   
   def run(self):
@@ -58,17 +70,19 @@ class TestCase:
     # Subclass and overload
     assert(False)
   
-  def _queryEngine(self, ss, es, regex, input):
+  def _queryEngine(self, ss, es, regex, input, engine=libMemo.ProtoRegexEngine.ENGINE.EN_Backtrack, flags=[], timeout=None):
     """Returns rawCmd, validSyntax, EngineMeasurements"""
     try:
       queryFile = libMemo.ProtoRegexEngine.buildQueryFile(regex, input)
-      rawCmd = "{} {} {} '{}' {}".format(libMemo.ProtoRegexEngine.CLI,
+      rawCmd = "{} --engine {} {}{} {} '{}' {} singlerlek 0".format(libMemo.ProtoRegexEngine.CLI,
+            libMemo.ProtoRegexEngine.ENGINE.engine2cox[engine],
+            "".join(f + " " for f in flags),
             libMemo.ProtoRegexEngine.SELECTION_SCHEME.scheme2cox[ss],
             libMemo.ProtoRegexEngine.ENCODING_SCHEME.scheme2cox[es],
           regex, input
       )
       libLF.log("  Test case: {}".format(rawCmd))
-      em = libMemo.ProtoRegexEngine.query(ss, es, queryFile)
+      em = libMemo.ProtoRegexEngine.query(ss, es, queryFile, timeout=timeout, engine=engine, flags=flags)
       validSyntax = True
     except SyntaxError as err:
       validSyntax = False
@@ -86,11 +100,18 @@ class SemanticTestCase(TestCase):
     self.shouldMatch = (self.result == "MATCH")
     self.type = TestSuite.SEMANTIC_TEST
   
+  def _usesBackreferences(self):
+    """An unescaped \\1 .. \\9: the Pike VM rejects these"""
+    return re.search(r'(?<!\\)(?:\\\\)*\\[1-9]', self.regex) is not None
+
   def run(self):
     testResults = []
+    # Each engine's result line, with the captures
+    engine2matchLine = {}
 
-    # Semantics should be identical across all memoization treatments
-    for selectionScheme, encodingScheme in itertools.product(
+    # Semantics should be identical across all memoization treatments, and across the engines
+    for engine, selectionScheme, encodingScheme in itertools.product(
+      libMemo.ProtoRegexEngine.ENGINE.engine2cox.keys(),
       libMemo.ProtoRegexEngine.SELECTION_SCHEME.scheme2cox.keys(),
       libMemo.ProtoRegexEngine.ENCODING_SCHEME.scheme2cox.keys()
     ):
@@ -98,8 +119,14 @@ class SemanticTestCase(TestCase):
       if libMemo.ProtoRegexEngine.SELECTION_SCHEME.scheme2cox[selectionScheme] == "none" and \
          libMemo.ProtoRegexEngine.ENCODING_SCHEME.scheme2cox[encodingScheme] != "none":
          continue
+      # The Pike VM has no memo table, and no backreferences
+      if engine == libMemo.ProtoRegexEngine.ENGINE.EN_Pike and \
+         (libMemo.ProtoRegexEngine.SELECTION_SCHEME.scheme2cox[selectionScheme] != "none" or self._usesBackreferences()):
+         continue
 
-      rawCmd, validRegex, em = self._queryEngine(selectionScheme, encodingScheme, self.regex, self.input)
+      rawCmd, validRegex, em = self._queryEngine(selectionScheme, encodingScheme, self.regex, self.input, engine)
+      if validRegex and libMemo.ProtoRegexEngine.SELECTION_SCHEME.scheme2cox[selectionScheme] == "none":
+        engine2matchLine[engine] = (em.matchLine, rawCmd)
 
       # Calculate the TestResult
       if validRegex:
@@ -117,6 +144,11 @@ class SemanticTestCase(TestCase):
           tr = TestResult(False, "Incorrect, syntax error for /{}/".format(self.regex))
       
       testResults.append(tr)
+
+    # Same captures from the Pike VM as from the backtracker
+    if len(engine2matchLine) > 1:
+      (btLine, btCmd), (pikeLine, pikeCmd) = [ engine2matchLine[e] for e in libMemo.ProtoRegexEngine.ENGINE.engine2cox.keys() ]
+      testResults.append(TestResult(btLine == pikeLine, "Incorrect, match(/{}/, {}): backtracking gives {} but the Pike VM {} -- try {}".format(self.regex, self.input, btLine, pikeLine, pikeCmd)))
     return testResults
 
 class PerformanceTestCase(TestCase):
@@ -125,7 +157,13 @@ class PerformanceTestCase(TestCase):
   CURVE_LIN = "linear"
 
   def __init__(self, pieces):
-    regex, evilInput, memo, curve = pieces
+    # An optional fifth piece holds engine flags, e.g. "--memo-budget 1"
+    if len(pieces) == 5:
+      regex, evilInput, memo, curve, flags = pieces
+      self.flags = flags.split()
+    else:
+      regex, evilInput, memo, curve = pieces
+      self.flags = []
     self.regex = regex
     ei_pref, ei_pump, ei_suff = [p.strip() for p in evilInput.split(":")]
     self.evilInput = libLF.EvilInput().initFromRaw(
@@ -134,16 +172,9 @@ class PerformanceTestCase(TestCase):
       ei_suff
     )
 
-    if memo == "NONE":
-      self.memoSS = libMemo.ProtoRegexEngine.SELECTION_SCHEME.SS_None
-    elif memo == "FULL":
-      self.memoSS = libMemo.ProtoRegexEngine.SELECTION_SCHEME.SS_Full
-    elif memo == "INDEG":
-      self.memoSS = libMemo.ProtoRegexEngine.SELECTION_SCHEME.SS_InDeg
-    elif memo == "ANCESTOR":
-      self.memoSS = libMemo.ProtoRegexEngine.SELECTION_SCHEME.SS_Loop
-    else:
+    if memo not in TestCase.MEMO2SS:
       raise SyntaxError("Unexpected memo " + memo)
+    self.memoSS = TestCase.MEMO2SS[memo]
 
     if curve == "EXP":
       self.curve = PerformanceTestCase.CURVE_EXP
@@ -166,10 +197,10 @@ class PerformanceTestCase(TestCase):
     # Collect visit counts as we increase pump
     for nPumps in range(1, maxPumps):
       input = self.evilInput.build(nPumps)[0]
-      rawCmd, validRegex, em = self._queryEngine(self.memoSS, libMemo.ProtoRegexEngine.ENCODING_SCHEME.ES_None, self.regex, input)
+      rawCmd, validRegex, em = self._queryEngine(self.memoSS, libMemo.ProtoRegexEngine.ENCODING_SCHEME.ES_None, self.regex, input, flags=self.flags)
       assert(validRegex)
 
-      if not baselineVisits:
+      if baselineVisits is None:
         assert(nPumps == 1)
         baselineVisits = em.si_nTotalVisits
 
@@ -210,11 +241,37 @@ class PerformanceTestCase(TestCase):
     elif expectedCurve == PerformanceTestCase.CURVE_LIN:
       return len(set(firstDifferences)) == 1
 
+class BudgetTestCase(TestCase):
+  """A query under budget flags (--max-steps, --budget-retry, ...), and the result line re should print"""
+  # Seconds: a budget that is not enforced would search for far longer
+  TIMEOUT = 60
+
+  def __init__(self, pieces):
+    self.regex, self.input, memo, flags, self.result = pieces
+    if memo not in TestCase.MEMO2SS:
+      raise SyntaxError("Unexpected memo " + memo)
+    self.memoSS = TestCase.MEMO2SS[memo]
+    # The statistics are not checked
+    self.flags = flags.split() + [ '--stats', 'none' ]
+
+  def run(self):
+    try:
+      rawCmd, validRegex, em = self._queryEngine(self.memoSS, libMemo.ProtoRegexEngine.ENCODING_SCHEME.ES_None, self.regex, self.input,
+        flags=self.flags, timeout=BudgetTestCase.TIMEOUT)
+    except subprocess.TimeoutExpired:
+      return [ TestResult(False, "{} on {} with {}: no result after {} seconds".format(self.regex, self.input, self.flags, BudgetTestCase.TIMEOUT)) ]
+    assert(validRegex)
+    return [
+      TestResult(em.matchLine == self.result, "Incorrect, /{}/ on {} with {}: {} but expected {} -- try {}".format(self.regex, self.input, self.flags, em.matchLine, self.result, rawCmd))
+    ]
+
 class TestSuite:
   """A collection of test cases"""
 
   SEMANTIC_TEST = "semantics"
   PERF_TEST = "performance"
+  BATCH_TEST = "batch"
+  BUDGET_TEST = "budget"
 
   def __init__(self, testSuiteFile, testsType):
     self.testSuiteFile = testSuiteFile
@@ -281,9 +338,120 @@ class TestSuite:
 
     return nFailures
 
-def main(semanticsTestsFile, semanticOnly, performanceTestsFile, perfOnly):
-  libLF.log('semanticsTestsFile {} semanticOnly, performanceTestsFile {} perfOnly {}' \
-    .format(semanticsTestsFile, semanticOnly, performanceTestsFile, perfOnly))
+class BatchTestSuite(TestSuite):
+  """re --batch over the semantic suite: each regex against all of its inputs at once"""
+
+  def __init__(self, testSuiteFile):
+    super().__init__(testSuiteFile, TestSuite.BATCH_TEST)
+
+  def _loadTests(self):
+    """Returns [ (regex, [ (input, shouldMatch) ]) ] for the regexes with valid syntax, in file order"""
+    regex2cases = {}
+    with open(self.testSuiteFile, 'r') as inStream:
+      for line in inStream:
+        pieces = self._parse(line)
+        if not pieces:
+          continue
+        regex, input, result = pieces
+        if result != "SYNTAX":
+          regex2cases.setdefault(regex, []).append((input, result == "MATCH"))
+    libLF.log("Loaded {} regexes for {} tests from {}".format(len(regex2cases), self.type, self.testSuiteFile))
+    return list(regex2cases.items())
+
+  def _batch(self, patternArgs, lines, flags=[], selectionScheme=libMemo.ProtoRegexEngine.SELECTION_SCHEME.SS_None):
+    return libMemo.ProtoRegexEngine.batch(
+      selectionScheme,
+      libMemo.ProtoRegexEngine.ENCODING_SCHEME.ES_None,
+      patternArgs, lines, flags
+    )
+
+  def _checkLines(self, regex, cases):
+    """One result line per input, agreeing with the suite"""
+    results = self._batch([ regex ], [ input for input, _ in cases ])
+    matched = [ not line.startswith("-no match-") for line in results ]
+    expected = [ shouldMatch for _, shouldMatch in cases ]
+    return TestResult(matched == expected, "{}: --batch results {} but expected matches {}".format(regex, results, expected))
+
+  def _checkNDJSON(self, regex, cases):
+    """The same results from NDJSON records, and a record without an "input" gets its own line without ending the batch"""
+    inputs = [ input for input, _ in cases ]
+    expected = self._batch([ regex ], inputs)
+    expected.insert(1, "-bad record-")
+    records = [ json.dumps({ "input": input }) for input in inputs ]
+    records.insert(1, json.dumps({ "noInput": True }))
+    results = self._batch([ regex ], records, [ '--ndjson' ])
+    return TestResult(results == expected, "{}: --batch --ndjson results {} but expected {}".format(regex, results, expected))
+
+  def _checkJobs(self, regex, lines):
+    """--jobs 4 (many chunks, stolen between workers) writes what --jobs 1 does, in input order.
+    Other regexes' inputs can be slow for this one, so it is memoized and bounded (the step count is deterministic)."""
+    flags = [ '--max-steps', '100000' ]
+    ss = libMemo.ProtoRegexEngine.SELECTION_SCHEME.SS_Full
+    expected = self._batch([ regex ], lines, flags + [ '--jobs', '1' ], ss)
+    results = self._batch([ regex ], lines, flags + [ '--jobs', '4' ], ss)
+    return TestResult(results == expected, "{}: --batch --jobs 4 differs from --jobs 1 on {} inputs".format(regex, len(lines)))
+
+  def _checkSet(self, inputs):
+    """-s: every regex in one set, against every input. Pattern i is reported iff it matches alone.
+    Bounded as in _checkJobs; an input past the budget is left out of the comparison."""
+    flags = [ '--max-steps', '100000' ]
+    ss = libMemo.ProtoRegexEngine.SELECTION_SCHEME.SS_Full
+    regexes = [ regex for regex, _ in self.tests ]
+
+    # The ids each input should get, from each regex alone
+    expected = [ [] for _ in inputs ]
+    exceeded = set()
+    for i, regex in enumerate(regexes):
+      for j, line in enumerate(self._batch([ regex ], inputs, flags, ss)):
+        if line.startswith("-budget exceeded-"):
+          exceeded.add(j)
+        elif not line.startswith("-no match-"):
+          expected[j].append(i)
+
+    fd, patternsFile = tempfile.mkstemp(suffix=".txt", prefix="unittestBatchSet-")
+    with os.fdopen(fd, 'w') as outStream:
+      for regex in regexes:
+        outStream.write(regex + "\n")
+    try:
+      results = self._batch([ '-s', patternsFile ], inputs, flags, ss)
+    finally:
+      os.unlink(patternsFile)
+
+    testResults = []
+    if len(results) != len(inputs):
+      return [ TestResult(False, "--batch -s gave {} result lines for {} inputs".format(len(results), len(inputs))) ]
+    for j, (input, line) in enumerate(zip(inputs, results)):
+      if j in exceeded or line.startswith("-budget exceeded-"):
+        continue
+      ids = [ int(id) for id in line.split()[1:] ] if line.startswith("match") else []
+      testResults.append(TestResult(ids == expected[j], "<{}>: --batch -s matched patterns {} but alone {} match".format(input, ids, expected[j])))
+    return testResults
+
+  def run(self):
+    """Returns nFailures"""
+    # Every input in the suite, enough times over to fill several chunks per worker
+    allInputs = [ input for _, cases in self.tests for input, _ in cases ] * 20
+
+    testFailures = []
+    for regex, cases in self.tests:
+      for testResult in [ self._checkLines(regex, cases), self._checkNDJSON(regex, cases), self._checkJobs(regex, allInputs) ]:
+        if not testResult.success:
+          testFailures.append(testResult.failureMsg)
+    for testResult in self._checkSet(sorted(set(allInputs))):
+      if not testResult.success:
+        testFailures.append(testResult.failureMsg)
+
+    if testFailures:
+      libLF.log("{} {} tests failed:".format(len(testFailures), self.type))
+      for failDescr in testFailures:
+        libLF.log("  {}".format(failDescr))
+    else:
+      libLF.log("All {} tests passed for {} regexes".format(self.type, len(self.tests)))
+    return len(testFailures)
+
+def main(semanticsTestsFile, semanticOnly, performanceTestsFile, perfOnly, budgetTestsFile):
+  libLF.log('semanticsTestsFile {} semanticOnly, performanceTestsFile {} perfOnly {} budgetTestsFile {}' \
+    .format(semanticsTestsFile, semanticOnly, performanceTestsFile, perfOnly, budgetTestsFile))
 
   #### Check dependencies
   libLF.checkShellDependencies(shellDeps)
@@ -293,15 +461,20 @@ def main(semanticsTestsFile, semanticOnly, performanceTestsFile, perfOnly):
   
   for testType, testsFile in [
     (TestSuite.SEMANTIC_TEST, semanticsTestsFile),
+    (TestSuite.BATCH_TEST, semanticsTestsFile),
+    (TestSuite.BUDGET_TEST, budgetTestsFile),
     (TestSuite.PERF_TEST, performanceTestsFile)
   ]:
     if perfOnly and testType != TestSuite.PERF_TEST:
       continue
-    if semanticOnly and testType != TestSuite.SEMANTIC_TEST:
+    if semanticOnly and testType == TestSuite.PERF_TEST:
       continue
 
     libLF.log("Loading {} tests from {}".format(testType, testsFile))
-    ts = TestSuite(testsFile, testType)
+    if testType == TestSuite.BATCH_TEST:
+      ts = BatchTestSuite(testsFile)
+    else:
+      ts = TestSuite(testsFile, testType)
 
     libLF.log("Running {} tests".format(testType))
     nFailures = ts.run()
@@ -321,9 +494,11 @@ parser.add_argument('--semanticOnly', default=False, action='store_true', help='
 parser.add_argument('--performanceTestsFile', type=str, default=DEFAULT_PERF_TEST_SUITE, help='In: Test suite file of inputs and outputs. Format is described in the default file, {}'.format(DEFAULT_PERF_TEST_SUITE), required=False,
   dest='performanceTestsFile')
 parser.add_argument('--perfOnly', default=False, action='store_true', help='Skip semantic tests')
+parser.add_argument('--budgetTestsFile', type=str, default=DEFAULT_BUDGET_TEST_SUITE, help='In: Test suite file of budgeted queries and results. Format is described in the default file, {}'.format(DEFAULT_BUDGET_TEST_SUITE), required=False,
+  dest='budgetTestsFile')
 
 # Parse args
 args = parser.parse_args()
 
 # Here we go!
-main(args.semanticsTestsFile, args.semanticOnly, args.performanceTestsFile, args.perfOnly)
+main(args.semanticsTestsFile, args.semanticOnly, args.performanceTestsFile, args.perfOnly, args.budgetTestsFile)
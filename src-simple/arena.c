@@ -0,0 +1,98 @@
+// Copyright 2020 James C. Davis.  All Rights Reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "arena.h"
+#include "regexp.h"
+
+struct ArenaBlock
+{
+	ArenaBlock *next;
+	size_t dataBytes;
+	max_align_t data[];
+};
+
+#define ARENA_ALIGN (sizeof(max_align_t))
+
+/* Standard blocks that Arena_free has kept for the next Arena.
+ * Handing them all back to malloc lets it trim the heap, and the next compilation faults the pages in again.
+ * Like the parser's state, this is not thread-safe. */
+#define ARENA_MAX_SPARE 32
+static ArenaBlock *spare;
+static int nSpare;
+
+void
+Arena_init(Arena *a)
+{
+	a->blocks = NULL;
+	a->next = a->end = NULL;
+	a->nBytes = 0;
+}
+
+static ArenaBlock *
+_newBlock(size_t dataBytes)
+{
+	ArenaBlock *b;
+
+	if (dataBytes == ARENA_BLOCK_BYTES && spare != NULL) {
+		b = spare;
+		spare = b->next;
+		nSpare--;
+		memset(b->data, 0, dataBytes);
+	} else {
+		b = mal(sizeof *b + dataBytes);
+		b->dataBytes = dataBytes;
+	}
+	b->next = NULL;
+	return b;
+}
+
+void *
+Arena_alloc(Arena *a, size_t n)
+{
+	ArenaBlock *b;
+	void *p;
+
+	n = (n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	a->nBytes += n;
+	if (n > ARENA_BLOCK_BYTES / 4) {
+		/* Its own block, behind the current one so the current one's free space is kept */
+		b = _newBlock(n);
+		if (a->blocks == NULL) {
+			a->blocks = b;
+			a->next = a->end = (char *) b->data + n;
+		} else {
+			b->next = a->blocks->next;
+			a->blocks->next = b;
+		}
+		return b->data;
+	}
+	if ((size_t) (a->end - a->next) < n) {
+		b = _newBlock(ARENA_BLOCK_BYTES);
+		b->next = a->blocks;
+		a->blocks = b;
+		a->next = (char *) b->data;
+		a->end = a->next + ARENA_BLOCK_BYTES;
+	}
+	p = a->next;
+	a->next += n;
+	return p;
+}
+
+void
+Arena_free(Arena *a)
+{
+	ArenaBlock *b, *next;
+
+	for (b = a->blocks; b != NULL; b = next) {
+		next = b->next;
+		if (b->dataBytes == ARENA_BLOCK_BYTES && nSpare < ARENA_MAX_SPARE) {
+			b->next = spare;
+			spare = b;
+			nSpare++;
+		} else {
+			free(b);
+		}
+	}
+	Arena_init(a);
+}
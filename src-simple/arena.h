@@ -0,0 +1,32 @@
+// Copyright 2020 James C. Davis.  All Rights Reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* A bump allocator: allocations are never freed one by one, only all at once by Arena_free.
+ * Memory comes in blocks of ARENA_BLOCK_BYTES; a larger allocation gets a block of its own.
+ * Arena_free keeps a few standard blocks for the next Arena. */
+
+#define ARENA_BLOCK_BYTES (64 * 1024)
+
+typedef struct Arena Arena;
+typedef struct ArenaBlock ArenaBlock;
+
+struct Arena
+{
+	ArenaBlock *blocks; /* Newest first */
+	char *next; /* Free space in blocks[0] */
+	char *end;
+	size_t nBytes; /* Handed out so far */
+};
+
+void Arena_init(Arena *a);
+/* n zeroed bytes, aligned for any type */
+void *Arena_alloc(Arena *a, size_t n);
+void Arena_free(Arena *a);
+
+#endif /* ARENA_H */
@@ -4,6 +4,7 @@
 //
 // Annotations, statistics, and memoization by James Davis, 2020.
 
+#define _GNU_SOURCE /* memmem */
 #include "regexp.h"
 #include "memoize.h"
 #include "statistics.h"
@@ -11,6 +12,21 @@
 
 #include <assert.h>
 
+/* Dispatch in the backtracking loop.
+ * With GCC (labels-as-values) each Inst is pre-resolved to the address of its handler, and memoized Insts get
+ * their own handlers, so the loop never tests an unmemoized Inst for a memo slot.
+ * Elsewhere, or when built with -DBACKTRACK_SWITCH ("make DISPATCH=switch"), the loop is a switch on the opcode. */
+#if defined(__GNUC__) && !defined(BACKTRACK_SWITCH)
+#define BACKTRACK_THREADED 1
+#else
+#define BACKTRACK_THREADED 0
+#endif
+
+/* A _backtrack not specialized on the memo encoding */
+#define MEMO_ENCODING_ANY -1
+/* A _backtrack specialized on Memo.window's pages (ENCODING_NONE and ENCODING_BITSET with Prog.memoWindow) */
+#define MEMO_ENCODING_WINDOW -2
+
 /* Misc. */
 
 typedef struct Thread Thread;
@@ -32,7 +48,8 @@ thread(Inst *pc, char *sp, Sub *sub)
 }
 
 /****** Backtracking stack ("ThreadVec") ********/
-/* Supports arbitrary input length instead of max of 1K -- dynamic stack reallocation. */
+/* Supports arbitrary input length instead of max of 1K -- dynamic stack reallocation.
+ * Threads are pushed at the current sp, which only moves forward, so threads[0] has the least sp. */
 
 typedef struct ThreadVec ThreadVec;
 struct ThreadVec
@@ -104,54 +121,116 @@ ThreadVec_push(ThreadVec *tv, Thread t)
   assert(tv->nThreads <= tv->maxThreads);
 }
 
-/***** Helpers for evaluating complex Instructions *****/
+/****** Per-match scratch ("MatchCtx") ********/
+/* Kept across matches so repeated calls do not re-allocate the stack and memo table. */
 
-static int
-_inCharClass(Inst *pc, char c)
+struct MatchCtx
 {
-  int i, j;
-  int inThisRange = 0, inAnyInstCharRange = 0;
-
-  // Test for membership in each of the CharRange conditions
-  for (i = 0; i < pc->charRangeCounts; i++) {
-    logMsg(LOG_DEBUG, "testing range %d of %d (inv this one? %d)", i, pc->charRangeCounts, pc->invert ? 1 : 0);
-    inThisRange = 0;
-    for (j = 0; j < pc->charRanges[i].count; j++) {
-      logMsg(LOG_DEBUG, "testing range %d.%d: [%d, %d]", i, j, pc->charRanges[i].lows[j], pc->charRanges[i].highs[j]);
-      inThisRange += pc->charRanges[i].lows[j] <= (int) c && (int) c <= pc->charRanges[i].highs[j];
-    }
+  ThreadVec ready; /* The backtracking stack */
+  SubPool subs;
+  Memo memo;
+  Prog *memoProg; /* memo was initialized for this Prog; NULL if never */
+  StatsTotals totals; /* Accumulated here if Prog.statsAggregate */
+  MatchUsage usage; /* The last search's */
+  const void **handlers; /* Threaded dispatch: handlers[i] runs Prog.start[i] */
+  int maxHandlers;
+  /* backtrackSetCtx */
+  char *setMatched; /* setMatched[k] once pattern k has matched */
+  char *setDone; /* Pattern k has matched, or its required literal is not in the input: not worth a start */
+  int *setDepth; /* The depth of ready when the root pushed pattern k: its threads are the ones above */
+  int setCap;
+  int nSetLeft; /* Patterns not done */
+};
 
-    // Invert the inner formula
-    if (pc->charRanges[i].invert)
-      inThisRange = !inThisRange;
+MatchCtx *
+MatchCtx_create(void)
+{
+  MatchCtx *ctx = mal(sizeof(*ctx));
+  ctx->ready = ThreadVec_alloc();
+  SubPool_init(&ctx->subs);
+  ctx->memoProg = NULL;
+  StatsTotals_init(&ctx->totals);
+  return ctx;
+}
 
-    if (inThisRange) {
-      logMsg(LOG_VERBOSE, "in range %d", i);
-      inAnyInstCharRange = 1;
-    }
+const StatsTotals *
+MatchCtx_totals(MatchCtx *ctx)
+{
+  return &ctx->totals;
+}
+
+const MatchUsage *
+MatchCtx_usage(MatchCtx *ctx)
+{
+  return &ctx->usage;
+}
+
+void
+MatchCtx_mergeTotals(MatchCtx *into, MatchCtx *from)
+{
+  StatsTotals_merge(&into->totals, &from->totals);
+}
+
+void
+MatchCtx_free(MatchCtx *ctx)
+{
+  ThreadVec_free(&ctx->ready);
+  SubPool_destroy(&ctx->subs);
+  free(ctx->handlers);
+  free(ctx->setMatched);
+  free(ctx->setDone);
+  free(ctx->setDepth);
+  if (ctx->memoProg != NULL)
+    freeMemoTable(ctx->memo);
+  free(ctx);
+}
+
+/* An empty memo table for this prog and input */
+static Memo *
+MatchCtx_memo(MatchCtx *ctx, Prog *prog, int nChars)
+{
+  if (ctx->memoProg == prog) {
+    resetMemoTable(&ctx->memo, prog, nChars);
+  } else {
+    if (ctx->memoProg != NULL)
+      freeMemoTable(ctx->memo);
+    ctx->memo = initMemoTable(prog, nChars);
+    ctx->memoProg = prog;
   }
+  return &ctx->memo;
+}
 
-  // Apply top-level inversion
-  if ( (inAnyInstCharRange && !pc->invert) || (!inAnyInstCharRange && pc->invert) )
-    return 1;
-  return 0;
+#if BACKTRACK_THREADED
+/* Room for one handler per Inst of a Prog with len Insts */
+static const void **
+MatchCtx_handlers(MatchCtx *ctx, int len)
+{
+  if (len > ctx->maxHandlers) {
+    free(ctx->handlers);
+    ctx->handlers = mal(len * sizeof(*ctx->handlers));
+    ctx->maxHandlers = len;
+  }
+  return ctx->handlers;
 }
+#endif
+
+/***** Helpers for evaluating complex Instructions *****/
 
 static int
 _stringCompare(Inst *pc, Sub *sub, char *sp, char *inputEOL)
 {
-  static char msg[128];
+  char msg[128];
 
   // CG is not set -- match the empty string
-  if (sub->sub[CGID_TO_SUB_STARTP_IX(pc->cgNum)] == nil || sub->sub[CGID_TO_SUB_ENDP_IX(pc->cgNum)] == nil) {
-    logMsg(LOG_DEBUG, "CG %d not set yet (startpix %d endpix %d). We match the empty string", pc->cgNum, CGID_TO_SUB_STARTP_IX(pc->cgNum), CGID_TO_SUB_ENDP_IX(pc->cgNum));
+  if (sub->sub[CGID_TO_SUB_STARTP_IX(pc->c)] == nil || sub->sub[CGID_TO_SUB_ENDP_IX(pc->c)] == nil) {
+    logMsg(LOG_DEBUG, "CG %d not set yet (startpix %d endpix %d). We match the empty string", pc->c, CGID_TO_SUB_STARTP_IX(pc->c), CGID_TO_SUB_ENDP_IX(pc->c));
     return 0;
   }
 
-  logMsg(LOG_DEBUG, "CG %d set, checking match", pc->cgNum);
+  logMsg(LOG_DEBUG, "CG %d set, checking match", pc->c);
 
-  char *begin = CGID_TO_STARTP(sub, pc->cgNum);
-  char *end = CGID_TO_ENDP(sub, pc->cgNum);
+  char *begin = CGID_TO_STARTP(sub, pc->c);
+  char *end = CGID_TO_ENDP(sub, pc->c);
   int charsRemaining = inputEOL - sp;
   logMsg(LOG_DEBUG, "charsRemaining %d end-begin %d", charsRemaining, end-begin);
 
@@ -172,8 +251,8 @@ _stringCompare(Inst *pc, Sub *sub, char *sp, char *inputEOL)
   return -1;
 }
 
-static int
-_testInlineZeroWidthAssertion(Inst *pc, char *sp, int isBegin, int isEnd)
+int
+testInlineZeroWidthAssertion(Inst *pc, char *sp, int isBegin, int isEnd)
 {
   int satisfied = 0;
   switch (pc->c) {
@@ -192,10 +271,10 @@ _testInlineZeroWidthAssertion(Inst *pc, char *sp, int isBegin, int isEnd)
       int prev_c = *(sp-1);
       int curr_c = *sp;
 
-      // TODO This re-defines \w and \W in terms of IS_WORD_CHAR instead of in terms of ranges
-      // It would be cleaner to have a static compiled version of '\w' and '\W' nodes, and apply those nodes here.
-      int prev_w = IS_WORD_CHAR(prev_c);
-      int curr_w = IS_WORD_CHAR(curr_c);
+      // Same table as a \w CharClass
+      const CharClassMap *wordMap = CharClassMap_builtin('w');
+      int prev_w = CCMAP_HAS(wordMap, prev_c);
+      int curr_w = CCMAP_HAS(wordMap, curr_c);
 
       isWordBoundary = (prev_w ^ curr_w);
     } 
@@ -223,6 +302,33 @@ _testInlineZeroWidthAssertion(Inst *pc, char *sp, int isBegin, int isEnd)
   return satisfied;
 }
 
+/***** Prefilter *****/
+
+/* The first start at or after sp from which the Prog's literals allow a match; NULL if there is none.
+ * *reqAt caches the offset of the next litRequired at or after the last start (-1 before any).
+ * glibc's memmem and memchr are vectorized, so a miss costs about one pass over the input. */
+static char *
+_nextStart(Prog *prog, char *input, char *sp, char *inputEOL, int *reqAt)
+{
+  char *req;
+
+  if (prog->litPrefixLen > 0) {
+    sp = memmem(sp, inputEOL - sp, prog->litPrefix, prog->litPrefixLen);
+    if (sp == NULL)
+      return NULL;
+  }
+
+  /* A match from sp contains litRequired at or after sp */
+  if (prog->litRequiredLen > 0 && *reqAt < sp - input) {
+    req = memmem(sp, inputEOL - sp, prog->litRequired, prog->litRequiredLen);
+    if (req == NULL)
+      return NULL;
+    *reqAt = req - input;
+  }
+
+  return sp;
+}
+
 /***** Backtracking core *****/
 
 // Offset of sp relative to start of string ("w").
@@ -232,44 +338,182 @@ woffset(char *input, char *sp)
   return (int) (sp - input);
 }
 
-int
-backtrack(Prog *prog, char *input, /* start-end pointers for each CG */ char **subp, /* Length of subp */ int nsubp)
+/* markMemo, resolved at compile time when the encoding is known */
+static inline __attribute__((always_inline)) int
+_markMemo(Memo *memo, const int encoding, int statenum, int woffset, Sub *sub)
 {
-  Memo memo;
+  switch (encoding) {
+  case ENCODING_NONE:
+    return markMemoNone(memo, statenum, woffset);
+  case ENCODING_BITSET:
+    return markMemoBitset(memo, statenum, woffset);
+  case MEMO_ENCODING_WINDOW:
+    return markMemoWindow(memo, statenum, woffset);
+  default:
+    return markMemo(memo, statenum, woffset, sub);
+  }
+}
+
+#if BACKTRACK_THREADED
+/* Each opcode X has one plain handler, op_X, and one memo handler per encoding, which marks the memo table first:
+ * memo_X (any encoding, through markMemo), memoNone_X, memoBitset_X and memoWindow_X. */
+#define VM_CASE(op) case op: op_##op
+#define VM_MEMO_HANDLERS(op) \
+  memo_##op: \
+    if (markMemo(memo, pc->memoStateNum, woffset(input, sp), sub)) \
+      goto MemoHit; \
+    goto op_##op; \
+  memoNone_##op: \
+    if (markMemoNone(memo, pc->memoStateNum, woffset(input, sp))) \
+      goto MemoHit; \
+    goto op_##op; \
+  memoBitset_##op: \
+    if (markMemoBitset(memo, pc->memoStateNum, woffset(input, sp))) \
+      goto MemoHit; \
+    goto op_##op; \
+  memoWindow_##op: \
+    if (markMemoWindow(memo, pc->memoStateNum, woffset(input, sp))) \
+      goto MemoHit; \
+    goto op_##op;
+/* The family of handlers named prefix##X, indexed by opcode */
+#define VM_HANDLER_TABLE(prefix) { \
+    [Char] = &&prefix##Char, [Match] = &&prefix##Match, [RecursiveMatch] = &&prefix##RecursiveMatch, \
+    [Jmp] = &&prefix##Jmp, [Split] = &&prefix##Split, [SplitMany] = &&prefix##SplitMany, \
+    [Any] = &&prefix##Any, [CharClass] = &&prefix##CharClass, [Save] = &&prefix##Save, \
+    [StringCompare] = &&prefix##StringCompare, [InlineZeroWidthAssertion] = &&prefix##InlineZeroWidthAssertion, \
+    [RecursiveZeroWidthAssertion] = &&prefix##RecursiveZeroWidthAssertion, [String] = &&prefix##String, \
+    [CountInit] = &&prefix##CountInit, [CountLoop] = &&prefix##CountLoop, \
+  }
+/* GCC never inlines a function with computed gotos. The handler table does the specializing instead. */
+#define BACKTRACK_INLINE
+#else
+#define VM_CASE(op) case op
+/* Inlined into each instantiation in backtrackCtx() */
+#define BACKTRACK_INLINE inline __attribute__((always_inline))
+#endif
+
+/* Every so many steps: has the search used up Prog.budget? If not, count off the next steps to check after.
+ * usage->steps runs to the end of the count, so the step about to run is its last. */
+static __attribute__((noinline)) int
+_budgetSpent(Prog *prog, Memo *memo, MatchUsage *usage, int *tick, uint64_t startTime)
+{
+  const MatchBudget *budget = &prog->budget;
+
+  if (budget->maxSteps > 0 && usage->steps > budget->maxSteps)
+    usage->exceeded = MATCH_BUDGET_STEPS;
+  else if (budget->timeoutUS > 0 && now() - startTime >= budget->timeoutUS)
+    usage->exceeded = MATCH_BUDGET_TIME;
+  else if (budget->maxMemoBytes > 0 && memoTableBytes(memo) > budget->maxMemoBytes)
+    usage->exceeded = MATCH_BUDGET_MEMORY;
+  if (usage->exceeded != MATCH_BUDGET_OK) {
+    logMsg(LOG_INFO, "Backtrack: budget exceeded (%d) after %llu steps", usage->exceeded, (unsigned long long) usage->steps - 1);
+    *tick = 1; /* The step about to run does not */
+    return 1;
+  }
+
+  /* With maxSteps, the next check falls on step maxSteps + 1 at the latest */
+  *tick = MATCH_BUDGET_CHECK_STEPS;
+  if (budget->maxSteps > 0 && budget->maxSteps + 1 - usage->steps < (uint64_t) *tick)
+    *tick = (int) (budget->maxSteps + 1 - usage->steps);
+  usage->steps += *tick;
+  return 0;
+}
+
+/* The simulation proper.
+ * With the switch, each instantiation in backtrackCtx() has trackVisits and encoding constant,
+ * so the visit bookkeeping and the memo dispatch are compiled out of the hot loop.
+ * With threaded dispatch the same is done per Inst, by the handler it is resolved to.
+ * Visit tracking (and LOG_VERBOSE) take the Generic path through the switch: they touch every Inst anyway. */
+static BACKTRACK_INLINE int
+_backtrack(Prog *prog, MatchCtx *ctx, char *input, int len, int from, char **subp, int nsubp, const int trackVisits, const int encoding)
+{
+  Memo *memo;
   VisitTable visitTable;
   int i;
   Inst *pc; /* Current position in VM (pc) */
   char *sp; /* Current position in input */
   Sub *sub; /* submatch (capture group) */
-  char *inputEOL; /* Position of \0 terminating input */
-  uint64_t startTime;
+  char *inputEOL; /* One past the last char of input. input need not be NUL-terminated, and may contain NULs. */
+  char *startSp; /* Where the current search for a match began */
+  uint64_t startTime, memoInitNS, startNS;
   ThreadVec *threads = NULL;
 	int matched = 0;
 
   int inZWA = 0;
   char *sp_save = NULL;
   ThreadVec *threads_save = NULL;
+  int reqAt = -1;
+  int budgetTick = 1; /* Steps to the next check of Prog.budget, this one included. The first step checks. */
+#if BACKTRACK_THREADED
+  const void **handlers = NULL;
+#endif
+
+  inputEOL = input + len;
+  memset(&ctx->usage, 0, sizeof ctx->usage);
+
+  /* Prefilter: skip to the first start whose literals are in place, or reject the input.
+   * The bytes before input + from are only context, for \b. */
+  startSp = _nextStart(prog, input, input + from, inputEOL, &reqAt);
+  if (prog->bolAnchor && startSp != input)
+    startSp = NULL;
+  if (startSp == NULL && prog->statsMode == STATS_NONE) {
+    logMsg(LOG_DEBUG, "Prefilter: no match possible");
+    return 0;
+  }
 
-  inputEOL = input + strlen(input);
-
-  /* Prep sub-captures */
-  sub = newsub(nsubp, input);
+  /* Prep sub-captures. Subs from the last match are all dead. */
+  SubPool_reset(&ctx->subs);
+  sub = newsub(&ctx->subs, nsubp, input);
   for(i=0; i<nsubp; i++)
     sub->sub[i] = nil;
 
   /* Prep memo structures */
+  memoInitNS = nowNS();
   logMsg(LOG_VERBOSE, "Initializing visit table");
-  visitTable = initVisitTable(prog, strlen(input) + 1);
+  visitTable = initVisitTable(prog, len + 1);
   logMsg(LOG_VERBOSE, "Initializing memo table");
-  memo = initMemoTable(prog, strlen(input) + 1);
+  memo = MatchCtx_memo(ctx, prog, len + 1);
 
   logMsg(LOG_INFO, "Backtrack: Simulation begins");
-  startTime = now();
+  startNS = nowNS();
+  startTime = startNS / 1000;
+  ctx->usage.steps = budgetTick;
 
   /* Initial thread state is < q0, w[0], current capture group > */
-  ThreadVec ready = ThreadVec_alloc();
-  ThreadVec_push(&ready, thread(prog->start, input, sub));
-  threads = &ready;
+  threads = &ctx->ready;
+  threads->nThreads = 0;
+  if (startSp == NULL) {
+    logMsg(LOG_DEBUG, "Prefilter: no match possible");
+    goto CleanupAndRet; /* Still print the (empty) statistics */
+  }
+  ThreadVec_push(threads, thread(prog->start, startSp, sub));
+
+#if BACKTRACK_THREADED
+  {
+    const void *opHandlers[] = VM_HANDLER_TABLE(op_);
+    const void *memoAnyHandlers[] = VM_HANDLER_TABLE(memo_);
+    const void *memoNoneHandlers[] = VM_HANDLER_TABLE(memoNone_);
+    const void *memoBitsetHandlers[] = VM_HANDLER_TABLE(memoBitset_);
+    const void *memoWindowHandlers[] = VM_HANDLER_TABLE(memoWindow_);
+    const void **memoHandlers = encoding == ENCODING_NONE ? memoNoneHandlers
+      : encoding == ENCODING_BITSET ? memoBitsetHandlers
+      : encoding == MEMO_ENCODING_WINDOW ? memoWindowHandlers
+      : memoAnyHandlers;
+
+    /* Pre-resolve each Inst to its handler */
+    handlers = MatchCtx_handlers(ctx, prog->len);
+    for (i = 0; i < prog->len; i++) {
+      Inst *inst = &prog->start[i];
+      assert(0 < inst->opcode && inst->opcode < (int) nelem(opHandlers));
+      if (trackVisits || shouldLog(LOG_VERBOSE))
+        handlers[i] = &&Generic;
+      else if (prog->memoMode != MEMO_NONE && inst->memoStateNum >= 0)
+        handlers[i] = memoHandlers[inst->opcode];
+      else
+        handlers[i] = opHandlers[inst->opcode];
+    }
+  }
+#endif
 
   /* To recurse: save the state (sp, threads) and replace threads with the new starting point */
 
@@ -281,48 +525,61 @@ BACKTRACKING_SEARCH:
     sp = next.sp;
     sub = next.sub;
     assert(sub->ref > 0);
+    if (memo->windowed) {
+      /* Nothing below the bottom thread (the outer one during a lookahead) is searched again,
+       * nor, unanchored, below the next start: the memo table carries over to it */
+      ThreadVec *outer = inZWA ? threads_save : threads;
+      char *low = inZWA ? sp_save : sp;
+      if (outer->nThreads > 0)
+        low = outer->threads[0].sp;
+      if (!prog->bolAnchor && startSp + 1 < low)
+        low = startSp + 1;
+      advanceMemoWindow(memo, woffset(input, low));
+    }
     for(;;) { /* Run thread to completion */
-      logMsg(LOG_VERBOSE, "  search state: <%d (M: %d), %d>", pc->stateNum, pc->memoInfo.memoStateNum, woffset(input, sp));
-
-      if (prog->memoMode != MEMO_NONE && pc->memoInfo.memoStateNum >= 0) {
-        /* Check if we've been here. */
-        if (isMarked(&memo, pc->memoInfo.memoStateNum, woffset(input, sp), sub)) {
-          /* Since we return on first match, the prior visit failed.
-           * Short-circuit thread */
-          logMsg(LOG_VERBOSE, "marked, short-circuiting thread");
-          assert(pc->opcode != Match);
-          goto Dead;
+      if (--budgetTick == 0 && _budgetSpent(prog, memo, &ctx->usage, &budgetTick, startTime))
+        goto BudgetExceeded;
+#if BACKTRACK_THREADED
+      goto *handlers[INST_NUM(prog, pc)];
+    Generic:
+#endif
+      logMsg(LOG_VERBOSE, "  search state: <%d (M: %d), %d>", INST_NUM(prog, pc), pc->memoStateNum, woffset(input, sp));
+
+      if (prog->memoMode != MEMO_NONE && pc->memoStateNum >= 0) {
+        /* Mark that we've been here, and check if we already had been. */
+        if (_markMemo(memo, encoding, pc->memoStateNum, woffset(input, sp), sub)) {
+          goto MemoHit;
         }
-
-        /* Mark that we've been here */
-        markMemo(&memo, pc->memoInfo.memoStateNum, woffset(input, sp), sub);
       }
 
       /* "Visit" means that we evaluate pc appropriately. */
-      markVisit(&visitTable, pc->stateNum, woffset(input, sp));
+      if (trackVisits)
+        markVisit(&visitTable, INST_NUM(prog, pc), woffset(input, sp));
 
       /* Proceed as normal */
       switch(pc->opcode) {
-      case Char:
-        if(*sp != pc->c)
+      VM_CASE(Char):
+        if(sp == inputEOL || *sp != pc->c)
           goto Dead;
         pc++;
         sp++;
         continue;
-      case Any:
-        if(*sp == 0 || *sp == '\n' || *sp == '\r')
+      VM_CASE(String):
+        if(inputEOL - sp < pc->n || memcmp(sp, pc->str, pc->n) != 0)
+          goto Dead;
+        sp += pc->n;
+        pc++;
+        continue;
+      VM_CASE(Any):
+        if(sp == inputEOL || *sp == '\n' || *sp == '\r')
           goto Dead;
         pc++;
         sp++;
         continue;
-      case CharClass:
-        if (*sp == 0)
+      VM_CASE(CharClass):
+        if (sp == inputEOL)
           goto Dead;
-        /* Look through char class mins/maxes */
-        logMsg(LOG_VERBOSE, "Does char %d match CC? charClassCounts %d",
-          *sp, pc->charRangeCounts);
-
-        if (!_inCharClass(pc, *sp)) {
+        if (!CCMAP_HAS(pc->ccMap, *sp)) {
           logMsg(LOG_VERBOSE, "not in char class");
           goto Dead;
         }
@@ -330,39 +587,90 @@ BACKTRACKING_SEARCH:
         pc++;
         sp++;  
         continue;
-      case Match:
+      VM_CASE(Match):
         logMsg(LOG_VERBOSE, "Match: eolAnchor %d sp %p inputEOL %p", prog->eolAnchor, sp, inputEOL);
         if (!prog->eolAnchor || (prog->eolAnchor && sp == inputEOL)) {
+          if (prog->nPatterns > 0) {
+            /* A set: note the pattern and go on to the others.
+             * A memo hit now means every pattern reachable from the prior visit has been noted. */
+            if (!ctx->setMatched[pc->c]) {
+              ctx->setMatched[pc->c] = 1;
+              ctx->setDone[pc->c] = 1;
+              ctx->nSetLeft--;
+              /* Its other threads cannot tell us more. Without memoization they could take exponential time.
+               * A set's Match is outside any lookahead, so threads is the stack the root pushed onto. */
+              while (threads->nThreads > ctx->setDepth[pc->c])
+                decref(&ctx->subs, ThreadVec_pop(threads).sub);
+            }
+            if (ctx->nSetLeft > 0)
+              goto Dead;
+          }
           for(i=0; i<nsubp; i++)
             subp[i] = sub->sub[i];
-          decref(sub);
+          decref(&ctx->subs, sub);
 
 					matched = 1;
 					goto CleanupAndRet;
         }
         goto Dead;
-      case Jmp:
+      VM_CASE(Jmp):
         pc = pc->x;
         continue;
-      case Split: /* Non-deterministic choice */
+      VM_CASE(Split): /* Non-deterministic choice */
         ThreadVec_push(threads, thread(pc->y, sp, incref(sub)));
         pc = pc->x;  /* continue current thread */
         continue;
-      case SplitMany: /* Non-deterministic choice */
-        for (i = 1; i < pc->arity; i++) {
+      VM_CASE(SplitMany): /* Non-deterministic choice */
+        if (prog->nPatterns > 1 && pc == prog->start) {
+          /* A set's root: start only the patterns still worth searching for that can begin here */
+          int b = sp < inputEOL ? (unsigned char) *sp : 256;
+          for (i = prog->setStartsAt[b]; i < prog->setStartsAt[b + 1]; i++)
+            if (!ctx->setDone[prog->setStarts[i]]) {
+              ctx->setDepth[prog->setStarts[i]] = threads->nThreads;
+              ThreadVec_push(threads, thread(pc->edges[prog->setStarts[i]], sp, incref(sub)));
+            }
+          goto Dead;
+        }
+        for (i = 1; i < pc->n; i++) {
           ThreadVec_push(threads, thread(pc->edges[i], sp, incref(sub)));
         }
         pc = pc->edges[0];  /* continue current thread */
         continue;
-      case Save:
+      VM_CASE(CountInit):
+        sub = countPush(&ctx->subs, sub);
+        pc++;
+        continue;
+      VM_CASE(CountLoop): /* Choice, unless the counter forces it */
+      {
+        int k = sub->count[sub->nCount - 1];
+        Inst *body = pc->x < pc->y ? pc->x : pc->y;
+        if (k < pc->c) {
+          sub = countIncr(&ctx->subs, sub);
+          pc = body;
+        } else if (k == pc->n) {
+          sub = countPop(&ctx->subs, sub);
+          pc = pc->x < pc->y ? pc->y : pc->x;
+        } else {
+          /* Each thread leaves with its own counter: one more iteration, or the loop's popped */
+          Sub *other = incref(sub);
+          other = pc->y == body ? countIncr(&ctx->subs, other) : countPop(&ctx->subs, other);
+          ThreadVec_push(threads, thread(pc->y, sp, other));
+          sub = pc->x == body ? countIncr(&ctx->subs, sub) : countPop(&ctx->subs, sub);
+          pc = pc->x;
+        }
+        continue;
+      }
+      VM_CASE(Save):
         logMsg(LOG_DEBUG, "  save %d at %p", pc->n, sp);
-        sub = update(sub, pc->n, sp);
+        sub = update(&ctx->subs, sub, pc->n, sp);
+        if (memo->backrefSubs & (1 << pc->n))
+          sub->cgVecId = -1;
         pc++;
         continue;
-      case StringCompare:
+      VM_CASE(StringCompare):
       {
         /* Check if appropriate sub matches */
-        logMsg(LOG_DEBUG, "  StringCompare on %d at %p", pc->cgNum, sp);
+        logMsg(LOG_DEBUG, "  StringCompare on %d at %p", pc->c, sp);
         int nCharsMatched = _stringCompare(pc, sub, sp, inputEOL);
         if (nCharsMatched > -1) {
           sp += nCharsMatched;
@@ -372,9 +680,9 @@ BACKTRACKING_SEARCH:
 
         goto Dead;
       }
-      case InlineZeroWidthAssertion:
+      VM_CASE(InlineZeroWidthAssertion):
       {
-        if (_testInlineZeroWidthAssertion(pc, sp, sp == input, sp == inputEOL)) {
+        if (testInlineZeroWidthAssertion(pc, sp, sp == input, sp == inputEOL)) {
           pc++;
           continue;
         }
@@ -382,7 +690,7 @@ BACKTRACKING_SEARCH:
 				logMsg(LOG_DEBUG, "InlineZWA %c unsatisfied", pc->c);
         goto Dead;
       }
-      case RecursiveZeroWidthAssertion:
+      VM_CASE(RecursiveZeroWidthAssertion):
       {
         // Save state: i, backtrack stack
         assert(!inZWA); // No nesting
@@ -399,7 +707,7 @@ BACKTRACKING_SEARCH:
         goto BACKTRACKING_SEARCH;
       }
         assert(!"unreachable");
-      case RecursiveMatch:
+      VM_CASE(RecursiveMatch):
         logMsg(LOG_DEBUG, "Made it to %d RecursiveMatch", (int)(pc-prog->start));
         // Restore state: i, backtrack stack
         assert(inZWA);
@@ -416,10 +724,37 @@ BACKTRACKING_SEARCH:
 
       default:
         logMsg(LOG_ERROR, "Unknown opcode %d", pc->opcode);
+        assert(!"Unknown opcode");
+        goto Dead;
       }
+
+#if BACKTRACK_THREADED
+      VM_MEMO_HANDLERS(Char)
+      VM_MEMO_HANDLERS(String)
+      VM_MEMO_HANDLERS(Any)
+      VM_MEMO_HANDLERS(CharClass)
+      VM_MEMO_HANDLERS(Match)
+      VM_MEMO_HANDLERS(Jmp)
+      VM_MEMO_HANDLERS(Split)
+      VM_MEMO_HANDLERS(SplitMany)
+      VM_MEMO_HANDLERS(Save)
+      VM_MEMO_HANDLERS(StringCompare)
+      VM_MEMO_HANDLERS(InlineZeroWidthAssertion)
+      VM_MEMO_HANDLERS(RecursiveZeroWidthAssertion)
+      VM_MEMO_HANDLERS(RecursiveMatch)
+      VM_MEMO_HANDLERS(CountInit)
+      VM_MEMO_HANDLERS(CountLoop)
+#endif
+
+    MemoHit:
+      /* Since we return on first match, the prior visit failed.
+       * Short-circuit thread */
+      logMsg(LOG_VERBOSE, "marked, short-circuiting thread");
+      assert(pc->opcode != Match || prog->nPatterns > 0);
+      goto Dead;
     }
   Dead:
-    decref(sub);
+    decref(&ctx->subs, sub);
   }
   // Backtracking stack is exhausted.
   if (inZWA) {
@@ -432,24 +767,131 @@ BACKTRACKING_SEARCH:
     threads_save = nil;
     goto BACKTRACKING_SEARCH;
   }
+
+  /* Unanchored: the leftmost match starts at the first start that has one. Try the next.
+   * The memo table carries over. Since we return on first match, every <q, i> marked from an earlier start failed,
+   * and fails again from this one: what happens from <q, i> does not depend on where the match began.
+   * (With backrefs the memo key includes the backreferenced CGs still to be read, so this holds for those too.)
+   * So scanning all of w visits each memoized <q, i> at most once in all. */
+  if (!prog->bolAnchor && startSp < inputEOL
+      && (startSp = _nextStart(prog, input, startSp + 1, inputEOL, &reqAt)) != NULL) {
+    logMsg(LOG_DEBUG, "Unanchored: searching from %d", woffset(input, startSp));
+    sub = newsub(&ctx->subs, nsubp, input);
+    for(i=0; i<nsubp; i++)
+      sub->sub[i] = nil;
+    ThreadVec_push(threads, thread(prog->start, startSp, sub));
+    goto BACKTRACKING_SEARCH;
+  }
 	matched = 0;
+  goto CleanupAndRet;
+
+BudgetExceeded:
+  /* The threads left are the pool's, and go with SubPool_reset */
+  if (inZWA) {
+    inZWA = 0;
+    ThreadVec_free(threads);
+    threads = threads_save;
+    threads_save = nil;
+  }
+  matched = MATCH_BUDGET_EXCEEDED;
 
 CleanupAndRet:
 	//decref(&sub);
-  if(memo.encoding == MEMO_NONE){
-for (int i = 0; i < prog->nMemoizedStates; i++) {  
-    printf("%d) ", i);
-    for (int j = 0; j < (strlen(input) + 1); j++) {
-      printf("%d ", memo.visitVectors[i][j]);
+  if (shouldLog(LOG_DEBUG) && memo->mode != MEMO_NONE && memo->mode != MEMO_ADAPTIVE && !memo->windowed && memo->encoding == ENCODING_NONE) {
+    for (i = 0; i < memo->nStates; i++) {
+      printf("%d) ", i);
+      for (int j = 0; j < memo->nChars; j++) {
+        printf("%d ", memo->visitVectors[i][j]);
+      }
+      printf("\n");
     }
-    printf("\n");
   }
+
+  ctx->usage.steps -= budgetTick;
+  ctx->usage.memoBytes = memoTableBytes(memo);
+  ctx->usage.memoInitNS = startNS - memoInitNS;
+  ctx->usage.simNS = nowNS() - startNS;
+  ctx->usage.timeUS = ctx->usage.simNS / 1000;
+
+  if (prog->statsMode != STATS_NONE) {
+    if (prog->statsAggregate)
+      StatsTotals_add(&ctx->totals, memo, &visitTable, startTime, matched);
+    else
+      printStats(prog, memo, &visitTable, startTime, sub, &ctx->usage);
   }
-  
-  printStats(prog, &memo, &visitTable, startTime, sub);
-  ThreadVec_free(&ready);
   freeVisitTable(visitTable);
-  freeMemoTable(memo);
   
   return matched;
 }
+
+int
+backtrackCtxFrom(Prog *prog, MatchCtx *ctx, char *input, /* Chars in input */ int len, /* First offset a match may start at */ int from, /* start-end pointers for each CG */ char **subp, /* Length of subp */ int nsubp)
+{
+  if (prog->statsMode == STATS_VISITS)
+    return _backtrack(prog, ctx, input, len, from, subp, nsubp, 1, MEMO_ENCODING_ANY);
+  /* MEMO_ADAPTIVE marks through markMemo, which keeps its per-vertex vectors */
+  if (prog->memoMode == MEMO_NONE || prog->memoMode == MEMO_ADAPTIVE)
+    return _backtrack(prog, ctx, input, len, from, subp, nsubp, 0, MEMO_ENCODING_ANY);
+  if (prog->memoWindow) {
+    if (prog->memoEncoding == ENCODING_NONE || prog->memoEncoding == ENCODING_BITSET)
+      return _backtrack(prog, ctx, input, len, from, subp, nsubp, 0, MEMO_ENCODING_WINDOW);
+    return _backtrack(prog, ctx, input, len, from, subp, nsubp, 0, MEMO_ENCODING_ANY);
+  }
+
+  /* The encodings whose test-and-set is cheap enough that the dispatch matters */
+  switch (prog->memoEncoding) {
+  case ENCODING_NONE:
+    return _backtrack(prog, ctx, input, len, from, subp, nsubp, 0, ENCODING_NONE);
+  case ENCODING_BITSET:
+    return _backtrack(prog, ctx, input, len, from, subp, nsubp, 0, ENCODING_BITSET);
+  default:
+    return _backtrack(prog, ctx, input, len, from, subp, nsubp, 0, MEMO_ENCODING_ANY);
+  }
+}
+
+int
+backtrackCtx(Prog *prog, MatchCtx *ctx, char *input, int len, char **subp, int nsubp)
+{
+  return backtrackCtxFrom(prog, ctx, input, len, 0, subp, nsubp);
+}
+
+int
+backtrackSetCtx(Prog *prog, MatchCtx *ctx, char *input, int len, int *ids)
+{
+  char *sub[MAXSUB];
+  int k, n;
+
+  assert(prog->nPatterns > 0);
+  if (prog->nPatterns > ctx->setCap) {
+    free(ctx->setMatched);
+    free(ctx->setDone);
+    free(ctx->setDepth);
+    ctx->setMatched = mal(prog->nPatterns);
+    ctx->setDone = mal(prog->nPatterns);
+    ctx->setDepth = mal(prog->nPatterns * sizeof(*ctx->setDepth));
+    ctx->setCap = prog->nPatterns;
+  }
+  memset(ctx->setMatched, 0, prog->nPatterns);
+  ctx->nSetLeft = 0;
+  for (k = 0; k < prog->nPatterns; k++) {
+    ProgPattern *pat = &prog->patterns[k];
+    ctx->setDone[k] = pat->litRequiredLen > 0 && memmem(input, len, pat->litRequired, pat->litRequiredLen) == NULL;
+    ctx->nSetLeft += !ctx->setDone[k];
+  }
+  if (ctx->nSetLeft > 0 && backtrackCtxFrom(prog, ctx, input, len, 0, sub, nelem(sub)) == MATCH_BUDGET_EXCEEDED)
+    return MATCH_BUDGET_EXCEEDED;
+
+  for (k = n = 0; k < prog->nPatterns; k++)
+    if (ctx->setMatched[k])
+      ids[n++] = k;
+  return n;
+}
+
+int
+backtrack(Prog *prog, char *input, int len, char **subp, int nsubp)
+{
+  MatchCtx *ctx = MatchCtx_create();
+  int matched = backtrackCtx(prog, ctx, input, len, subp, nsubp);
+  MatchCtx_free(ctx);
+  return matched;
+}
@@ -0,0 +1,515 @@
+// Copyright 2020 James C. Davis.  All Rights Reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "batch.h"
+#include "regexp.h"
+#include "vendor/cJSON.h"
+#include "log.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+/* A chunk is closed once it holds this many bytes of input or this many inputs.
+ * Long inputs thus travel alone, so a slow (super-linear) one holds up only its own chunk. */
+#define BATCH_CHUNK_BYTES (16*1024)
+#define BATCH_CHUNK_INPUTS 256
+
+/* Chunks read but not yet written, per worker. Bounds memory and the reorder buffer. */
+#define BATCH_WINDOW_PER_JOB 16
+
+/* A chunk's length for an NDJSON record that had no input */
+#define BATCH_BAD_RECORD ((size_t) -1)
+
+void
+printMatch(FILE *out, const char *input, int matched, const char **sub)
+{
+	int k, l;
+
+	if(matched == MEMORE_BUDGET_EXCEEDED) {
+		fprintf(out, "-budget exceeded-\n");
+		return;
+	}
+	if(matched == MEMORE_TOO_LONG) {
+		fprintf(out, "-input too long-\n");
+		return;
+	}
+	if(!matched) {
+		fprintf(out, "-no match-\n");
+		return;
+	}
+	fprintf(out, "match");
+	for(k=MAXSUB; k>0; k--)
+		if(sub[k-1])
+			break;
+	for(l=0; l<k; l+=2) {
+		fprintf(out, " (");
+		if(sub[l] == nil)
+			fprintf(out, "?");
+		else
+			fprintf(out, "%d", (int)(sub[l] - input));
+		fprintf(out, ",");
+		if(sub[l+1] == nil)
+			fprintf(out, "?");
+		else
+			fprintf(out, "%d", (int)(sub[l+1] - input));
+		fprintf(out, ")");
+	}
+	fprintf(out, "\n");
+}
+
+static void *
+_regrow(void *p, size_t n)
+{
+	p = realloc(p, n);
+	if (p == NULL)
+		fatal("out of memory");
+	return p;
+}
+
+/* The result line for an NDJSON record without a string "input": the batch goes on with the next record */
+static void
+_printBadRecord(FILE *out)
+{
+	fprintf(out, "-bad record-\n");
+}
+
+/* Reads the next input into *line. Returns 0 at EOF.
+ * For NDJSON the input is the record's "input"; free *record (if set) when done with *input.
+ * *input is NULL for a record without one. */
+static int
+_nextInput(FILE *in, int ndjson, char **line, size_t *cap, char **input, size_t *len, cJSON **record)
+{
+	ssize_t n;
+	cJSON *key;
+
+	*record = NULL;
+	if ((n = getline(line, cap, in)) < 0)
+		return 0;
+	*len = n;
+	if (*len > 0 && (*line)[*len-1] == '\n')
+		(*line)[--*len] = '\0';
+	*input = *line;
+
+	if (ndjson) {
+		*record = cJSON_Parse(*line);
+		key = *record != NULL ? cJSON_GetObjectItem(*record, "input") : NULL;
+		if (key == NULL || key->valuestring == NULL) {
+			logMsg(LOG_WARN, "batch: record without a string \"input\": %s", *line);
+			*input = NULL;
+			*len = 0;
+			return 1;
+		}
+		*input = key->valuestring;
+		*len = strlen(*input);
+	}
+	return 1;
+}
+
+/* Match each line of in against mre. The memo table and stack are reused from one input to the next. */
+void
+runBatch(memore *mre, FILE *in, int ndjson)
+{
+	char *line = NULL, *input;
+	size_t cap = 0, len;
+	cJSON *record;
+	const char *sub[MAXSUB];
+	int matched;
+
+	while (_nextInput(in, ndjson, &line, &cap, &input, &len, &record)) {
+		if (input == NULL) {
+			_printBadRecord(stdout);
+			cJSON_Delete(record);
+			continue;
+		}
+		logMsg(LOG_INFO, "Candidate string: %.*s", (int) len, input);
+		matched = memore_match(mre, input, len, sub, nelem(sub));
+		printMatch(stdout, input, matched, sub);
+		cJSON_Delete(record);
+	}
+	free(line);
+}
+
+void
+runBatchSet(memore_set *set, int nPatterns, FILE *in, int ndjson)
+{
+	char *line = NULL, *input;
+	size_t cap = 0, len;
+	cJSON *record;
+	int *ids = mal(nPatterns * sizeof(*ids));
+	int i, n;
+
+	while (_nextInput(in, ndjson, &line, &cap, &input, &len, &record)) {
+		if (input == NULL) {
+			_printBadRecord(stdout);
+			cJSON_Delete(record);
+			continue;
+		}
+		logMsg(LOG_INFO, "Candidate string: %.*s", (int) len, input);
+		n = memore_set_match(set, input, len, ids);
+		if (n == MEMORE_BUDGET_EXCEEDED)
+			printf("-budget exceeded-\n");
+		else if (n == MEMORE_TOO_LONG)
+			printf("-input too long-\n");
+		else if (n == 0)
+			printf("-no match-\n");
+		else {
+			printf("match");
+			for (i = 0; i < n; i++)
+				printf(" %d", ids[i]);
+			printf("\n");
+		}
+		cJSON_Delete(record);
+	}
+	free(ids);
+	free(line);
+}
+
+/****** Parallel batch ********/
+
+/* Consecutive inputs, matched by one worker. Chunks are numbered in input order. */
+typedef struct BatchChunk BatchChunk;
+struct BatchChunk
+{
+	long seq;
+	int nInputs;
+	int inputCap;
+	size_t *offsets; /* Input i is buf + offsets[i], NUL-terminated */
+	size_t *lens; /* BATCH_BAD_RECORD for a record without an input */
+	char *buf;
+	size_t bufLen;
+	size_t bufCap;
+
+	/* Filled by the worker */
+	char *out;
+	size_t outLen;
+	int done; /* Under BatchPool.lock */
+};
+
+/* A worker's chunks. The owner takes the oldest; thieves take the newest. */
+typedef struct BatchDeque BatchDeque;
+struct BatchDeque
+{
+	pthread_mutex_t lock;
+	BatchChunk **chunks; /* Ring of cap */
+	int cap;
+	int head; /* Oldest */
+	int n;
+};
+
+typedef struct BatchPool BatchPool;
+typedef struct BatchWorker BatchWorker;
+
+struct BatchWorker
+{
+	BatchPool *pool;
+	int id;
+	pthread_t thread;
+	BatchDeque deque;
+	memore_ctx *ctx;
+};
+
+struct BatchPool
+{
+	const memore *mre;
+	int nJobs;
+	BatchWorker *workers;
+
+	pthread_mutex_t lock;
+	pthread_cond_t workReady; /* nQueued > 0 or eof */
+	pthread_cond_t chunkDone;
+	int nQueued; /* Chunks sitting in deques and not yet claimed by a worker */
+	int eof;
+
+	/* Reorder buffer: chunk seq waits in window[seq % windowSize] until every earlier chunk is written */
+	BatchChunk **window;
+	int windowSize;
+	long nextSeq;
+	long nextToWrite;
+};
+
+static BatchChunk *
+BatchChunk_new(long seq)
+{
+	BatchChunk *chunk = mal(sizeof *chunk);
+	chunk->seq = seq;
+	return chunk;
+}
+
+/* input NULL: a bad record, kept in its place for its result line */
+static void
+BatchChunk_append(BatchChunk *chunk, const char *input, size_t len)
+{
+	if (chunk->nInputs == chunk->inputCap) {
+		chunk->inputCap = chunk->inputCap ? 2 * chunk->inputCap : 16;
+		chunk->offsets = _regrow(chunk->offsets, chunk->inputCap * sizeof(*chunk->offsets));
+		chunk->lens = _regrow(chunk->lens, chunk->inputCap * sizeof(*chunk->lens));
+	}
+	if (chunk->bufLen + len + 1 > chunk->bufCap) {
+		chunk->bufCap = 2 * (chunk->bufLen + len + 1);
+		chunk->buf = _regrow(chunk->buf, chunk->bufCap);
+	}
+	if (len > 0)
+		memcpy(chunk->buf + chunk->bufLen, input, len);
+	chunk->buf[chunk->bufLen + len] = '\0';
+	chunk->offsets[chunk->nInputs] = chunk->bufLen;
+	chunk->lens[chunk->nInputs] = input != NULL ? len : BATCH_BAD_RECORD;
+	chunk->nInputs++;
+	chunk->bufLen += len + 1;
+}
+
+static int
+BatchChunk_full(BatchChunk *chunk)
+{
+	return chunk->bufLen >= BATCH_CHUNK_BYTES || chunk->nInputs >= BATCH_CHUNK_INPUTS;
+}
+
+static void
+BatchChunk_free(BatchChunk *chunk)
+{
+	free(chunk->offsets);
+	free(chunk->lens);
+	free(chunk->buf);
+	free(chunk->out);
+	free(chunk);
+}
+
+static void
+BatchDeque_init(BatchDeque *dq, int cap)
+{
+	pthread_mutex_init(&dq->lock, NULL);
+	dq->chunks = mal(cap * sizeof(*dq->chunks));
+	dq->cap = cap;
+	dq->head = 0;
+	dq->n = 0;
+}
+
+static void
+BatchDeque_destroy(BatchDeque *dq)
+{
+	assert(dq->n == 0);
+	pthread_mutex_destroy(&dq->lock);
+	free(dq->chunks);
+}
+
+static void
+BatchDeque_push(BatchDeque *dq, BatchChunk *chunk)
+{
+	pthread_mutex_lock(&dq->lock);
+	/* The window bounds the chunks in flight, so this never fills */
+	assert(dq->n < dq->cap);
+	dq->chunks[(dq->head + dq->n) % dq->cap] = chunk;
+	dq->n++;
+	pthread_mutex_unlock(&dq->lock);
+}
+
+/* fromOldest: the owner's end. Returns NULL if empty. */
+static BatchChunk *
+BatchDeque_take(BatchDeque *dq, int fromOldest)
+{
+	BatchChunk *chunk = NULL;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->n > 0) {
+		if (fromOldest) {
+			chunk = dq->chunks[dq->head];
+			dq->head = (dq->head + 1) % dq->cap;
+		} else
+			chunk = dq->chunks[(dq->head + dq->n - 1) % dq->cap];
+		dq->n--;
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return chunk;
+}
+
+/* Blocks until there is a chunk for w (its own, or stolen), or returns NULL once the input is exhausted */
+static BatchChunk *
+BatchWorker_nextChunk(BatchWorker *w)
+{
+	BatchPool *pool = w->pool;
+	BatchChunk *chunk;
+	int i;
+
+	/* Claim a chunk first, so that the search below cannot come up empty */
+	pthread_mutex_lock(&pool->lock);
+	while (pool->nQueued == 0 && !pool->eof)
+		pthread_cond_wait(&pool->workReady, &pool->lock);
+	if (pool->nQueued == 0) {
+		pthread_mutex_unlock(&pool->lock);
+		return NULL;
+	}
+	pool->nQueued--;
+	pthread_mutex_unlock(&pool->lock);
+
+	if ((chunk = BatchDeque_take(&w->deque, 1)) != NULL)
+		return chunk;
+	for (;;) {
+		for (i = 1; i < pool->nJobs; i++) {
+			chunk = BatchDeque_take(&pool->workers[(w->id + i) % pool->nJobs].deque, 0);
+			if (chunk != NULL) {
+				logMsg(LOG_VERBOSE, "batch: worker %d stole chunk %ld", w->id, chunk->seq);
+				return chunk;
+			}
+		}
+		/* The claimed chunk was pushed to our own deque after we looked */
+		if ((chunk = BatchDeque_take(&w->deque, 1)) != NULL)
+			return chunk;
+	}
+}
+
+static void *
+BatchWorker_run(void *arg)
+{
+	BatchWorker *w = arg;
+	BatchPool *pool = w->pool;
+	BatchChunk *chunk;
+	const char *sub[MAXSUB];
+	char *input;
+	FILE *out;
+	int i, matched;
+
+	while ((chunk = BatchWorker_nextChunk(w)) != NULL) {
+		out = open_memstream(&chunk->out, &chunk->outLen);
+		if (out == NULL)
+			fatal("out of memory");
+		for (i = 0; i < chunk->nInputs; i++) {
+			if (chunk->lens[i] == BATCH_BAD_RECORD) {
+				_printBadRecord(out);
+				continue;
+			}
+			input = chunk->buf + chunk->offsets[i];
+			matched = memore_match_ctx(pool->mre, w->ctx, input, chunk->lens[i], sub, nelem(sub));
+			printMatch(out, input, matched, sub);
+		}
+		fclose(out);
+
+		pthread_mutex_lock(&pool->lock);
+		chunk->done = 1;
+		pthread_cond_signal(&pool->chunkDone);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return NULL;
+}
+
+/* Write out every finished chunk whose predecessors have all been written.
+ * With wait, block until the chunk at the front of the window is done (if there is one). Call with pool->lock held. */
+static void
+BatchPool_drain(BatchPool *pool, int wait)
+{
+	BatchChunk *chunk;
+
+	while (pool->nextToWrite < pool->nextSeq) {
+		chunk = pool->window[pool->nextToWrite % pool->windowSize];
+		if (!chunk->done) {
+			if (!wait)
+				return;
+			pthread_cond_wait(&pool->chunkDone, &pool->lock);
+			continue;
+		}
+		fwrite(chunk->out, 1, chunk->outLen, stdout);
+		BatchChunk_free(chunk);
+		pool->window[pool->nextToWrite % pool->windowSize] = NULL;
+		pool->nextToWrite++;
+		wait = 0;
+	}
+}
+
+/* Hand a full chunk to a worker, first making room in the window */
+static void
+BatchPool_submit(BatchPool *pool, BatchChunk *chunk)
+{
+	pthread_mutex_lock(&pool->lock);
+	BatchPool_drain(pool, 0);
+	while (pool->nextSeq - pool->nextToWrite >= pool->windowSize)
+		BatchPool_drain(pool, 1);
+	pool->window[chunk->seq % pool->windowSize] = chunk;
+	pool->nextSeq++;
+	pthread_mutex_unlock(&pool->lock);
+
+	BatchDeque_push(&pool->workers[chunk->seq % pool->nJobs].deque, chunk);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->nQueued++;
+	pthread_cond_signal(&pool->workReady);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void
+runBatchParallel(memore *mre, FILE *in, int ndjson, int nJobs)
+{
+	BatchPool pool;
+	BatchWorker *w;
+	BatchChunk *chunk;
+	char *line = NULL, *input;
+	size_t cap = 0, len;
+	cJSON *record;
+	long seq = 0;
+	int i;
+
+	assert(nJobs >= 1);
+	/* Resolve the log level before the workers can race to */
+	log_init();
+
+	pool.mre = mre;
+	pool.nJobs = nJobs;
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.workReady, NULL);
+	pthread_cond_init(&pool.chunkDone, NULL);
+	pool.nQueued = 0;
+	pool.eof = 0;
+	pool.windowSize = BATCH_WINDOW_PER_JOB * nJobs;
+	pool.window = mal(pool.windowSize * sizeof(*pool.window));
+	pool.nextSeq = 0;
+	pool.nextToWrite = 0;
+
+	pool.workers = mal(nJobs * sizeof(*pool.workers));
+	for (i = 0; i < nJobs; i++) {
+		w = &pool.workers[i];
+		w->pool = &pool;
+		w->id = i;
+		BatchDeque_init(&w->deque, pool.windowSize);
+		w->ctx = memore_ctx_create();
+	}
+	for (i = 0; i < nJobs; i++) {
+		if (pthread_create(&pool.workers[i].thread, NULL, BatchWorker_run, &pool.workers[i]) != 0)
+			fatal("batch: cannot start worker %d", i);
+	}
+
+	/* This thread reads (and, for NDJSON, parses) the inputs and writes the results */
+	chunk = BatchChunk_new(seq++);
+	while (_nextInput(in, ndjson, &line, &cap, &input, &len, &record)) {
+		BatchChunk_append(chunk, input, len);
+		cJSON_Delete(record);
+		if (BatchChunk_full(chunk)) {
+			BatchPool_submit(&pool, chunk);
+			chunk = BatchChunk_new(seq++);
+		}
+	}
+	free(line);
+	if (chunk->nInputs > 0)
+		BatchPool_submit(&pool, chunk);
+	else
+		BatchChunk_free(chunk);
+
+	pthread_mutex_lock(&pool.lock);
+	pool.eof = 1;
+	pthread_cond_broadcast(&pool.workReady);
+	while (pool.nextToWrite < pool.nextSeq)
+		BatchPool_drain(&pool, 1);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (i = 0; i < nJobs; i++) {
+		w = &pool.workers[i];
+		pthread_join(w->thread, NULL);
+		memore_merge_stats(mre, w->ctx);
+		memore_ctx_free(w->ctx);
+		BatchDeque_destroy(&w->deque);
+	}
+	free(pool.workers);
+	free(pool.window);
+	pthread_cond_destroy(&pool.chunkDone);
+	pthread_cond_destroy(&pool.workReady);
+	pthread_mutex_destroy(&pool.lock);
+}
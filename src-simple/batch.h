@@ -0,0 +1,28 @@
+// Copyright 2020 James C. Davis.  All Rights Reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "memore.h"
+
+#include <stdio.h>
+
+/* re --batch: one compiled regex against a stream of inputs, one per line (or one NDJSON record per line).
+ * One result line per input, in input order; "-bad record-" for an NDJSON record without a string "input". */
+
+/* "match (0,3) (1,2)" or "-no match-", offsets relative to input */
+void printMatch(FILE *out, const char *input, int matched, const char **sub);
+
+/* All inputs on the calling thread, through the handle's own match scratch */
+void runBatch(memore *mre, FILE *in, int ndjson);
+
+/* A set: "match 0 3" (the indices of the patterns that match) or "-no match-" per input */
+void runBatchSet(memore_set *set, int nPatterns, FILE *in, int ndjson);
+
+/* Inputs are read in chunks and spread over nJobs worker threads, which steal chunks from each other when idle.
+ * Each worker has its own memore_ctx; their aggregated statistics are merged into mre's at the end. */
+void runBatchParallel(memore *mre, FILE *in, int ndjson, int nJobs);
+
+#endif /* BATCH_H */
@@ -0,0 +1,669 @@
+// Copyright 2020 James C. Davis.  All Rights Reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/* re-bench: the performance suite (test/perf-behav.txt) measured in-process.
+ *
+ * Each row's input is pumped to several lengths and matched under every memo mode x encoding x engine,
+ * with no process per query and the lazy DFA off, so the time is the engine's.
+ * One JSON record per (row, configuration, length) goes to stdout: median and p99 ns per input byte,
+ * memo bytes, steps, and the median time of each phase (parse, transform, compile, memo-init, simulate, free).
+ * With --baseline, the records are compared to an earlier run's and regressions are reported. */
+
+#include "memore.h"
+#include "statistics.h"
+#include "vendor/cJSON.h"
+#include "uthash.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#define BENCH_MAX_PUMPS 16
+#define BENCH_LINE 4096
+/* Matches faster than this are mostly timer and cache noise: --baseline compares only their steps and memo bytes */
+#define BENCH_MIN_COMPARE_NS 10000
+
+typedef struct BenchCase BenchCase;
+struct BenchCase
+{
+	char *regex;
+	char *prefix;
+	char *pump;
+	char *suffix;
+};
+
+typedef struct BenchConfig BenchConfig;
+struct BenchConfig
+{
+	int memoMode;
+	int encoding;
+	int engine;
+};
+
+typedef struct BenchArgs BenchArgs;
+struct BenchArgs
+{
+	const char *suite;
+	int pumps[BENCH_MAX_PUMPS];
+	int nPumps;
+	int reps;
+	unsigned long long maxSteps;
+	int perfCounters;
+	const char *baseline;
+	double tolerance; /* Fraction: a median ns/byte this much above the baseline's is a regression */
+};
+
+/* One record of a baseline run, by bench_key */
+typedef struct BenchBaseline BenchBaseline;
+struct BenchBaseline
+{
+	char *key;
+	double medianNSPerByte;
+	double steps;
+	double memoBytes;
+	int exceeded;
+	UT_hash_handle hh;
+};
+
+static const char *memoNames[] = { "none", "full", "indeg", "loop", "adaptive" };
+static const char *encodingNames[] = { "none", "neg", "rle", "rle-tuned", "bitset" };
+static const char *engineNames[] = { "backtrack", "pike" };
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: re-bench [--pumps N,N,...] [--reps N] [--max-steps N] [--perf-counters] [--baseline results.ndjson [--tolerance PCT]] [ perf-behav.txt ]\n");
+	fprintf(stderr, "  Each row's input is pumped --pumps times (default 4,16,64) and matched --reps times (default 11) per configuration\n");
+	fprintf(stderr, "  --max-steps bounds each search (default 1000000), so exponential configurations report -exceeded- instead of running on\n");
+	fprintf(stderr, "  --perf-counters adds cache and branch misses per match (Linux perf_event_open)\n");
+	fprintf(stderr, "  --baseline compares to an earlier run's output: more steps or memo bytes, a new -exceeded-,\n");
+	fprintf(stderr, "    or a median ns/byte (of a match taking 10us or more) more than --tolerance percent (default 25) above the baseline's is a regression (exit 1)\n");
+	exit(2);
+}
+
+static void *
+bench_alloc(size_t n)
+{
+	void *p = calloc(1, n);
+	if (p == NULL) {
+		fprintf(stderr, "re-bench: out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+static char *
+bench_strip(char *s)
+{
+	char *end;
+
+	while (*s == ' ' || *s == '\t')
+		s++;
+	end = s + strlen(s);
+	while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n' || end[-1] == '\r'))
+		end--;
+	*end = '\0';
+	return s;
+}
+
+/* As unittest-prototype.py: a # starts a comment, and the pieces are ::-separated. Returns the number of pieces. */
+static int
+bench_splitRow(char *line, char **pieces, int maxPieces)
+{
+	char *comment, *sep;
+	int n = 0;
+
+	if ((comment = strchr(line, '#')) != NULL)
+		*comment = '\0';
+	if (*bench_strip(line) == '\0')
+		return 0;
+	while (n < maxPieces) {
+		sep = strstr(line, "::");
+		if (sep != NULL)
+			*sep = '\0';
+		pieces[n++] = bench_strip(line);
+		if (sep == NULL)
+			break;
+		line = sep + 2;
+	}
+	return n;
+}
+
+/* The suite's distinct (regex, input) rows: its MEMO and CURVE columns are what the Python suite checks,
+ * while every memo mode is measured here. */
+static BenchCase *
+bench_loadSuite(const char *path, int *nCases)
+{
+	FILE *f;
+	char line[BENCH_LINE], *pieces[4], *parts[3], *s;
+	BenchCase *cases = NULL, *c;
+	int i, n = 0, cap = 0, dup;
+
+	if ((f = fopen(path, "r")) == NULL) {
+		perror(path);
+		exit(1);
+	}
+	while (fgets(line, sizeof line, f) != NULL) {
+		if (bench_splitRow(line, pieces, 4) != 4)
+			continue;
+		/* PREFIX:PUMP:SUFFIX */
+		s = pieces[1];
+		for (i = 0; i < 3; i++) {
+			parts[i] = s;
+			if (i < 2 && (s = strchr(s, ':')) != NULL)
+				*s++ = '\0';
+			if (s == NULL) {
+				fprintf(stderr, "re-bench: %s: bad input %s\n", path, pieces[1]);
+				exit(1);
+			}
+			parts[i] = bench_strip(parts[i]);
+		}
+		for (i = 0, dup = 0; i < n && !dup; i++)
+			dup = strcmp(cases[i].regex, pieces[0]) == 0 && strcmp(cases[i].prefix, parts[0]) == 0
+				&& strcmp(cases[i].pump, parts[1]) == 0 && strcmp(cases[i].suffix, parts[2]) == 0;
+		if (dup)
+			continue;
+		if (n == cap) {
+			cap = cap ? 2*cap : 32;
+			cases = realloc(cases, cap * sizeof cases[0]);
+			if (cases == NULL) {
+				fprintf(stderr, "re-bench: out of memory\n");
+				exit(1);
+			}
+		}
+		c = &cases[n++];
+		c->regex = strdup(pieces[0]);
+		c->prefix = strdup(parts[0]);
+		c->pump = strdup(parts[1]);
+		c->suffix = strdup(parts[2]);
+	}
+	fclose(f);
+	*nCases = n;
+	return cases;
+}
+
+/* prefix, nPumps copies of pump, suffix */
+static char *
+bench_buildInput(const BenchCase *c, int nPumps, size_t *len)
+{
+	size_t prefLen = strlen(c->prefix), pumpLen = strlen(c->pump), suffLen = strlen(c->suffix);
+	char *input, *p;
+	int i;
+
+	*len = prefLen + nPumps * pumpLen + suffLen;
+	p = input = bench_alloc(*len + 1);
+	memcpy(p, c->prefix, prefLen);
+	p += prefLen;
+	for (i = 0; i < nPumps; i++, p += pumpLen)
+		memcpy(p, c->pump, pumpLen);
+	memcpy(p, c->suffix, suffLen);
+	return input;
+}
+
+/* The Pike VM rejects backreferences (fatally), so it is skipped for these patterns */
+static int
+bench_hasBackref(const char *regex)
+{
+	const char *s;
+
+	for (s = regex; *s; s++) {
+		if (*s != '\\')
+			continue;
+		if (s[1] >= '1' && s[1] <= '9')
+			return 1;
+		if (s[1] != '\0')
+			s++;
+	}
+	return 0;
+}
+
+static int
+bench_cmpU64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+/* The q-quantile of the n samples, which it sorts */
+static uint64_t
+bench_quantile(uint64_t *samples, int n, double q)
+{
+	int i;
+
+	if (n == 0)
+		return 0;
+	qsort(samples, n, sizeof samples[0], bench_cmpU64);
+	i = (int) (q * (n - 1) + 0.5);
+	return samples[i];
+}
+
+/****** Hardware counters ********/
+
+enum { BENCH_CACHE_MISSES, BENCH_BRANCH_MISSES, BENCH_NCOUNTERS };
+
+static int counterFds[BENCH_NCOUNTERS] = { -1, -1 };
+
+/* Returns 0 if the counters cannot be opened here (another OS, or perf_event_paranoid) */
+static int
+bench_openCounters(void)
+{
+#ifdef __linux__
+	static const unsigned long long configs[BENCH_NCOUNTERS] = { PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+	struct perf_event_attr attr;
+	int i;
+
+	for (i = 0; i < BENCH_NCOUNTERS; i++) {
+		memset(&attr, 0, sizeof attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof attr;
+		attr.config = configs[i];
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		counterFds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		if (counterFds[i] < 0) {
+			perror("re-bench: perf_event_open");
+			return 0;
+		}
+	}
+	return 1;
+#else
+	fprintf(stderr, "re-bench: no hardware counters on this OS\n");
+	return 0;
+#endif
+}
+
+static void
+bench_startCounters(void)
+{
+#ifdef __linux__
+	int i;
+
+	for (i = 0; i < BENCH_NCOUNTERS; i++) {
+		ioctl(counterFds[i], PERF_EVENT_IOC_RESET, 0);
+		ioctl(counterFds[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+}
+
+static void
+bench_stopCounters(uint64_t *counts)
+{
+#ifdef __linux__
+	int i;
+
+	for (i = 0; i < BENCH_NCOUNTERS; i++) {
+		ioctl(counterFds[i], PERF_EVENT_IOC_DISABLE, 0);
+		if (read(counterFds[i], &counts[i], sizeof counts[i]) != sizeof counts[i])
+			counts[i] = 0;
+	}
+#endif
+}
+
+/****** Baseline ********/
+
+/* What identifies a record across runs: its regex, input, configuration and length, space-separated */
+static char *
+bench_key(const cJSON *record)
+{
+	static const char *fields[] = { "regex", "input", "memo", "encoding", "engine" };
+	char *key, *p;
+	size_t n = 16;
+	int i;
+
+	for (i = 0; i < nelem(fields); i++)
+		n += strlen(cJSON_GetStringValue(cJSON_GetObjectItem(record, fields[i]))) + 1;
+	p = key = bench_alloc(n);
+	for (i = 0; i < nelem(fields); i++)
+		p += sprintf(p, "%s ", cJSON_GetStringValue(cJSON_GetObjectItem(record, fields[i])));
+	sprintf(p, "%d", cJSON_GetObjectItem(record, "len")->valueint);
+	return key;
+}
+
+static int
+bench_isRecord(const cJSON *record)
+{
+	static const char *strings[] = { "regex", "input", "memo", "encoding", "engine" };
+	static const char *numbers[] = { "len", "medianNSPerByte", "steps", "memoBytes" };
+	int i;
+
+	if (record == NULL)
+		return 0;
+	for (i = 0; i < nelem(strings); i++)
+		if (!cJSON_IsString(cJSON_GetObjectItem(record, strings[i])))
+			return 0;
+	for (i = 0; i < nelem(numbers); i++)
+		if (!cJSON_IsNumber(cJSON_GetObjectItem(record, numbers[i])))
+			return 0;
+	return 1;
+}
+
+static BenchBaseline *
+bench_loadBaseline(const char *path)
+{
+	FILE *f;
+	char *line = NULL;
+	size_t cap = 0;
+	cJSON *record;
+	BenchBaseline *table = NULL, *b;
+
+	if ((f = fopen(path, "r")) == NULL) {
+		perror(path);
+		exit(1);
+	}
+	while (getline(&line, &cap, f) > 0) {
+		record = cJSON_Parse(line);
+		if (bench_isRecord(record)) {
+			b = bench_alloc(sizeof *b);
+			b->key = bench_key(record);
+			b->medianNSPerByte = cJSON_GetObjectItem(record, "medianNSPerByte")->valuedouble;
+			b->steps = cJSON_GetObjectItem(record, "steps")->valuedouble;
+			b->memoBytes = cJSON_GetObjectItem(record, "memoBytes")->valuedouble;
+			b->exceeded = cJSON_IsTrue(cJSON_GetObjectItem(record, "exceeded"));
+			HASH_ADD_KEYPTR(hh, table, b->key, strlen(b->key), b);
+		}
+		cJSON_Delete(record);
+	}
+	free(line);
+	fclose(f);
+	return table;
+}
+
+/* Returns the number of regressions in record (0 or 1), printing it to stderr */
+static int
+bench_compare(BenchBaseline *baseline, const cJSON *record, double tolerance)
+{
+	BenchBaseline *b;
+	char *key = bench_key(record), *why = NULL;
+	char buf[128];
+	double nsPerByte = cJSON_GetObjectItem(record, "medianNSPerByte")->valuedouble;
+	double steps = cJSON_GetObjectItem(record, "steps")->valuedouble;
+	double memoBytes = cJSON_GetObjectItem(record, "memoBytes")->valuedouble;
+	int len = cJSON_GetObjectItem(record, "len")->valueint;
+	int exceeded = cJSON_IsTrue(cJSON_GetObjectItem(record, "exceeded"));
+
+	HASH_FIND_STR(baseline, key, b);
+	if (b == NULL) {
+		free(key);
+		return 0;
+	}
+	/* Steps and memo bytes do not vary from run to run, so any growth counts */
+	if (exceeded && !b->exceeded)
+		why = "now exceeds --max-steps";
+	else if (!exceeded && !b->exceeded) {
+		if (steps > b->steps) {
+			snprintf(buf, sizeof buf, "steps %.0f -> %.0f", b->steps, steps);
+			why = buf;
+		} else if (memoBytes > b->memoBytes) {
+			snprintf(buf, sizeof buf, "memo bytes %.0f -> %.0f", b->memoBytes, memoBytes);
+			why = buf;
+		} else if (b->medianNSPerByte * (len + 1) >= BENCH_MIN_COMPARE_NS && nsPerByte > b->medianNSPerByte * (1 + tolerance)) {
+			snprintf(buf, sizeof buf, "median ns/byte %.2f -> %.2f", b->medianNSPerByte, nsPerByte);
+			why = buf;
+		}
+	}
+	if (why != NULL)
+		fprintf(stderr, "REGRESSION %s: %s\n", key, why);
+	free(key);
+	return why != NULL;
+}
+
+/****** Measuring ********/
+
+/* The median parse, transform, compile and free times over args->reps compiles of c under opts, into phases */
+static void
+bench_compilePhases(const BenchCase *c, const memore_options *opts, const BenchArgs *args, cJSON *phases)
+{
+	uint64_t *parse, *transform, *compile, *freeNS, startNS;
+	memore_compile_times times;
+	memore *mre;
+	int i;
+
+	parse = bench_alloc(args->reps * sizeof parse[0]);
+	transform = bench_alloc(args->reps * sizeof transform[0]);
+	compile = bench_alloc(args->reps * sizeof compile[0]);
+	freeNS = bench_alloc(args->reps * sizeof freeNS[0]);
+	for (i = 0; i < args->reps; i++) {
+		mre = memore_compile_ex(c->regex, opts);
+		memore_get_compile_times(mre, &times);
+		parse[i] = times.parseNS;
+		transform[i] = times.transformNS;
+		compile[i] = times.compileNS;
+		startNS = nowNS();
+		memore_free(mre);
+		freeNS[i] = nowNS() - startNS;
+	}
+	cJSON_AddNumberToObject(phases, "parse", bench_quantile(parse, args->reps, 0.5));
+	cJSON_AddNumberToObject(phases, "transform", bench_quantile(transform, args->reps, 0.5));
+	cJSON_AddNumberToObject(phases, "compile", bench_quantile(compile, args->reps, 0.5));
+	cJSON_AddNumberToObject(phases, "free", bench_quantile(freeNS, args->reps, 0.5));
+	free(parse);
+	free(transform);
+	free(compile);
+	free(freeNS);
+}
+
+/* Match c pumped to each length under cfg. Prints a record per length; returns the number of regressions. */
+static int
+bench_run(const BenchCase *c, const BenchConfig *cfg, const BenchArgs *args, BenchBaseline *baseline)
+{
+	memore_options opts;
+	memore_usage usage;
+	memore *mre;
+	memore_ctx *ctx;
+	cJSON *compilePhases, *record, *phases, *item;
+	const char *subs[MEMORE_MAXSUB];
+	uint64_t *matchNS, *memoInit, *sim, *counts[BENCH_NCOUNTERS], count[BENCH_NCOUNTERS], startNS;
+	char *input, *line, *inputSpec;
+	size_t len;
+	int p, i, k, n, matched, nRegressions = 0;
+
+	memore_options_init(&opts);
+	opts.memoMode = cfg->memoMode;
+	opts.encoding = cfg->encoding;
+	opts.engine = cfg->engine;
+	opts.stats = MEMORE_STATS_NONE;
+	opts.maxSteps = args->maxSteps;
+	opts.noDFA = 1;
+
+	compilePhases = cJSON_CreateObject();
+	bench_compilePhases(c, &opts, args, compilePhases);
+
+	n = snprintf(NULL, 0, "%s:%s:%s", c->prefix, c->pump, c->suffix);
+	inputSpec = bench_alloc(n + 1);
+	snprintf(inputSpec, n + 1, "%s:%s:%s", c->prefix, c->pump, c->suffix);
+
+	mre = memore_compile_ex(c->regex, &opts);
+	ctx = memore_ctx_create();
+	matchNS = bench_alloc(args->reps * sizeof matchNS[0]);
+	memoInit = bench_alloc(args->reps * sizeof memoInit[0]);
+	sim = bench_alloc(args->reps * sizeof sim[0]);
+	for (k = 0; k < BENCH_NCOUNTERS; k++)
+		counts[k] = bench_alloc(args->reps * sizeof counts[k][0]);
+
+	for (p = 0; p < args->nPumps; p++) {
+		input = bench_buildInput(c, args->pumps[p], &len);
+
+		/* Warm up the ctx's scratch; a search that runs into the budget is measured once */
+		matched = memore_match_ctx(mre, ctx, input, len, subs, MEMORE_MAXSUB);
+		n = matched == MEMORE_BUDGET_EXCEEDED ? 1 : args->reps;
+		for (i = 0; i < n; i++) {
+			if (args->perfCounters)
+				bench_startCounters();
+			startNS = nowNS();
+			matched = memore_match_ctx(mre, ctx, input, len, subs, MEMORE_MAXSUB);
+			matchNS[i] = nowNS() - startNS;
+			if (args->perfCounters) {
+				bench_stopCounters(count);
+				for (k = 0; k < BENCH_NCOUNTERS; k++)
+					counts[k][i] = count[k];
+			}
+			memore_ctx_last_usage(ctx, &usage);
+			memoInit[i] = usage.memoInitNS;
+			sim[i] = usage.simNS;
+		}
+
+		record = cJSON_CreateObject();
+		cJSON_AddStringToObject(record, "regex", c->regex);
+		cJSON_AddStringToObject(record, "input", inputSpec);
+		cJSON_AddStringToObject(record, "memo", memoNames[cfg->memoMode]);
+		cJSON_AddStringToObject(record, "encoding", encodingNames[cfg->encoding]);
+		cJSON_AddStringToObject(record, "engine", engineNames[cfg->engine]);
+		cJSON_AddNumberToObject(record, "pumps", args->pumps[p]);
+		cJSON_AddNumberToObject(record, "len", len);
+		cJSON_AddNumberToObject(record, "reps", n);
+		cJSON_AddBoolToObject(record, "exceeded", matched == MEMORE_BUDGET_EXCEEDED);
+		cJSON_AddNumberToObject(record, "matched", matched == 1);
+		/* Per byte of input, counting the end-of-input position so an empty input is defined */
+		cJSON_AddNumberToObject(record, "p99NSPerByte", (double) bench_quantile(matchNS, n, 0.99) / (len + 1));
+		cJSON_AddNumberToObject(record, "medianNSPerByte", (double) bench_quantile(matchNS, n, 0.5) / (len + 1));
+		cJSON_AddNumberToObject(record, "steps", usage.steps);
+		cJSON_AddNumberToObject(record, "memoBytes", usage.memoBytes);
+		phases = cJSON_AddObjectToObject(record, "phasesNS");
+		for (item = compilePhases->child; item != NULL; item = item->next)
+			if (strcmp(item->string, "free") != 0)
+				cJSON_AddNumberToObject(phases, item->string, item->valuedouble);
+		cJSON_AddNumberToObject(phases, "memoInit", bench_quantile(memoInit, n, 0.5));
+		cJSON_AddNumberToObject(phases, "simulate", bench_quantile(sim, n, 0.5));
+		cJSON_AddNumberToObject(phases, "free", cJSON_GetObjectItem(compilePhases, "free")->valuedouble);
+		if (args->perfCounters) {
+			cJSON_AddNumberToObject(record, "cacheMisses", bench_quantile(counts[BENCH_CACHE_MISSES], n, 0.5));
+			cJSON_AddNumberToObject(record, "branchMisses", bench_quantile(counts[BENCH_BRANCH_MISSES], n, 0.5));
+		}
+
+		line = cJSON_PrintUnformatted(record);
+		printf("%s\n", line);
+		fflush(stdout);
+		free(line);
+		if (baseline != NULL)
+			nRegressions += bench_compare(baseline, record, args->tolerance);
+		cJSON_Delete(record);
+		free(input);
+	}
+
+	for (k = 0; k < BENCH_NCOUNTERS; k++)
+		free(counts[k]);
+	free(sim);
+	free(memoInit);
+	free(matchNS);
+	memore_ctx_free(ctx);
+	memore_free(mre);
+	free(inputSpec);
+	cJSON_Delete(compilePhases);
+	return nRegressions;
+}
+
+static void
+bench_parseArgs(int argc, char **argv, BenchArgs *args)
+{
+	char *s, *end;
+
+	args->suite = "test/perf-behav.txt";
+	args->pumps[0] = 4;
+	args->pumps[1] = 16;
+	args->pumps[2] = 64;
+	args->nPumps = 3;
+	args->reps = 11;
+	args->maxSteps = 1000000;
+	args->perfCounters = 0;
+	args->baseline = NULL;
+	args->tolerance = 0.25;
+
+	for (argv++, argc--; argc > 0; argv++, argc--) {
+		if (strcmp(argv[0], "--pumps") == 0 && argc > 1) {
+			args->nPumps = 0;
+			for (s = argv[1]; *s; s = *end ? end + 1 : end) {
+				if (args->nPumps == BENCH_MAX_PUMPS)
+					usage();
+				args->pumps[args->nPumps++] = (int) strtol(s, &end, 10);
+				if (end == s || args->pumps[args->nPumps-1] < 0 || (*end && *end != ','))
+					usage();
+			}
+			if (args->nPumps == 0)
+				usage();
+			argv++, argc--;
+		} else if (strcmp(argv[0], "--reps") == 0 && argc > 1) {
+			args->reps = atoi(argv[1]);
+			if (args->reps <= 0)
+				usage();
+			argv++, argc--;
+		} else if (strcmp(argv[0], "--max-steps") == 0 && argc > 1) {
+			args->maxSteps = strtoull(argv[1], NULL, 10);
+			argv++, argc--;
+		} else if (strcmp(argv[0], "--perf-counters") == 0) {
+			args->perfCounters = 1;
+		} else if (strcmp(argv[0], "--baseline") == 0 && argc > 1) {
+			args->baseline = argv[1];
+			argv++, argc--;
+		} else if (strcmp(argv[0], "--tolerance") == 0 && argc > 1) {
+			args->tolerance = atof(argv[1]) / 100;
+			if (args->tolerance < 0)
+				usage();
+			argv++, argc--;
+		} else if (argv[0][0] == '-') {
+			usage();
+		} else if (argc == 1) {
+			args->suite = argv[0];
+		} else
+			usage();
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	BenchArgs args;
+	BenchCase *cases;
+	BenchConfig cfg;
+	BenchBaseline *baseline = NULL, *b, *tmp;
+	int nCases, i, nRegressions = 0;
+
+	bench_parseArgs(argc, argv, &args);
+	cases = bench_loadSuite(args.suite, &nCases);
+	if (args.perfCounters && !bench_openCounters())
+		args.perfCounters = 0;
+	if (args.baseline != NULL)
+		baseline = bench_loadBaseline(args.baseline);
+
+	for (i = 0; i < nCases; i++) {
+		logMsg(LOG_INFO, "re-bench: /%s/ on %s:%s:%s", cases[i].regex, cases[i].prefix, cases[i].pump, cases[i].suffix);
+		cfg.engine = MEMORE_ENGINE_BACKTRACK;
+		for (cfg.memoMode = MEMORE_MEMO_NONE; cfg.memoMode <= MEMORE_MEMO_ADAPTIVE; cfg.memoMode++) {
+			/* Without a memo table the encoding does not matter */
+			for (cfg.encoding = MEMORE_ENCODING_NONE; cfg.encoding <= MEMORE_ENCODING_BITSET; cfg.encoding++) {
+				nRegressions += bench_run(&cases[i], &cfg, &args, baseline);
+				if (cfg.memoMode == MEMORE_MEMO_NONE)
+					break;
+			}
+		}
+		if (!bench_hasBackref(cases[i].regex)) {
+			cfg.engine = MEMORE_ENGINE_PIKE;
+			cfg.memoMode = MEMORE_MEMO_NONE;
+			cfg.encoding = MEMORE_ENCODING_NONE;
+			nRegressions += bench_run(&cases[i], &cfg, &args, baseline);
+		}
+		free(cases[i].regex);
+		free(cases[i].prefix);
+		free(cases[i].pump);
+		free(cases[i].suffix);
+	}
+	free(cases);
+
+	HASH_ITER(hh, baseline, b, tmp) {
+		HASH_DEL(baseline, b);
+		free(b->key);
+		free(b);
+	}
+	if (args.baseline != NULL)
+		fprintf(stderr, "re-bench: %d regressions against %s\n", nRegressions, args.baseline);
+	return nRegressions > 0;
+}
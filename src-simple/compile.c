@@ -8,33 +8,24 @@
 
 #include <ctype.h>
 
-static Inst *pc; /* VM array */
 static int count(Regexp*);
-static void emit(Regexp*, int);
-
-static void
-Prog_assignStateNumbers(Prog *p)
-{
-	int i;
-	for (i = 0; i < p->len; i++) {
-		p->start[i].stateNum = i;
-	}
-}
+static void emit(Regexp*, int, Prog*, Inst**);
 
 // Transformation passes
-Regexp* _transformCurlies(Regexp *r);
+Regexp* _transformCurlies(Regexp *r, int countedLoops);
 Regexp* _transformAltGroups(Regexp *r);
 Regexp* _escapedNumsToBackrefs(Regexp *r);
 Regexp* _mergeCustomCharClassRanges(Regexp *r);
 
 /* Update this Regexp AST to make it more amenable to compilation
  *  - convert Curly to Alt-chain by expansion: A{1,3} --> A(A(A)?)?
+ *    (with countedLoops, a Curly too big to expand is kept, and compiles to a CountLoop)
  *  - replace Alt-chains with a "flat" AltList with one child per Alt entity
  *  - replace a CustomCharClass's CharRange chain with a flat list of CharRange's within the CCC
  *  - convert \1 to a backref
  */
 Regexp*
-transform(Regexp *r)
+transform(Regexp *r, int countedLoops)
 {
 	Regexp *ret;
 
@@ -42,7 +33,7 @@ transform(Regexp *r)
 
 	ret = r;
 	logMsg(LOG_DEBUG, "  Curlies");
-	ret = _transformCurlies(ret);
+	ret = _transformCurlies(ret, countedLoops);
 	logMsg(LOG_DEBUG, "  AltGroups");
 	ret = _transformAltGroups(ret);
 	logMsg(LOG_DEBUG, "  Backrefs");
@@ -90,7 +81,7 @@ _repeatPatternWithConcat(Regexp *r, int n)
 
 static
 Regexp *
-_repeatPatternWithNestedQuest(Regexp *r, int max)
+_repeatPatternWithNestedQuest(Regexp *r, int max, int nonGreedy)
 {
 	assert(r != NULL);
 	assert(max > 0);
@@ -100,12 +91,14 @@ _repeatPatternWithNestedQuest(Regexp *r, int max)
 	// To avoid recursion, we'll start with the innermost and work our way outward.
 	// max > 0, so we know there's at least an innermost node
 	Regexp *innermost = reg(Quest, copyreg(r), NULL);
+	innermost->n = nonGreedy;
 
 	int i;
 	Regexp *prev = innermost;
 	for (i = 1; i < max; i++) {
 		// Given prev, the next layer is (X prev)?
 		Regexp *nextInnermost = reg(Quest, reg(Cat, copyreg(r), prev), NULL);
+		nextInnermost->n = nonGreedy;
 		prev = nextInnermost;
 	}
 	ret = prev;
@@ -141,14 +134,56 @@ _repeatPatternWithAlt(Regexp *r, int min, int max)
 }
 #endif
 
+/* Counted loops nested in r */
+static int
+_countedDepth(Regexp *r)
+{
+	int d, dChild, i;
+
+	if (r == NULL)
+		return 0;
+	d = _countedDepth(r->left);
+	dChild = _countedDepth(r->right);
+	if (dChild > d)
+		d = dChild;
+	for (i = 0; r->children != NULL && i < r->arity; i++) {
+		dChild = _countedDepth(r->children[i]);
+		if (dChild > d)
+			d = dChild;
+	}
+	return d + (r->type == Curly);
+}
+
+/* Expanding a Curly costs about this many Insts per copy of A */
+#ifndef CURLY_MAX_EXPANSION
+#define CURLY_MAX_EXPANSION 512
+#endif
+
+/* Should A'{min,max} be a counted loop? Small ones are expanded: the loop forces memo keys to include its counter.
+ * A'{m,} is A'{m}A'*, so it is the A'{m} that would be counted. */
+static int
+_curlyShouldCount(Regexp *r, Regexp *A)
+{
+	int copies = r->curlyMax == -1 ? r->curlyMin : r->curlyMax;
+
+	if (copies <= 1 || _countedDepth(A) >= MAXCOUNT)
+		return 0;
+	return (long long) copies * count(A) > CURLY_MAX_EXPANSION;
+}
+
 /* Given A and recursively transformed A':
  *   A{2}   ->  A'A'
  *   A{1,2} ->  A'(A')?
  *   A{,2}  ->  (A'(A')?)?
  *   A{2,}  ->  A'A'A'*
+ * Or with countedLoops, when the expansion would be large:
+ *   A{1000}      ->  A'{1000}, a CountLoop
+ *   A{,1000}     ->  A'{0,1000}
+ *   A{1000,}     ->  A'{1000}A'*
+ * A non-greedy Curly makes non-greedy Quests, Stars, and CountLoops.
  */
 Regexp*
-_transformCurlies(Regexp *r)
+_transformCurlies(Regexp *r, int countedLoops)
 {
 	switch(r->type) {
 	default:
@@ -161,13 +196,26 @@ _transformCurlies(Regexp *r)
 		// r is of the form {m,n} where at most one of m and n is undefined
 
 		// Obtain A'. Make a copy anywhere you use it.
-		Regexp *A = _transformCurlies(r->left);
+		Regexp *A = _transformCurlies(r->left, countedLoops);
 		// This is populated with the replacement tree
 		Regexp *newR = NULL;
 
 		Regexp *prefix = NULL;
 		Regexp *suffix = NULL;
 
+		if (countedLoops && _curlyShouldCount(r, A)) {
+			logMsg(LOG_DEBUG, "  transformCurlies: Counted loop: (min %d, max %d)", r->curlyMin, r->curlyMax);
+			r->left = A;
+			if (r->curlyMin < 0)
+				r->curlyMin = 0;
+			if (r->curlyMax != -1)
+				return r;
+			r->curlyMax = r->curlyMin;
+			suffix = reg(Star, copyreg(A), NULL);
+			suffix->n = r->n;
+			return reg(Cat, r, suffix);
+		}
+
 		// TODO: 
 		//   2. Express A'{,n} as either A' (if n == -1) or Ques(A'.Ques(...))
 		//      NB: (?:A(?:A(...)?)?)? is "tail recursive" so all of the jumps point to the same place. in-deg>1 just covers that one place.
@@ -186,12 +234,13 @@ _transformCurlies(Regexp *r)
 		if (r->curlyMax == -1) {
 			logMsg(LOG_DEBUG, "  transformCurlies: Suffix is A*");
 			suffix = reg(Star, copyreg(A), NULL);
+			suffix->n = r->n;
 		} else {
 			int remainder = r->curlyMax - prefixLen;
 			if (remainder > 0) {
 				// A{,7}: Express with nested Quest
 				logMsg(LOG_DEBUG, "  transformCurlies: Suffix is A{,%d}", remainder);
-				suffix = _repeatPatternWithNestedQuest(A, remainder);
+				suffix = _repeatPatternWithNestedQuest(A, remainder, r->n);
 			} else {
 				// A{5,5} == A{5}
 				logMsg(LOG_DEBUG, "  transformCurlies: No suffix");
@@ -208,16 +257,14 @@ _transformCurlies(Regexp *r)
 			newR = reg(Cat, prefix, suffix);
 		}
 
-		freereg(A); // We no longer need this subtree
-		free(r); // We no longer need this Curly node -- should this be freereg now that copyreg is deep?
-		return newR;
+		return newR; // A and r are left in the compilation arena
 	}
 	case Alt:
 	case Cat:
 		/* Binary operators -- pass the buck. */
 		logMsg(LOG_DEBUG, "  curlies: Alt/Cat: passing buck");
-		r->left = _transformCurlies(r->left);
-		r->right = _transformCurlies(r->right);
+		r->left = _transformCurlies(r->left, countedLoops);
+		r->right = _transformCurlies(r->right, countedLoops);
 		return r;
 	case Quest:
 	case Star:
@@ -228,7 +275,7 @@ _transformCurlies(Regexp *r)
 		/* Unary operators -- pass the buck. */
 		logMsg(LOG_DEBUG, "  curlies: Quest/Star/Plus/Paren/CCC/Lookahead: passing buck");
 		if (r->left != NULL)
-			r->left = _transformCurlies(r->left);
+			r->left = _transformCurlies(r->left, countedLoops);
 		return r;
 	case Lit:
 	case Dot:
@@ -265,7 +312,6 @@ _fillAltChildren(Regexp *r, Regexp **children, int i)
 		// Now populate right child
 		assert(r->right->type != Alt); // I think?
 		children[next] = r->right;
-		free(r); // We don't need this Reg node anymore -- the left and right have been copied out to the parent already
 		return next + 1;
 	} else {
 		// End of the recursion
@@ -291,9 +337,9 @@ _transformAltGroups(Regexp *r)
 		logMsg(LOG_DEBUG, "  groupSize %d", groupSize);
 		assert(groupSize >= 2);
 
-		altList = mal(sizeof(*altList));
+		altList = amal(sizeof(*altList));
 		altList->type = AltList;
-		altList->children = mal(groupSize * sizeof(altList));
+		altList->children = amal(groupSize * sizeof(altList));
 		altList->arity = groupSize;
 		logMsg(LOG_DEBUG, "  Populating children array");
 		_fillAltChildren(r, altList->children, 0);
@@ -443,7 +489,7 @@ _mergeCustomCharClassRanges(Regexp *r)
 		groupSize = _countCCCNRanges(r->left);
 		logMsg(LOG_DEBUG, "  groupSize %d", groupSize);
 
-		r->children = mal(groupSize * sizeof(Regexp *));
+		r->children = amal(groupSize * sizeof(Regexp *));
 		r->arity = groupSize;
 		logMsg(LOG_DEBUG, "  Populating children array");
 		_fillCCCChildren(r->left, r->children, 0);
@@ -488,46 +534,277 @@ _mergeCustomCharClassRanges(Regexp *r)
 	return r;
 }
 
-// Compile into a Prog
-Prog*
-compile(Regexp *r, int memoMode, int memoEncoding, int *rleValues, int rleValuesLength, int singleRleK)
+/* Literals for the prefilter.
+ * The text of every match of r begins with prefix, ends with suffix, and contains required.
+ * If exact, r matches only prefix (== suffix == required), e.g. abc. Zero-width assertions match "". */
+typedef struct RegexpLiterals RegexpLiterals;
+struct RegexpLiterals
+{
+	int exact;
+	char prefix[PROG_MAX_LITERAL];
+	int prefixLen;
+	char suffix[PROG_MAX_LITERAL];
+	int suffixLen;
+	char required[PROG_MAX_LITERAL];
+	int requiredLen;
+};
+
+static void
+_litsSetAll(RegexpLiterals *l, int exact, const char *s, int n)
+{
+	l->exact = exact;
+	memcpy(l->prefix, s, n);
+	memcpy(l->suffix, s, n);
+	memcpy(l->required, s, n);
+	l->prefixLen = l->suffixLen = l->requiredLen = n;
+}
+
+/* Concatenate a and b into out (PROG_MAX_LITERAL long), keeping the first (or, keepEnd, the last) bytes if too long */
+static int
+_litsConcat(char *out, const char *a, int aLen, const char *b, int bLen, int keepEnd)
+{
+	char buf[2 * PROG_MAX_LITERAL];
+	int n = aLen + bLen;
+	memcpy(buf, a, aLen);
+	memcpy(buf + aLen, b, bLen);
+	if (n > PROG_MAX_LITERAL) {
+		if (keepEnd)
+			memmove(buf, buf + n - PROG_MAX_LITERAL, PROG_MAX_LITERAL);
+		n = PROG_MAX_LITERAL;
+	}
+	memcpy(out, buf, n);
+	return n;
+}
+
+static void
+_regexpLiterals(Regexp *r, RegexpLiterals *l)
 {
+	RegexpLiterals a, b;
+	char ch;
 	int i, n;
-	Prog *p;
 
-	n = count(r) + 1;
+	switch (r->type) {
+	default:
+		/* Nothing known */
+		_litsSetAll(l, 0, "", 0);
+		break;
+	case Lit:
+		ch = r->ch;
+		_litsSetAll(l, 1, &ch, 1);
+		break;
+	case InlineZWA:
+	case Lookahead:
+		/* Zero-width: they contribute nothing to the matched text */
+		_litsSetAll(l, 1, "", 0);
+		break;
+	case Paren:
+		_regexpLiterals(r->left, l);
+		break;
+	case Plus:
+		_regexpLiterals(r->left, l);
+		l->exact = 0;
+		break;
+	case Curly:
+		/* At least one iteration: like Plus */
+		if (r->curlyMin == 0) {
+			_litsSetAll(l, 0, "", 0);
+			break;
+		}
+		_regexpLiterals(r->left, l);
+		l->exact = 0;
+		break;
+	case Cat:
+		_regexpLiterals(r->left, &a);
+		_regexpLiterals(r->right, &b);
+		if (a.exact && b.exact && a.prefixLen + b.prefixLen <= PROG_MAX_LITERAL) {
+			n = _litsConcat(l->prefix, a.prefix, a.prefixLen, b.prefix, b.prefixLen, 0);
+			_litsSetAll(l, 1, l->prefix, n);
+			break;
+		}
+		l->exact = 0;
+		if (a.exact)
+			l->prefixLen = _litsConcat(l->prefix, a.prefix, a.prefixLen, b.prefix, b.prefixLen, 0);
+		else
+			l->prefixLen = _litsConcat(l->prefix, a.prefix, a.prefixLen, "", 0, 0);
+		if (b.exact)
+			l->suffixLen = _litsConcat(l->suffix, a.suffix, a.suffixLen, b.suffix, b.suffixLen, 1);
+		else
+			l->suffixLen = _litsConcat(l->suffix, b.suffix, b.suffixLen, "", 0, 1);
+		/* The longest of a's, b's, and the one spanning the seam */
+		l->requiredLen = _litsConcat(l->required, a.suffix, a.suffixLen, b.prefix, b.prefixLen, 0);
+		if (a.requiredLen > l->requiredLen)
+			l->requiredLen = _litsConcat(l->required, a.required, a.requiredLen, "", 0, 0);
+		if (b.requiredLen > l->requiredLen)
+			l->requiredLen = _litsConcat(l->required, b.required, b.requiredLen, "", 0, 0);
+		break;
+	case Alt:
+	case AltList:
+		/* What the branches have in common */
+		n = r->type == Alt ? 2 : r->arity;
+		for (i = 0; i < n; i++) {
+			Regexp *branch = r->type == Alt ? (i == 0 ? r->left : r->right) : r->children[i];
+			if (i == 0) {
+				_regexpLiterals(branch, l);
+				continue;
+			}
+			_regexpLiterals(branch, &b);
+			l->exact = l->exact && b.exact && l->prefixLen == b.prefixLen && memcmp(l->prefix, b.prefix, b.prefixLen) == 0;
+			if (l->exact)
+				continue;
+			while (l->prefixLen > b.prefixLen || memcmp(l->prefix, b.prefix, l->prefixLen) != 0)
+				l->prefixLen--;
+			while (l->suffixLen > b.suffixLen || memcmp(l->suffix, b.suffix + b.suffixLen - l->suffixLen, l->suffixLen) != 0) {
+				memmove(l->suffix, l->suffix + 1, l->suffixLen - 1);
+				l->suffixLen--;
+			}
+			/* Either branch's required literal might be the absent one */
+			l->requiredLen = 0;
+		}
+		if (!l->exact && l->prefixLen > l->requiredLen)
+			l->requiredLen = _litsConcat(l->required, l->prefix, l->prefixLen, "", 0, 0);
+		if (!l->exact && l->suffixLen > l->requiredLen)
+			l->requiredLen = _litsConcat(l->required, l->suffix, l->suffixLen, "", 0, 0);
+		break;
+	}
+}
+
+/* A Prog with room for n Insts, and each Inst's default visit interval */
+static Prog *
+_allocProg(int n, int memoEncoding, int singleRleK)
+{
+	int i;
+	Prog *p;
 
-	p = mal(sizeof *p + n*sizeof p->start[0]);
+	p = amal(sizeof *p + n*sizeof p->start[0] + n*sizeof p->aux[0]);
 	p->start = (Inst*)(p+1);
-	pc = p->start;
+	p->aux = (InstAux*)(p->start + n);
 	if (memoEncoding == ENCODING_RLE_TUNED) {
 		// for (i = 0; i < n; i++) {
 		// 	if (singleRleK != NULL){
-		// 		p->start[i].memoInfo.visitInterval = singleRleK;
+		// 		p->aux[i].memoInfo.visitInterval = singleRleK;
 		// 	} else{
 		// 		if (i < rleValuesLength){
-		// 			p->start[i].memoInfo.visitInterval = rleValues[i];	
+		// 			p->aux[i].memoInfo.visitInterval = rleValues[i];	
 		// 		} else {
-		// 			p->start[i].memoInfo.visitInterval = 1; /* A good default */
+		// 			p->aux[i].memoInfo.visitInterval = 1; /* A good default */
 		// 		}
 		// 	}
 		// }
 		for (i = 0; i < n; i++) {
-			p->start[i].memoInfo.visitInterval = singleRleK; /* A good default */
+			p->aux[i].memoInfo.visitInterval = singleRleK; /* A good default */
 		}
 	} else {
 		for (i = 0; i < n; i++) {
-			p->start[i].memoInfo.visitInterval = 1; /* A good default */
+			p->aux[i].memoInfo.visitInterval = 1; /* A good default */
 		}
 	}
+	return p;
+}
+
+static void
+_setLiterals(Prog *p, Regexp *r)
+{
+	RegexpLiterals lits;
+	_regexpLiterals(r, &lits);
+	memcpy(p->litPrefix, lits.prefix, lits.prefixLen);
+	p->litPrefixLen = lits.prefixLen;
+	memcpy(p->litRequired, lits.required, lits.requiredLen);
+	p->litRequiredLen = lits.requiredLen;
+	logMsg(LOG_INFO, "Literals: prefix <%.*s> required <%.*s>", p->litPrefixLen, p->litPrefix, p->litRequiredLen, p->litRequired);
+}
+
+// Compile into a Prog
+Prog*
+compile(Regexp *r, int memoMode, int memoEncoding, int *rleValues, int rleValuesLength, int singleRleK)
+{
+	int n;
+	Prog *p;
+	Inst *pc;
+
+	n = count(r) + 1;
+	p = _allocProg(n, memoEncoding, singleRleK);
+	pc = p->start;
 	
-	emit(r, memoMode);
+	emit(r, memoMode, p, &pc);
 	pc->opcode = Match;
 	pc++;
 	p->len = pc - p->start;
 	p->eolAnchor = r->eolAnchor;
+	p->bolAnchor = r->bolAnchor;
+	p->nCounters = _countedDepth(r);
+	_setLiterals(p, r);
+
+	return p;
+}
+
+/* parse() tacks a lazy .* onto a regex without a trailing anchor. It matches "" first, so it never changes
+ * whether there is a match, and a set search, which goes on past each match, would only walk it to the end. */
+static Regexp *
+_dropTrailingDotstar(Regexp *r)
+{
+	if (r->type == Cat && r->left->type == Paren && r->right->type == Star && r->right->n && r->right->left->type == Dot)
+		return r->left;
+	return r;
+}
+
+Prog*
+compileSet(Regexp **rs, int nRegexps, int memoMode, int memoEncoding, int singleRleK)
+{
+	Regexp alts, **bodies;
+	int i, n;
+	Prog *p;
+	Inst *pc, *split;
+
+	bodies = amal(nRegexps * sizeof bodies[0]);
+	n = nRegexps > 1 ? 1 : 0;
+	for (i = 0; i < nRegexps; i++) {
+		bodies[i] = _dropTrailingDotstar(rs[i]);
+		n += count(bodies[i]) + 1;
+	}
+	p = _allocProg(n, memoEncoding, singleRleK);
+	pc = p->start;
+
+	/* Each pattern in turn, ending in its own Match */
+	split = NULL;
+	if (nRegexps > 1) {
+		split = pc++;
+		split->opcode = SplitMany;
+		split->n = nRegexps;
+		split->edges = amal(nRegexps * sizeof split->edges[0]);
+	}
+	p->bolAnchor = 1;
+	p->eolAnchor = 1;
+	for (i = 0; i < nRegexps; i++) {
+		if (split != NULL)
+			split->edges[i] = pc;
+		emit(bodies[i], memoMode, p, &pc);
+		pc->opcode = Match;
+		pc->c = i;
+		pc++;
+		p->bolAnchor = p->bolAnchor && rs[i]->bolAnchor;
+		p->eolAnchor = p->eolAnchor && rs[i]->eolAnchor;
+		if (_countedDepth(bodies[i]) > p->nCounters)
+			p->nCounters = _countedDepth(bodies[i]);
+	}
+	if (split != NULL)
+		split->x = split->edges[0];
+	p->len = pc - p->start;
+	p->nPatterns = nRegexps;
+	p->patterns = amal(nRegexps * sizeof p->patterns[0]);
+	for (i = 0; i < nRegexps; i++) {
+		RegexpLiterals lits;
+		_regexpLiterals(bodies[i], &lits);
+		memcpy(p->patterns[i].litRequired, lits.required, lits.requiredLen);
+		p->patterns[i].litRequiredLen = lits.requiredLen;
+	}
+
+	/* A start is worth trying if any pattern could match from it */
+	memset(&alts, 0, sizeof alts);
+	alts.type = AltList;
+	alts.children = bodies;
+	alts.arity = nRegexps;
+	_setLiterals(p, &alts);
 
-	Prog_assignStateNumbers(p);
 	return p;
 }
 
@@ -568,6 +845,46 @@ count(Regexp *r)
 		return 1 +  count(r->left);
 	case Lookahead:
 		return 2 +  count(r->left); /* ZWA + RecursiveMatch */
+	case Curly:
+		return 3 + count(r->left); /* CountInit, CountLoop, Jmp */
+	}
+}
+
+long long
+expandedCount(Regexp *r)
+{
+	long long _count = 0;
+	int i, copies;
+
+	switch(r->type) {
+	default:
+		fatal("expandedCount: unknown type");
+	case Alt:
+		return 2 + expandedCount(r->left) + expandedCount(r->right);
+	case AltList:
+		for (i = 0; i < r->arity; i++)
+			_count += expandedCount(r->children[i]) + 1;
+		return 1 + _count;
+	case Cat:
+		return expandedCount(r->left) + expandedCount(r->right);
+	case Lit:
+	case Dot:
+	case CharEscape:
+	case CustomCharClass:
+	case Backref:
+	case InlineZWA:
+		return 1;
+	case Paren:
+	case Star:
+	case Lookahead:
+		return 2 + expandedCount(r->left);
+	case Quest:
+	case Plus:
+		return 1 + expandedCount(r->left);
+	case Curly:
+		/* As _transformCurlies would expand it: a copy of A per count, each but the required ones behind a Split */
+		copies = r->curlyMax == -1 ? r->curlyMin : r->curlyMax;
+		return (long long) copies * (1 + expandedCount(r->left));
 	}
 }
 
@@ -932,10 +1249,95 @@ _emitRegexpCharEscape2InstCharRange(Regexp *r, InstCharRange *instCR)
 	}
 }
 
+/* Built-in classes, matching _emitRegexpCharEscape2InstCharRange().
+ * Bytes >= 0x80 compare as negative chars, so they fall only in the inverted classes. */
+static const CharClassMap ccMap_w = {{ 0x03FF000000000000ULL, 0x07FFFFFE07FFFFFEULL, 0, 0 }};
+static const CharClassMap ccMap_W = {{ ~0x03FF000000000000ULL, ~0x07FFFFFE07FFFFFEULL, ~0ULL, ~0ULL }};
+static const CharClassMap ccMap_s = {{ 0x00000001F0003E00ULL, 0, 0, 0 }};
+static const CharClassMap ccMap_S = {{ ~0x00000001F0003E00ULL, ~0ULL, ~0ULL, ~0ULL }};
+static const CharClassMap ccMap_d = {{ 0x03FF000000000000ULL, 0, 0, 0 }};
+static const CharClassMap ccMap_D = {{ ~0x03FF000000000000ULL, ~0ULL, ~0ULL, ~0ULL }};
+
+const CharClassMap *
+CharClassMap_builtin(int ch)
+{
+	switch (ch) {
+	case 'w': return &ccMap_w;
+	case 'W': return &ccMap_W;
+	case 's': return &ccMap_s;
+	case 'S': return &ccMap_S;
+	case 'd': return &ccMap_d;
+	case 'D': return &ccMap_D;
+	default: return NULL;
+	}
+}
+
+int
+CharClassMap_builtinEscape(const CharClassMap *map)
+{
+	const char *ch;
+
+	for (ch = "wWsSdD"; *ch != '\0'; ch++)
+		if (map == CharClassMap_builtin(*ch))
+			return *ch;
+	return 0;
+}
+
+/* Byte c against cc->charRanges, with per-range and top-level inversion */
+static int
+_inCharRanges(const InstCharClass *cc, char c)
+{
+	int i, j;
+	int inThisRange = 0, inAnyInstCharRange = 0;
+
+	for (i = 0; i < cc->charRangeCounts; i++) {
+		inThisRange = 0;
+		for (j = 0; j < cc->charRanges[i].count; j++) {
+			inThisRange += cc->charRanges[i].lows[j] <= (int) c && (int) c <= cc->charRanges[i].highs[j];
+		}
+
+		// Invert the inner formula
+		if (cc->charRanges[i].invert)
+			inThisRange = !inThisRange;
+
+		if (inThisRange)
+			inAnyInstCharRange = 1;
+	}
+
+	// Apply top-level inversion
+	return inAnyInstCharRange ^ (cc->invert ? 1 : 0);
+}
+
+/* Compile cc->charRanges into inst->ccMap, so matching a byte is one load.
+ * Classes equal to a built-in share its interned map. */
+static void
+_emitCharClassMap(Inst *inst, InstCharClass *cc)
+{
+	static const char builtins[] = "wWsSdD";
+	const CharClassMap *builtin;
+	int b, i;
+
+	memset(&cc->ccMapOwn, 0, sizeof cc->ccMapOwn);
+	for (b = 0; b < 256; b++) {
+		if (_inCharRanges(cc, (char) b))
+			cc->ccMapOwn.bits[b >> 6] |= 1ULL << (b & 63);
+	}
+	inst->ccMap = &cc->ccMapOwn;
+
+	for (i = 0; builtins[i] != '\0'; i++) {
+		builtin = CharClassMap_builtin(builtins[i]);
+		if (memcmp(builtin, &cc->ccMapOwn, sizeof *builtin) == 0) {
+			logMsg(LOG_DEBUG, "  CharClass: interned as \\%c", builtins[i]);
+			inst->ccMap = builtin;
+			break;
+		}
+	}
+}
+
 static void
-_emitRegexpCharRange2Inst(Regexp *r, Inst *inst)
+_emitRegexpCharRange2Inst(Regexp *r, InstCharClass *cc)
 {
-	InstCharRange *next = &inst->charRanges[ inst->charRangeCounts ];
+	InstCharRange *next = &cc->charRanges[ cc->charRangeCounts ];
 	switch (r->type) {
     default:
 		assert(!"emitrcr2int: Unexpected type");
@@ -962,7 +1364,7 @@ _emitRegexpCharRange2Inst(Regexp *r, Inst *inst)
 
 /* Populate pc for r
  *   emit() produces instructions corresponding to r
- *   and saves them into the global pc array
+ *   and saves them into the array at *pcp, advancing *pcp past them
  * 
  *   Instructions are emitted sequentially into pc,
  *     whose size is calculated by walking r in count()
@@ -983,9 +1385,11 @@ _emitRegexpCharRange2Inst(Regexp *r, Inst *inst)
  *   Call after Regexp_calcLLI.
  */ 
 static void
-emit(Regexp *r, int memoMode)
+emit(Regexp *r, int memoMode, Prog *p, Inst **pcp)
 {
+	Inst *pc = *pcp; /* Next free Inst */
 	Inst *p1, *p2, *t, **t2;
+	InstCharClass *cc;
 	int i;
 
 	switch(r->type) {
@@ -996,21 +1400,21 @@ emit(Regexp *r, int memoMode)
 		pc->opcode = Split;
 		p1 = pc++;
 		p1->x = pc;
-		emit(r->left, memoMode);
+		emit(r->left, memoMode, p, &pc);
 		pc->opcode = Jmp;
 		p2 = pc++;
 		p1->y = pc;
-		emit(r->right, memoMode);
+		emit(r->right, memoMode, p, &pc);
 		p2->x = pc;
 		break;
 
 	case AltList:
 		pc->opcode = SplitMany;
-		pc->arity = r->arity;
-		pc->edges = mal(r->arity * sizeof(Inst **));
+		pc->n = r->arity;
+		pc->edges = amal(r->arity * sizeof(Inst **));
 
 		/* The Jmp nodes associated with each branch */
-		t2 = mal(r->arity * sizeof(Inst **));
+		t2 = amal(r->arity * sizeof(Inst **));
 
 		/* Emit the branches */
 		p1 = pc++;
@@ -1018,7 +1422,7 @@ emit(Regexp *r, int memoMode)
 		for (i = 0; i < r->arity; i++) {
 			/* Emit a branch */
 			p1->edges[i] = pc;
-			emit(r->children[i], memoMode);
+			emit(r->children[i], memoMode, p, &pc);
 			/* Emit a Jmp node and save it so we can set its destination once we exhaust the AltList */
 			pc->opcode = Jmp;
 			t2[i] = pc;
@@ -1030,15 +1434,14 @@ emit(Regexp *r, int memoMode)
 		for (i = 0; i < r->arity; i++) {
 			t2[i]->x = pc;
 		}
-		free(t2);
 
 		break;
 
 	case Cat:
 		p1 = pc;
-		emit(r->left, memoMode);
+		emit(r->left, memoMode, p, &pc);
 		p2 = pc;
-		emit(r->right, memoMode);
+		emit(r->right, memoMode, p, &pc);
 
 		break;
 	
@@ -1051,32 +1454,36 @@ emit(Regexp *r, int memoMode)
 	case CustomCharClass:
 		assert(r->mergedRanges);
 		pc->opcode = CharClass;
-		if (r->arity+1 > nelem(pc->charRanges)) // +1: space for a dash if needed
+		cc = INST_AUX(p, pc)->cc = amal(sizeof *cc);
+		if (r->arity+1 > nelem(cc->charRanges)) // +1: space for a dash if needed
 			fatal("Too many ranges in char class");
 
-		pc->charRangeCounts = 0;
+		cc->charRangeCounts = 0;
 		for (i = 0; i < r->arity; i++) {
-			// This doesn't really emit, it's actually populating pc fields
-			_emitRegexpCharRange2Inst(r->children[i], pc);
-			pc->charRangeCounts++;
+			// This doesn't really emit, it's actually populating cc fields
+			_emitRegexpCharRange2Inst(r->children[i], cc);
+			cc->charRangeCounts++;
 		}
 		if (r->plusDash) {
-			pc->charRanges[pc->charRangeCounts].lows[0] = '-';
-			pc->charRanges[pc->charRangeCounts].highs[0] = '-';
-			pc->charRanges[pc->charRangeCounts].count = 1;
+			cc->charRanges[cc->charRangeCounts].lows[0] = '-';
+			cc->charRanges[cc->charRangeCounts].highs[0] = '-';
+			cc->charRanges[cc->charRangeCounts].count = 1;
 
-			pc->charRangeCounts++;
+			cc->charRangeCounts++;
 		}
-		pc->invert = r->ccInvert;
+		cc->invert = r->ccInvert;
+		_emitCharClassMap(pc, cc);
 		pc++;
 		break;
 
 	case CharEscape:
 		pc->opcode = CharClass;
+		cc = INST_AUX(p, pc)->cc = amal(sizeof *cc);
 
-		// Fill in the pc details
-		_emitRegexpCharRange2Inst(r, pc);
-		pc->charRangeCounts = 1;
+		// Fill in the cc details
+		_emitRegexpCharRange2Inst(r, cc);
+		cc->charRangeCounts = 1;
+		_emitCharClassMap(pc, cc);
 		pc++;
 		break;
 	
@@ -1089,7 +1496,7 @@ emit(Regexp *r, int memoMode)
 		pc->n = 2*r->n;
 
 		pc++;
-		emit(r->left, memoMode);
+		emit(r->left, memoMode, p, &pc);
 		pc->opcode = Save;
 		pc->n = 2*r->n + 1;
 
@@ -1100,7 +1507,7 @@ emit(Regexp *r, int memoMode)
 		pc->opcode = Split;
 		p1 = pc++;
 		p1->x = pc;
-		emit(r->left, memoMode);
+		emit(r->left, memoMode, p, &pc);
 		p1->y = pc;
 		if(r->n) {	// non-greedy
 			t = p1->x;
@@ -1113,7 +1520,7 @@ emit(Regexp *r, int memoMode)
 		pc->opcode = Split;
 		p1 = pc++;
 		p1->x = pc;
-		emit(r->left, memoMode);
+		emit(r->left, memoMode, p, &pc);
 		pc->opcode = Jmp;
 		pc->x = p1; /* Back-edge */
 		pc++;
@@ -1127,7 +1534,7 @@ emit(Regexp *r, int memoMode)
 
 	case Plus:
 		p1 = pc;
-		emit(r->left, memoMode);
+		emit(r->left, memoMode, p, &pc);
 		pc->opcode = Split;
 		pc->x = p1; /* Back-edge */
 		p2 = pc;
@@ -1142,24 +1549,47 @@ emit(Regexp *r, int memoMode)
 
 	case Backref:
 		pc->opcode = StringCompare;
-		pc->cgNum = r->cgNum;
+		pc->c = r->cgNum;
 		pc++;
 		break;
 
 	case Lookahead:
 		pc->opcode = RecursiveZeroWidthAssertion;
 		pc++;
-		emit(r->left, memoMode);
+		emit(r->left, memoMode, p, &pc);
 		pc->opcode = RecursiveMatch;
 		pc++;
 		break;
 
+	case Curly:
+		/* A counted loop: _transformCurlies expanded the rest */
+		pc->opcode = CountInit;
+		pc++;
+		pc->opcode = CountLoop;
+		pc->c = r->curlyMin;
+		pc->n = r->curlyMax;
+		p1 = pc++;
+		p1->x = pc;
+		emit(r->left, memoMode, p, &pc);
+		pc->opcode = Jmp;
+		pc->x = p1; /* Back-edge */
+		pc++;
+		p1->y = pc;
+		if(r->n) {	// non-greedy
+			t = p1->x;
+			p1->x = p1->y;
+			p1->y = t;
+		}
+		break;
+
 	case InlineZWA:
 		pc->opcode = InlineZeroWidthAssertion;
 		pc->c = r->ch;
 		pc++;
 		break;
 	}
+
+	*pcp = pc;
 }
 
 // This function is used in simulation, but is most appropriately defined here.
@@ -1177,22 +1607,23 @@ usesBackreferences(Prog *prog)
   return 0;
 }
 
-char* printAllCharRanges(const Inst *inst) {
+char* printAllCharRanges(const InstCharClass *cc) {
     // printf("CharRanges:\n");
 	char* result = (char*)malloc(100 * sizeof(char));
     if (result == NULL) {
         printf("Memory allocation failed\n");
         exit(1);
     }
-    for (int i = 0; i < inst->charRangeCounts; i++) {
+    result[0] = '\0';
+    for (int i = 0; i < cc->charRangeCounts; i++) {
         // printf("CharRange #%d:\n", i + 1);
-		if (inst->invert || inst->charRanges[i].invert) {
+		if (cc->invert || cc->charRanges[i].invert) {
             strcat(result, "^");
         }
-        for (int j = 0; j < inst->charRanges[i].count; j++) {
+        for (int j = 0; j < cc->charRanges[i].count; j++) {
             // Convert the lows and highs to characters and concatenate them
-            char low = inst->charRanges[i].lows[j];
-            char high = inst->charRanges[i].highs[j];
+            char low = cc->charRanges[i].lows[j];
+            char high = cc->charRanges[i].highs[j];
 			// printf("%d: %d %d \n", j, low, high);
             // char range[6];
 
@@ -1205,6 +1636,114 @@ char* printAllCharRanges(const Inst *inst) {
 	return result;
 }
 
+/* A CharClass whose map is neither its InstCharClass's nor an interned built-in */
+static int
+_ownsLooseMap(Prog *p, int i)
+{
+	return p->start[i].opcode == CharClass && p->aux[i].cc == NULL && CharClassMap_builtinEscape(p->start[i].ccMap) == 0;
+}
+
+Prog*
+Prog_pack(Prog *p)
+{
+	size_t nEdges = 0, nClasses = 0, nMaps = 0, nStrBytes = 0, nSetStarts, size;
+	Inst **edges;
+	InstCharClass *cc;
+	CharClassMap *map;
+	char *at, *str;
+	Prog *q;
+	int i;
+
+	/* Most-aligned first: Prog, Insts, aux, edges, InstCharClasses, CharClassMaps, patterns, setStarts, String bytes.
+	 * A CharClass's map is its InstCharClass's, or a built-in, or (Prog_deserialize: no InstCharClass) one of its own. */
+	for (i = 0; i < p->len; i++) {
+		if (p->start[i].opcode == SplitMany)
+			nEdges += p->start[i].n;
+		else if (p->start[i].opcode == String)
+			nStrBytes += p->start[i].n;
+		else if (_ownsLooseMap(p, i))
+			nMaps++;
+		if (p->aux[i].cc != NULL)
+			nClasses++;
+	}
+	nSetStarts = p->setStarts != NULL ? p->setStartsAt[257] : 0;
+	size = sizeof *p + p->len * (sizeof p->start[0] + sizeof p->aux[0]) + nEdges * sizeof edges[0]
+		+ nClasses * sizeof *cc + nMaps * sizeof *map + p->nPatterns * sizeof p->patterns[0] + nSetStarts * sizeof p->setStarts[0] + nStrBytes;
+
+	q = mal(size);
+	*q = *p;
+	at = (char*)(q+1);
+	q->start = (Inst*)at;
+	at += p->len * sizeof p->start[0];
+	q->aux = (InstAux*)at;
+	at += p->len * sizeof p->aux[0];
+	edges = (Inst**)at;
+	at += nEdges * sizeof edges[0];
+	cc = (InstCharClass*)at;
+	at += nClasses * sizeof *cc;
+	map = (CharClassMap*)at;
+	at += nMaps * sizeof *map;
+	q->patterns = p->nPatterns > 0 ? (ProgPattern*)at : NULL;
+	at += p->nPatterns * sizeof p->patterns[0];
+	q->setStarts = nSetStarts > 0 ? (int*)at : NULL;
+	at += nSetStarts * sizeof p->setStarts[0];
+	str = at;
+	memcpy(q->start, p->start, p->len * sizeof p->start[0]);
+	memcpy(q->aux, p->aux, p->len * sizeof p->aux[0]);
+	if (q->patterns != NULL)
+		memcpy(q->patterns, p->patterns, p->nPatterns * sizeof p->patterns[0]);
+	if (q->setStarts != NULL)
+		memcpy(q->setStarts, p->setStarts, nSetStarts * sizeof p->setStarts[0]);
+
+#define PACK_EDGE(e) (q->start + INST_NUM(p, e))
+	for (i = 0; i < p->len; i++) {
+		Inst *pc = &q->start[i];
+		if (pc->x != NULL)
+			pc->x = PACK_EDGE(pc->x);
+		switch (pc->opcode) {
+		case Split:
+		case CountLoop:
+			pc->y = PACK_EDGE(pc->y);
+			break;
+		case SplitMany:
+			memcpy(edges, pc->edges, pc->n * sizeof edges[0]);
+			pc->edges = edges;
+			for (; edges < pc->edges + pc->n; edges++)
+				*edges = PACK_EDGE(*edges);
+			break;
+		case String:
+			memcpy(str, pc->str, pc->n);
+			pc->str = str;
+			str += pc->n;
+			break;
+		case CharClass:
+			if (_ownsLooseMap(p, i)) {
+				*map = *pc->ccMap;
+				pc->ccMap = map++;
+			}
+			break;
+		}
+		if (p->aux[i].cc != NULL) {
+			*cc = *p->aux[i].cc;
+			if (pc->opcode == CharClass && pc->ccMap == &p->aux[i].cc->ccMapOwn)
+				pc->ccMap = &cc->ccMapOwn;
+			q->aux[i].cc = cc++;
+		}
+	}
+#undef PACK_EDGE
+	assert((char*)q + size == str);
+	// Prog_peephole moved Insts, and Prog_deserialize has no summaries
+	Prog_summarizeEpsilons(q);
+	logMsg(LOG_INFO, "Packed the Prog into %zu bytes", size);
+	return q;
+}
+
+void
+freeprog(Prog *p)
+{
+	free(p); // Prog_pack put everything in one block
+}
+
 void
 printprog(Prog *p)
 {
@@ -1219,36 +1758,45 @@ printprog(Prog *p)
 		default:
 			fatal("printprog: unknown opcode");
 		case StringCompare:
-			printf("%2d. stringcompare %d (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), pc->cgNum, pc->memoInfo.shouldMemo, pc->memoInfo.memoStateNum, pc->memoInfo.visitInterval);
+			printf("%2d. stringcompare %d (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), pc->c, INST_AUX(p, pc)->memoInfo.shouldMemo, pc->memoStateNum, INST_AUX(p, pc)->memoInfo.visitInterval);
 			break;
 		case Split:
-			printf("%2d. split %d, %d (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), (int)(pc->x-p->start), (int)(pc->y-p->start), pc->memoInfo.shouldMemo, pc->memoInfo.memoStateNum, pc->memoInfo.visitInterval);
+			printf("%2d. split %d, %d (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), (int)(pc->x-p->start), (int)(pc->y-p->start), INST_AUX(p, pc)->memoInfo.shouldMemo, pc->memoStateNum, INST_AUX(p, pc)->memoInfo.visitInterval);
 			//printf("%2d. split %d, %d\n", (int)(pc->stateNum), (int)(pc->x->stateNum), (int)(pc->y->stateNum));
 			break;
 		case SplitMany:
 			printf("%2d. splitmany ", (int) (pc - p->start));
-			for (i = 0; i < pc->arity; i++) {
+			for (i = 0; i < pc->n; i++) {
 				printf("%d", (int) (pc->edges[i]-p->start));
-				if (i + 1 < pc->arity)
+				if (i + 1 < pc->n)
 					printf(", ");
 			}
-			printf("  (memo? %d -- state %d, visitInterval %d)\n", pc->memoInfo.shouldMemo, pc->memoInfo.memoStateNum, pc->memoInfo.visitInterval);
+			printf("  (memo? %d -- state %d, visitInterval %d)\n", INST_AUX(p, pc)->memoInfo.shouldMemo, pc->memoStateNum, INST_AUX(p, pc)->memoInfo.visitInterval);
 			//printf("%2d. split %d, %d\n", (int)(pc->stateNum), (int)(pc->x->stateNum), (int)(pc->y->stateNum));
 			break;
+		case CountInit:
+			printf("%2d. countinit (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), INST_AUX(p, pc)->memoInfo.shouldMemo, pc->memoStateNum, INST_AUX(p, pc)->memoInfo.visitInterval);
+			break;
+		case CountLoop:
+			printf("%2d. countloop {%d,%d} %d, %d (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), pc->c, pc->n, (int)(pc->x-p->start), (int)(pc->y-p->start), INST_AUX(p, pc)->memoInfo.shouldMemo, pc->memoStateNum, INST_AUX(p, pc)->memoInfo.visitInterval);
+			break;
 		case Jmp:
-			printf("%2d. jmp %d (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), (int)(pc->x-p->start), pc->memoInfo.shouldMemo, pc->memoInfo.memoStateNum, pc->memoInfo.visitInterval);
+			printf("%2d. jmp %d (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), (int)(pc->x-p->start), INST_AUX(p, pc)->memoInfo.shouldMemo, pc->memoStateNum, INST_AUX(p, pc)->memoInfo.visitInterval);
 			//printf("%2d. jmp %d\n", (int)(pc->stateNum), (int)(pc->x->stateNum));
 			break;
 		case Char:
-			printf("%2d. char %d (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), pc->c, pc->memoInfo.shouldMemo, pc->memoInfo.memoStateNum, pc->memoInfo.visitInterval);
+			printf("%2d. char %d (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), pc->c, INST_AUX(p, pc)->memoInfo.shouldMemo, pc->memoStateNum, INST_AUX(p, pc)->memoInfo.visitInterval);
 			//printf("%2d. char %c\n", (int)(pc->stateNum), pc->c);
 			break;
+		case String:
+			printf("%2d. string \"%.*s\" (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), pc->n, pc->str, INST_AUX(p, pc)->memoInfo.shouldMemo, pc->memoStateNum, INST_AUX(p, pc)->memoInfo.visitInterval);
+			break;
 		case Any:
-			printf("%2d. any (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), pc->memoInfo.shouldMemo, pc->memoInfo.memoStateNum, pc->memoInfo.visitInterval);
+			printf("%2d. any (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), INST_AUX(p, pc)->memoInfo.shouldMemo, pc->memoStateNum, INST_AUX(p, pc)->memoInfo.visitInterval);
 			//printf("%2d. any\n", (int)(pc->stateNum));
 			break;
 		case InlineZeroWidthAssertion:
-			printf("%2d. inlineZWA %c (memo? %d -- state %d)\n", (int)(pc-p->start), pc->c, pc->memoInfo.shouldMemo, pc->memoInfo.memoStateNum);
+			printf("%2d. inlineZWA %c (memo? %d -- state %d)\n", (int)(pc-p->start), pc->c, INST_AUX(p, pc)->memoInfo.shouldMemo, pc->memoStateNum);
 			//printf("%2d. any\n", (int)(pc->stateNum));
 			break;
 		case RecursiveZeroWidthAssertion:
@@ -1258,16 +1806,19 @@ printprog(Prog *p)
 			printf("%2d. recursivematch\n", (int)(pc-p->start));
 			break;
 		case CharClass:
-			// printAllCharRanges(pc);
-			printf("%2d. charClass %s (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), printAllCharRanges(pc),  pc->memoInfo.shouldMemo, pc->memoInfo.memoStateNum, pc->memoInfo.visitInterval);
+			// printAllCharRanges(INST_AUX(p, pc)->cc);
+			printf("%2d. charClass %s (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), INST_AUX(p, pc)->cc != NULL ? printAllCharRanges(INST_AUX(p, pc)->cc) : strdup("(map only)"),  INST_AUX(p, pc)->memoInfo.shouldMemo, pc->memoStateNum, INST_AUX(p, pc)->memoInfo.visitInterval);
 			//printf("%2d. any\n", (int)(pc->stateNum));
 			break;
 		case Match:
-			printf("%2d. match (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), pc->memoInfo.shouldMemo, pc->memoInfo.memoStateNum, pc->memoInfo.visitInterval);
+			if (p->nPatterns > 0)
+				printf("%2d. match pattern %d (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), pc->c, INST_AUX(p, pc)->memoInfo.shouldMemo, pc->memoStateNum, INST_AUX(p, pc)->memoInfo.visitInterval);
+			else
+				printf("%2d. match (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), INST_AUX(p, pc)->memoInfo.shouldMemo, pc->memoStateNum, INST_AUX(p, pc)->memoInfo.visitInterval);
 			//printf("%2d. match\n", (int)(pc->stateNum));
 			break;
 		case Save:
-			printf("%2d. save %d (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), pc->n, pc->memoInfo.shouldMemo, pc->memoInfo.memoStateNum, pc->memoInfo.visitInterval);
+			printf("%2d. save %d (memo? %d -- state %d, visitInterval %d)\n", (int)(pc-p->start), pc->n, INST_AUX(p, pc)->memoInfo.shouldMemo, pc->memoStateNum, INST_AUX(p, pc)->memoInfo.visitInterval);
 			//printf("%2d. save %d\n", (int)(pc->stateNum), pc->n);
 			break;
 		}
@@ -1275,107 +1826,584 @@ printprog(Prog *p)
 	printf("END\n");
 }
 
-static void Prog_unmarkAll(Prog *p)
+/* The infinite loop check: is there a cycle of Insts that consumes no character?
+ * Every pass below is iterative and linear in the Prog (times the CountLoop nesting, at most MAXCOUNT,
+ * or the number of backreferenced CGs), so generated patterns with thousands of alternatives compile in time
+ * and stack proportional to their size. The same pass records each Inst's InstEpsilonInfo. */
+
+// The k'th Inst that pc continues at without consuming a character, or -1 past the last.
+// nullable[i]: can Inst i go on without consuming? For a CountLoop, its body; for a StringCompare, its backreference.
+// Other consuming Insts, Match and RecursiveMatch end the path.
+// withBodies: a CountLoop continues into its body too, for _countBodiesNullable.
+// Otherwise its body runs at most n times, so a cycle through it ends: only the way out can loop back for good,
+// and only without consuming if the body need not consume to reach it.
+static int _epsilonSucc(Prog *p, Inst *pc, int k, const char *nullable, int withBodies)
 {
-	int i = 0;
-	for (i = 0; i < p->len; i++) {
-		p->start[i].startMark = 0;
-		p->start[i].visitMark = 0;
+	switch(pc->opcode) {
+	case Jmp:
+		return k == 0 ? INST_NUM(p, pc->x) : -1;
+	case Split:
+		return k == 0 ? INST_NUM(p, pc->x) : k == 1 ? INST_NUM(p, pc->y) : -1;
+	case SplitMany:
+		return k < pc->n ? INST_NUM(p, pc->edges[k]) : -1;
+	case Save:
+	case InlineZeroWidthAssertion:
+	case CountInit:
+		// Cost 0, so skip over
+		return k == 0 ? INST_NUM(p, pc) + 1 : -1;
+	case StringCompare:
+		return k == 0 && nullable[INST_NUM(p, pc)] ? INST_NUM(p, pc) + 1 : -1;
+	case RecursiveZeroWidthAssertion:
+		// Skip over the lookahead (nesting is verboten); its own branches are checked as Insts of their own
+		if (k > 0)
+			return -1;
+		while (pc->opcode != RecursiveMatch) pc++;
+		return INST_NUM(p, pc) + 1;
+	case CountLoop:
+	{
+		Inst *body = pc->x < pc->y ? pc->x : pc->y, *exit = pc->x < pc->y ? pc->y : pc->x;
+		int exitFree = pc->c == 0 || nullable[INST_NUM(p, pc)];
+		if (withBodies && k == 0)
+			return INST_NUM(p, body);
+		return k == withBodies && exitFree ? INST_NUM(p, exit) : -1;
+	}
+	default:
+		return -1;
 	}
 }
 
-static int Inst_couldStartLoop(Inst *inst)
+// The k'th Inst that pc continues at, consuming or not, or -1 past the last. A lookahead is entered and skipped over.
+static int _anySucc(Prog *p, Inst *pc, int k)
 {
-    // For the infinite loop check, we check if there's a loop to a branch.
-	// Only branches can introduce a back-edge -- START a loop.
-	switch (inst->opcode) {
-    case Jmp:
+	switch(pc->opcode) {
+	case Match:
+	case RecursiveMatch:
+		return -1;
+	case Jmp:
+		return k == 0 ? INST_NUM(p, pc->x) : -1;
 	case Split:
+	case CountLoop:
+		return k == 0 ? INST_NUM(p, pc->x) : k == 1 ? INST_NUM(p, pc->y) : -1;
 	case SplitMany:
-		return 1;
+		return k < pc->n ? INST_NUM(p, pc->edges[k]) : -1;
+	case RecursiveZeroWidthAssertion:
+		if (k == 0)
+			return INST_NUM(p, pc) + 1;
+		if (k > 1)
+			return -1;
+		while (pc->opcode != RecursiveMatch) pc++;
+		return INST_NUM(p, pc) + 1;
 	default:
-		return 0;
+		return k == 0 ? INST_NUM(p, pc) + 1 : -1;
+	}
+}
+
+// Mark in seen (as mark) what the Insts already on stack[0..n) reach, not going past a Save of slot stopAt.
+// anyEdge: every edge; else the zero-width ones, under nullable.
+static void _reachSearch(Prog *p, int *stack, int n, int *seen, int mark, int stopAt, int anyEdge, const char *nullable)
+{
+	int k, v, w;
+
+	while (n > 0) {
+		v = stack[--n];
+		if (p->start[v].opcode == Save && p->start[v].n == stopAt)
+			continue;
+		for (k = 0; (w = anyEdge ? _anySucc(p, &p->start[v], k) : _epsilonSucc(p, &p->start[v], k, nullable, 1)) >= 0; k++) {
+			if (seen[w] != mark) {
+				seen[w] = mark;
+				stack[n++] = w;
+			}
+		}
 	}
 }
 
-// Return non-zero if we form a cycle, starting from stateNum, without consuming a character
-// Uses a recursive DFS. Will blow the stack on large curlies...
-static int Prog_epsilonClosure(Prog *p, int stateNum, int start /* True if first call */)
+// nullable[i] for each StringCompare i: may its backreference match the empty string?
+// It may if its CG can be unset, half-set or empty there: if it can be reached from the start, from a Save of the CG's start,
+// or from a Save of its end that a Save of its start reaches without consuming, without passing another Save of its end.
+// Conservatively, every CountLoop may exit and every StringCompare may match nothing while the CG is matched.
+// Each search is per Save and not per CG, so that the patterns of a set, which share CG numbers, do not mix.
+static void _backrefsNullable(Prog *p, char *nullable)
 {
-	int i = 0;
-	Inst *curr = &p->start[stateNum];
+	int *seen = mal(p->len * sizeof(*seen)); /* 2k + 1 or 2k + 2 once CG k's searches reached it */
+	int *stack = mal(p->len * sizeof(*stack));
+	char *everything = mal(p->len);
+	char searched[MAXSUB/2] = {0};
+	int i, j, k, n, m;
 
-	logMsg(LOG_DEBUG, "  epsilonClosure: instr %d", stateNum);
-	if (curr->startMark) {
-		logMsg(LOG_DEBUG, "  infinite loop found: returned to instr %d", stateNum);
-		return 1;
-	} else if (curr->visitMark) {
-		logMsg(LOG_DEBUG, "  visited instr %d before, nothing more to mark here", stateNum);
-		return 0;
+	memset(everything, 1, p->len);
+	for (i = 0; i < p->len; i++) {
+		if (p->start[i].opcode != StringCompare)
+			continue;
+		k = p->start[i].c;
+		if (k < 0 || k >= MAXSUB/2) {
+			nullable[i] = 1; // Prog_deserialize does not check it
+			continue;
+		}
+		if (searched[k])
+			continue;
+		searched[k] = 1;
+
+		// The Saves of its end that can close an empty match of the CG
+		n = 0;
+		for (j = 0; j + 1 < p->len; j++) {
+			if (p->start[j].opcode == Save && p->start[j].n == CGID_TO_SUB_STARTP_IX(k)) {
+				seen[j + 1] = 2*k + 1;
+				stack[n++] = j + 1;
+			}
+		}
+		_reachSearch(p, stack, n, seen, 2*k + 1, CGID_TO_SUB_ENDP_IX(k), 0, everything);
+
+		// Where the CG can be unset, half-set or empty
+		n = 0;
+		stack[n++] = 0;
+		for (j = 0; j + 1 < p->len; j++) {
+			if (p->start[j].opcode == Save && p->start[j].n == CGID_TO_SUB_STARTP_IX(k))
+				stack[n++] = j;
+			else if (p->start[j].opcode == Save && p->start[j].n == CGID_TO_SUB_ENDP_IX(k) && seen[j] == 2*k + 1)
+				stack[n++] = j + 1;
+		}
+		for (m = 0; m < n; m++)
+			seen[stack[m]] = 2*k + 2;
+		_reachSearch(p, stack, n, seen, 2*k + 2, CGID_TO_SUB_ENDP_IX(k), 1, NULL);
+
+		for (j = i, m = 0; j < p->len; j++) {
+			if (p->start[j].opcode == StringCompare && p->start[j].c == k) {
+				nullable[j] = seen[j] == 2*k + 2;
+				m += nullable[j];
+			}
+		}
+		logMsg(LOG_DEBUG, "  backreferences to CG %d: %d may match the empty string", k, m);
 	}
+	free(seen);
+	free(stack);
+	free(everything);
+}
 
-	if (start) {
-		curr->startMark = 1;
-	} else {
-		curr->visitMark = 1;
+// nullable[L]: can CountLoop L's body run without consuming a character? Then its minimum does not make the loop consume.
+// A search from the body back to L, inner loops first: each body is searched once per CountLoop around it.
+static void _countBodiesNullable(Prog *p, char *nullable)
+{
+	int *mark = mal(p->len * sizeof(*mark)); /* i + 1 once CountLoop i's search reached it */
+	int *stack = mal(p->len * sizeof(*stack));
+	int i, k, n, v, w;
+	Inst *loop;
+
+	for (i = p->len - 1; i >= 0; i--) {
+		loop = &p->start[i];
+		if (loop->opcode != CountLoop)
+			continue;
+		n = 0;
+		stack[n++] = _epsilonSucc(p, loop, 0, nullable, 1);
+		mark[stack[0]] = i + 1;
+		while (n > 0 && !nullable[i]) {
+			v = stack[--n];
+			for (k = 0; (w = _epsilonSucc(p, &p->start[v], k, nullable, 1)) >= 0; k++) {
+				if (w == i) {
+					nullable[i] = 1;
+					break;
+				}
+				if (mark[w] != i + 1) {
+					mark[w] = i + 1;
+					stack[n++] = w;
+				}
+			}
+		}
+		logMsg(LOG_DEBUG, "  countloop %d: body nullable? %d", i, nullable[i]);
+	}
+	free(mark);
+	free(stack);
+}
+
+// Tarjan's algorithm over the zero-width edges, with an explicit stack: an Inst on a cycle, or -1.
+// Only branches have edges backwards, so every such cycle is a loop through a Jmp, Split or SplitMany.
+// Without a cycle every component is one Inst, popped after those its edges lead to: that order and
+// InstEpsilonInfo.acceptsEmpty are recorded as they are popped.
+static int _epsilonCycle(Prog *p, const char *nullable)
+{
+	int *order = mal(p->len * sizeof(*order)); /* DFS preorder number, 1-based; 0 if not reached yet */
+	int *low = mal(p->len * sizeof(*low));
+	char *onStack = mal(p->len);
+	int *scc = mal(p->len * sizeof(*scc)); /* Tarjan's stack */
+	int *call = mal(p->len * sizeof(*call)); /* The DFS path ... */
+	int *nextEdge = mal(p->len * sizeof(*nextEdge)); /* ... and the next edge to follow from each of its Insts */
+	int nScc = 0, nCall = 0, counter = 0, popped = 0, cycle = -1;
+	int root, v, w, size;
+
+	for (root = 0; root < p->len && cycle < 0; root++) {
+		if (order[root])
+			continue;
+		order[root] = low[root] = ++counter;
+		scc[nScc++] = root;
+		onStack[root] = 1;
+		call[nCall] = root;
+		nextEdge[nCall++] = 0;
+		while (nCall > 0 && cycle < 0) {
+			v = call[nCall - 1];
+			w = _epsilonSucc(p, &p->start[v], nextEdge[nCall - 1]++, nullable, 0);
+			if (w == v) {
+				cycle = v;
+			} else if (w >= 0 && !order[w]) {
+				order[w] = low[w] = ++counter;
+				scc[nScc++] = w;
+				onStack[w] = 1;
+				call[nCall] = w;
+				nextEdge[nCall++] = 0;
+			} else if (w >= 0) {
+				if (onStack[w] && order[w] < low[v])
+					low[v] = order[w];
+				else if (!onStack[w] && p->aux[w].eps.acceptsEmpty)
+					p->aux[v].eps.acceptsEmpty = 1;
+			} else {
+				// v is done. The root of a component pops it.
+				nCall--;
+				if (p->start[v].opcode == Match || p->start[v].opcode == RecursiveMatch)
+					p->aux[v].eps.acceptsEmpty = 1;
+				if (low[v] == order[v]) {
+					size = 0;
+					do {
+						w = scc[--nScc];
+						onStack[w] = 0;
+						p->aux[w].eps.order = popped++;
+						size++;
+					} while (w != v);
+					if (size > 1)
+						cycle = v;
+				}
+				if (nCall > 0 && low[v] < low[call[nCall - 1]])
+					low[call[nCall - 1]] = low[v];
+				if (nCall > 0 && p->aux[v].eps.acceptsEmpty)
+					p->aux[call[nCall - 1]].eps.acceptsEmpty = 1;
+			}
+		}
+	}
+
+	free(order);
+	free(low);
+	free(onStack);
+	free(scc);
+	free(call);
+	free(nextEdge);
+	return cycle;
+}
+
+// The closures' entries: the start, where each consuming Inst leads, and where a lookahead's sub-simulation starts
+static void _epsilonEntries(Prog *p)
+{
+	int i;
+
+	p->aux[0].eps.entry = 1;
+	for (i = 0; i + 1 < p->len; i++) {
+		switch (p->start[i].opcode) {
+		case Char:
+		case Any:
+		case CharClass:
+		case String:
+		case StringCompare:
+		case RecursiveZeroWidthAssertion:
+			p->aux[i + 1].eps.entry = 1;
+			break;
+		}
+	}
+}
+
+int
+Prog_summarizeEpsilons(Prog *p)
+{
+	char *nullable = mal(p->len);
+	int i, cycle;
+
+	for (i = 0; i < p->len; i++)
+		memset(&p->aux[i].eps, 0, sizeof p->aux[i].eps);
+	_backrefsNullable(p, nullable);
+	_countBodiesNullable(p, nullable);
+	cycle = _epsilonCycle(p, nullable);
+	_epsilonEntries(p);
+	free(nullable);
+	return cycle;
+}
+
+void Prog_assertNoInfiniteLoops(Prog *p)
+{
+	int cycle = Prog_summarizeEpsilons(p);
+
+	if (cycle >= 0) {
+		logMsg(LOG_DEBUG, "Found infinite loop through instr %d. Unsupported regex", cycle);
+		fatal("'syntax error': infinite loop possible due to nested *s like (a*)*");
+	}
+
+	logMsg(LOG_DEBUG, "No infinite loops found");
+}
+/* Peephole pass. Run after Prog_assertNoInfiniteLoops (so Jmp chains end) and before Prog_determineMemoNodes. */
+
+/* Where a transfer to pc really goes: past any chain of Jmps */
+static Inst *
+_jmpChainEnd(Prog *p, Inst *pc)
+{
+	int steps = 0;
+	while (pc->opcode == Jmp) {
+		pc = pc->x;
+		assert(++steps <= p->len); /* No epsilon cycles */
 	}
+	return pc;
+}
 
-	switch(curr->opcode) {
+/* Does pc continue at pc+1? */
+static int
+_fallsThrough(Inst *pc)
+{
+	switch (pc->opcode) {
 	case Jmp:
-		return Prog_epsilonClosure(p, curr->x->stateNum, 0);
 	case Split:
-		return Prog_epsilonClosure(p, curr->x->stateNum, 0) ? 1 : Prog_epsilonClosure(p, curr->y->stateNum, 0);
 	case SplitMany:
-		for (i = 0; i < curr->arity; i++) {
-			if (Prog_epsilonClosure(p, curr->edges[i]->stateNum, 0))
-				return 1;
-		}	
-		return 0;
-    case Char:
+	case CountLoop:
 	case Match:
-	case Any:
-	case CharClass:
-		return 0;
-	case Save:
-		// Costs 0, so skip over
-		return Prog_epsilonClosure(p, stateNum + 1, 0);
-	case StringCompare:
-		return 0; // TODO This requires a more sophisticated analysis. (.)?\1 can match the empty string
-	case InlineZeroWidthAssertion:
-		// InlineZWA costs 0, so skip over
-		return Prog_epsilonClosure(p, stateNum + 1, 0);
-	case RecursiveZeroWidthAssertion:
-	{
-		// RecursiveZWA costs 0, so skip over
-		// Nesting is verboten
-		while (curr->opcode != RecursiveMatch) curr++;
-		return Prog_epsilonClosure(p, curr->stateNum + 1, 0);
-	}
-	case RecursiveMatch:
-		// Nothing to do here, we'll explore this from another starting vertex
 		return 0;
 	default:
-		fatal("Unknown inst type");
+		return 1;
 	}
+}
 
-	fatal("Never reached");
-	return 0;
+/* Retarget every edge into a Jmp chain to the chain's end, and fold each Split whose arms agree into a Jmp.
+ * Returns the number of changes. */
+static int
+_threadJmps(Prog *p)
+{
+	Inst *pc, *to;
+	int i, j, nChanges = 0;
+
+	for (i = 0; i < p->len; i++) {
+		pc = &p->start[i];
+		switch (pc->opcode) {
+		case Jmp:
+			to = _jmpChainEnd(p, pc->x);
+			nChanges += to != pc->x;
+			pc->x = to;
+			break;
+		case Split:
+			to = _jmpChainEnd(p, pc->x);
+			nChanges += to != pc->x;
+			pc->x = to;
+			to = _jmpChainEnd(p, pc->y);
+			nChanges += to != pc->y;
+			pc->y = to;
+			if (pc->x == pc->y) {
+				logMsg(LOG_DEBUG, "  peephole: split %d has both arms at %d, now a jmp", i, INST_NUM(p, pc->x));
+				pc->opcode = Jmp;
+				pc->y = NULL;
+				nChanges++;
+			}
+			break;
+		case SplitMany:
+			for (j = 0; j < pc->n; j++) {
+				to = _jmpChainEnd(p, pc->edges[j]);
+				nChanges += to != pc->edges[j];
+				pc->edges[j] = to;
+			}
+			pc->x = pc->edges[0];
+			break;
+		}
+	}
+	return nChanges;
 }
 
-void Prog_assertNoInfiniteLoops(Prog *p)
+/* Remap an edge of the Prog being compacted: newIx[old index] is the Inst's index afterwards */
+static Inst *
+_remapEdge(Prog *p, const int *newIx, Inst *to)
+{
+	assert(newIx[INST_NUM(p, to)] >= 0);
+	return p->start + newIx[INST_NUM(p, to)];
+}
+
+void
+Prog_peephole(Prog *p)
 {
-	int i = 0;
-	for (i = 0; i < p->len; i++ ) {
-		if (Inst_couldStartLoop(&p->start[i])) {
-			Prog_unmarkAll(p);
-
-			logMsg(LOG_DEBUG, "  check for no infinite loops: starting from instr %d", i);
-			if (Prog_epsilonClosure(p, i, 1)) {
-				logMsg(LOG_DEBUG, "Found infinite loop from instr %d. Unsupported regex", i);
-				fatal("'syntax error': infinite loop possible due to nested *s like (a*)*");
+	int *nRefs, *newIx;
+	Inst *pc;
+	int i, j, k, len;
+
+	logMsg(LOG_INFO, "Peephole pass on %d instructions", p->len);
+
+	while (_threadJmps(p) > 0)
+		;
+
+	/* Edges into each Inst. Falling through from the previous Inst is counted separately. */
+	nRefs = mal(p->len * sizeof(*nRefs));
+	nRefs[0] = 1; /* The start */
+	for (i = 0; i < p->len; i++) {
+		pc = &p->start[i];
+		switch (pc->opcode) {
+		case Jmp:
+			nRefs[INST_NUM(p, pc->x)]++;
+			break;
+		case Split:
+		case CountLoop:
+			nRefs[INST_NUM(p, pc->x)]++;
+			nRefs[INST_NUM(p, pc->y)]++;
+			break;
+		case SplitMany:
+			for (j = 0; j < pc->n; j++)
+				nRefs[INST_NUM(p, pc->edges[j])]++;
+			break;
+		}
+	}
+
+	/* Decide what survives.
+	 *   A Jmp that nothing reaches any more is dropped.
+	 *   A run of Chars that is only entered at its head becomes one String. */
+	newIx = mal(p->len * sizeof(*newIx));
+	len = 0;
+	for (i = 0; i < p->len; i = j) {
+		pc = &p->start[i];
+		j = i + 1;
+		if (pc->opcode == Jmp && nRefs[i] == 0 && (i == 0 || !_fallsThrough(pc - 1))) {
+			logMsg(LOG_DEBUG, "  peephole: jmp %d is unreachable", i);
+			newIx[i] = -1;
+			continue;
+		}
+		newIx[i] = len++;
+		if (pc->opcode == Char) {
+			while (j < p->len && p->start[j].opcode == Char && nRefs[j] == 0)
+				newIx[j++] = -1;
+			if (j - i > 1) {
+				char *str = amal(j - i);
+				for (k = i; k < j; k++)
+					str[k - i] = p->start[k].c;
+				logMsg(LOG_DEBUG, "  peephole: chars %d-%d are a string", i, j - 1);
+				pc->opcode = String;
+				pc->n = j - i;
+				pc->str = str;
 			}
 		}
 	}
 
-	logMsg(LOG_DEBUG, "No infinite loops found");
-}
\ No newline at end of file
+	/* Compact in place: Insts only move down, and the edges are remapped before they do */
+	for (i = 0; i < p->len; i++) {
+		if (newIx[i] < 0)
+			continue;
+		pc = &p->start[i];
+		switch (pc->opcode) {
+		case Jmp:
+			pc->x = _remapEdge(p, newIx, pc->x);
+			break;
+		case Split:
+		case CountLoop:
+			pc->x = _remapEdge(p, newIx, pc->x);
+			pc->y = _remapEdge(p, newIx, pc->y);
+			break;
+		case SplitMany:
+			for (j = 0; j < pc->n; j++)
+				pc->edges[j] = _remapEdge(p, newIx, pc->edges[j]);
+			pc->x = pc->edges[0];
+			break;
+		}
+	}
+	for (i = 0; i < p->len; i++) {
+		if (newIx[i] >= 0 && newIx[i] != i) {
+			p->start[newIx[i]] = p->start[i];
+			p->aux[newIx[i]] = p->aux[i];
+		}
+	}
+
+	logMsg(LOG_INFO, "Peephole pass: %d -> %d instructions", p->len, len);
+	p->len = len;
+	free(nRefs);
+	free(newIx);
+}
+
+/* The bytes a match of the pattern from pc can begin with. *empty: it could also begin at the end of the input.
+ * Zero-width assertions are taken to hold. mark and stack have room for p->len; mark[i] == gen once visited. */
+static void
+_firstBytes(Prog *p, Inst *pc, CharClassMap *first, int *empty, int *mark, int gen, Inst **stack)
+{
+	int b, i, top = 0;
+
+	memset(first, 0, sizeof *first);
+	*empty = 0;
+	stack[top++] = pc;
+	mark[INST_NUM(p, pc)] = gen;
+#define FIRST_PUSH(ip) do { Inst *_ip = (ip); if (mark[INST_NUM(p, _ip)] != gen) { mark[INST_NUM(p, _ip)] = gen; stack[top++] = _ip; } } while (0)
+	while (top > 0) {
+		pc = stack[--top];
+		switch (pc->opcode) {
+		case Jmp:
+			FIRST_PUSH(pc->x);
+			break;
+		case Split:
+		case CountLoop:
+			FIRST_PUSH(pc->x);
+			FIRST_PUSH(pc->y);
+			break;
+		case SplitMany:
+			for (i = 0; i < pc->n; i++)
+				FIRST_PUSH(pc->edges[i]);
+			break;
+		case Save:
+		case InlineZeroWidthAssertion:
+		case CountInit:
+			FIRST_PUSH(pc + 1);
+			break;
+		case Char:
+			first->bits[(unsigned char) pc->c >> 6] |= (uint64_t) 1 << ((unsigned char) pc->c & 63);
+			break;
+		case String:
+			first->bits[(unsigned char) pc->str[0] >> 6] |= (uint64_t) 1 << ((unsigned char) pc->str[0] & 63);
+			break;
+		case CharClass:
+			for (i = 0; i < 4; i++)
+				first->bits[i] |= pc->ccMap->bits[i];
+			break;
+		case Any:
+			for (b = 0; b < 256; b++)
+				if (b != '\n' && b != '\r')
+					first->bits[b >> 6] |= (uint64_t) 1 << (b & 63);
+			break;
+		default:
+			/* Match, or what we do not look into (lookahead, backreferences) */
+			memset(first, 0xff, sizeof *first);
+			*empty = 1;
+			break;
+		}
+	}
+#undef FIRST_PUSH
+}
+
+void
+Prog_determineSetStarts(Prog *p)
+{
+	CharClassMap *first;
+	int *empty, *mark, b, k, n;
+	Inst *root = p->start, **stack;
+
+	assert(p->nPatterns > 0);
+	if (p->nPatterns == 1)
+		return;
+	assert(root->opcode == SplitMany && root->n == p->nPatterns);
+
+	first = mal(p->nPatterns * sizeof first[0]);
+	empty = mal(p->nPatterns * sizeof empty[0]);
+	mark = mal(p->len * sizeof mark[0]);
+	stack = mal(p->len * sizeof stack[0]);
+	for (k = 0; k < p->nPatterns; k++)
+		_firstBytes(p, root->edges[k], &first[k], &empty[k], mark, k + 1, stack);
+
+	/* setStarts[setStartsAt[b]..setStartsAt[b+1]) lists the patterns that can begin with byte b (256: at the end) */
+	n = 0;
+	for (b = 0; b < 257; b++)
+		for (k = 0; k < p->nPatterns; k++)
+			n += b < 256 ? CCMAP_HAS(&first[k], b) : empty[k];
+	p->setStarts = amal((n > 0 ? n : 1) * sizeof p->setStarts[0]);
+	n = 0;
+	for (b = 0; b < 257; b++) {
+		p->setStartsAt[b] = n;
+		for (k = 0; k < p->nPatterns; k++)
+			if (b < 256 ? CCMAP_HAS(&first[k], b) : empty[k])
+				p->setStarts[n++] = k;
+	}
+	p->setStartsAt[257] = n;
+	logMsg(LOG_INFO, "Set: %d start entries for %d patterns", n, p->nPatterns);
+
+	free(first);
+	free(empty);
+	free(mark);
+	free(stack);
+}
@@ -0,0 +1,452 @@
+// Copyright 2020 James C. Davis.  All Rights Reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#define _GNU_SOURCE /* memmem */
+#include "dfa.h"
+#include "log.h"
+#include "uthash.h"
+
+/* A DFA state is the set of NFA positions waiting for the next byte, plus what the previous byte was.
+ * The epsilon closure is taken on the way out of a state, once the next byte is known,
+ * so the anchors (which look at the bytes on both sides) are resolved exactly.
+ * A position is an Inst, or for a String, an offset into it. */
+
+enum {
+	/* DState.key[0] */
+	FlagBegin = 1,    /* Nothing consumed yet */
+	FlagPrevWord = 2, /* The previous byte is \w */
+};
+
+struct DState
+{
+	DState *next[DFA_EOF + 1]; /* By byte, then DFA_EOF. NULL until first taken. */
+	uint64_t matchOn[(DFA_EOF + 64) / 64]; /* Scanner: the cached transition on this byte passed a Match */
+	int *key; /* Flags, then the positions in ascending order */
+	int keyLen; /* In bytes */
+	int nPos;
+	int idle; /* Nothing but a fresh start (unanchored), or nothing at all */
+	UT_hash_handle hh;
+};
+
+struct DFA
+{
+	Prog *prog;
+	int maxStates;
+	int scan; /* DFA_createScanner: a Match does not end the run */
+	int nStates;
+	int nFlushes;
+	DState *states; /* Hash table over DState.key */
+	DState *start; /* NULL after a flush */
+	DState matched; /* Pseudo-state: the transition reached Match */
+	DState failed; /* Pseudo-state: DFA_EOF without reaching Match */
+
+	/* Positions */
+	int nPos;
+	int *instPos; /* Inst number -> its first position */
+	int *posInst; /* Position -> Inst number */
+	int *posOff;  /* Position -> offset into its String, else 0 */
+
+	/* Scratch for _step, nPos each */
+	int *closeMark;
+	int closeGen;
+	int *nextMark;
+	int nextGen;
+	int *stack;
+	int *consumers;
+	int *key; /* One more, for the flags */
+};
+
+int
+DFA_supports(Prog *prog)
+{
+	int i;
+
+	if(!DFA_supportsExpanded(prog))
+		return 0;
+	for(i = 0; i < prog->len; i++)
+		if(prog->start[i].opcode == CountLoop)
+			return 0;
+	return 1;
+}
+
+int
+DFA_supportsExpanded(Prog *prog)
+{
+	int i;
+
+	if(usesBackreferences(prog))
+		return 0;
+	for(i = 0; i < prog->len; i++) {
+		switch(prog->start[i].opcode) {
+		case StringCompare:
+		case RecursiveMatch:
+		case RecursiveZeroWidthAssertion:
+			return 0;
+		}
+	}
+	return 1;
+}
+
+DFA *
+DFA_create(Prog *prog, int maxStates)
+{
+	DFA *d;
+	int i, k, p;
+
+	d = mal(sizeof *d);
+	d->prog = prog;
+	d->maxStates = maxStates > 0 ? maxStates : DFA_MAX_STATES;
+
+	d->instPos = mal((prog->len + 1) * sizeof d->instPos[0]);
+	d->nPos = 0;
+	for(i = 0; i < prog->len; i++) {
+		d->instPos[i] = d->nPos;
+		d->nPos += prog->start[i].opcode == String ? prog->start[i].n : 1;
+	}
+	d->instPos[prog->len] = d->nPos;
+
+	d->posInst = mal(d->nPos * sizeof d->posInst[0]);
+	d->posOff = mal(d->nPos * sizeof d->posOff[0]);
+	for(i = 0; i < prog->len; i++) {
+		for(p = d->instPos[i], k = 0; p < d->instPos[i + 1]; p++, k++) {
+			d->posInst[p] = i;
+			d->posOff[p] = k;
+		}
+	}
+
+	d->closeMark = mal(d->nPos * sizeof d->closeMark[0]);
+	d->nextMark = mal(d->nPos * sizeof d->nextMark[0]);
+	d->stack = mal(d->nPos * sizeof d->stack[0]);
+	d->consumers = mal(d->nPos * sizeof d->consumers[0]);
+	d->key = mal((d->nPos + 1) * sizeof d->key[0]);
+	return d;
+}
+
+static void
+_flush(DFA *d)
+{
+	DState *s, *tmp;
+
+	HASH_ITER(hh, d->states, s, tmp) {
+		HASH_DEL(d->states, s);
+		free(s->key);
+		free(s);
+	}
+	d->nStates = 0;
+	d->start = NULL;
+	d->nFlushes++;
+	logMsg(LOG_DEBUG, "DFA: cache full at %d states, flushed (%d flushes)", d->maxStates, d->nFlushes);
+}
+
+void
+DFA_free(DFA *d)
+{
+	if(d == NULL)
+		return;
+	_flush(d);
+	free(d->instPos);
+	free(d->posInst);
+	free(d->posOff);
+	free(d->closeMark);
+	free(d->nextMark);
+	free(d->stack);
+	free(d->consumers);
+	free(d->key);
+	free(d);
+}
+
+/* The cached state for key[0..n), built if need be. May flush the cache. */
+static DState *
+_lookup(DFA *d, int *key, int n)
+{
+	DState *s;
+	int keyLen = n * sizeof key[0];
+
+	HASH_FIND(hh, d->states, key, keyLen, s);
+	if(s != NULL)
+		return s;
+
+	if(d->nStates >= d->maxStates)
+		_flush(d);
+	s = mal(sizeof *s);
+	s->key = mal(keyLen);
+	memcpy(s->key, key, keyLen);
+	s->keyLen = keyLen;
+	s->nPos = n - 1;
+	s->idle = s->nPos == 0 || (!d->prog->bolAnchor && s->nPos == 1 && key[1] == d->instPos[0]);
+	HASH_ADD_KEYPTR(hh, d->states, s->key, s->keyLen, s);
+	d->nStates++;
+	return s;
+}
+
+/* A fresh mark generation: everything is unmarked */
+static void
+_newGen(int *gen, int *mark, int n)
+{
+	if(++*gen == 0x7fffffff) {
+		memset(mark, 0, n * sizeof mark[0]);
+		*gen = 1;
+	}
+}
+
+static int
+_isWord(int c)
+{
+	return c != DFA_EOF && CCMAP_HAS(CharClassMap_builtin('w'), c);
+}
+
+/* Does the InlineZeroWidthAssertion pc hold before c? Same rules as backtrack's. */
+static int
+_zwaHolds(Inst *pc, int flags, int c)
+{
+	int isBegin = (flags & FlagBegin) != 0;
+	int isEnd = c == DFA_EOF;
+	int isWordBoundary;
+
+	switch(pc->c) {
+	case 'b':
+	case 'B':
+		/* The begin and end of the input always count as a word boundary */
+		if(isBegin || isEnd)
+			isWordBoundary = 1;
+		else
+			isWordBoundary = ((flags & FlagPrevWord) != 0) ^ _isWord(c);
+		return pc->c == 'b' ? isWordBoundary : !isWordBoundary;
+	case '^':
+	case 'A':
+		return isBegin;
+	case '$':
+	case 'Z':
+	case 'z':
+		return isEnd;
+	}
+	fatal("DFA: unknown InlineZWA character %c", pc->c);
+	return 0;
+}
+
+static int
+_cmpInt(const void *a, const void *b)
+{
+	return *(const int *) a - *(const int *) b;
+}
+
+/* The transition out of s on c (a byte or DFA_EOF). A scanner sets *matched if it passes a Match. */
+static DState *
+_step(DFA *d, DState *s, int c, int *matched)
+{
+	Prog *prog = d->prog;
+	int flags = s->key[0];
+	int i, p, top, nConsumers, nNext;
+	Inst *pc;
+
+#define PUSH(q) do { int _q = (q); if(d->closeMark[_q] != d->closeGen) { d->closeMark[_q] = d->closeGen; d->stack[top++] = _q; } } while(0)
+#define PUSH_INST(ip) PUSH(d->instPos[INST_NUM(prog, ip)])
+#define ADD_NEXT(q) do { int _q = (q); if(d->nextMark[_q] != d->nextGen) { d->nextMark[_q] = d->nextGen; d->key[1 + nNext++] = _q; } } while(0)
+
+	/* Closure: follow everything that consumes nothing, until the Insts that want c */
+	_newGen(&d->closeGen, d->closeMark, d->nPos);
+	top = 0;
+	nConsumers = 0;
+	for(i = 0; i < s->nPos; i++)
+		PUSH(s->key[1 + i]);
+	while(top > 0) {
+		p = d->stack[--top];
+		if(d->posOff[p] > 0) {
+			/* Partway through a String */
+			d->consumers[nConsumers++] = p;
+			continue;
+		}
+		pc = prog->start + d->posInst[p];
+		switch(pc->opcode) {
+		case Jmp:
+			PUSH_INST(pc->x);
+			break;
+		case Split:
+			PUSH_INST(pc->y);
+			PUSH_INST(pc->x);
+			break;
+		case SplitMany:
+			for(i = pc->n - 1; i >= 0; i--)
+				PUSH_INST(pc->edges[i]);
+			break;
+		case Save:
+			PUSH_INST(pc + 1);
+			break;
+		case InlineZeroWidthAssertion:
+			if(_zwaHolds(pc, flags, c))
+				PUSH_INST(pc + 1);
+			break;
+		case Match:
+			if(!prog->eolAnchor || c == DFA_EOF) {
+				if(!d->scan)
+					return &d->matched;
+				*matched = 1;
+			}
+			break;
+		case Char:
+		case Any:
+		case CharClass:
+		case String:
+			d->consumers[nConsumers++] = p;
+			break;
+		default:
+			fatal("DFA: unsupported opcode %d", pc->opcode);
+		}
+	}
+	if(c == DFA_EOF)
+		return &d->failed;
+
+	/* Consume c */
+	_newGen(&d->nextGen, d->nextMark, d->nPos);
+	nNext = 0;
+	for(i = 0; i < nConsumers; i++) {
+		p = d->consumers[i];
+		pc = prog->start + d->posInst[p];
+		switch(pc->opcode) {
+		case Char:
+			if((char) c == pc->c)
+				ADD_NEXT(p + 1);
+			break;
+		case Any:
+			if(c != '\n' && c != '\r')
+				ADD_NEXT(p + 1);
+			break;
+		case CharClass:
+			if(CCMAP_HAS(pc->ccMap, c))
+				ADD_NEXT(p + 1);
+			break;
+		case String:
+			/* The last byte's p + 1 is pc + 1's position */
+			if(pc->str[d->posOff[p]] == (char) c)
+				ADD_NEXT(p + 1);
+			break;
+		}
+	}
+	/* Unanchored: a match may also begin after c */
+	if(!prog->bolAnchor)
+		ADD_NEXT(d->instPos[0]);
+
+#undef PUSH
+#undef PUSH_INST
+#undef ADD_NEXT
+
+	qsort(d->key + 1, nNext, sizeof d->key[0], _cmpInt);
+	d->key[0] = _isWord(c) ? FlagPrevWord : 0;
+	return _lookup(d, d->key, 1 + nNext);
+}
+
+DState *
+DFA_start(DFA *d)
+{
+	if(d->start == NULL) {
+		d->key[0] = FlagBegin;
+		d->key[1] = d->instPos[0];
+		d->start = _lookup(d, d->key, 2);
+	}
+	return d->start;
+}
+
+int
+DFA_match(DFA *d, char *input, int len)
+{
+	Prog *prog = d->prog;
+	DState *s, *next;
+	int i, c, nFlushes;
+
+	assert(!d->scan);
+	if(prog->litRequiredLen > 0 && memmem(input, len, prog->litRequired, prog->litRequiredLen) == NULL)
+		return 0;
+
+	s = DFA_start(d);
+	for(i = 0; ; i++) {
+		c = i < len ? (unsigned char) input[i] : DFA_EOF;
+		next = s->next[c];
+		if(next == NULL) {
+			nFlushes = d->nFlushes;
+			next = _step(d, s, c, NULL);
+			/* A flush freed s */
+			if(d->nFlushes == nFlushes)
+				s->next[c] = next;
+		}
+		if(next == &d->matched)
+			return 1;
+		if(next == &d->failed || next->nPos == 0)
+			return 0;
+		s = next;
+	}
+}
+
+DFA *
+DFA_createScanner(Prog *prog, int maxStates)
+{
+	DFA *d = DFA_create(prog, maxStates);
+	d->scan = 1;
+	return d;
+}
+
+/* The scanner's transition out of s on c */
+static DState *
+_scanStep(DFA *d, DState *s, int c, int *matched)
+{
+	DState *next = s->next[c];
+	int nFlushes, m;
+
+	if(next != NULL) {
+		*matched = (s->matchOn[c >> 6] >> (c & 63)) & 1;
+		return next;
+	}
+	m = 0;
+	nFlushes = d->nFlushes;
+	next = _step(d, s, c, &m);
+	/* A flush freed s */
+	if(d->nFlushes == nFlushes) {
+		s->next[c] = next;
+		if(m)
+			s->matchOn[c >> 6] |= (uint64_t) 1 << (c & 63);
+	}
+	*matched = m;
+	return next;
+}
+
+int
+DFA_scan(DFA *d, DState **sp, const char *input, int n, int inMatch, int *matched, int *idleAt)
+{
+	DState *s = *sp, *next;
+	int i, m;
+
+	assert(d->scan);
+	for(i = 0; i < n; i++) {
+		next = _scanStep(d, s, (unsigned char) input[i], &m);
+		s = next;
+		if(inMatch) {
+			if(next->idle)
+				break;
+		} else if(m) {
+			*matched = 1;
+			break;
+		} else if(next->idle) {
+			*idleAt = i + 1;
+			if(d->prog->bolAnchor)
+				break;
+		}
+	}
+	*sp = s;
+	return i < n ? i + 1 : n;
+}
+
+int
+DFA_scanEnd(DFA *d, DState *s)
+{
+	int m;
+
+	assert(d->scan);
+	_scanStep(d, s, DFA_EOF, &m);
+	return m;
+}
+
+int
+DFA_isIdle(DState *s)
+{
+	return s->idle;
+}
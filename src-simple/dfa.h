@@ -0,0 +1,51 @@
+// Copyright 2020 James C. Davis.  All Rights Reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef DFA_H
+#define DFA_H
+
+#include "regexp.h"
+
+/* A lazily built DFA over a Prog: match/no-match in one pass over the input, with no memo table.
+ * States are built on first use and cached. A full cache is flushed and refilled. */
+
+/* Default bound on cached states (each is about 2KB) */
+#define DFA_MAX_STATES 1024
+
+typedef struct DFA DFA;
+typedef struct DState DState;
+
+enum {
+	DFA_EOF = 256, /* The transition on the end of the input */
+};
+
+/* Can the DFA run this Prog? Not with backreferences, lookahead, or counted loops. */
+int DFA_supports(Prog *prog);
+/* Could it, were the Prog's counted loops expanded? */
+int DFA_supportsExpanded(Prog *prog);
+
+/* The cache is mutable: one DFA per thread */
+DFA *DFA_create(Prog *prog, int maxStates);
+/* Same answer as backtrack() on (input, len) */
+int DFA_match(DFA *dfa, char *input, int len);
+void DFA_free(DFA *dfa);
+
+/* A scanner runs one unanchored pass over input that arrives a chunk at a time, and does not stop at a match.
+ * A state is idle when no partial match is live in it: no match starts before that offset,
+ * and none of the earlier starts reaches past it.
+ * Only the last state a scanner returned stays valid: a full cache is flushed. */
+DFA *DFA_createScanner(Prog *prog, int maxStates);
+DState *DFA_start(DFA *dfa);
+/* Run *s over the n bytes at input, and return how many were taken.
+ * Before a match (!inMatch): stop after the first byte whose transition passes a Match (setting *matched),
+ * or after an idle state for an anchored Prog, whose threads are then all dead; *idleAt is one past the last byte
+ * after which *s was idle, or unchanged.
+ * inMatch: stop after an idle state. */
+int DFA_scan(DFA *dfa, DState **s, const char *input, int n, int inMatch, int *matched, int *idleAt);
+/* Does the end of the input after *s complete a match? */
+int DFA_scanEnd(DFA *dfa, DState *s);
+/* Is no partial match live in s? */
+int DFA_isIdle(DState *s);
+
+#endif /* DFA_H */
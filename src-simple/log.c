@@ -39,45 +39,30 @@ int getenvVerbosity() {
     assert(!"Unknown verbosity");
 }
 
-int initialized = 0;
-int maxVerbosity = LOG_SILENT;
-void log_init() {
-    if (initialized) {
-        return;
+int logVerbosity = -1;
+int log_init() {
+    if (logVerbosity < 0) {
+        logVerbosity = getenvVerbosity();
     }
-
-    maxVerbosity = getenvVerbosity();
-    initialized = 1;
+    return logVerbosity;
 }
 
 void logMsg_format(const char* tag, const char* message, va_list args);
-int shouldLog(int logLvl)
-{
-    if (!initialized){
-        log_init();
-    }
-
-    return logLvl <= maxVerbosity;
-}
 
-void logMsg(int level, const char* message, ...) {
+/* Only reached through logMsg(), which has already tested the level. */
+void logMsg_emit(int level, const char* message, ...) {
     va_list args;
 
-    if (!initialized){
-        log_init();
-    }
-
-    if (shouldLog(level)) {
-        va_start(args, message);
-        logMsg_format(logLevels[level], message, args);
-        va_end(args);
-    }
+    va_start(args, message);
+    logMsg_format(logLevels[level], message, args);
+    va_end(args);
 }
 
 void logMsg_format(const char* tag, const char* message, va_list args) {
     time_t now;
+    char date[32];
     time(&now);
-    char * date = ctime(&now);
+    ctime_r(&now, date);
     date[strlen(date) - 1] = '\0';
     printf("%s [%s]:\t", date, tag);
     vprintf(message, args);
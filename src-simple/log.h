@@ -21,9 +21,24 @@ enum
  * Logging is performed at or below the specified level.
  * Default level is SILENT */
 
-void logMsg(int level, const char* message, ...);
+/* Compile-time ceiling: sites above MEMO_LOG_MAX compile to nothing.
+ * e.g. -DMEMO_LOG_MAX=LOG_INFO (see "make release") drops all verbose and debug logging. */
+#ifndef MEMO_LOG_MAX
+#define MEMO_LOG_MAX LOG_MAX
+#endif
+
+/* Run-time level from MEMOIZATION_LOGLVL; -1 until log_init() runs. */
+extern int logVerbosity;
+int log_init(void);
 
 /* True if we log such messages (e.g. to control a call to printre). */
-int shouldLog(int level);
+#define shouldLog(level) \
+  ( (level) <= MEMO_LOG_MAX && (level) <= (logVerbosity >= 0 ? logVerbosity : log_init()) )
+
+/* The level is tested before the arguments are evaluated. */
+#define logMsg(level, ...) \
+  do { if (shouldLog(level)) logMsg_emit((level), __VA_ARGS__); } while (0)
+
+void logMsg_emit(int level, const char* message, ...);
 
-#endif
\ No newline at end of file
+#endif
@@ -4,6 +4,8 @@
 
 #include "regexp.h"
 #include "memoize.h"
+#include "memore.h"
+#include "batch.h"
 #include "vendor/cJSON.h"
 #include "log.h"
 
@@ -13,6 +15,9 @@
 #include <unistd.h>
 #include <errno.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 // Set this to 1 if you want to see regex and VM representations
 #define DEBUG 0
 
@@ -22,29 +27,47 @@ struct Query
 {
 	char *regex;
 	char *input;
+	size_t inputLen;
+	int mapped; /* input is an mmap of inputLen bytes */
 	int *rleValues;
 	int rleValuesLength;
 	int singleRleK;
 };
 
-struct {
-	char *name;
-	int (*fn)(Prog*, char*, char**, int);
-} tab[] = {
-	{"recursive", recursiveprog},
-	{"recursiveloop", recursiveloopprog},
-	{"backtrack", backtrack},
-	{"thompson", thompsonvm},
-	{"pike", pikevm},
-};
+static memore *
+compileRegex(const char *regex, const memore_options *opts, const char *cacheDir)
+{
+	if (cacheDir != NULL)
+		return memore_compile_cached(regex, opts, cacheDir);
+	return memore_compile_ex(regex, opts);
+}
 
 void
 usage(void)
 {
 	/* TODO: Diagnose cases where rle-tuned doesn't help */
-	fprintf(stderr, "usage: re {none|full|indeg|loop} {none|neg|rle|rle-tuned} { regexp string | -f patternAndStr.json } { singlerlek int | multiplerlek int,int...}\n");
+	fprintf(stderr, "usage: re [--stats {visits|summary|none}] [--engine {backtrack|pike}] [--memo-budget BYTES] [--memo-window] [--max-steps N] [--max-memo-bytes BYTES] [--timeout-us US] [--budget-retry {none|full|pike}] [--cache DIR] {none|full|indeg|loop|adaptive} {none|neg|rle|rle-tuned|bitset} { regexp string | -f patternAndStr.json } { singlerlek int | multiplerlek int,int...}\n");
+	fprintf(stderr, "       re [--stats {visits|summary|none}] [--engine {backtrack|pike}] [--memo-budget BYTES] [--memo-window] [--max-steps N] [--max-memo-bytes BYTES] [--timeout-us US] [--budget-retry {none|full|pike}] [--cache DIR] [--stream] {none|full|indeg|loop|adaptive} {none|neg|rle|rle-tuned|bitset} -F input regexp [ singlerlek int ]\n");
+	fprintf(stderr, "       re [--stats {visits|summary|none}] [--engine {backtrack|pike}] [--memo-budget BYTES] [--memo-window] [--max-steps N] [--max-memo-bytes BYTES] [--timeout-us US] [--budget-retry {none|full|pike}] [--cache DIR] --batch [--ndjson] [--jobs N] {none|full|indeg|loop|adaptive} {none|neg|rle|rle-tuned|bitset} { regexp | -f pattern.json } [ inputs | - ]\n");
+	fprintf(stderr, "       re [--stats {visits|summary|none}] [--memo-budget BYTES] [--memo-window] [--max-steps N] [--max-memo-bytes BYTES] [--timeout-us US] --batch [--ndjson] {none|full|indeg|loop|adaptive} {none|neg|rle|rle-tuned|bitset} -s patterns [ inputs | - ]\n");
+	fprintf(stderr, "  -F matches the bytes of the file input in place, NULs and all; a file of INT_MAX bytes or more is streamed, as with --stream\n");
+	fprintf(stderr, "    With --stream input (- for stdin) is read a chunk at a time, keeping only the bytes a match could still use\n");
+	fprintf(stderr, "  --stats selects the statistics printed to stderr (default visits; summary and none skip the visit table)\n");
+	fprintf(stderr, "  --engine pike finds the captures with the Pike VM instead of the backtracker: no memo table, no backreferences, no statistics\n");
+	fprintf(stderr, "  --batch compiles once and matches each line of inputs (default stdin), printing one result line per input\n");
+	fprintf(stderr, "    With --ndjson each line is a JSON record whose \"input\" is matched; a record without one gets -bad record-\n");
+	fprintf(stderr, "    With -s each line of patterns is a pattern, and the set is searched at once: the indices of the matching ones are printed (not with --jobs)\n");
+	fprintf(stderr, "    With --jobs N the inputs are matched on N threads (0: one per CPU); results stay in input order\n");
+	fprintf(stderr, "    Statistics are summed over the inputs and printed once at the end (default none)\n");
 	fprintf(stderr, "  The first argument is the memoization strategy\n");
+	fprintf(stderr, "    adaptive memoizes an indeg or loop vertex only once the search keeps revisiting it\n");
+	fprintf(stderr, "    --memo-budget BYTES bounds its bit vectors per match; past it, hot vertices get RLE vectors\n");
+	fprintf(stderr, "  --memo-window frees memo entries behind the lowest offset left to backtrack to (not with adaptive or backreferences)\n");
+	fprintf(stderr, "  --max-steps N, --max-memo-bytes BYTES and --timeout-us US bound each backtracking search; past one, the result is -budget exceeded-\n");
+	fprintf(stderr, "    With --budget-retry full the search is run again memoizing every vertex, and with pike by the Pike VM (full instead for counted loops; not for -s)\n");
+	fprintf(stderr, "  --cache DIR loads the compiled regex from DIR if it was saved there, and saves it there if not (not for -s)\n");
 	fprintf(stderr, "  The second argument is the memo table encoding scheme\n");
+	fprintf(stderr, "  rle-tuned picks each vertex's run length, unless singlerlek (or rleKValue) gives one k > 0 for all\n");
 	exit(2);
 }
 
@@ -68,8 +91,9 @@ char *loadFile(char *fileName)
 	return string;
 }
 
+/* needInput: 0 for a batch pattern file, where the inputs come from elsewhere */
 Query
-loadQuery(char *inFile)
+loadQuery(char *inFile, int needInput)
 {
 	Query q;
 	char *rawJson;
@@ -88,18 +112,25 @@ loadQuery(char *inFile)
 	logMsg(LOG_INFO, "json parse");
 	parsedJson = cJSON_Parse(rawJson);
 	logMsg(LOG_INFO, "%d keys", cJSON_GetArraySize(parsedJson));
-	assert(cJSON_GetArraySize(parsedJson) >= 2);
-	
+	assert(cJSON_GetArraySize(parsedJson) >= (needInput ? 2 : 1));
+
 	key = cJSON_GetObjectItem(parsedJson, "pattern");
 	assert(key != NULL);
 	q.regex = strdup(key->valuestring);
 	logMsg(LOG_INFO, "regex: <%s>", q.regex);
 
 	key = cJSON_GetObjectItem(parsedJson, "input");
-	assert(key != NULL);
-	q.input = strdup(key->valuestring);
-	logMsg(LOG_INFO, "input: <%s>", q.input);
-	logMsg(LOG_INFO, "length: %zu", strlen(q.input));
+	if (needInput) {
+		assert(key != NULL);
+		/* Take the string from the parse tree rather than copy it */
+		q.input = key->valuestring;
+		key->valuestring = NULL;
+		q.inputLen = strlen(q.input);
+		logMsg(LOG_INFO, "input: <%s>", q.input);
+		logMsg(LOG_INFO, "length: %zu", q.inputLen);
+	} else
+		q.input = NULL;
+	q.mapped = 0;
 	// key = cJSON_GetObjectItem(parsedJson, "rleValues");
 	// int array_size = cJSON_GetArraySize(key);
 	// int *int_array = malloc(array_size * sizeof(int));
@@ -109,13 +140,121 @@ loadQuery(char *inFile)
     // }
 	// q.rleValues = int_array;
 	// q.rleValuesLength = array_size;
+	/* Absent or 0: let rle-tuned choose */
 	key = cJSON_GetObjectItem(parsedJson, "rleKValue");
-	q.singleRleK = key->valueint;
+	q.singleRleK = key != NULL ? key->valueint : 0;
 	cJSON_Delete(parsedJson);
 	free(rawJson);
 	return q;
 }
 
+/* -s: one pattern per line */
+char **
+loadPatterns(char *fileName, int *n)
+{
+	FILE *f;
+	char **patterns = NULL, *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+
+	f = fopen(fileName, "r");
+	if (f == NULL)
+		fatal("cannot open %s: %s", fileName, strerror(errno));
+	*n = 0;
+	while ((len = getline(&line, &cap, f)) >= 0) {
+		if (len > 0 && line[len-1] == '\n')
+			line[--len] = '\0';
+		patterns = realloc(patterns, (*n + 1) * sizeof(*patterns));
+		if (patterns == NULL)
+			fatal("out of memory");
+		patterns[(*n)++] = strdup(line);
+	}
+	free(line);
+	fclose(f);
+	if (*n == 0)
+		fatal("no patterns in %s", fileName);
+	return patterns;
+}
+
+/* --stream: feed the file (- for stdin) to the matcher a chunk at a time, and print the result as printMatch does */
+void
+streamFile(memore *mre, char *fileName)
+{
+	static char chunk[1 << 16];
+	memore_stream *st;
+	long long offs[MAXSUB];
+	ssize_t n;
+	int fd, matched, k, l;
+
+	fd = strcmp(fileName, "-") == 0 ? 0 : open(fileName, O_RDONLY);
+	if (fd < 0)
+		fatal("cannot open %s: %s", fileName, strerror(errno));
+	st = memore_stream_begin(mre);
+	while ((n = read(fd, chunk, sizeof chunk)) > 0)
+		if (memore_stream_feed(st, chunk, n))
+			break;
+	if (n < 0)
+		fatal("cannot read %s: %s", fileName, strerror(errno));
+	if (fd != 0)
+		close(fd);
+	matched = memore_stream_end(st, offs, nelem(offs));
+
+	if (matched == MEMORE_BUDGET_EXCEEDED) {
+		printf("-budget exceeded-\n");
+		return;
+	}
+	if (matched == MEMORE_TOO_LONG) {
+		printf("-input too long-\n");
+		return;
+	}
+	if (!matched) {
+		printf("-no match-\n");
+		return;
+	}
+	printf("match");
+	for (k = MAXSUB; k > 0; k--)
+		if (offs[k-1] >= 0)
+			break;
+	for (l = 0; l < k; l += 2) {
+		printf(" (");
+		if (offs[l] < 0)
+			printf("?");
+		else
+			printf("%lld", offs[l]);
+		printf(",");
+		if (offs[l+1] < 0)
+			printf("?");
+		else
+			printf("%lld", offs[l+1]);
+		printf(")");
+	}
+	printf("\n");
+}
+
+/* The file's bytes, read-only and not NUL-terminated */
+char *
+mapFile(char *fileName, size_t *len)
+{
+	struct stat st;
+	char *p;
+	int fd;
+
+	fd = open(fileName, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0)
+		fatal("cannot open %s: %s", fileName, strerror(errno));
+	*len = st.st_size;
+	if (*len == 0) {
+		close(fd);
+		return NULL;
+	}
+
+	p = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED)
+		fatal("cannot mmap %s: %s", fileName, strerror(errno));
+	close(fd);
+	return p;
+}
+
 int
 getMemoMode(char *arg)
 {
@@ -127,6 +266,8 @@ getMemoMode(char *arg)
 		return MEMO_IN_DEGREE_GT1;
 	else if (strcmp(arg, "loop") == 0)
 		return MEMO_LOOP_DEST;
+	else if (strcmp(arg, "adaptive") == 0)
+		return MEMO_ADAPTIVE;
     else {
 		fprintf(stderr, "Error, unknown memostrategy %s\n", arg);
 		usage();
@@ -145,6 +286,8 @@ getEncoding(char *arg)
 		return ENCODING_RLE;
 	else if (strcmp(arg, "rle-tuned") == 0)
 		return ENCODING_RLE_TUNED;
+	else if (strcmp(arg, "bitset") == 0)
+		return ENCODING_BITSET;
     else {
 		fprintf(stderr, "Error, unknown encoding %s\n", arg);
 		usage();
@@ -152,17 +295,52 @@ getEncoding(char *arg)
 	}
 }
 
-static void
-freeprog(Prog *p)
+int
+getStatsMode(char *arg)
+{
+	if (strcmp(arg, "visits") == 0)
+		return STATS_VISITS;
+	else if (strcmp(arg, "summary") == 0)
+		return STATS_SUMMARY;
+	else if (strcmp(arg, "none") == 0)
+		return STATS_NONE;
+	else {
+		fprintf(stderr, "Error, unknown stats mode %s\n", arg);
+		usage();
+		return -1; // Compiler warning
+	}
+}
+
+int
+getEngine(char *arg)
 {
-	int i;
-	for (i = 0; i < p->len; i++) {
-		Inst *inst = p->start + i;
-		if (inst->edges != NULL)
-			free(inst->edges);
+	if (strcmp(arg, "backtrack") == 0)
+		return MEMORE_ENGINE_BACKTRACK;
+	else if (strcmp(arg, "pike") == 0)
+		return MEMORE_ENGINE_PIKE;
+	else {
+		fprintf(stderr, "Error, unknown engine %s\n", arg);
+		usage();
+		return -1; // Compiler warning
 	}
-	free(p); // This also free p->start
 }
+
+int
+getBudgetRetry(char *arg)
+{
+	if (strcmp(arg, "none") == 0)
+		return MEMORE_RETRY_NONE;
+	else if (strcmp(arg, "full") == 0)
+		return MEMORE_RETRY_MEMO_FULL;
+	else if (strcmp(arg, "pike") == 0)
+		return MEMORE_RETRY_PIKE;
+	else {
+		fprintf(stderr, "Error, unknown budget retry %s\n", arg);
+		usage();
+		return -1; // Compiler warning
+	}
+}
+
 char* processStringWithEscapes(const char *str) {
 	char *parsedString = (char *)malloc(strlen(str) + 1);
     char *dst = parsedString; // Destination pointer for the parsed string
@@ -205,28 +383,167 @@ char* processStringWithEscapes(const char *str) {
 int
 main(int argc, char **argv)
 {
-	int j, k, l, memoMode, memoEncoding;
+	int memoMode, memoEncoding;
+	int statsMode = STATS_VISITS, statsGiven = 0;
+	int batch = 0, ndjson = 0, nJobs = 1;
+	int engine = MEMORE_ENGINE_BACKTRACK;
+	size_t memoBudget = 0;
+	int memoWindow = 0;
+	unsigned long long maxSteps = 0, timeoutUS = 0;
+	size_t maxMemoBytes = 0;
+	int budgetRetry = MEMORE_RETRY_NONE;
+	char *cacheDir = NULL;
+	int stream = 0;
+	char *batchInputs = NULL;
+	char *streamInput = NULL;
+	char **setPatterns = NULL;
+	int i, nSetPatterns = 0;
+	memore_set *set;
+	FILE *in;
 	Query q;
-	Regexp *re;
-	Prog *prog;
-	char *sub[MAXSUB]; /* Start and end pointers for each CG */
+	memore_options opts;
+	memore *mre;
+	const char *sub[MAXSUB]; /* Start and end pointers for each CG */
+	int matched;
+
+	/* Options precede the positional arguments */
+	while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+		if (strcmp(argv[1], "--stats") == 0 && argc > 2) {
+			statsMode = getStatsMode(argv[2]);
+			statsGiven = 1;
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--engine") == 0 && argc > 2) {
+			engine = getEngine(argv[2]);
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--memo-budget") == 0 && argc > 2) {
+			memoBudget = strtoull(argv[2], NULL, 10);
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--max-steps") == 0 && argc > 2) {
+			maxSteps = strtoull(argv[2], NULL, 10);
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--max-memo-bytes") == 0 && argc > 2) {
+			maxMemoBytes = strtoull(argv[2], NULL, 10);
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--timeout-us") == 0 && argc > 2) {
+			timeoutUS = strtoull(argv[2], NULL, 10);
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--budget-retry") == 0 && argc > 2) {
+			budgetRetry = getBudgetRetry(argv[2]);
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--cache") == 0 && argc > 2) {
+			cacheDir = argv[2];
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--memo-window") == 0) {
+			memoWindow = 1;
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "--stream") == 0) {
+			stream = 1;
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "--batch") == 0) {
+			batch = 1;
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "--jobs") == 0 && argc > 2) {
+			nJobs = strtol(argv[2], NULL, 10);
+			if (nJobs == 0)
+				nJobs = sysconf(_SC_NPROCESSORS_ONLN);
+			if (nJobs < 1)
+				usage();
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--ndjson") == 0) {
+			ndjson = 1;
+			argc--;
+			argv++;
+		} else
+			usage();
+	}
 
 	if (argc < 4)
 		usage();
 	
 	memoMode = getMemoMode(argv[1]);
 	memoEncoding = getEncoding(argv[2]);
-	if (memoMode == MEMO_NONE)
-		memoEncoding = ENCODING_NONE;
 
-	if (strcmp(argv[3], "-f") == 0) {
-		q = loadQuery(argv[4]);
+	if ((ndjson || nJobs > 1) && !batch)
+		usage();
+	if (stream && (batch || strcmp(argv[3], "-F") != 0))
+		usage();
+	/* The Pike VM has no statistics to print */
+	if (engine == MEMORE_ENGINE_PIKE && !statsGiven)
+		statsMode = STATS_NONE;
+
+	if (batch) {
+		if (!statsGiven)
+			statsMode = STATS_NONE;
+		if (strcmp(argv[3], "-f") == 0) {
+			if (argc < 5)
+				usage();
+			q = loadQuery(argv[4], 0);
+			batchInputs = argc > 5 ? argv[5] : NULL;
+		} else if (strcmp(argv[3], "-s") == 0) {
+			if (argc < 5)
+				usage();
+			/* A set has one match scratch, and no memore_ctx to give each worker */
+			if (nJobs > 1)
+				fatal("batch: --jobs does not apply to -s; match the set on one thread");
+			setPatterns = loadPatterns(argv[4], &nSetPatterns);
+			q.regex = NULL;
+			q.input = NULL;
+			q.singleRleK = 0;
+			batchInputs = argc > 5 ? argv[5] : NULL;
+		} else {
+			q.regex = argv[3];
+			q.input = NULL;
+			q.singleRleK = 0;
+			batchInputs = argc > 4 ? argv[4] : NULL;
+		}
+	} else if (strcmp(argv[3], "-f") == 0) {
+		q = loadQuery(argv[4], 1);
+	} else if (strcmp(argv[3], "-F") == 0) {
+		if (argc < 6)
+			usage();
+		if (stream) {
+			streamInput = argv[4];
+			q.input = NULL;
+			q.mapped = 0;
+		} else {
+			q.input = mapFile(argv[4], &q.inputLen);
+			q.mapped = q.input != NULL;
+			if (q.input == NULL)
+				q.input = "";
+			/* Too long to match in place: stream it, keeping only the window a match needs */
+			if (q.inputLen >= INT_MAX) {
+				logMsg(LOG_INFO, "%s: %zu bytes; streaming it", argv[4], q.inputLen);
+				munmap(q.input, q.inputLen);
+				streamInput = argv[4];
+				q.input = NULL;
+				q.mapped = 0;
+			}
+		}
+		q.regex = argv[5];
+		q.singleRleK = 0;
+		if (argc > 7 && strcmp(argv[6], "singlerlek") == 0)
+			q.singleRleK = strtol(argv[7], NULL, 10);
 	} else {
 		if (argc < 7)
   			usage();
 		q.regex = argv[3];
 		// q.input = argv[4];
 		q.input = processStringWithEscapes(argv[4]);
+		q.inputLen = strlen(q.input);
+		q.mapped = 0;
+		q.singleRleK = 0;
 		if (strcmp(argv[5], "singlerlek") == 0){
 			q.singleRleK = strtol(argv[6], NULL, 10);
 		} else {
@@ -277,77 +594,67 @@ main(int argc, char **argv)
 		
 	}
 
-	// Parse
-	re = parse(q.regex);
-
-	// Optimize
-	if (shouldLog(LOG_DEBUG)) {
-		logMsg(LOG_INFO, "Initial re:");
-		printre(re);
-		printf("\n");
+	// Parse, optimize, compile
+	memore_options_init(&opts);
+	opts.memoMode = memoMode;
+	opts.encoding = memoEncoding;
+	opts.rleK = q.singleRleK;
+	opts.stats = statsMode;
+	opts.aggregateStats = batch;
+	opts.engine = engine;
+	opts.memoBudget = memoBudget;
+	opts.memoWindow = memoWindow;
+	opts.maxSteps = maxSteps;
+	opts.maxMemoBytes = maxMemoBytes;
+	opts.timeoutUS = timeoutUS;
+	opts.budgetRetry = budgetRetry;
+
+	if (batch) {
+		in = stdin;
+		if (batchInputs != NULL && strcmp(batchInputs, "-") != 0) {
+			in = fopen(batchInputs, "r");
+			if (in == NULL)
+				fatal("batch: cannot open %s: %s", batchInputs, strerror(errno));
+		}
+		if (setPatterns != NULL) {
+			set = memore_set_compile((const char *const *) setPatterns, nSetPatterns, &opts);
+			for (i = 0; i < nSetPatterns; i++)
+				free(setPatterns[i]);
+			free(setPatterns);
+			runBatchSet(set, nSetPatterns, in, ndjson);
+			memore_set_print_stats(set);
+			memore_set_free(set);
+		} else {
+			mre = compileRegex(q.regex, &opts, cacheDir);
+			if (nJobs > 1)
+				runBatchParallel(mre, in, ndjson, nJobs);
+			else
+				runBatch(mre, in, ndjson);
+			memore_print_stats(mre);
+			memore_free(mre);
+		}
+		if (in != stdin)
+			fclose(in);
+		return 0;
 	}
-	re = transform(re);
 
-	if (shouldLog(LOG_DEBUG)) {
-		logMsg(LOG_INFO, "Transformed re:");
-		printre(re);
-		printf("\n");
-	}
+	mre = compileRegex(q.regex, &opts, cacheDir);
 
-	// Compile
-	prog = compile(re, memoMode, memoEncoding, q.rleValues, q.rleValuesLength, q.singleRleK);
-	// if (shouldLog(LOG_DEBUG)) {
-		logMsg(LOG_INFO, "Compiled :");
-		printprog(prog);
-		printf("\n");
-	// }
-	Prog_assertNoInfiniteLoops(prog);
-
-	// Memoization settings
-	prog->memoMode = memoMode;
-	prog->memoEncoding = memoEncoding;
-	Prog_determineMemoNodes(prog, memoMode);
-	logMsg(LOG_INFO, "Will memoize %d states", prog->nMemoizedStates);
-
-	if (shouldLog(LOG_DEBUG)) {
-		logMsg(LOG_INFO, "Compiled and memo-marked:");
-		printprog(prog);
-		printf("\n");
+	if (streamInput != NULL) {
+		streamFile(mre, streamInput);
+		memore_free(mre);
+		return 0;
 	}
 
 	// Simulate
-	logMsg(LOG_INFO, "Candidate string: %s", q.input);
-	for(j=0; j<nelem(tab); j++) { /* Go through all matchers */
-		if (strcmp(tab[j].name, "backtrack") != 0) { /* We just care about backtrack */
-			continue;
-		}
-		memset(sub, 0, sizeof sub);
-		if(!tab[j].fn(prog, q.input, sub, nelem(sub))) {
-			printf("-no match-\n");
-			continue;
-		}
-		printf("match");
-		for(k=MAXSUB; k>0; k--)
-			if(sub[k-1])
-				break;
-		for(l=0; l<k; l+=2) {
-			printf(" (");
-			if(sub[l] == nil)
-				printf("?");
-			else
-				printf("%d", (int)(sub[l] - q.input));
-			printf(",");
-			if(sub[l+1] == nil)
-				printf("?");
-			else
-				printf("%d", (int)(sub[l+1] - q.input));
-			printf(")");
-		}
-		printf("\n");
-	}
+	logMsg(LOG_INFO, "Candidate string: %.*s", (int) q.inputLen, q.input);
+	matched = memore_match(mre, q.input, q.inputLen, sub, nelem(sub));
+	printMatch(stdout, q.input, matched, sub);
+
+	if (q.mapped)
+		munmap(q.input, q.inputLen);
 
-	freeprog(prog);
-	freereg(re);
+	memore_free(mre);
 
 	return 0;
 }
@@ -4,6 +4,17 @@
 
 /******* Compiler phase ********/
 
+/* Backreferences complicate memoization.
+ * Whenever we check if we can abort, we must now test both <q, i> and current contents of the backreferenced CGs.
+ *  (Really we only need to check the backreferenced CGs *that are still reachable* from the current q,
+ *   which Prog_determineLiveBackrefs works out)
+ *
+ * Record the cgNum for the groups referenced in a StringCompare (backreference Inst).
+ *   (aka CG_BR or CGBR)
+ * Updates list, returns the number of distinct referenced groups (|CG_{BR}|). */
+static int backrefdCGs(Prog *prog, int *list);
+static void Prog_determineLiveBackrefs(Prog *p);
+
 static void
 Prog_compute_in_degrees(Prog *p)
 {
@@ -11,11 +22,11 @@ Prog_compute_in_degrees(Prog *p)
 
 	/* Initialize */
 	for (i = 0; i < p->len; i++) {
-		p->start[i].memoInfo.inDegree = 0;
+		p->aux[i].memoInfo.inDegree = 0;
 	}
 
 	/* q0 has an in-edge */
-	p->start[0].memoInfo.inDegree = 1;
+	p->aux[0].memoInfo.inDegree = 1;
 
 	/* Increment */
 	for (i = 0; i < p->len; i++) {
@@ -27,29 +38,32 @@ Prog_compute_in_degrees(Prog *p)
 			break;
 		case Jmp:
 			/* Goes to X */
-			p->start[i].x->memoInfo.inDegree++;
+			INST_AUX(p, p->start[i].x)->memoInfo.inDegree++;
 			break;
 		case Split:
+		case CountLoop:
 			/* Goes to X or Y */
-			p->start[i].x->memoInfo.inDegree++;
-			p->start[i].y->memoInfo.inDegree++;
+			INST_AUX(p, p->start[i].x)->memoInfo.inDegree++;
+			INST_AUX(p, p->start[i].y)->memoInfo.inDegree++;
 			break;
 		case SplitMany:
 			/* Goes to each child */
-			for (j = 0; j < p->start[i].arity; j++) {
-				p->start[i].edges[j]->memoInfo.inDegree++;
+			for (j = 0; j < p->start[i].n; j++) {
+				INST_AUX(p, p->start[i].edges[j])->memoInfo.inDegree++;
 			}
 			break;
 		case Any:
 		case CharClass:
 		case Char:
+		case String:
 		case Save:
 		case StringCompare:
 		case InlineZeroWidthAssertion:
 		case RecursiveZeroWidthAssertion:
 		case RecursiveMatch:
+		case CountInit:
 			/* Always goes to next instr */
-			p->start[i+1].memoInfo.inDegree++;
+			p->aux[i+1].memoInfo.inDegree++;
 			break;
 		}
 	}
@@ -62,36 +76,37 @@ Prog_find_ancestor_nodes(Prog *p)
 
 	/* Initialize */
 	for (i = 0; i < p->len; i++) {
-		p->start[i].memoInfo.isAncestorLoopDestination = 0;
+		p->aux[i].memoInfo.isAncestorLoopDestination = 0;
 	}
 
 	/* Observe back-edges */
 	for (i = 0; i < p->len; i++) {
-    int stateNum = p->start[i].stateNum;
+    int stateNum = i;
     switch (p->start[i].opcode) {
     default: break; // Not a branch type, cannot create a back-edge
 		case Jmp:
-      logMsg(LOG_DEBUG, "  Jmp: from %d to %d", stateNum, p->start[i].x->stateNum);
-      if (stateNum > p->start[i].x->stateNum) {
-          p->start[i].x->memoInfo.isAncestorLoopDestination = 1;
+      logMsg(LOG_DEBUG, "  Jmp: from %d to %d", stateNum, INST_NUM(p, p->start[i].x));
+      if (stateNum > INST_NUM(p, p->start[i].x)) {
+          INST_AUX(p, p->start[i].x)->memoInfo.isAncestorLoopDestination = 1;
       }
       break;
     case Split:
-      logMsg(LOG_DEBUG, "  Split option: from %d to %d or %d", stateNum, p->start[i].x->stateNum, p->start[i].y->stateNum);
-      if (stateNum > p->start[i].x->stateNum) {
-          p->start[i].x->memoInfo.isAncestorLoopDestination = 1;
+    case CountLoop:
+      logMsg(LOG_DEBUG, "  Split option: from %d to %d or %d", stateNum, INST_NUM(p, p->start[i].x), INST_NUM(p, p->start[i].y));
+      if (stateNum > INST_NUM(p, p->start[i].x)) {
+          INST_AUX(p, p->start[i].x)->memoInfo.isAncestorLoopDestination = 1;
       } 
-      if (stateNum > p->start[i].y->stateNum) {
-          p->start[i].y->memoInfo.isAncestorLoopDestination = 1;
+      if (stateNum > INST_NUM(p, p->start[i].y)) {
+          INST_AUX(p, p->start[i].y)->memoInfo.isAncestorLoopDestination = 1;
       } 
       break;
     case SplitMany:
       {
         int j;
-        for (j = 0; j < p->start[i].arity; j++) {
-          logMsg(LOG_DEBUG, "  SplitMany: from %d to %d", stateNum, p->start[i].edges[j]->stateNum);
-          if (stateNum > p->start[i].edges[j]->stateNum) {
-            p->start[i].edges[j]->memoInfo.isAncestorLoopDestination = 1;
+        for (j = 0; j < p->start[i].n; j++) {
+          logMsg(LOG_DEBUG, "  SplitMany: from %d to %d", stateNum, INST_NUM(p, p->start[i].edges[j]));
+          if (stateNum > INST_NUM(p, p->start[i].edges[j])) {
+            INST_AUX(p, p->start[i].edges[j])->memoInfo.isAncestorLoopDestination = 1;
           }
         }
       }
@@ -111,7 +126,7 @@ Prog_determineMemoNodes(Prog *p, int memoMode)
         /* Memoize all nodes. */
         logMsg(LOG_DEBUG, "Prog_determineMemoNodes: FULL");
 		for (i = 0; i < p->len; i++){
-			p->start[i].memoInfo.shouldMemo = 1;
+			p->aux[i].memoInfo.shouldMemo = 1;
 		}
 		break;
 	case MEMO_IN_DEGREE_GT1:
@@ -119,8 +134,8 @@ Prog_determineMemoNodes(Prog *p, int memoMode)
         logMsg(LOG_DEBUG, "Prog_determineMemoNodes: IN_DEGREE");
 		Prog_compute_in_degrees(p);
 		for (i = 0; i < p->len; i++) {
-			if (p->start[i].memoInfo.inDegree > 1) {
-				p->start[i].memoInfo.shouldMemo = 1;
+			if (p->aux[i].memoInfo.inDegree > 1) {
+				p->aux[i].memoInfo.shouldMemo = 1;
 			}
 		}
 		break;
@@ -129,17 +144,27 @@ Prog_determineMemoNodes(Prog *p, int memoMode)
         logMsg(LOG_DEBUG, "Prog_determineMemoNodes: LOOP");
         Prog_find_ancestor_nodes(p);
         for (i = 0; i < p->len; i++) {
-            if (p->start[i].memoInfo.isAncestorLoopDestination) {
-            	logMsg(LOG_DEBUG, "  ancestor node %d", p->start[i].stateNum);
-                p->start[i].memoInfo.shouldMemo = 1;
+            if (p->aux[i].memoInfo.isAncestorLoopDestination) {
+            	logMsg(LOG_DEBUG, "  ancestor node %d", i);
+                p->aux[i].memoInfo.shouldMemo = 1;
             }
         }
 		break;
+	case MEMO_ADAPTIVE:
+		/* Candidates: the vertices either of those would memoize. The simulation decides which of them get vectors. */
+		logMsg(LOG_DEBUG, "Prog_determineMemoNodes: ADAPTIVE");
+		Prog_compute_in_degrees(p);
+		Prog_find_ancestor_nodes(p);
+		for (i = 0; i < p->len; i++) {
+			if (p->aux[i].memoInfo.inDegree > 1 || p->aux[i].memoInfo.isAncestorLoopDestination)
+				p->aux[i].memoInfo.shouldMemo = 1;
+		}
+		break;
 	case MEMO_NONE:
         /* Memoize no nodes. */
         logMsg(LOG_DEBUG, "Prog_determineMemoNodes: NONE");
 		for (i = 0; i < p->len; i++) {
-			p->start[i].memoInfo.shouldMemo = 0;
+			p->aux[i].memoInfo.shouldMemo = 0;
 		}
 		break;
 	default:
@@ -149,38 +174,266 @@ Prog_determineMemoNodes(Prog *p, int memoMode)
 	/* Assign memoStateNum to the shouldMemo nodes */
 	nextStateNum = 0;
 	for (i = 0; i < p->len; i++) {
-		if (p->start[i].memoInfo.shouldMemo) {
-			p->start[i].memoInfo.memoStateNum = nextStateNum;
+		if (p->aux[i].memoInfo.shouldMemo) {
+			p->start[i].memoStateNum = nextStateNum;
 			nextStateNum++;
 		} else {
-			p->start[i].memoInfo.memoStateNum = -1;
+			p->start[i].memoStateNum = -1;
 		}
 	}
 	p->nMemoizedStates = nextStateNum;
+
+	/* Create the CG -> memo ix mapping for the memo table keys */
+	p->nBackrefCGs = backrefdCGs(p, p->backrefCGs);
+	Prog_determineLiveBackrefs(p);
+	if (p->nBackrefCGs > 0 && memoMode != MEMO_NONE) {
+		logMsg(LOG_INFO, "Backreferences present and memo enabled -- coercing to ENCODING_NEGATIVE");
+		p->memoEncoding = ENCODING_NEGATIVE;
+	}
+	/* Likewise the CountLoop counters: a key per <q, i, counters> only fits in the hash table */
+	if (p->nCounters > 0 && memoMode != MEMO_NONE) {
+		logMsg(LOG_INFO, "Counted loops present and memo enabled -- coercing to ENCODING_NEGATIVE");
+		p->memoEncoding = ENCODING_NEGATIVE;
+	}
 }
 
-/******* Simulation ********/
+/* Visit intervals.
+ * Give each edge the number of chars it consumes, and let phi(q) be the length of some path from q0 to q.
+ * Then every path to q has length phi(q) + (a sum of the edges' discrepancies phi(u) + w - phi(v)),
+ * so the offsets at which q is visited are all congruent mod the gcd of the discrepancies of the edges that can lead to q.
+ * A run of that length (or a divisor of it) always holds the same bit pattern, so the RLE vector for q is one run per stretch. */
 
-/* Backreferences complicate memoization.
- * Whenever we check if we can abort, we must now test both <q, i> and current contents of the backreferenced CGs.
- *  (Really we only need to check the backreferenced CGs *that are still reachable* from the current q)
- *
- * Record the cgNum for the groups referenced in a StringCompare (backreference Inst).
- *   (aka CG_BR or CGBR)
- * Updates list, returns the number of distinct referenced groups (|CG_{BR}|). */
-static int backrefdCGs(Prog *prog, int *list);
+typedef struct ProgEdge ProgEdge;
+struct ProgEdge
+{
+	int to;
+	int width; /* Chars consumed; -1 if it varies (backreference) */
+};
 
-/* Turn back to a CGID, then call into that family */
-#define MEMOCGID_TO_SUB_STARTP_IX(memocgbr_num) (CGID_TO_SUB_STARTP_IX( CG_BR_memo2num[memocgbr_num] ))
-#define MEMOCGID_TO_SUB_ENDP_IX(memocgbr_num)   (CGID_TO_SUB_ENDP_IX(   CG_BR_memo2num[memocgbr_num] ))
-#define MEMOCGID_TO_STARTP(s, memocgbr_num)     (CGID_TO_STARTP((s),    CG_BR_memo2num[(memocgbr_num)]))
-#define MEMOCGID_TO_ENDP(s, memocgbr_num)       (CGID_TO_ENDP((s),      CG_BR_memo2num[(memocgbr_num)]))
+static int
+_gcd(int a, int b)
+{
+	while (b != 0) {
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+	return a < 0 ? -a : a;
+}
+
+/* Fills edges (at least 2 + max arity long) with the successors of Inst i. Returns the number of edges. */
+static int
+_progEdges(Prog *p, int i, ProgEdge *edges)
+{
+	Inst *pc = &p->start[i], *end;
+	int j, n = 0;
 
-static int CG_BR[MAXSUB]; /* CGs that are backreferenced */
-int nCG_BR = 0;
+	switch (pc->opcode) {
+	default:
+		fatal("visit interval: unknown type");
+	case Match:
+	case RecursiveMatch: /* Resumes after the lookahead: see RecursiveZeroWidthAssertion */
+		break;
+	case Jmp:
+		edges[n].to = pc->x - p->start;
+		edges[n++].width = 0;
+		break;
+	case Split:
+	case CountLoop:
+		edges[n].to = pc->x - p->start;
+		edges[n++].width = 0;
+		edges[n].to = pc->y - p->start;
+		edges[n++].width = 0;
+		break;
+	case SplitMany:
+		for (j = 0; j < pc->n; j++) {
+			edges[n].to = pc->edges[j] - p->start;
+			edges[n++].width = 0;
+		}
+		break;
+	case Char:
+	case Any:
+	case CharClass:
+		edges[n].to = i + 1;
+		edges[n++].width = 1;
+		break;
+	case String:
+		edges[n].to = i + 1;
+		edges[n++].width = pc->n;
+		break;
+	case StringCompare:
+		edges[n].to = i + 1;
+		edges[n++].width = -1;
+		break;
+	case Save:
+	case InlineZeroWidthAssertion:
+	case CountInit:
+		edges[n].to = i + 1;
+		edges[n++].width = 0;
+		break;
+	case RecursiveZeroWidthAssertion:
+		/* Into the lookahead, and (at the same offset) past it */
+		edges[n].to = i + 1;
+		edges[n++].width = 0;
+		for (end = pc; end->opcode != RecursiveMatch; end++)
+			;
+		edges[n].to = (end - p->start) + 1;
+		edges[n++].width = 0;
+		break;
+	}
+	return n;
+}
 
-static int CG_BR_num2memo[MAXSUB]; /* CG number to memo vertex ix -- only populated for the CGBR's */
-static int CG_BR_memo2num[MAXSUB]; /* Memo vertex ix to CG number */
+/* Live backrefs: a StringCompare sets its CG's bit, and each Inst takes the union over its successors.
+ * Iterate to a fixed point -- a pass per loop nesting, near enough. */
+static void
+Prog_determineLiveBackrefs(Prog *p)
+{
+	int i, j, n, live, changed, maxEdges;
+	ProgEdge *edges;
+
+	for (i = 0; i < p->len; i++)
+		p->aux[i].memoInfo.liveBackrefs = 0;
+	if (p->nBackrefCGs == 0)
+		return;
+
+	maxEdges = 2;
+	for (i = 0; i < p->len; i++) {
+		if (p->start[i].opcode == SplitMany && p->start[i].n > maxEdges)
+			maxEdges = p->start[i].n;
+	}
+	edges = mal(maxEdges * sizeof(*edges));
+
+	do {
+		changed = 0;
+		for (i = p->len - 1; i >= 0; i--) {
+			live = p->aux[i].memoInfo.liveBackrefs;
+			if (p->start[i].opcode == StringCompare) {
+				for (j = 0; j < p->nBackrefCGs; j++) {
+					if (p->backrefCGs[j] == p->start[i].c)
+						live |= 1 << j;
+				}
+			}
+			n = _progEdges(p, i, edges);
+			for (j = 0; j < n; j++)
+				live |= p->aux[edges[j].to].memoInfo.liveBackrefs;
+			if (live != p->aux[i].memoInfo.liveBackrefs) {
+				p->aux[i].memoInfo.liveBackrefs = live;
+				changed = 1;
+			}
+		}
+	} while (changed);
+
+	/* A lookahead's Insts are marked even when its sub-simulation succeeds, so a hit there is no proof of failure.
+	 * Keep all the CGs in their keys, rather than let dead ones make more of those hits. */
+	for (i = 0; i < p->len; i++) {
+		if (p->start[i].opcode != RecursiveZeroWidthAssertion)
+			continue;
+		for (i++; p->start[i].opcode != RecursiveMatch; i++)
+			p->aux[i].memoInfo.liveBackrefs = (1 << p->nBackrefCGs) - 1;
+		p->aux[i].memoInfo.liveBackrefs = (1 << p->nBackrefCGs) - 1;
+	}
+
+	for (i = 0; i < p->len; i++)
+		logMsg(LOG_DEBUG, "Prog_determineLiveBackrefs: %d: 0x%x", i, p->aux[i].memoInfo.liveBackrefs);
+	free(edges);
+}
+
+void
+Prog_determineVisitIntervals(Prog *p)
+{
+	int i, j, n, q, maxEdges, nStack, d, g;
+	int *phi, *period, *stack, *onStack;
+	ProgEdge *edges;
+
+	maxEdges = 2;
+	for (i = 0; i < p->len; i++) {
+		if (p->start[i].opcode == SplitMany && p->start[i].n > maxEdges)
+			maxEdges = p->start[i].n;
+	}
+	edges = mal(maxEdges * sizeof(*edges));
+	phi = mal(p->len * sizeof(*phi));
+	period = mal(p->len * sizeof(*period));
+	stack = mal(p->len * sizeof(*stack));
+	onStack = mal(p->len * sizeof(*onStack));
+
+	/* phi: the length of the first path found to each reachable Inst. -1 if unreachable. */
+	for (i = 0; i < p->len; i++)
+		phi[i] = -1;
+	phi[0] = 0;
+	stack[0] = 0;
+	nStack = 1;
+	while (nStack > 0) {
+		i = stack[--nStack];
+		n = _progEdges(p, i, edges);
+		for (j = 0; j < n; j++) {
+			if (phi[edges[j].to] < 0) {
+				phi[edges[j].to] = phi[i] + (edges[j].width < 0 ? 0 : edges[j].width);
+				stack[nStack++] = edges[j].to;
+			}
+		}
+	}
+
+	/* period: the gcd of the discrepancies on the way to each Inst, to a fixed point.
+	 * 0 means visited at a single offset. The gcds only shrink, so this terminates quickly. */
+	nStack = 0;
+	for (i = 0; i < p->len; i++) {
+		period[i] = 0;
+		onStack[i] = phi[i] >= 0;
+		if (onStack[i])
+			stack[nStack++] = i;
+	}
+	while (nStack > 0) {
+		i = stack[--nStack];
+		onStack[i] = 0;
+		n = _progEdges(p, i, edges);
+		for (j = 0; j < n; j++) {
+			q = edges[j].to;
+			/* A backreference consumes a varying number of chars: assume nothing after it */
+			d = edges[j].width < 0 ? 1 : phi[i] + edges[j].width - phi[q];
+			g = _gcd(period[q], _gcd(period[i], d));
+			if (g != period[q]) {
+				period[q] = g;
+				if (!onStack[q]) {
+					onStack[q] = 1;
+					stack[nStack++] = q;
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < p->len; i++) {
+		/* Runs hold up to RLE_MAX_RUN_LENGTH bits; a divisor of the period is also a period */
+		g = period[i];
+		if (g == 0 || phi[i] < 0)
+			g = 1;
+		for (d = RLE_MAX_RUN_LENGTH; g % d != 0; d--)
+			;
+		g = d;
+		p->aux[i].memoInfo.visitInterval = g;
+		logMsg(LOG_DEBUG, "Prog_determineVisitIntervals: %d: phi %d period %d -> visitInterval %d", i, phi[i], period[i], g);
+	}
+
+	free(edges);
+	free(phi);
+	free(period);
+	free(stack);
+	free(onStack);
+}
+
+/******* Simulation ********/
+
+/* Turn back to a CGID, then call into that family */
+#define MEMOCGID_TO_STARTP(memo, s, memocgbr_num)     (CGID_TO_STARTP((s),    (memo)->backrefCGs[(memocgbr_num)]))
+#define MEMOCGID_TO_ENDP(memo, s, memocgbr_num)       (CGID_TO_ENDP((s),      (memo)->backrefCGs[(memocgbr_num)]))
+
+/* Round each row up to a whole number of cache lines so rows never share one. */
+static int
+_bitRowWords(int nChars)
+{
+  int words = (nChars + 63) / 64;
+  return (words + MEMO_WORDS_PER_CACHE_LINE - 1) / MEMO_WORDS_PER_CACHE_LINE * MEMO_WORDS_PER_CACHE_LINE;
+}
 
 /* Visit table.  */
 
@@ -193,6 +446,12 @@ initVisitTable(Prog *prog, int nChars)
 
   visitTable.nStates = nStates;
   visitTable.nChars = nChars;
+  visitTable.visitVectors = NULL;
+
+  /* The counters cost |Q| x |w| ints, so only pay for them if someone will read them */
+  if (prog->statsMode != STATS_VISITS)
+    return visitTable;
+
   visitTable.visitVectors = mal(sizeof(int*) * nStates);
   for (i = 0; i < nStates; i++) {
     visitTable.visitVectors[i] = mal(sizeof(int) * nChars);
@@ -222,6 +481,8 @@ void
 freeVisitTable(VisitTable vt)
 {
   int i;
+  if (vt.visitVectors == NULL)
+    return;
   for (i = 0; i < vt.nStates; i++) {
     free(vt.visitVectors[i]);
   }
@@ -230,6 +491,113 @@ freeVisitTable(VisitTable vt)
 
 /* Memo table */
 
+/* Memo.windowed, ENCODING_NONE and ENCODING_BITSET: an empty window of pages */
+static void
+_initWindowPages(Memo *memo)
+{
+  MemoWindow *w = &memo->window;
+
+  w->capPages = 4;
+  w->pages = mal(sizeof(*w->pages) * w->capPages);
+  w->freePages = mal(sizeof(*w->freePages) * w->capPages);
+  w->pageBytes = sizeof(uint64_t) * MEMO_WINDOW_PAGE_WORDS * memo->nStates;
+}
+
+/* Room for one more live page. A released page is reused, or else one is allocated. */
+static void
+_appendWindowPage(MemoWindow *w)
+{
+  uint64_t **pages, *page = NULL;
+  int i, capPages;
+
+  if (w->nPages == w->capPages) {
+    capPages = 2 * w->capPages;
+    pages = mal(sizeof(*pages) * capPages);
+    for (i = w->firstPage; i < w->firstPage + w->nPages; i++)
+      pages[i & (capPages - 1)] = w->pages[i & (w->capPages - 1)];
+    free(w->pages);
+    w->pages = pages;
+    w->freePages = realloc(w->freePages, sizeof(*w->freePages) * capPages);
+    assert(w->freePages != NULL);
+    w->capPages = capPages;
+  }
+
+  if (w->nFreePages > 0) {
+    page = w->freePages[--w->nFreePages];
+  } else if (posix_memalign((void **) &page, MEMO_CACHE_LINE_BYTES, w->pageBytes > 0 ? w->pageBytes : 1) != 0) {
+    fatal("out of memory");
+  }
+  memset(page, 0, w->pageBytes);
+  w->pages[(w->firstPage + w->nPages) & (w->capPages - 1)] = page;
+  w->nPages++;
+  if (w->nPages * w->pageBytes > w->peakBytes)
+    w->peakBytes = w->nPages * w->pageBytes;
+}
+
+void
+extendMemoWindow(Memo *memo, int p)
+{
+  while (p >= memo->window.firstPage + memo->window.nPages)
+    _appendWindowPage(&memo->window);
+}
+
+/* Bytes held by a SimPosSet */
+static size_t
+_simPosBytes(SimPosSet *set)
+{
+  return SimPosSet_overheadBytes(set) + SimPosSet_count(set) * SimPosSet_bytesPerEntry(set);
+}
+
+void
+releaseMemoWindow(Memo *memo, int low)
+{
+  MemoWindow *w = &memo->window;
+  SimPosSet *tmp;
+  size_t bytes;
+  int i;
+
+  assert(memo->windowed);
+  if (low < w->low)
+    return;
+  w->low = low;
+
+  switch (memo->encoding) {
+  case ENCODING_NONE:
+  case ENCODING_BITSET:
+    while (w->nPages > 0 && (w->firstPage + 1) * MEMO_WINDOW_PAGE_CHARS <= low) {
+      w->freePages[w->nFreePages++] = w->pages[w->firstPage & (w->capPages - 1)];
+      w->firstPage++;
+      w->nPages--;
+    }
+    if (w->nPages == 0)
+      w->firstPage = low / MEMO_WINDOW_PAGE_CHARS;
+    w->nextRelease = (w->firstPage + 1) * MEMO_WINDOW_PAGE_CHARS;
+    logMsg(LOG_DEBUG, "Memo window: watermark %d, pages [%d, %d)", low, w->firstPage, w->firstPage + w->nPages);
+    return;
+  case ENCODING_NEGATIVE:
+    /* Wait for a generation's worth of entries, so that clearing costs O(1) per entry */
+    if (w->oldMaxOffset < low && SimPosSet_count(memo->simPosSet) >= MEMO_WINDOW_PAGE_CHARS) {
+      bytes = _simPosBytes(memo->simPosSet) + _simPosBytes(w->oldSimPosSet);
+      if (bytes > w->peakBytes)
+        w->peakBytes = bytes;
+      logMsg(LOG_DEBUG, "Memo window: watermark %d, clearing a generation of %d entries", low, SimPosSet_count(w->oldSimPosSet));
+      SimPosSet_clear(w->oldSimPosSet);
+      tmp = w->oldSimPosSet;
+      w->oldSimPosSet = memo->simPosSet;
+      memo->simPosSet = tmp;
+      w->oldMaxOffset = w->maxOffset;
+      w->maxOffset = -1;
+    }
+    break;
+  case ENCODING_RLE:
+  case ENCODING_RLE_TUNED:
+    for (i = 0; i < memo->nStates; i++)
+      RLEVector_releaseBelow(memo->rleVectors[i], low);
+    break;
+  }
+  w->nextRelease = low + MEMO_WINDOW_PAGE_CHARS;
+}
+
 Memo
 initMemoTable(Prog *prog, int nChars)
 {
@@ -239,33 +607,68 @@ initMemoTable(Prog *prog, int nChars)
   int i, j;
   char *prefix = "MEMO_TABLE";
 
-  if (usesBackreferences(prog) && prog->memoMode != MEMO_NONE) {
-    logMsg(LOG_INFO, "Backreferences present and memo enabled -- coercing to ENCODING_NEGATIVE");
-    prog->memoEncoding = ENCODING_NEGATIVE;
-    //assert(prog->memoEncoding == ENCODING_NEGATIVE);
-  }
-
+  /* Prog_determineMemoNodes coerced backreferences to NEGATIVE */
   memo.mode = prog->memoMode;
   memo.encoding = prog->memoEncoding;
   memo.nStates = nStatesToTrack;
   memo.nChars = nChars;
-  memo.backrefs = usesBackreferences(prog);
-
-  if (memo.backrefs) {
-    /* Create CG <-> Memo Ix mappings for accessing the table later */
-    nCG_BR = backrefdCGs(prog, CG_BR);
-    for (i = 0; i < nCG_BR; i++) {
-      logMsg(LOG_DEBUG, "i %d CG_BR[i] %d", i, CG_BR[i]);
-      CG_BR_num2memo[ CG_BR[i] ] = i;
-      CG_BR_memo2num[ i ] = CG_BR[i];
-      logMsg(LOG_DEBUG, "CG num %d memo %d", CG_BR[i], i);
+  memo.backrefs = prog->nBackrefCGs > 0;
+  memo.backrefCGs = prog->backrefCGs;
+  memo.nBackrefCGs = prog->nBackrefCGs;
+  memo.nCounters = prog->nCounters;
+  memo.liveBackrefs = NULL;
+  memo.backrefSubs = 0;
+  memo.cgVectors = NULL;
+  for (i = 0; i < memo.nBackrefCGs; i++)
+    memo.backrefSubs |= (1 << CGID_TO_SUB_STARTP_IX(memo.backrefCGs[i])) | (1 << CGID_TO_SUB_ENDP_IX(memo.backrefCGs[i]));
+  if (memo.backrefs && memo.mode != MEMO_NONE) {
+    memo.liveBackrefs = mal(sizeof(*memo.liveBackrefs) * (nStatesToTrack + 1));
+    for (j = 0; j < prog->len; j++) {
+      if (prog->start[j].memoStateNum >= 0)
+        memo.liveBackrefs[prog->start[j].memoStateNum] = prog->aux[j].memoInfo.liveBackrefs;
     }
+    if (memo.nBackrefCGs >= MEMO_INTERN_MIN_CGS)
+      memo.cgVectors = SimPosSet_createInterning(2 * memo.nBackrefCGs);
   }
-  
-  if (memo.mode != MEMO_NONE) {
+  assert(!memo.backrefs || memo.mode == MEMO_NONE || memo.encoding == ENCODING_NEGATIVE);
+  assert(memo.nCounters == 0 || memo.mode == MEMO_NONE || memo.encoding == ENCODING_NEGATIVE);
+  memo.windowed = prog->memoWindow && memo.mode != MEMO_NONE;
+  memset(&memo.window, 0, sizeof(memo.window));
+  memo.window.nextRelease = MEMO_WINDOW_PAGE_CHARS;
+  memo.window.maxOffset = -1;
+  memo.window.oldMaxOffset = -1;
+  assert(!memo.windowed || (memo.mode != MEMO_ADAPTIVE && !memo.backrefs));
+
+  if (memo.mode == MEMO_ADAPTIVE) {
+    /* Nothing but the counters until a vertex is hot */
+    logMsg(LOG_INFO, "%s: Initializing adaptive, %d candidate vertices, budget %zu bytes", prefix, nStatesToTrack, prog->memoBudgetBytes);
+    memo.adaptive = mal(sizeof(*memo.adaptive) * (nStatesToTrack + 1));
+    memo.budgetBytes = prog->memoBudgetBytes;
+    memo.usedBytes = 0;
+    for (i = 0, j = 0; j < prog->len; j++) {
+      if (!prog->aux[j].memoInfo.shouldMemo)
+        continue;
+      memo.adaptive[i].maxOffset = -1;
+      memo.adaptive[i].rleRunLength = 1;
+      if (memo.encoding == ENCODING_RLE_TUNED && prog->aux[j].memoInfo.visitInterval > 1)
+        memo.adaptive[i].rleRunLength = prog->aux[j].memoInfo.visitInterval;
+      i++;
+    }
+    if (memo.encoding == ENCODING_NEGATIVE) {
+      memo.simPosInts = 2 + (memo.cgVectors != NULL ? 1 : 2 * memo.nBackrefCGs) + memo.nCounters;
+      memo.simPosSet = SimPosSet_create(memo.simPosInts);
+    }
+  } else if (memo.mode != MEMO_NONE) {
     switch(memo.encoding){
     case ENCODING_NONE:
       assert(!memo.backrefs);
+      if (memo.windowed) {
+        /* An int per <q, i> buys nothing here: share BITSET's pages */
+        logMsg(LOG_INFO, "%s: Initializing with encoding NONE, in a window of %d-offset pages", prefix, MEMO_WINDOW_PAGE_CHARS);
+        memo.visitVectors = NULL;
+        _initWindowPages(&memo);
+        break;
+      }
       logMsg(LOG_INFO, "%s: Initializing with encoding NONE", prefix);
       logMsg(LOG_INFO, "%s: cardQ = %d, Phi_memo = %d", prefix, cardQ, nStatesToTrack);
 
@@ -273,6 +676,7 @@ initMemoTable(Prog *prog, int nChars)
       memo.visitVectors = mal(sizeof(*memo.visitVectors) * nStatesToTrack);
 
       logMsg(LOG_INFO, "%s: %d visit vectors x %d chars for each", prefix, nStatesToTrack, nChars);
+      memo.capChars = nChars;
       for (i = 0; i < nStatesToTrack; i++) {
         memo.visitVectors[i] = mal(sizeof(int) * nChars);
         for (j = 0; j < nChars; j++) {
@@ -282,8 +686,38 @@ initMemoTable(Prog *prog, int nChars)
       break;
     case ENCODING_NEGATIVE:
       logMsg(LOG_INFO, "%s: Initializing with encoding NEGATIVE", prefix);
-      memo.simPosTable = NULL;
+      memo.simPosInts = 2 + (memo.cgVectors != NULL ? 1 : 2 * memo.nBackrefCGs) + memo.nCounters;
+      memo.simPosSet = SimPosSet_create(memo.simPosInts);
+      if (memo.windowed)
+        memo.window.oldSimPosSet = SimPosSet_create(memo.simPosInts);
       break;
+    case ENCODING_BITSET:
+    {
+      size_t nBytes;
+      assert(!memo.backrefs);
+      if (memo.windowed) {
+        logMsg(LOG_INFO, "%s: Initializing with encoding BITSET, in a window of %d-offset pages", prefix, MEMO_WINDOW_PAGE_CHARS);
+        memo.bitVectors = NULL;
+        memo.bitRowWords = 0;
+        memo.bitCapWords = 0;
+        _initWindowPages(&memo);
+        break;
+      }
+      logMsg(LOG_INFO, "%s: Initializing with encoding BITSET", prefix);
+
+      memo.bitRowWords = _bitRowWords(nChars);
+      memo.bitCapWords = (size_t) memo.bitRowWords * nStatesToTrack;
+      nBytes = sizeof(*memo.bitVectors) * memo.bitCapWords;
+
+      logMsg(LOG_INFO, "%s: %d bit vectors x %d words for each (%zu bytes)", prefix, nStatesToTrack, memo.bitRowWords, nBytes);
+      memo.bitVectors = NULL;
+      if (nBytes > 0) {
+        if (posix_memalign((void **) &memo.bitVectors, MEMO_CACHE_LINE_BYTES, nBytes) != 0)
+          fatal("out of memory");
+        memset(memo.bitVectors, 0, nBytes);
+      }
+      break;
+    }
     case ENCODING_RLE:
     case ENCODING_RLE_TUNED:
       assert(!memo.backrefs);
@@ -300,8 +734,8 @@ initMemoTable(Prog *prog, int nChars)
         /* Find the corresponding states so we know the run lengths to use */
         while (j < prog->len) {
           j++;
-          if (prog->start[j].memoInfo.shouldMemo) {
-            int visitInterval = (memo.encoding == ENCODING_RLE_TUNED) ? prog->start[j].memoInfo.visitInterval : 1;
+          if (prog->aux[j].memoInfo.shouldMemo) {
+            int visitInterval = (memo.encoding == ENCODING_RLE_TUNED) ? prog->aux[j].memoInfo.visitInterval : 1;
             if (visitInterval < 1)
               visitInterval = 1;
             //visitInterval = 60;
@@ -322,111 +756,296 @@ initMemoTable(Prog *prog, int nChars)
   return memo;
 }
 
+/* sub's spans of the backref'd CGs in live, into vec. Dead ones read as 0. */
+static void
+_cgSpans(Memo *memo, Sub *sub, int live, int *vec)
+{
+  int cgIx;
+
+  // Easy to support backreferences in this scheme -- just add more info to the key
+  // For the other schemes we would have to allocate stupendous amounts of memory (NONE) or perhaps be creative (RLE)
+  for (cgIx = 0; cgIx < memo->nBackrefCGs; cgIx++) {
+    int *cgStart = &vec[2*cgIx], *cgEnd = &vec[2*cgIx + 1];
+    if ((live & (1 << cgIx)) && isgroupset(sub, memo->backrefCGs[cgIx])) {
+      *cgStart = (int) (MEMOCGID_TO_STARTP(memo, sub, cgIx) - sub->start);
+      *cgEnd = (int) (MEMOCGID_TO_ENDP(memo, sub, cgIx) - sub->start);
+    } else {
+      *cgStart = 0;
+      *cgEnd = 0;
+    }
+    logMsg(LOG_DEBUG, "cgVectorId: CG%d (%d, %d)", memo->backrefCGs[cgIx], *cgStart, *cgEnd);
+
+    /* Sanity check */
+    assert(0 <= *cgStart);
+    assert(*cgStart <= *cgEnd);
+    assert(*cgEnd < memo->nChars);
+  }
+}
+
+/* The id of sub's spans of the backref'd CGs in live.
+ * Cached on the Sub until a Save changes them. Sharers of a Sub have the same spans, so any of them may fill it in. */
+static int
+_cgVectorId(Memo *memo, Sub *sub, int live)
+{
+  int vec[MAXSUB];
+
+  if (live == 0)
+    return -1;
+  if (sub->cgVecId >= 0 && sub->cgVecLive == live)
+    return sub->cgVecId;
+
+  _cgSpans(memo, sub, live, vec);
+  sub->cgVecId = SimPosSet_intern(memo->cgVectors, vec);
+  sub->cgVecLive = live;
+  return sub->cgVecId;
+}
+
+/* ENCODING_NEGATIVE key: < q, i [, the live backref'd CG spans ] [, counter of each CountLoop around q ] >
+ * With MEMO_INTERN_MIN_CGS or more backref'd CGs the spans are interned and take one int.
+ * Below that, hashing the spans in place costs less than the lookup. */
+static void
+_simPosKey(Memo *memo, int statenum, int woffset, Sub *sub, int *key)
+{
+  int n, j;
+
+  key[0] = statenum;
+  key[1] = woffset;
+  n = 2;
+  if (memo->cgVectors != NULL) {
+    key[n++] = _cgVectorId(memo, sub, memo->liveBackrefs[statenum]);
+    logMsg(LOG_DEBUG, "simPosKey: <%d, %d> CG vector %d", statenum, woffset, key[2]);
+  } else if (memo->backrefs) {
+    _cgSpans(memo, sub, memo->liveBackrefs[statenum], &key[n]);
+    n += 2 * memo->nBackrefCGs;
+  }
+
+  /* Where q is in fewer loops than the deepest, pad with 0: the key for q is always as long */
+  if (memo->nCounters > 0) {
+    assert(sub->nCount <= memo->nCounters);
+    for (j = 0; j < memo->nCounters; j++)
+      key[n++] = j < sub->nCount ? sub->count[j] : 0;
+  }
+}
+
+/* MEMO_ADAPTIVE: give a hot vertex its vector */
+static void
+_heatAdaptive(Memo *memo, int statenum)
+{
+  MemoAdaptiveVertex *v = &memo->adaptive[statenum];
+  size_t bytes = sizeof(*v->bits) * ((memo->nChars + 63) / 64);
+
+  v->hot = 1;
+  if (memo->encoding == ENCODING_NEGATIVE) {
+    logMsg(LOG_VERBOSE, "Memo: memo state %d is hot, memoizing in the hash table", statenum);
+  } else if (memo->encoding != ENCODING_RLE && memo->encoding != ENCODING_RLE_TUNED
+      && (memo->budgetBytes == 0 || memo->usedBytes + bytes <= memo->budgetBytes)) {
+    logMsg(LOG_VERBOSE, "Memo: memo state %d is hot, %zu bytes of bit vector", statenum, bytes);
+    v->bits = mal(bytes);
+    memo->usedBytes += bytes;
+  } else {
+    if (memo->encoding != ENCODING_RLE && memo->encoding != ENCODING_RLE_TUNED)
+      logMsg(LOG_INFO, "Memo: budget of %zu bytes reached, memo state %d gets an RLE vector", memo->budgetBytes, statenum);
+    v->rle = RLEVector_create(v->rleRunLength, 0 /* Do not auto-validate */);
+  }
+}
+
+/* MEMO_ADAPTIVE markMemo. Until it is hot, a vertex only counts its revisits, and nothing is marked. */
+static int
+_markMemoAdaptive(Memo *memo, int statenum, int woffset, Sub *sub)
+{
+  MemoAdaptiveVertex *v = &memo->adaptive[statenum];
+  uint64_t *word, mask;
+  int wasMarked;
+
+  if (!v->hot) {
+    if (woffset > v->maxOffset) {
+      v->maxOffset = woffset;
+      return 0;
+    }
+    if (++v->revisits <= MEMO_ADAPTIVE_HOT_REVISITS)
+      return 0;
+    _heatAdaptive(memo, statenum);
+  }
+
+  if (v->bits != NULL) {
+    word = &v->bits[woffset >> 6];
+    mask = (uint64_t) 1 << MEMO_BIT_IX(woffset);
+    wasMarked = (*word & mask) != 0;
+    *word |= mask;
+    return wasMarked;
+  }
+  if (v->rle != NULL) {
+    if (RLEVector_get(v->rle, woffset))
+      return 1;
+    RLEVector_set(v->rle, woffset);
+    return 0;
+  }
+  {
+    int key[MEMO_MAX_KEY_INTS];
+    _simPosKey(memo, statenum, woffset, sub, key);
+    return SimPosSet_insert(memo->simPosSet, key);
+  }
+}
+
 int
 isMarked(Memo *memo, int statenum /* PC's memoStateNum */, int woffset, Sub *sub)
 {
   logMsg(LOG_VERBOSE, "  isMarked: querying <%d, %d>", statenum, woffset);
 
+  if (memo->mode == MEMO_ADAPTIVE) {
+    MemoAdaptiveVertex *v = &memo->adaptive[statenum];
+    if (v->bits != NULL)
+      return (int) ((v->bits[woffset >> 6] >> MEMO_BIT_IX(woffset)) & 1);
+    if (v->rle != NULL)
+      return RLEVector_get(v->rle, woffset) != 0;
+    if (v->hot) {
+      int key[MEMO_MAX_KEY_INTS];
+      _simPosKey(memo, statenum, woffset, sub, key);
+      return SimPosSet_contains(memo->simPosSet, key);
+    }
+    return 0;
+  }
+
+  if (memo->windowed && memo->window.pages != NULL) {
+    MemoWindow *w = &memo->window;
+    int p = woffset / MEMO_WINDOW_PAGE_CHARS;
+    assert(woffset >= w->low);
+    if (p >= w->firstPage + w->nPages)
+      return 0;
+    return (int) ((w->pages[p & (w->capPages - 1)][(size_t) statenum * MEMO_WINDOW_PAGE_WORDS + (woffset % MEMO_WINDOW_PAGE_CHARS) / 64] >> MEMO_BIT_IX(woffset)) & 1);
+  }
+
   switch(memo->encoding){
   default: assert(!"isMarked: Unexpected encoding");
   case ENCODING_NONE:
     return memo->visitVectors[statenum][woffset] == 1;
   case ENCODING_NEGATIVE:
   {
-    // Easy to support backreferences in this scheme -- just add more info to the SimPosTable entry
-    // For the other schemes we would have to allocate stupendous amounts of memory (NONE) or perhaps be creative (RLE)
-    SimPosTable entry;
-    SimPosTable *p;
-
-    memset(&entry, 0, sizeof(SimPosTable));
-    entry.key.stateNum = statenum;
-    entry.key.stringIndex = woffset;
-    if (memo->backrefs) {
-      char printStr[256];
-      printStr[0] = '\0';
-      sprintf(printStr + strlen(printStr), "isMarked: marking < <%d, %d> -> [", statenum, woffset);
-      int cgIx;
-      for (cgIx = 0; cgIx < nCG_BR; cgIx++) {
-        logMsg(LOG_DEBUG, "cgIx %d CG%d startp %p start %p", cgIx, CG_BR_memo2num[cgIx], MEMOCGID_TO_STARTP(sub, cgIx), sub->start);
-        if (isgroupset(sub, CG_BR_memo2num[cgIx])) {
-          entry.key.cgStarts[cgIx] = (int) (MEMOCGID_TO_STARTP(sub, cgIx) - sub->start);
-          entry.key.cgEnds[cgIx] = (int) (MEMOCGID_TO_ENDP(sub, cgIx) - sub->start);
-        } else {
-          entry.key.cgStarts[cgIx] = 0;
-          entry.key.cgEnds[cgIx] = 0;
-        }
-        sprintf(printStr + strlen(printStr), "CG%d (%d, %d), ", CG_BR_memo2num[cgIx], entry.key.cgStarts[cgIx], entry.key.cgEnds[cgIx]);
-      }
-      sprintf(printStr + strlen(printStr), "]");
-      logMsg(LOG_DEBUG, printStr);
-
-      /* Sanity check */
-      for (cgIx = 0; cgIx < nCG_BR; cgIx++) {
-        assert(0 <= entry.key.cgStarts[cgIx]);
-        assert(entry.key.cgStarts[cgIx] <= entry.key.cgEnds[cgIx]);
-        assert(entry.key.cgEnds[cgIx] <= strlen(sub->start));
-      }
-    }
-
-    HASH_FIND(hh, memo->simPosTable, &entry.key, sizeof(SimPos), p);
-    return p != NULL;
+    int key[MEMO_MAX_KEY_INTS];
+    _simPosKey(memo, statenum, woffset, sub, key);
+    if (memo->windowed && SimPosSet_contains(memo->window.oldSimPosSet, key))
+      return 1;
+    return SimPosSet_contains(memo->simPosSet, key);
   }
   case ENCODING_RLE:
   case ENCODING_RLE_TUNED:
     return RLEVector_get(memo->rleVectors[statenum], woffset) != 0;
+  case ENCODING_BITSET:
+    return (int) ((*MEMO_BIT_WORD(memo, statenum, woffset) >> MEMO_BIT_IX(woffset)) & 1);
   }
 
   assert(!"Unreachable");
   return -1;
 }
 
-void
+int
 markMemo(Memo *memo, int statenum, int woffset, Sub *sub)
 {
   logMsg(LOG_VERBOSE, "Memo: Marking <%d, %d>", statenum, woffset);
 
-  if (isMarked(memo, statenum, woffset, sub)) {
-    logMsg(LOG_WARN, "\n****\n\n   Hmm, already marked s%d c%d\n\n*****\n\n", statenum, woffset);
-  }
+  if (memo->mode == MEMO_ADAPTIVE)
+    return _markMemoAdaptive(memo, statenum, woffset, sub);
+
+  if (memo->windowed && memo->window.pages != NULL)
+    return markMemoWindow(memo, statenum, woffset);
 
   switch(memo->encoding) {
   case ENCODING_NONE:
-    assert(statenum < memo->nStates);
-    assert(woffset < memo->nChars);
-    assert(!memo->backrefs);
-    memo->visitVectors[statenum][woffset] = 1;
-    break;
+    return markMemoNone(memo, statenum, woffset);
+  case ENCODING_BITSET:
+    return markMemoBitset(memo, statenum, woffset);
   case ENCODING_NEGATIVE:
   {
-    SimPosTable *entry = mal(sizeof(*entry));
-    memset(entry, 0, sizeof(*entry));
-    entry->key.stateNum = statenum;
-    entry->key.stringIndex = woffset;
-
-    if (memo->backrefs) {
-      int cgIx;
-      for (cgIx = 0; cgIx < nCG_BR; cgIx++) {
-        if (isgroupset(sub, CG_BR_memo2num[cgIx])) {
-          entry->key.cgStarts[cgIx] = (int) (MEMOCGID_TO_STARTP(sub, cgIx) - sub->start);
-          entry->key.cgEnds[cgIx] = (int) (MEMOCGID_TO_ENDP(sub, cgIx) - sub->start);
-        } else {
-          entry->key.cgStarts[cgIx] = 0;
-          entry->key.cgEnds[cgIx] = 0;
-        }
-      }
+    int key[MEMO_MAX_KEY_INTS];
+    _simPosKey(memo, statenum, woffset, sub, key);
+    if (memo->windowed) {
+      /* Every entry in the old generation is at or before its oldMaxOffset */
+      if (woffset <= memo->window.oldMaxOffset && SimPosSet_contains(memo->window.oldSimPosSet, key))
+        return 1;
+      if (woffset > memo->window.maxOffset)
+        memo->window.maxOffset = woffset;
     }
-
-    HASH_ADD(hh, memo->simPosTable, key, sizeof(SimPos), entry);
-    break;
+    return SimPosSet_insert(memo->simPosSet, key);
   }
   case ENCODING_RLE:
   case ENCODING_RLE_TUNED:
     assert(!memo->backrefs);
+    if (RLEVector_get(memo->rleVectors[statenum], woffset))
+      return 1;
     RLEVector_set(memo->rleVectors[statenum], woffset);
-    break;
+    return 0;
   default:
     assert(!"Unknown encoding\n");
   }
+
+  return -1;
+}
+
+void
+resetMemoTable(Memo *memo, Prog *prog, int nChars)
+{
+  int i;
+
+  /* A window keeps its pages (and both generations) for the next input */
+  if (memo->windowed && memo->encoding != ENCODING_RLE && memo->encoding != ENCODING_RLE_TUNED) {
+    MemoWindow *w = &memo->window;
+    while (w->nPages > 0) {
+      w->freePages[w->nFreePages++] = w->pages[w->firstPage & (w->capPages - 1)];
+      w->firstPage++;
+      w->nPages--;
+    }
+    if (memo->encoding == ENCODING_NEGATIVE) {
+      SimPosSet_clear(memo->simPosSet);
+      SimPosSet_clear(w->oldSimPosSet);
+    }
+    w->low = 0;
+    w->nextRelease = MEMO_WINDOW_PAGE_CHARS;
+    w->firstPage = 0;
+    w->maxOffset = -1;
+    w->oldMaxOffset = -1;
+    w->peakBytes = 0;
+    memo->nChars = nChars;
+    return;
+  }
+
+  /* MEMO_ADAPTIVE tables are mostly counters, and the vectors are sized by |w|: start over */
+  if (memo->mode != MEMO_NONE && memo->mode != MEMO_ADAPTIVE) {
+    switch (memo->encoding) {
+    case ENCODING_NONE:
+      if (nChars <= memo->capChars) {
+        for (i = 0; i < memo->nStates; i++)
+          memset(memo->visitVectors[i], 0, sizeof(int) * nChars);
+        memo->nChars = nChars;
+        return;
+      }
+      break;
+    case ENCODING_NEGATIVE:
+      SimPosSet_clear(memo->simPosSet);
+      if (memo->cgVectors != NULL)
+        SimPosSet_clear(memo->cgVectors);
+      memo->nChars = nChars;
+      return;
+    case ENCODING_BITSET:
+    {
+      int rowWords = _bitRowWords(nChars);
+      size_t nWords = (size_t) rowWords * memo->nStates;
+      if (nWords <= memo->bitCapWords) {
+        if (nWords > 0)
+          memset(memo->bitVectors, 0, sizeof(*memo->bitVectors) * nWords);
+        memo->bitRowWords = rowWords;
+        memo->nChars = nChars;
+        return;
+      }
+      break;
+    }
+    default:
+      /* RLE vectors are trees of runs -- nothing worth keeping */
+      break;
+    }
+  }
+
+  freeMemoTable(*memo);
+  *memo = initMemoTable(prog, nChars);
 }
 
 void freeMemoTable(Memo memo)
@@ -436,6 +1055,39 @@ void freeMemoTable(Memo memo)
     if (memo.mode == MEMO_NONE)
         return;
 
+    free(memo.liveBackrefs);
+    if (memo.cgVectors != NULL) {
+        logMsg(LOG_INFO, "Memo: %d distinct backref'd CG vectors", SimPosSet_count(memo.cgVectors));
+        SimPosSet_destroy(memo.cgVectors);
+    }
+
+    if (memo.mode == MEMO_ADAPTIVE) {
+        for (i = 0; i < memo.nStates; i++) {
+            free(memo.adaptive[i].bits);
+            if (memo.adaptive[i].rle != NULL)
+                RLEVector_destroy(memo.adaptive[i].rle);
+        }
+        free(memo.adaptive);
+        if (memo.encoding == ENCODING_NEGATIVE)
+            SimPosSet_destroy(memo.simPosSet);
+        return;
+    }
+
+    if (memo.windowed) {
+        if (memo.window.oldSimPosSet != NULL)
+            SimPosSet_destroy(memo.window.oldSimPosSet);
+        if (memo.window.pages != NULL) {
+            /* ENCODING_NONE or ENCODING_BITSET: the pages are the whole table */
+            for (i = 0; i < memo.window.nPages; i++)
+                free(memo.window.pages[(memo.window.firstPage + i) & (memo.window.capPages - 1)]);
+            for (i = 0; i < memo.window.nFreePages; i++)
+                free(memo.window.freePages[i]);
+            free(memo.window.pages);
+            free(memo.window.freePages);
+            return;
+        }
+    }
+
     switch(memo.encoding) {
     case ENCODING_NONE:
         for (i = 0; i < memo.nStates; i++) {
@@ -444,15 +1096,8 @@ void freeMemoTable(Memo memo)
         free(memo.visitVectors);
         break;
     case ENCODING_NEGATIVE:
-    {
-        SimPosTable *n, *tmp = NULL;
-        HASH_ITER(hh, memo.simPosTable, n, tmp) {
-          HASH_DEL(memo.simPosTable, n);
-          free(n);
-        }
-        HASH_CLEAR(hh, memo.simPosTable);
+        SimPosSet_destroy(memo.simPosSet);
         break;
-    }
     case ENCODING_RLE:
     case ENCODING_RLE_TUNED:
         logMsg(LOG_DEBUG, "Freeing %d vectors", memo.nStates);
@@ -461,6 +1106,9 @@ void freeMemoTable(Memo memo)
         }
         free(memo.rleVectors);
         break;
+    case ENCODING_BITSET:
+        free(memo.bitVectors);
+        break;
     default:
         assert(!"free table: Unknown encoding");
     }
@@ -479,14 +1127,14 @@ backrefdCGs(Prog *prog, int *list)
       /* Is it a new CG or one we've already seen? */
       newCG = 1;
       for (j = 0; j < n; j++) {
-        if (pc->cgNum == list[j]) {
+        if (pc->c == list[j]) {
           newCG = 0;
         }
       }
 
       if (newCG) {
-        list[n] = pc->cgNum;
-        logMsg(LOG_DEBUG, "backrefdCGs: CG %d has CGBR ix %d (%d)", pc->cgNum, n, list[n]);
+        list[n] = pc->c;
+        logMsg(LOG_DEBUG, "backrefdCGs: CG %d has CGBR ix %d (%d)", pc->c, n, list[n]);
         n++;
       }
     }
@@ -7,43 +7,93 @@
 
 #include "regexp.h"
 #include "rle.h"
+#include "simpos.h"
+
+#include <stdint.h>
 
 /* Memoization-related compilation phase. */
 
 void Prog_determineMemoNodes(Prog *p, int memoMode);
+/* ENCODING_RLE_TUNED: choose each Inst's memoInfo.visitInterval (its RLE run length) from the Prog's structure */
+void Prog_determineVisitIntervals(Prog *p);
 
 /* Memoization-related simulation. */
 
 typedef struct VisitTable VisitTable;
 typedef struct Memo Memo;
-typedef struct SimPos SimPos;
-typedef struct SimPosTable SimPosTable;
 
 // Used to evaluate whether memoization guarantees have failed.
 struct VisitTable
 {
-  int **visitVectors; /* Counters */
+  int **visitVectors; /* Counters; NULL unless Prog.statsMode == STATS_VISITS */
   int nStates; /* |Q| */
   int nChars;  /* |w| */
 };
 
-struct SimPos
+/* ENCODING_BITSET rows are aligned and padded to this */
+#define MEMO_CACHE_LINE_BYTES 64
+#define MEMO_WORDS_PER_CACHE_LINE (MEMO_CACHE_LINE_BYTES / sizeof(uint64_t))
+
+/* MEMO_ADAPTIVE: a vertex only gets a memo vector once it is hot, i.e. once the search keeps coming back to it.
+ * A visit beyond the furthest offset so far is progress; any other visit is a revisit.
+ * After MEMO_ADAPTIVE_HOT_REVISITS revisits the vertex is memoized like any other.
+ * Before that it has at most |w| + 1 forward visits and the few revisits, so the search stays linear. */
+#define MEMO_ADAPTIVE_HOT_REVISITS 8
+
+typedef struct MemoAdaptiveVertex MemoAdaptiveVertex;
+struct MemoAdaptiveVertex
 {
-    /* Relevant regex engine state: <vertex, w index> */
-	int stateNum;
-	int stringIndex;
-	/* At vertices corresponding to backreferences, also track the CG vector. */
-	int cgStarts[MAXSUB/2];
-	int cgEnds[MAXSUB/2];
+	int maxOffset; /* Furthest offset visited; -1 before the first visit */
+	int revisits;
+	int hot;
+	int rleRunLength; /* For an RLE vector */
+	uint64_t *bits; /* A bit per offset, if the budget allowed. Otherwise rle (or Memo.simPosSet for backrefs) */
+	RLEVector *rle;
 };
 
-/* For hashing */
-struct SimPosTable
+/* Prog.memoWindow: the memo table only keeps the offsets the search can still reach.
+ * A thread is pushed at the sp of the thread that pushes it, and sp only moves forward,
+ * so the backtracking stack is sorted by sp: no offset below the sp of its bottom thread
+ * (nor, unanchored, below the next start) will be marked or queried again.
+ * Storage behind that watermark is released a page of MEMO_WINDOW_PAGE_CHARS offsets at a time. */
+#ifndef MEMO_WINDOW_PAGE_CHARS
+#define MEMO_WINDOW_PAGE_CHARS 4096 /* A multiple of 64 */
+#endif
+#define MEMO_WINDOW_PAGE_WORDS (MEMO_WINDOW_PAGE_CHARS / 64)
+
+typedef struct MemoWindow MemoWindow;
+struct MemoWindow
 {
-	SimPos key;
-	UT_hash_handle hh; /* Makes this structure hashable */
+	int low; /* The watermark when last released */
+	int nextRelease; /* advanceMemoWindow does nothing below this */
+
+	/* ENCODING_NONE and ENCODING_BITSET: a ring of pages from firstPage on.
+	 * A page holds the bits of every memo state for its offsets, MEMO_WINDOW_PAGE_WORDS words per state. */
+	uint64_t **pages; /* Page p is pages[p & (capPages - 1)] */
+	int capPages; /* A power of 2 */
+	int firstPage;
+	int nPages;
+	uint64_t **freePages; /* Released, for reuse */
+	int nFreePages;
+	size_t pageBytes;
+
+	/* ENCODING_NEGATIVE: two generations. Memo.simPosSet takes new entries; oldSimPosSet is cleared
+	 * once the watermark passes its last offset, and then the two trade places. */
+	SimPosSet *oldSimPosSet;
+	int maxOffset; /* In Memo.simPosSet */
+	int oldMaxOffset;
+
+	size_t peakBytes;
 };
 
+/* Intern the backref'd CG spans of an ENCODING_NEGATIVE key when there are this many backref'd CGs; else the key holds them */
+#ifndef MEMO_INTERN_MIN_CGS
+#define MEMO_INTERN_MIN_CGS 3
+#endif
+
+/* The widest ENCODING_NEGATIVE key */
+#define MEMO_MAX_KEY_INTS (2 + 2 * (MEMO_INTERN_MIN_CGS - 1) + MAXCOUNT)
+
 /* Declare here so visible for selecting vertices during compilation */
 struct Memo
 {
@@ -52,17 +102,39 @@ struct Memo
 	int mode;
 	int encoding;
 	int backrefs; /* Backrefs present? */
+	const int *backrefCGs; /* Prog.backrefCGs */
+	int nBackrefCGs;
+	int *liveBackrefs; /* Per memo state: its InstInfoForMemoSelPolicy.liveBackrefs */
+	int backrefSubs; /* Bit n set if Sub.sub[n] is a start or end of a backref'd CG */
+	SimPosSet *cgVectors; /* Interned spans of the live backref'd CGs, with MEMO_INTERN_MIN_CGS or more. The ids go in the keys. */
+	int nCounters; /* Prog.nCounters */
 
 	/* Structures for each encoding scheme. */
 
 	/* ENCODING_NONE */
 	int **visitVectors; /* Booleans: visitVector[q][i] */
+	int capChars; /* Allocated length of each visitVector */
 
 	/* ENCODING_NEGATIVE */
-	SimPosTable *simPosTable; /* Tuples: < q, i [, backrefs ] > */
+	SimPosSet *simPosSet; /* Tuples: < q, i [, cgVectors id, or the backref'd CG spans ] [, CountLoop counters ] > */
+	int simPosInts; /* Ints per tuple: 2, plus 1 (cgVectors) or 2 per backref'd CG, plus nCounters */
 
 	/* ENCODING_RLE, ENCODING_RLE_TUNED */
 	RLEVector **rleVectors;
+
+	/* ENCODING_BITSET */
+	uint64_t *bitVectors; /* One flat |Phi| x |w| bitmap: row q starts at bitVectors + q*bitRowWords */
+	int bitRowWords; /* Words per row, padded so each row starts on a cache line */
+	size_t bitCapWords; /* Allocated words */
+
+	/* MEMO_ADAPTIVE. Hot vertices get bit vectors, or RLE vectors with ENCODING_RLE*, or simPosSet entries with backrefs. */
+	MemoAdaptiveVertex *adaptive; /* One per candidate vertex */
+	size_t budgetBytes; /* Bit vectors stop here, and later hot vertices get RLE vectors; 0 for no bound */
+	size_t usedBytes; /* By the bit vectors */
+
+	/* Prog.memoWindow. ENCODING_NONE and ENCODING_BITSET keep their bits in window.pages instead of visitVectors and bitVectors. */
+	int windowed;
+	MemoWindow window;
 };
 
 enum /* Memo.mode */
@@ -71,6 +143,7 @@ enum /* Memo.mode */
 	MEMO_FULL,
 	MEMO_IN_DEGREE_GT1,
 	MEMO_LOOP_DEST,
+	MEMO_ADAPTIVE, /* The MEMO_IN_DEGREE_GT1 and MEMO_LOOP_DEST vertices, each once it proves hot */
 };
 
 enum /* Memo.encoding */
@@ -79,6 +152,7 @@ enum /* Memo.encoding */
 	ENCODING_NEGATIVE,  /* Hash table */
 	ENCODING_RLE,       /* Run-length encoding */
 	ENCODING_RLE_TUNED, /* DO NOT USE -- RLE, tuned for language lengths -- DO NOT USE */
+	ENCODING_BITSET,    /* One bit per <q, i> */
 };
 
 VisitTable initVisitTable(Prog *prog, int nChars);
@@ -87,7 +161,72 @@ void freeVisitTable(VisitTable vt);
 
 Memo initMemoTable(Prog *prog, int nChars);
 int isMarked(Memo *memo, int statenum /* PC's memoStateNum */, int woffset, Sub *sub);
-void markMemo(Memo *memo, int statenum, int woffset, Sub *sub);
+/* Test-and-set: marks <statenum, woffset> and returns 1 if it was already marked. */
+int markMemo(Memo *memo, int statenum, int woffset, Sub *sub);
+/* Empty a table from initMemoTable(prog, ...) for a new input, reusing its allocations if they are big enough. */
+void resetMemoTable(Memo *memo, Prog *prog, int nChars);
 void freeMemoTable(Memo memo);
 
+/* Memo.windowed, ENCODING_NONE and ENCODING_BITSET: make page p live, with the pages before it */
+void extendMemoWindow(Memo *memo, int p);
+
+/* Memo.windowed: release the storage for the offsets below low, which the search will not mark or query again */
+void releaseMemoWindow(Memo *memo, int low);
+static inline void
+advanceMemoWindow(Memo *memo, int low)
+{
+  if (low >= memo->window.nextRelease)
+    releaseMemoWindow(memo, low);
+}
+
+/* ENCODING_BITSET addressing: the word and bit holding <q, i> */
+#define MEMO_BIT_WORD(memo, q, i) ( (memo)->bitVectors + (size_t) (q) * (memo)->bitRowWords + ((i) >> 6) )
+#define MEMO_BIT_IX(i) ( (i) & 63 )
+
+/* markMemo for one known encoding, inline so a simulation specialized on the encoding skips the dispatch */
+static inline int
+markMemoNone(Memo *memo, int statenum, int woffset)
+{
+  int wasMarked;
+  assert(statenum < memo->nStates);
+  assert(woffset < memo->nChars);
+  assert(!memo->backrefs && memo->nCounters == 0);
+  wasMarked = memo->visitVectors[statenum][woffset];
+  memo->visitVectors[statenum][woffset] = 1;
+  return wasMarked;
+}
+
+static inline int
+markMemoBitset(Memo *memo, int statenum, int woffset)
+{
+  /* Branch-free test-and-set */
+  uint64_t *word = MEMO_BIT_WORD(memo, statenum, woffset);
+  uint64_t mask = (uint64_t) 1 << MEMO_BIT_IX(woffset);
+  int wasMarked;
+  assert(statenum < memo->nStates);
+  assert(woffset < memo->nChars);
+  wasMarked = (int) ((*word >> MEMO_BIT_IX(woffset)) & 1);
+  *word |= mask;
+  return wasMarked;
+}
+
+/* Memo.windowed, ENCODING_NONE and ENCODING_BITSET */
+static inline int
+markMemoWindow(Memo *memo, int statenum, int woffset)
+{
+  MemoWindow *w = &memo->window;
+  int p = woffset / MEMO_WINDOW_PAGE_CHARS;
+  uint64_t *word;
+  int wasMarked;
+  assert(statenum < memo->nStates);
+  assert(woffset < memo->nChars);
+  assert(woffset >= w->low);
+  if (p >= w->firstPage + w->nPages)
+    extendMemoWindow(memo, p);
+  word = w->pages[p & (w->capPages - 1)] + (size_t) statenum * MEMO_WINDOW_PAGE_WORDS + (woffset % MEMO_WINDOW_PAGE_CHARS) / 64;
+  wasMarked = (int) ((*word >> MEMO_BIT_IX(woffset)) & 1);
+  *word |= (uint64_t) 1 << MEMO_BIT_IX(woffset);
+  return wasMarked;
+}
+
 #endif /* MEMOIZE_H */
@@ -0,0 +1,317 @@
+// Copyright 2020 James C. Davis.  All Rights Reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/* libmemore tests over the semantic suite (test/semantic-behav.txt).
+ * The Python suite drives the re binary, which always asks for captures and statistics;
+ * these call the library directly, so each path that answers without the backtracker (or without the whole input) is checked against it. */
+
+#define _GNU_SOURCE /* memmem */
+
+#include "memore.h"
+#include "log.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct SuiteCase SuiteCase;
+struct SuiteCase
+{
+  char *regex;
+  char *input;
+  int shouldMatch;
+};
+
+static char *strip(char *s) {
+  char *end;
+
+  while (*s == ' ' || *s == '\t')
+    s++;
+  end = s + strlen(s);
+  while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n' || end[-1] == '\r'))
+    end--;
+  *end = '\0';
+  return s;
+}
+
+/* As unittest-prototype.py: "REGEX :: INPUT :: MATCH/MISMATCH/SYNTAX", a # starts a comment.
+ * SYNTAX rows are skipped: syntax errors are fatal. */
+static SuiteCase *loadSuite(const char *path, int *nCases) {
+  char line[4096], *pieces[3], *sep, *s;
+  SuiteCase *cases = NULL;
+  int n = 0, cap = 0, nPieces;
+  FILE *f;
+
+  f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    exit(1);
+  }
+  while (fgets(line, sizeof line, f) != NULL) {
+    if ((s = strchr(line, '#')) != NULL)
+      *s = '\0';
+    for (s = line, nPieces = 0; nPieces < 3; s = sep + 2) {
+      sep = strstr(s, "::");
+      if (sep != NULL)
+        *sep = '\0';
+      pieces[nPieces++] = strip(s);
+      if (sep == NULL)
+        break;
+    }
+    if (nPieces != 3 || strcmp(pieces[2], "SYNTAX") == 0)
+      continue;
+    if (n == cap) {
+      cap = cap ? 2 * cap : 256;
+      cases = realloc(cases, cap * sizeof(*cases));
+      assert(cases != NULL);
+    }
+    cases[n].regex = strdup(pieces[0]);
+    cases[n].input = strdup(pieces[1]);
+    cases[n].shouldMatch = strcmp(pieces[2], "MATCH") == 0;
+    n++;
+  }
+  fclose(f);
+  *nCases = n;
+  return cases;
+}
+
+/* Match/no-match (no captures) is the lazy DFA's alone where it applies; it must agree with the backtracker */
+void testDFA(const SuiteCase *cases, int n) {
+  logMsg(LOG_INFO, "Test begins: testDFA");
+  memore_options opts, noDFAOpts;
+  memore_usage usage, noDFAUsage;
+  memore *dfa, *backtrack;
+  int i, fast, slow, nByDFA = 0;
+
+  memore_options_init(&opts);
+  noDFAOpts = opts;
+  noDFAOpts.noDFA = 1;
+  for (i = 0; i < n; i++) {
+    dfa = memore_compile_ex(cases[i].regex, &opts);
+    backtrack = memore_compile_ex(cases[i].regex, &noDFAOpts);
+    fast = memore_match(dfa, cases[i].input, strlen(cases[i].input), NULL, 0);
+    slow = memore_match(backtrack, cases[i].input, strlen(cases[i].input), NULL, 0);
+    /* Zero steps: nothing but the DFA ran (the prefilter alone also takes none, but then so does the backtracker) */
+    memore_last_usage(dfa, &usage);
+    memore_last_usage(backtrack, &noDFAUsage);
+    nByDFA += usage.steps == 0 && noDFAUsage.steps > 0;
+    if (fast != slow || slow != cases[i].shouldMatch)
+      fprintf(stderr, "testDFA: /%s/ on <%s>: %d with the DFA, %d without, expected %d\n",
+        cases[i].regex, cases[i].input, fast, slow, cases[i].shouldMatch);
+    assert(fast == slow);
+    assert(slow == cases[i].shouldMatch);
+    memore_free(dfa);
+    memore_free(backtrack);
+  }
+  /* Most of the suite has no backreferences or lookahead */
+  logMsg(LOG_INFO, "  the DFA answered %d of %d", nByDFA, n);
+  assert(nByDFA > n / 2);
+  logMsg(LOG_INFO, "...test passed");
+}
+
+/* Either side of CURLY_MAX_EXPANSION (6 Insts a copy of (a|a): 85 copies are expanded, 86 counted),
+ * and far past it, the DFA still answers. The memo-less backtracker would take exponential time. */
+void testDFACountedLoops(void) {
+  logMsg(LOG_INFO, "Test begins: testDFACountedLoops");
+  static const char *patterns[] = { "^(a|a){0,85}[bc]", "^(a|a){0,86}[bc]", "^(a|a){0,100}[bc]", "^(a|a){0,2000}[bc]" };
+  char noMatch[] = "aaaaaaaaaaaaaaaaaaaaaaaaaa", match[] = "aaaaaaaaaaaaaaaaaaaaaaaaaab";
+  memore_options opts;
+  memore_usage usage;
+  memore *re;
+  int i;
+
+  memore_options_init(&opts);
+  /* Far more than the DFA's answer takes, and far less than the backtracker's */
+  opts.maxSteps = 1000000;
+  for (i = 0; i < (int) (sizeof(patterns) / sizeof(patterns[0])); i++) {
+    re = memore_compile_ex(patterns[i], &opts);
+    assert(memore_match(re, noMatch, strlen(noMatch), NULL, 0) == 0);
+    memore_last_usage(re, &usage);
+    assert(usage.steps == 0);
+    assert(memore_match(re, match, strlen(match), NULL, 0) == 1);
+    memore_free(re);
+  }
+  logMsg(LOG_INFO, "...test passed");
+}
+
+/* A stream cut into 1-byte and odd-sized chunks must end with memore_match's answer and offsets */
+void testStream(const SuiteCase *cases, int n) {
+  logMsg(LOG_INFO, "Test begins: testStream");
+  static const size_t chunkSizes[] = { 1, 3, 7 };
+  const char *subs[MEMORE_MAXSUB];
+  long long want[MEMORE_MAXSUB], offs[MEMORE_MAXSUB];
+  memore_options opts;
+  memore_stream *st;
+  memore *re;
+  size_t len, off, chunk;
+  int i, j, k, matched, streamed;
+
+  memore_options_init(&opts);
+  for (i = 0; i < n; i++) {
+    re = memore_compile_ex(cases[i].regex, &opts);
+    len = strlen(cases[i].input);
+    matched = memore_match(re, cases[i].input, len, subs, MEMORE_MAXSUB);
+    for (k = 0; k < MEMORE_MAXSUB; k++)
+      want[k] = matched == 1 && subs[k] != NULL ? subs[k] - cases[i].input : -1;
+    assert(matched == cases[i].shouldMatch);
+
+    for (j = 0; j < (int) (sizeof(chunkSizes) / sizeof(chunkSizes[0])); j++) {
+      st = memore_stream_begin(re);
+      /* Stop feeding once the stream has its answer */
+      for (off = 0; off < len; off += chunk) {
+        chunk = len - off < chunkSizes[j] ? len - off : chunkSizes[j];
+        if (memore_stream_feed(st, cases[i].input + off, chunk))
+          break;
+      }
+      streamed = memore_stream_end(st, offs, MEMORE_MAXSUB);
+      if (streamed != matched)
+        fprintf(stderr, "testStream: /%s/ on <%s> in %zu-byte chunks: %d, memore_match %d\n",
+          cases[i].regex, cases[i].input, chunkSizes[j], streamed, matched);
+      assert(streamed == matched);
+      for (k = 0; matched == 1 && k < MEMORE_MAXSUB; k++) {
+        if (offs[k] != want[k])
+          fprintf(stderr, "testStream: /%s/ on <%s> in %zu-byte chunks: offs[%d] %lld, memore_match %lld\n",
+            cases[i].regex, cases[i].input, chunkSizes[j], k, offs[k], want[k]);
+        assert(offs[k] == want[k]);
+      }
+    }
+    memore_free(re);
+  }
+  logMsg(LOG_INFO, "...test passed");
+}
+
+static char *readFile(const char *path, size_t *len) {
+  FILE *f = fopen(path, "rb");
+  char *buf;
+
+  assert(f != NULL);
+  fseek(f, 0, SEEK_END);
+  *len = ftell(f);
+  rewind(f);
+  buf = malloc(*len + 1);
+  assert(buf != NULL && fread(buf, 1, *len, f) == *len);
+  fclose(f);
+  return buf;
+}
+
+static void writeFile(const char *path, const char *buf, size_t len) {
+  FILE *f = fopen(path, "wb");
+
+  assert(f != NULL && fwrite(buf, 1, len, f) == len);
+  fclose(f);
+}
+
+/* Returns memore_match's result, with the capture offsets in offs (-1 for unset) */
+static int matchOffsets(memore *re, const char *input, long long *offs) {
+  const char *subs[MEMORE_MAXSUB];
+  int k, matched;
+
+  matched = memore_match(re, input, strlen(input), subs, MEMORE_MAXSUB);
+  for (k = 0; k < MEMORE_MAXSUB; k++)
+    offs[k] = matched == 1 && subs[k] != NULL ? subs[k] - input : -1;
+  return matched;
+}
+
+/* A saved and loaded regex matches as the compiled one does; a truncated or garbled file does not load */
+void testSaveLoad(const SuiteCase *cases, int n) {
+  logMsg(LOG_INFO, "Test begins: testSaveLoad");
+  char path[] = "/tmp/memore-test-XXXXXX";
+  long long want[MEMORE_MAXSUB], offs[MEMORE_MAXSUB];
+  memore_options opts;
+  memore *compiled, *loaded;
+  char *buf, *progMagic;
+  size_t len, cut;
+  int i, fd;
+
+  fd = mkstemp(path);
+  assert(fd >= 0);
+  close(fd);
+
+  memore_options_init(&opts);
+  opts.memoMode = MEMORE_MEMO_FULL;
+  opts.encoding = MEMORE_ENCODING_BITSET;
+  for (i = 0; i < n; i++) {
+    compiled = memore_compile_ex(cases[i].regex, &opts);
+    assert(memore_save(compiled, path) == 0);
+    loaded = memore_load(path);
+    assert(loaded != NULL);
+    assert(matchOffsets(loaded, cases[i].input, offs) == matchOffsets(compiled, cases[i].input, want));
+    assert(memcmp(offs, want, sizeof offs) == 0);
+    memore_free(loaded);
+    memore_free(compiled);
+
+    /* The file's magic, the Prog's magic, and a trailing byte the lengths don't account for */
+    buf = readFile(path, &len);
+    buf[0] ^= 1;
+    writeFile(path, buf, len);
+    assert(memore_load(path) == NULL);
+    buf[0] ^= 1;
+    progMagic = memmem(buf, len, "memoprog", 8);
+    assert(progMagic != NULL);
+    progMagic[0] ^= 1;
+    writeFile(path, buf, len);
+    assert(memore_load(path) == NULL);
+    progMagic[0] ^= 1;
+    writeFile(path, buf, len + 1);
+    assert(memore_load(path) == NULL);
+
+    /* Every truncation, the header's included */
+    writeFile(path, buf, len);
+    for (cut = len; cut-- > 0; ) {
+      assert(truncate(path, cut) == 0);
+      assert(memore_load(path) == NULL);
+    }
+    free(buf);
+  }
+  assert(memore_load("/nonexistent/memore-test") == NULL);
+  unlink(path);
+  logMsg(LOG_INFO, "...test passed");
+}
+
+/* Without memoization, a set costs what its members do alone: once a member matches, its other threads are dropped */
+void testSetAmbiguous(void) {
+  logMsg(LOG_INFO, "Test begins: testSetAmbiguous");
+  const char *patterns[] = { "(a|a)*", "b" };
+  char input[] = "aaaaaaaaaaaaaaaaaaaaaaaaaab"; /* a{26}b */
+  memore_options opts;
+  memore_usage usage;
+  memore_set *set;
+  int ids[2];
+
+  memore_options_init(&opts);
+  opts.memoMode = MEMORE_MEMO_NONE;
+  /* Far more than the search takes, and far less than exploring every (a|a)* thread */
+  opts.maxSteps = 1000000;
+  set = memore_set_compile(patterns, 2, &opts);
+  assert(memore_set_match(set, input, strlen(input), ids) == 2);
+  assert(ids[0] == 0 && ids[1] == 1);
+  memore_set_last_usage(set, &usage);
+  logMsg(LOG_INFO, "  %llu steps", (unsigned long long) usage.steps);
+  memore_set_free(set);
+  logMsg(LOG_INFO, "...test passed");
+}
+
+int main(int argc, char **argv) {
+  SuiteCase *cases;
+  int i, n;
+
+  logMsg(LOG_INFO, "Running the libmemore test suite...");
+  cases = loadSuite(argc > 1 ? argv[1] : "test/semantic-behav.txt", &n);
+  assert(n > 0);
+
+  testDFA(cases, n);
+  testDFACountedLoops();
+  testStream(cases, n);
+  testSaveLoad(cases, n);
+  testSetAmbiguous();
+
+  for (i = 0; i < n; i++) {
+    free(cases[i].regex);
+    free(cases[i].input);
+  }
+  free(cases);
+  return 0;
+}
@@ -0,0 +1,937 @@
+// Copyright 2020 James C. Davis.  All Rights Reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "memore.h"
+#include "regexp.h"
+#include "memoize.h"
+#include "statistics.h"
+#include "dfa.h"
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+_Static_assert((int) MEMORE_MEMO_LOOP == (int) MEMO_LOOP_DEST, "memore.h memo modes out of sync");
+_Static_assert((int) MEMORE_MEMO_ADAPTIVE == (int) MEMO_ADAPTIVE, "memore.h memo modes out of sync");
+_Static_assert((int) MEMORE_ENCODING_BITSET == (int) ENCODING_BITSET, "memore.h encodings out of sync");
+_Static_assert((int) MEMORE_STATS_NONE == (int) STATS_NONE, "memore.h stats modes out of sync");
+_Static_assert((int) MEMORE_MAXSUB == (int) MAXSUB, "memore.h MAXSUB out of sync");
+_Static_assert((int) MEMORE_BUDGET_EXCEEDED == (int) MATCH_BUDGET_EXCEEDED, "memore.h budget result out of sync");
+_Static_assert((int) MEMORE_BUDGET_TIME == (int) MATCH_BUDGET_TIME, "memore.h budget limits out of sync");
+
+struct memore_ctx
+{
+	MatchCtx *match;
+	DFA *dfa; /* For dfaProg, built on first use */
+	Prog *dfaProg;
+	DFA *scanner; /* A memore's own ctx: its streams' scanner, between streams */
+	memore_usage usage; /* The last match's */
+};
+
+struct memore
+{
+	char *pattern; /* For memore_save */
+	memore_options opts;
+	Prog *prog;
+	Prog *dfaProg; /* What the DFA runs: prog, prog with its counted loops expanded, or NULL if it cannot */
+	int engine; /* MEMORE_ENGINE_* */
+	int useDFA; /* Ask the DFA whether there is a match, and the backtracker only for the captures */
+	int retry; /* MEMORE_RETRY_* */
+	Prog *retryProg; /* For retry: searches again when prog runs into its budget */
+	memore_ctx *ctx; /* For memore_match */
+	memore_compile_times compileTimes;
+};
+
+void
+memore_options_init(memore_options *opts)
+{
+	opts->memoMode = MEMORE_MEMO_NONE;
+	opts->encoding = MEMORE_ENCODING_NONE;
+	opts->rleK = 0;
+	opts->stats = MEMORE_STATS_NONE;
+	opts->aggregateStats = 0;
+	opts->engine = MEMORE_ENGINE_BACKTRACK;
+	opts->memoBudget = 0;
+	opts->memoWindow = 0;
+	opts->maxSteps = 0;
+	opts->maxMemoBytes = 0;
+	opts->timeoutUS = 0;
+	opts->budgetRetry = MEMORE_RETRY_NONE;
+	opts->noDFA = 0;
+}
+
+memore *
+memore_compile(const char *pattern, int memoMode, int encoding)
+{
+	memore_options opts;
+
+	memore_options_init(&opts);
+	opts.memoMode = memoMode;
+	opts.encoding = encoding;
+	return memore_compile_ex(pattern, &opts);
+}
+
+/* Parse and optimize. Syntax errors are fatal.
+ * countedLoops: compile large Curlies to CountLoops, which only the backtracker runs. times (if any) gets the phases. */
+static Regexp *
+_parsePattern(const char *pattern, int countedLoops, memore_compile_times *times)
+{
+	uint64_t startNS = nowNS();
+	Regexp *re;
+	char *s;
+
+	// Parse -- rewrites the pattern in place
+	s = strdup(pattern);
+	re = parse(s);
+	free(s);
+	if (times != NULL)
+		times->parseNS += nowNS() - startNS;
+
+	// Optimize
+	if (shouldLog(LOG_DEBUG)) {
+		logMsg(LOG_INFO, "Initial re:");
+		printre(re);
+		printf("\n");
+	}
+	startNS = nowNS();
+	re = transform(re, countedLoops);
+	if (times != NULL)
+		times->transformNS += nowNS() - startNS;
+	if (shouldLog(LOG_DEBUG)) {
+		logMsg(LOG_INFO, "Transformed re:");
+		printre(re);
+		printf("\n");
+	}
+	return re;
+}
+
+/* Everything after compile: the passes over the Prog, then its memo and stats settings */
+static void
+_prepareProg(Prog *prog, const memore_options *opts, int memoEncoding, int statsMode)
+{
+	if (shouldLog(LOG_DEBUG)) {
+		logMsg(LOG_INFO, "Compiled :");
+		printprog(prog);
+		printf("\n");
+	}
+	Prog_assertNoInfiniteLoops(prog);
+	Prog_peephole(prog);
+	if (shouldLog(LOG_DEBUG)) {
+		logMsg(LOG_INFO, "After peephole:");
+		printprog(prog);
+		printf("\n");
+	}
+
+	// Memoization settings
+	prog->memoMode = opts->memoMode;
+	prog->memoEncoding = memoEncoding;
+	prog->memoBudgetBytes = opts->memoBudget;
+	prog->budget.maxSteps = opts->maxSteps;
+	prog->budget.maxMemoBytes = opts->maxMemoBytes;
+	prog->budget.timeoutUS = opts->timeoutUS;
+	prog->memoWindow = opts->memoWindow && opts->memoMode != MEMO_NONE;
+	if (prog->memoWindow && (opts->memoMode == MEMO_ADAPTIVE || usesBackreferences(prog))) {
+		/* Adaptive vectors are sized by |w|, and backreference memo keys reach back to the CGs */
+		logMsg(LOG_WARN, "The memo window needs a fixed memo selection and no backreferences; keeping the whole memo table");
+		prog->memoWindow = 0;
+	}
+	prog->statsMode = statsMode;
+	prog->statsAggregate = opts->aggregateStats;
+	Prog_determineMemoNodes(prog, opts->memoMode);
+	if (prog->memoEncoding == ENCODING_RLE_TUNED && opts->rleK <= 0)
+		Prog_determineVisitIntervals(prog);
+	logMsg(LOG_INFO, "Will memoize %d states", prog->nMemoizedStates);
+
+	if (shouldLog(LOG_DEBUG)) {
+		logMsg(LOG_INFO, "Compiled and memo-marked:");
+		printprog(prog);
+		printf("\n");
+	}
+}
+
+/* Parse, compile and prepare one Prog for opts, adding the time each phase took to times.
+ * countedLoops as _parsePattern; the Pike VM needs them expanded. */
+static Prog *
+_compileProg(const char *pattern, const memore_options *opts, int countedLoops, memore_compile_times *times)
+{
+	uint64_t startNS;
+	Regexp *re;
+	Prog *prog;
+	Arena arena;
+	int memoEncoding = opts->encoding;
+	int statsMode = opts->stats;
+
+	if (opts->memoMode == MEMO_NONE)
+		memoEncoding = ENCODING_NONE;
+	if (opts->engine == MEMORE_ENGINE_PIKE && opts->stats != STATS_NONE) {
+		logMsg(LOG_WARN, "The Pike VM keeps no statistics");
+		statsMode = STATS_NONE;
+	}
+
+	Arena_init(&arena);
+	setCompileArena(&arena);
+	re = _parsePattern(pattern, countedLoops, times);
+
+	// Compile
+	startNS = nowNS();
+	prog = compile(re, opts->memoMode, memoEncoding, NULL, 0, opts->rleK);
+	_prepareProg(prog, opts, memoEncoding, statsMode);
+	prog = Prog_pack(prog);
+	times->compileNS += nowNS() - startNS;
+	logMsg(LOG_INFO, "Compilation arena: %zu bytes", arena.nBytes);
+	setCompileArena(NULL);
+	Arena_free(&arena);
+	return prog;
+}
+
+/* Insts an expanded Prog may take for the DFA's sake. Its states are built lazily, but each is a set of Insts. */
+#ifndef MEMORE_DFA_MAX_EXPANSION
+#define MEMORE_DFA_MAX_EXPANSION 65536
+#endif
+
+/* The Prog for the DFA: prog itself if the DFA runs it. A counted loop only saves space, and the DFA
+ * answers match/no-match alone, so with counted loops it gets a Prog with them expanded, if that is not too large. */
+static Prog *
+_dfaProg(const char *pattern, const memore_options *opts, Prog *prog, memore_compile_times *times)
+{
+	memore_options dfaOpts;
+	long long expandedLen;
+	Arena arena;
+
+	if (DFA_supports(prog))
+		return prog;
+	if (opts->noDFA || !DFA_supportsExpanded(prog))
+		return NULL;
+
+	Arena_init(&arena);
+	setCompileArena(&arena);
+	expandedLen = expandedCount(_parsePattern(pattern, 1, NULL));
+	setCompileArena(NULL);
+	Arena_free(&arena);
+	if (expandedLen > MEMORE_DFA_MAX_EXPANSION) {
+		logMsg(LOG_INFO, "Counted loops would expand to about %lld Insts: no DFA", expandedLen);
+		return NULL;
+	}
+
+	dfaOpts = *opts;
+	dfaOpts.memoMode = MEMO_NONE;
+	dfaOpts.stats = STATS_NONE;
+	return _compileProg(pattern, &dfaOpts, 0, times);
+}
+
+/* A memore on compiled Progs; retryProg (if any) does opts.budgetRetry, or the full-memo retry in its place */
+static memore *
+_newMemore(const char *pattern, const memore_options *opts, Prog *prog, Prog *retryProg, memore_compile_times *times)
+{
+	memore *mre = mal(sizeof *mre);
+
+	mre->pattern = strdup(pattern);
+	mre->opts = *opts;
+	mre->prog = prog;
+	mre->dfaProg = _dfaProg(pattern, opts, prog, times);
+	mre->engine = opts->engine;
+	/* The statistics are the backtracker's, so keep it on every input when they are wanted */
+	mre->useDFA = prog->statsMode == STATS_NONE && !opts->noDFA && mre->dfaProg != NULL;
+	if (mre->useDFA)
+		logMsg(LOG_INFO, "Will use the DFA for match/no-match");
+	mre->retry = retryProg == NULL ? MEMORE_RETRY_NONE
+		: retryProg->memoMode == MEMO_FULL ? MEMORE_RETRY_MEMO_FULL : MEMORE_RETRY_PIKE;
+	mre->retryProg = retryProg;
+	mre->ctx = memore_ctx_create();
+	return mre;
+}
+
+memore *
+memore_compile_ex(const char *pattern, const memore_options *opts)
+{
+	memore_options retryOpts;
+	memore_compile_times times = { 0, 0, 0 };
+	Prog *prog, *retryProg = NULL;
+	memore *mre;
+	int retry;
+
+	prog = _compileProg(pattern, opts, opts->engine != MEMORE_ENGINE_PIKE, &times);
+	if (opts->engine == MEMORE_ENGINE_PIKE && usesBackreferences(prog))
+		fatal("The Pike VM does not support backreferences");
+
+	retry = opts->engine == MEMORE_ENGINE_BACKTRACK ? opts->budgetRetry : MEMORE_RETRY_NONE;
+	if (retry == MEMORE_RETRY_MEMO_FULL && opts->memoMode == MEMO_FULL) {
+		logMsg(LOG_WARN, "Already memoizing every vertex: no retry");
+		retry = MEMORE_RETRY_NONE;
+	}
+	if (retry == MEMORE_RETRY_PIKE && usesBackreferences(prog))
+		fatal("The Pike VM does not support backreferences");
+	/* The Pike VM runs counted loops expanded: a Prog of every copy, too large to build for a retry */
+	if (retry == MEMORE_RETRY_PIKE && prog->nCounters > 0) {
+		logMsg(LOG_WARN, "The Pike VM would need the counted loops expanded; retrying with the full memo table instead");
+		retry = opts->memoMode == MEMO_FULL ? MEMORE_RETRY_NONE : MEMORE_RETRY_MEMO_FULL;
+	}
+	if (retry != MEMORE_RETRY_NONE) {
+		/* Compiled now: memore_match may be called from many threads */
+		retryOpts = *opts;
+		if (retry == MEMORE_RETRY_MEMO_FULL) {
+			retryOpts.memoMode = MEMO_FULL;
+			if (retryOpts.encoding == ENCODING_NONE)
+				retryOpts.encoding = ENCODING_BITSET; /* A bit per <q, i>, not an int */
+		} else {
+			retryOpts.engine = MEMORE_ENGINE_PIKE;
+			retryOpts.memoMode = MEMO_NONE;
+			retryOpts.stats = STATS_NONE;
+		}
+		retryProg = _compileProg(pattern, &retryOpts, retryOpts.engine != MEMORE_ENGINE_PIKE, &times);
+	}
+	mre = _newMemore(pattern, opts, prog, retryProg, &times);
+	mre->compileTimes = times;
+	return mre;
+}
+
+memore_ctx *
+memore_ctx_create(void)
+{
+	memore_ctx *ctx = mal(sizeof *ctx);
+	ctx->match = MatchCtx_create();
+	return ctx;
+}
+
+void
+memore_ctx_free(memore_ctx *ctx)
+{
+	MatchCtx_free(ctx->match);
+	DFA_free(ctx->dfa);
+	DFA_free(ctx->scanner);
+	free(ctx);
+}
+
+static void
+_takeUsage(memore_usage *usage, const MatchUsage *from)
+{
+	usage->steps = from->steps;
+	usage->memoBytes = from->memoBytes;
+	usage->timeUS = from->timeUS;
+	usage->exceeded = from->exceeded;
+	usage->retried = 0;
+	usage->memoInitNS = from->memoInitNS;
+	usage->simNS = from->simNS;
+}
+
+/* The backtracker on mre->prog, and if it runs into the budget, mre->retryProg. As backtrackCtxFrom, into sub[MAXSUB]. */
+static int
+_backtrackRetrying(const memore *mre, memore_ctx *ctx, char *input, int len, int from, char **sub)
+{
+	uint64_t startNS;
+	int matched;
+
+	matched = backtrackCtxFrom(mre->prog, ctx->match, input, len, from, sub, MAXSUB);
+	_takeUsage(&ctx->usage, MatchCtx_usage(ctx->match));
+	if (matched != MATCH_BUDGET_EXCEEDED || mre->retry == MEMORE_RETRY_NONE)
+		return matched;
+
+	logMsg(LOG_INFO, "Budget exceeded; searching again with the %s", mre->retry == MEMORE_RETRY_PIKE ? "Pike VM" : "full memo table");
+	memset(sub, 0, MAXSUB * sizeof sub[0]);
+	if (mre->retry == MEMORE_RETRY_PIKE) {
+		startNS = nowNS();
+		matched = pikevmFrom(mre->retryProg, input, len, from, sub, MAXSUB);
+		memset(&ctx->usage, 0, sizeof ctx->usage);
+		ctx->usage.simNS = nowNS() - startNS;
+		ctx->usage.timeUS = ctx->usage.simNS / 1000;
+	} else {
+		matched = backtrackCtxFrom(mre->retryProg, ctx->match, input, len, from, sub, MAXSUB);
+		_takeUsage(&ctx->usage, MatchCtx_usage(ctx->match));
+	}
+	ctx->usage.retried = 1;
+	return matched;
+}
+
+int
+memore_match_ctx(const memore *mre, memore_ctx *ctx, const char *input, size_t len, const char **subs, int nsubs)
+{
+	char *sub[MAXSUB];
+	uint64_t startNS;
+	int i, matched;
+
+	if (nsubs > MAXSUB)
+		nsubs = MAXSUB;
+	memset(&ctx->usage, 0, sizeof ctx->usage);
+	/* Offsets into the input are ints throughout the engine, with one more for the end-of-input position */
+	if (len >= INT_MAX) {
+		logMsg(LOG_WARN, "memore_match: input of %zu bytes is too long", len);
+		for (i = 0; i < nsubs; i++)
+			subs[i] = NULL;
+		return MEMORE_TOO_LONG;
+	}
+
+	if (mre->useDFA) {
+		if (ctx->dfaProg != mre->dfaProg) {
+			DFA_free(ctx->dfa);
+			ctx->dfa = DFA_create(mre->dfaProg, DFA_MAX_STATES);
+			ctx->dfaProg = mre->dfaProg;
+		}
+		matched = DFA_match(ctx->dfa, (char *) input, (int) len);
+		if (!matched || nsubs == 0) {
+			for (i = 0; i < nsubs; i++)
+				subs[i] = NULL;
+			return matched;
+		}
+	}
+
+	memset(sub, 0, sizeof sub);
+	if (mre->engine == MEMORE_ENGINE_PIKE) {
+		startNS = nowNS();
+		matched = pikevm(mre->prog, (char *) input, (int) len, sub, nelem(sub));
+		ctx->usage.simNS = nowNS() - startNS;
+		ctx->usage.timeUS = ctx->usage.simNS / 1000;
+	} else
+		matched = _backtrackRetrying(mre, ctx, (char *) input, (int) len, 0, sub);
+	for (i = 0; i < nsubs; i++)
+		subs[i] = matched == 1 ? sub[i] : NULL;
+	return matched;
+}
+
+int
+memore_match(memore *mre, const char *input, size_t len, const char **subs, int nsubs)
+{
+	return memore_match_ctx(mre, mre->ctx, input, len, subs, nsubs);
+}
+
+/* A stream's window is [winStart, winEnd): no match starts before winStart, the offset where the scanner was
+ * last idle before the first match it saw, and the backtracker's choices from the starts up to that match
+ * are all made before winEnd, where the scanner is next idle. One byte before winStart is kept, for \b. */
+struct memore_stream
+{
+	memore *re;
+	DFA *scanner; /* NULL: keep the whole stream and match it at the end */
+	DState *state;
+	int phase; /* STREAM_* */
+	int matched;
+	long long pos; /* Bytes fed so far */
+	long long winStart;
+	long long winEnd;
+	long long offs[MAXSUB];
+
+	char *buf; /* The bytes from stream offset bufStart on */
+	long long bufStart;
+	size_t bufLen;
+	size_t bufCap;
+};
+
+enum /* memore_stream.phase */
+{
+	STREAM_SCAN, /* No match seen yet */
+	STREAM_TAIL, /* A match seen; looking for winEnd */
+	STREAM_DONE,
+};
+
+memore_stream *
+memore_stream_begin(memore *mre)
+{
+	memore_stream *st = mal(sizeof *st);
+
+	st->re = mre;
+	if (mre->dfaProg != NULL) {
+		st->scanner = mre->ctx->scanner;
+		mre->ctx->scanner = NULL;
+		if (st->scanner == NULL)
+			st->scanner = DFA_createScanner(mre->dfaProg, DFA_MAX_STATES);
+		st->state = DFA_start(st->scanner);
+	}
+	st->phase = STREAM_SCAN;
+	return st;
+}
+
+/* Keep the bytes of chunk (at stream offset pos, n of them) from the window's context byte on, dropping older ones */
+static void
+_streamKeep(memore_stream *st, const char *chunk, size_t n)
+{
+	long long keepFrom = st->winStart > 0 ? st->winStart - 1 : 0;
+	long long dead = keepFrom - st->bufStart;
+
+	/* Compact once the dead bytes are at least as many as the live ones, so each byte moves O(1) times */
+	if (dead > 0 && (size_t) dead >= st->bufLen) {
+		st->bufLen = 0;
+		st->bufStart = keepFrom;
+	} else if (dead > 0 && (size_t) dead >= st->bufLen - dead) {
+		memmove(st->buf, st->buf + dead, st->bufLen - dead);
+		st->bufLen -= dead;
+		st->bufStart = keepFrom;
+	}
+	if (keepFrom > st->pos) {
+		chunk += keepFrom - st->pos;
+		n -= keepFrom - st->pos;
+	}
+	if (st->bufLen + n > st->bufCap) {
+		st->bufCap = st->bufCap * 2 > st->bufLen + n ? st->bufCap * 2 : st->bufLen + n;
+		st->buf = realloc(st->buf, st->bufCap);
+		if (st->buf == NULL)
+			fatal("memore_stream: cannot keep %zu bytes", st->bufCap);
+	}
+	memcpy(st->buf + st->bufLen, chunk, n);
+	st->bufLen += n;
+}
+
+/* The captures: the backtracker on the window */
+static void
+_streamFinish(memore_stream *st)
+{
+	long long keepFrom = st->winStart > 0 ? st->winStart - 1 : 0;
+	char *window = st->bufLen > 0 ? st->buf + (keepFrom - st->bufStart) : (char *) "";
+	long long len = st->winEnd - keepFrom;
+	char *sub[MAXSUB];
+	int i;
+
+	st->phase = STREAM_DONE;
+	if (len >= INT_MAX) {
+		logMsg(LOG_WARN, "memore_stream: window of %lld bytes is too long", len);
+		st->matched = MEMORE_TOO_LONG;
+		return;
+	}
+	memset(sub, 0, sizeof sub);
+	memset(&st->re->ctx->usage, 0, sizeof st->re->ctx->usage);
+	st->matched = _backtrackRetrying(st->re, st->re->ctx, window, (int) len, (int) (st->winStart - keepFrom), sub);
+	/* The scanner saw a match in the window */
+	assert(st->matched || st->scanner == NULL);
+	for (i = 0; i < MAXSUB; i++)
+		st->offs[i] = st->matched == 1 && sub[i] != NULL ? keepFrom + (sub[i] - window) : -1;
+}
+
+int
+memore_stream_feed(memore_stream *st, const char *chunk, size_t len)
+{
+	size_t done;
+	int n, matched, idleAt;
+
+	if (st->phase == STREAM_DONE)
+		return 1;
+	if (st->scanner == NULL) {
+		_streamKeep(st, chunk, len);
+		st->pos += len;
+		return 0;
+	}
+
+	for (done = 0; done < len; done += n) {
+		n = len - done > INT_MAX ? INT_MAX : (int) (len - done);
+		matched = 0;
+		idleAt = -1;
+		n = DFA_scan(st->scanner, &st->state, chunk + done, n, st->phase == STREAM_TAIL, &matched, &idleAt);
+		if (idleAt >= 0)
+			st->winStart = st->pos + done + idleAt;
+		if (matched)
+			st->phase = STREAM_TAIL;
+		if (DFA_isIdle(st->state) && (st->phase == STREAM_TAIL || st->re->prog->bolAnchor)) {
+			/* Every thread has reached its end: either the window is complete, or (anchored) no match is left */
+			_streamKeep(st, chunk, done + n);
+			st->pos += done + n;
+			if (st->phase == STREAM_TAIL) {
+				st->winEnd = st->pos;
+				_streamFinish(st);
+			}
+			st->phase = STREAM_DONE;
+			return 1;
+		}
+	}
+	_streamKeep(st, chunk, len);
+	st->pos += len;
+	return 0;
+}
+
+int
+memore_stream_end(memore_stream *st, long long *offs, int noffs)
+{
+	int i, matched;
+
+	if (st->phase == STREAM_SCAN && st->scanner != NULL && DFA_scanEnd(st->scanner, st->state))
+		st->phase = STREAM_TAIL;
+	if (st->phase == STREAM_TAIL || (st->phase == STREAM_SCAN && st->scanner == NULL)) {
+		st->winEnd = st->pos;
+		_streamFinish(st);
+	}
+	for (i = 0; i < noffs && i < MAXSUB; i++)
+		offs[i] = st->matched == 1 ? st->offs[i] : -1;
+	matched = st->matched;
+
+	if (st->scanner != NULL) {
+		if (st->re->ctx->scanner == NULL)
+			st->re->ctx->scanner = st->scanner;
+		else
+			DFA_free(st->scanner);
+	}
+	free(st->buf);
+	free(st);
+	return matched;
+}
+
+struct memore_set
+{
+	Prog *prog;
+	memore_ctx *ctx;
+};
+
+memore_set *
+memore_set_compile(const char *const *patterns, int n, const memore_options *opts)
+{
+	memore_set *set;
+	Regexp **res;
+	Prog *prog;
+	Arena arena;
+	int i, memoEncoding = opts->encoding;
+
+	if (n < 1)
+		fatal("memore_set_compile: no patterns");
+	if (opts->memoMode == MEMO_NONE)
+		memoEncoding = ENCODING_NONE;
+	if (opts->engine != MEMORE_ENGINE_BACKTRACK)
+		logMsg(LOG_WARN, "A set is searched by the backtracker");
+	if (opts->budgetRetry != MEMORE_RETRY_NONE)
+		logMsg(LOG_WARN, "A set is not searched again on a budget");
+
+	Arena_init(&arena);
+	setCompileArena(&arena);
+	res = amal(n * sizeof res[0]);
+	for (i = 0; i < n; i++)
+		res[i] = _parsePattern(patterns[i], 1, NULL);
+	prog = compileSet(res, n, opts->memoMode, memoEncoding, opts->rleK);
+	_prepareProg(prog, opts, memoEncoding, opts->stats);
+	Prog_determineSetStarts(prog);
+	set = mal(sizeof *set);
+	set->prog = Prog_pack(prog);
+	logMsg(LOG_INFO, "Compilation arena: %zu bytes", arena.nBytes);
+	setCompileArena(NULL);
+	Arena_free(&arena);
+	set->ctx = memore_ctx_create();
+	return set;
+}
+
+int
+memore_set_match(memore_set *set, const char *input, size_t len, int *ids)
+{
+	int n;
+
+	if (len >= INT_MAX) {
+		logMsg(LOG_WARN, "memore_set_match: input of %zu bytes is too long", len);
+		return MEMORE_TOO_LONG;
+	}
+	n = backtrackSetCtx(set->prog, set->ctx->match, (char *) input, (int) len, ids);
+	_takeUsage(&set->ctx->usage, MatchCtx_usage(set->ctx->match));
+	return n;
+}
+
+void
+memore_set_last_usage(const memore_set *set, memore_usage *usage)
+{
+	*usage = set->ctx->usage;
+}
+
+void
+memore_set_print_stats(const memore_set *set)
+{
+	if (set->prog->statsMode != STATS_NONE)
+		printStatsTotals(set->prog, MatchCtx_totals(set->ctx->match));
+}
+
+void
+memore_set_free(memore_set *set)
+{
+	memore_ctx_free(set->ctx);
+	freeprog(set->prog);
+	free(set);
+}
+
+void
+memore_ctx_last_usage(const memore_ctx *ctx, memore_usage *usage)
+{
+	*usage = ctx->usage;
+}
+
+void
+memore_last_usage(const memore *mre, memore_usage *usage)
+{
+	memore_ctx_last_usage(mre->ctx, usage);
+}
+
+void
+memore_get_compile_times(const memore *mre, memore_compile_times *times)
+{
+	*times = mre->compileTimes;
+}
+
+void
+memore_ctx_print_stats(const memore *mre, const memore_ctx *ctx)
+{
+	if (mre->prog->statsMode != STATS_NONE)
+		printStatsTotals(mre->prog, MatchCtx_totals(ctx->match));
+}
+
+void
+memore_print_stats(const memore *mre)
+{
+	memore_ctx_print_stats(mre, mre->ctx);
+}
+
+void
+memore_merge_stats(memore *mre, const memore_ctx *ctx)
+{
+	MatchCtx_mergeTotals(mre->ctx->match, ctx->match);
+}
+
+void
+memore_free(memore *mre)
+{
+	memore_ctx_free(mre->ctx);
+	if (mre->dfaProg != NULL && mre->dfaProg != mre->prog)
+		freeprog(mre->dfaProg);
+	freeprog(mre->prog);
+	if (mre->retryProg != NULL)
+		freeprog(mre->retryProg);
+	free(mre->pattern);
+	free(mre);
+}
+
+/****** memore_save, memore_load and the pattern cache ********/
+
+#define MEMORE_FILE_MAGIC "memore02"
+
+/* What a compiled memore depends on: the cache's key. Fixed-width fields, widest first, so no padding. */
+typedef struct MemoreFileKey MemoreFileKey;
+struct MemoreFileKey
+{
+	uint64_t patternLen;
+	uint64_t memoBudget;
+	uint64_t maxSteps;
+	uint64_t maxMemoBytes;
+	uint64_t timeoutUS;
+	int32_t memoMode;
+	int32_t encoding;
+	int32_t rleK;
+	int32_t stats;
+	int32_t aggregateStats;
+	int32_t engine;
+	int32_t memoWindow;
+	int32_t budgetRetry;
+	int32_t noDFA;
+	int32_t pad; /* Zero */
+};
+
+/* memore_save's file: this, the pattern, then Prog_serialize's bytes for the Prog and for the retry Prog (if any) */
+typedef struct MemoreFile MemoreFile;
+struct MemoreFile
+{
+	char magic[8]; /* MEMORE_FILE_MAGIC */
+	MemoreFileKey key;
+	uint64_t progLen;
+	uint64_t retryProgLen; /* 0: no retry Prog */
+};
+
+static void
+_fileKey(MemoreFileKey *key, const char *pattern, const memore_options *opts)
+{
+	memset(key, 0, sizeof *key);
+	key->patternLen = strlen(pattern);
+	key->memoBudget = opts->memoBudget;
+	key->maxSteps = opts->maxSteps;
+	key->maxMemoBytes = opts->maxMemoBytes;
+	key->timeoutUS = opts->timeoutUS;
+	key->memoMode = opts->memoMode;
+	key->encoding = opts->encoding;
+	key->rleK = opts->rleK;
+	key->stats = opts->stats;
+	key->aggregateStats = opts->aggregateStats;
+	key->engine = opts->engine;
+	key->memoWindow = opts->memoWindow;
+	key->budgetRetry = opts->budgetRetry;
+	key->noDFA = opts->noDFA;
+}
+
+static void
+_keyOptions(const MemoreFileKey *key, memore_options *opts)
+{
+	memore_options_init(opts);
+	opts->memoBudget = key->memoBudget;
+	opts->maxSteps = key->maxSteps;
+	opts->maxMemoBytes = key->maxMemoBytes;
+	opts->timeoutUS = key->timeoutUS;
+	opts->memoMode = key->memoMode;
+	opts->encoding = key->encoding;
+	opts->rleK = key->rleK;
+	opts->stats = key->stats;
+	opts->aggregateStats = key->aggregateStats;
+	opts->engine = key->engine;
+	opts->memoWindow = key->memoWindow;
+	opts->budgetRetry = key->budgetRetry;
+	opts->noDFA = key->noDFA;
+}
+
+/* FNV-1a over the key and the pattern */
+static uint64_t
+_keyHash(const MemoreFileKey *key, const char *pattern)
+{
+	const unsigned char *b = (const unsigned char *) key;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < sizeof *key; i++)
+		h = (h ^ b[i]) * 0x100000001b3ULL;
+	for (b = (const unsigned char *) pattern; *b != '\0'; b++)
+		h = (h ^ *b) * 0x100000001b3ULL;
+	return h;
+}
+
+/* Write n bytes to fd, or return -1 */
+static int
+_writeAll(int fd, const void *buf, size_t n)
+{
+	const char *p = buf;
+	ssize_t k;
+
+	while (n > 0) {
+		k = write(fd, p, n);
+		if (k < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += k;
+		n -= k;
+	}
+	return 0;
+}
+
+int
+memore_save(const memore *mre, const char *path)
+{
+	MemoreFile file;
+	void *progBytes, *retryBytes = NULL;
+	size_t progLen, retryLen = 0;
+	char *tmp;
+	int fd, err, rc = -1;
+
+	memset(&file, 0, sizeof file);
+	memcpy(file.magic, MEMORE_FILE_MAGIC, sizeof file.magic);
+	_fileKey(&file.key, mre->pattern, &mre->opts);
+	progBytes = Prog_serialize(mre->prog, &progLen);
+	if (mre->retryProg != NULL)
+		retryBytes = Prog_serialize(mre->retryProg, &retryLen);
+	file.progLen = progLen;
+	file.retryProgLen = retryLen;
+
+	/* Into a temporary file and then into place, so that a reader sees the whole file or none of it */
+	tmp = mal(strlen(path) + 8);
+	sprintf(tmp, "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd >= 0) {
+		if (_writeAll(fd, &file, sizeof file) == 0 && _writeAll(fd, mre->pattern, file.key.patternLen) == 0
+		    && _writeAll(fd, progBytes, progLen) == 0 && _writeAll(fd, retryBytes, retryLen) == 0
+		    && fchmod(fd, 0644) == 0)
+			rc = 0;
+		err = errno;
+		if (close(fd) != 0 && rc == 0) {
+			err = errno;
+			rc = -1;
+		}
+		if (rc == 0 && rename(tmp, path) != 0) {
+			err = errno;
+			rc = -1;
+		}
+		if (rc != 0)
+			unlink(tmp);
+		errno = err;
+	}
+	free(tmp);
+	free(progBytes);
+	free(retryBytes);
+	return rc;
+}
+
+/* memore_load; with want, only a file saved from a memore compiled as want describes, from wantPattern */
+static memore *
+_load(const char *path, const MemoreFileKey *want, const char *wantPattern)
+{
+	MemoreFile file;
+	memore_options opts;
+	memore_compile_times times = { 0, 0, 0 }; /* A load's are zero */
+	Prog *prog = NULL, *retryProg = NULL;
+	struct stat st;
+	char *map, *at, *pattern;
+	memore *mre = NULL;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof file) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	memcpy(&file, map, sizeof file);
+	if (memcmp(file.magic, MEMORE_FILE_MAGIC, sizeof file.magic) != 0
+	    || file.key.patternLen > st.st_size - sizeof file
+	    || file.progLen > st.st_size - sizeof file - file.key.patternLen
+	    || file.retryProgLen != st.st_size - sizeof file - file.key.patternLen - file.progLen) {
+		logMsg(LOG_WARN, "memore_load: %s is not a memore_save file", path);
+		goto Done;
+	}
+	at = map + sizeof file;
+	if (want != NULL && (memcmp(&file.key, want, sizeof *want) != 0 || memcmp(at, wantPattern, want->patternLen) != 0)) {
+		logMsg(LOG_INFO, "memore_load: %s is for another pattern or options", path);
+		goto Done;
+	}
+	pattern = mal(file.key.patternLen + 1);
+	memcpy(pattern, at, file.key.patternLen);
+	at += file.key.patternLen;
+
+	prog = Prog_deserialize(at, file.progLen);
+	at += file.progLen;
+	if (file.retryProgLen > 0)
+		retryProg = Prog_deserialize(at, file.retryProgLen);
+	if (prog != NULL && (retryProg != NULL) == (file.retryProgLen > 0)) {
+		_keyOptions(&file.key, &opts);
+		/* A Prog with counted loops gets its expanded DFA Prog compiled again */
+		mre = _newMemore(pattern, &opts, prog, retryProg, &times);
+		logMsg(LOG_INFO, "memore_load: %s", path);
+	} else {
+		if (prog != NULL)
+			freeprog(prog);
+		if (retryProg != NULL)
+			freeprog(retryProg);
+	}
+	free(pattern);
+
+Done:
+	munmap(map, st.st_size);
+	return mre;
+}
+
+memore *
+memore_load(const char *path)
+{
+	return _load(path, NULL, NULL);
+}
+
+memore *
+memore_compile_cached(const char *pattern, const memore_options *opts, const char *cacheDir)
+{
+	MemoreFileKey key;
+	memore *mre;
+	char *path;
+
+	_fileKey(&key, pattern, opts);
+	path = mal(strlen(cacheDir) + 32);
+	sprintf(path, "%s/%016llx.memore", cacheDir, (unsigned long long) _keyHash(&key, pattern));
+
+	mre = _load(path, &key, pattern);
+	if (mre == NULL) {
+		mre = memore_compile_ex(pattern, opts);
+		if (memore_save(mre, path) != 0)
+			logMsg(LOG_WARN, "memore_compile_cached: cannot write %s: %s", path, strerror(errno));
+	}
+	free(path);
+	return mre;
+}
@@ -0,0 +1,214 @@
+// Copyright 2020 James C. Davis.  All Rights Reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef MEMORE_H
+#define MEMORE_H
+
+#include <stddef.h>
+
+/* libmemore: compile a regex once, match it many times.
+ *
+ *   memore *re = memore_compile("(a|a)*b", MEMORE_MEMO_FULL, MEMORE_ENCODING_BITSET);
+ *   const char *subs[MEMORE_MAXSUB];
+ *   if (memore_match(re, line, len, subs, MEMORE_MAXSUB)) ...
+ *   memore_free(re);
+ *
+ * A handle keeps its match scratch (backtracking stack, memo table, captures) between calls,
+ * so memore_match must not be called on one handle from two threads at once.
+ * To share one compiled regex across threads, give each thread a memore_ctx and use memore_match_ctx:
+ * the compiled program is read-only during matching, so no locks are needed.
+ *
+ * memore_compile itself is not thread-safe (the parser has globals); compile up front.
+ * Syntax errors are fatal, as they are for the re binary. */
+
+typedef struct memore memore;
+typedef struct memore_ctx memore_ctx;
+
+enum /* Memo.mode */
+{
+	MEMORE_MEMO_NONE,
+	MEMORE_MEMO_FULL,
+	MEMORE_MEMO_INDEG,
+	MEMORE_MEMO_LOOP,
+	MEMORE_MEMO_ADAPTIVE, /* INDEG and LOOP vertices, memoized only once the search keeps revisiting them */
+};
+
+enum /* Memo.encoding */
+{
+	MEMORE_ENCODING_NONE,
+	MEMORE_ENCODING_NEGATIVE,
+	MEMORE_ENCODING_RLE,
+	MEMORE_ENCODING_RLE_TUNED,
+	MEMORE_ENCODING_BITSET,
+};
+
+enum /* Prog.statsMode */
+{
+	MEMORE_STATS_VISITS,
+	MEMORE_STATS_SUMMARY,
+	MEMORE_STATS_NONE,
+};
+
+enum /* memore_options.engine: what extracts the captures */
+{
+	MEMORE_ENGINE_BACKTRACK, /* Memoized backtracking (default) */
+	MEMORE_ENGINE_PIKE,      /* Pike VM: O(|Q|) memory instead of a memo table; no backreferences, no statistics */
+};
+
+enum
+{
+	MEMORE_MAXSUB = 20 /* Start and end for \0 (the whole match) through \9 */
+};
+
+enum
+{
+	MEMORE_BUDGET_EXCEEDED = -1, /* A match's result when the search ran into a limit (memore_options.maxSteps, ...) */
+	MEMORE_TOO_LONG = -2 /* ... when the input (or a stream's match window) is INT_MAX bytes or more: too long to search at once */
+};
+
+enum /* memore_usage.exceeded: the limit the search ran into */
+{
+	MEMORE_BUDGET_OK,
+	MEMORE_BUDGET_STEPS,
+	MEMORE_BUDGET_MEMORY,
+	MEMORE_BUDGET_TIME,
+};
+
+enum /* memore_options.budgetRetry: what searches again when the backtracker runs into a limit */
+{
+	MEMORE_RETRY_NONE,
+	MEMORE_RETRY_MEMO_FULL, /* The backtracker with MEMORE_MEMO_FULL (no backreferences: steps linear in |w|), under the same limits */
+	MEMORE_RETRY_PIKE,      /* The Pike VM: linear time (quadratic with lookahead) and O(|Q|) memory, unbounded. No backreferences.
+	                         * With counted loops, MEMORE_RETRY_MEMO_FULL instead: the Pike VM would need them expanded. */
+};
+
+typedef struct memore_options memore_options;
+struct memore_options
+{
+	int memoMode; /* MEMORE_MEMO_* */
+	int encoding; /* MEMORE_ENCODING_* */
+	int rleK;     /* Run length for MEMORE_ENCODING_RLE_TUNED; 0 (the default) chooses one per vertex */
+	int stats;    /* MEMORE_STATS_*: JSON printed to stderr after each match */
+	int aggregateStats; /* Instead, sum the stats over all matches on a ctx; print them with memore_print_stats */
+	int engine;   /* MEMORE_ENGINE_* */
+	size_t memoBudget; /* MEMORE_MEMO_ADAPTIVE: bytes of bit vectors per match, after which hot vertices get RLE vectors. 0: no bound */
+	int memoWindow; /* Free memo entries behind the lowest offset left on the backtracking stack: memory for the live window, not |w|.
+	                 * Not with MEMORE_MEMO_ADAPTIVE or backreferences. */
+	/* Limits on each backtracking search, so that no one input can hold a thread; 0: no bound.
+	 * They are checked every MATCH_BUDGET_CHECK_STEPS (1024) steps. The DFA and the Pike VM are not bounded: they take linear time, the Pike VM quadratic with lookahead. */
+	unsigned long long maxSteps; /* Simulation steps */
+	size_t maxMemoBytes; /* Memo table bytes, as the statistics count them */
+	unsigned long long timeoutUS; /* Wall clock */
+	int budgetRetry; /* MEMORE_RETRY_*. Not for sets. */
+	int noDFA; /* Never answer with the lazy DFA alone: every match runs opts.engine, e.g. to measure it */
+};
+
+/* Defaults: no memoization, no statistics, the backtracker */
+void memore_options_init(memore_options *opts);
+
+memore *memore_compile(const char *pattern, int memoMode, int encoding);
+memore *memore_compile_ex(const char *pattern, const memore_options *opts);
+
+/* Returns 1 on a match and fills subs[0..nsubs) with pointers into input (NULL for unset groups).
+ * The input is the len bytes at input: it need not be NUL-terminated, and NULs in it are ordinary chars.
+ * Without stats, a regex with no backreferences or lookahead is matched by a lazy DFA in linear time;
+ * the backtracker runs only to fill subs for a match (nsubs > 0).
+ * Returns MEMORE_BUDGET_EXCEEDED (subs all NULL) if the search, and its retry if any, ran into a limit,
+ * and MEMORE_TOO_LONG (subs all NULL) for len >= INT_MAX; a memore_stream keeps only the window a match needs. */
+int memore_match(memore *re, const char *input, size_t len, const char **subs, int nsubs);
+
+/* Per-thread match scratch for memore_match_ctx */
+memore_ctx *memore_ctx_create(void);
+int memore_match_ctx(const memore *re, memore_ctx *ctx, const char *input, size_t len, const char **subs, int nsubs);
+void memore_ctx_free(memore_ctx *ctx);
+
+/* What the last match on re (or on ctx) spent: up to the limit if it ran into one (then with its statistics,
+ * under "budgetInfo", if they are on). After a retry, the retry's, with retried set. Zero if the DFA answered alone. */
+typedef struct memore_usage memore_usage;
+struct memore_usage
+{
+	unsigned long long steps;
+	size_t memoBytes;
+	unsigned long long timeUS;
+	int exceeded; /* MEMORE_BUDGET_* */
+	int retried;  /* The first search ran into a limit, and opts.budgetRetry searched again */
+	unsigned long long memoInitNS; /* The backtracker: getting its memo table ready for the input */
+	unsigned long long simNS; /* The search itself (the backtracker's or the Pike VM's), in nanoseconds */
+};
+
+void memore_last_usage(const memore *re, memore_usage *usage);
+void memore_ctx_last_usage(const memore_ctx *ctx, memore_usage *usage);
+
+/* Where compiling re took its time, in nanoseconds. Zero for a memore_load. */
+typedef struct memore_compile_times memore_compile_times;
+struct memore_compile_times
+{
+	unsigned long long parseNS;
+	unsigned long long transformNS;
+	unsigned long long compileNS; /* The Prog: compile, its passes (memo selection too) and packing, and any retry Prog */
+};
+
+void memore_get_compile_times(const memore *re, memore_compile_times *times);
+
+/* With opts.aggregateStats: print the totals so far for memore_match (or for one ctx) as JSON to stderr */
+void memore_print_stats(const memore *re);
+void memore_ctx_print_stats(const memore *re, const memore_ctx *ctx);
+/* Add ctx's totals to re's own, e.g. to report once over several threads */
+void memore_merge_stats(memore *re, const memore_ctx *ctx);
+
+/* Streaming: match a stream that arrives in chunks, without holding all of it.
+ *
+ *   memore_stream *st = memore_stream_begin(re);
+ *   while ((n = read(fd, buf, sizeof buf)) > 0 && !memore_stream_feed(st, buf, n))
+ *     ;
+ *   long long offs[MEMORE_MAXSUB];
+ *   if (memore_stream_end(st, offs, MEMORE_MAXSUB)) ...
+ *
+ * The answer is memore_match's on the whole stream, with offsets from the start of the stream.
+ * Without backreferences or lookahead, a lazy DFA follows the stream, and the stream keeps only the bytes
+ * since no partial match was last live, e.g. since the last line break for a regex that does not cross lines.
+ * Once a match is certain, the backtracker finds its captures in that window.
+ * Otherwise the whole stream is kept and matched at the end.
+ * The captures use re's match scratch, as memore_match does. */
+typedef struct memore_stream memore_stream;
+
+memore_stream *memore_stream_begin(memore *re);
+/* Returns 1 once the answer is known: the rest of the stream is not needed */
+int memore_stream_feed(memore_stream *st, const char *chunk, size_t len);
+/* Frees st. Returns 1 on a match and fills offs[0..noffs) with the stream offsets of each CG's start and end
+ * (-1 for unset groups). Or, as memore_match, MEMORE_BUDGET_EXCEEDED or (for a window of INT_MAX bytes or more) MEMORE_TOO_LONG. */
+int memore_stream_end(memore_stream *st, long long *offs, int noffs);
+
+void memore_free(memore *re);
+
+/* Saving a compiled regex: its memo-annotated program, so a load skips parsing, compiling and memo selection.
+ * (Not quite for counted loops: the lazy DFA's Prog, with them expanded, is compiled again.)
+ * A file is for the machine and build that wrote it; memore_load returns NULL for any other file.
+ * Loading checks the file's structure, not that its program is one compile could produce: load only files memore_save wrote.
+ * memore_save returns 0, or -1 with errno set. It writes a temporary file and renames it into place. */
+int memore_save(const memore *re, const char *path);
+memore *memore_load(const char *path);
+/* As memore_compile_ex, through cacheDir: keyed on the pattern and opts, loaded if there, saved if not */
+memore *memore_compile_cached(const char *pattern, const memore_options *opts, const char *cacheDir);
+
+/* A RegexSet: n patterns compiled into one program, searched once per input with one memo table,
+ * so a <vertex, offset> pair is explored once for the whole set, and one literal prefilter.
+ *
+ *   memore_set *set = memore_set_compile(rules, nRules, &opts);
+ *   int ids[nRules];
+ *   int k = memore_set_match(set, line, len, ids);  // ids[0..k): the rules that match, ascending
+ *
+ * Pattern i matches iff memore_match would match it alone. No captures; opts.engine is ignored.
+ * Like a memore, a set keeps match scratch: one memore_set_match at a time. */
+typedef struct memore_set memore_set;
+
+memore_set *memore_set_compile(const char *const *patterns, int n, const memore_options *opts);
+/* Fills ids (room for n) with the indices of the matching patterns, ascending; returns how many, or MEMORE_BUDGET_EXCEEDED or MEMORE_TOO_LONG */
+int memore_set_match(memore_set *set, const char *input, size_t len, int *ids);
+/* With opts.aggregateStats, as memore_print_stats */
+void memore_set_print_stats(const memore_set *set);
+void memore_set_last_usage(const memore_set *set, memore_usage *usage);
+void memore_set_free(memore_set *set);
+
+#endif /* MEMORE_H */
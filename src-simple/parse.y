@@ -488,7 +488,6 @@ charRangeChar:
 static char *input;
 static Regexp *parsed_regexp;
 static int nparen;
-int gen;
 
 static int
 yylex(void)
@@ -535,6 +534,11 @@ startsWithAnchor(Regexp *r)
 			else
 				return 0;
 		case Alt:
+			/* Both branches must be anchored */
+			if (!startsWithAnchor(curr->right))
+				return 0;
+			curr = curr->left;
+			break;
 		case Cat:
 				curr = curr->left;
 				break;
@@ -643,24 +647,24 @@ parse(char *s)
 	if(parsed_regexp == nil)
 		yyerror("parser nil");
 	
-	logMsg(LOG_INFO, "parsed_regexp\n"); 
-	printre(parsed_regexp);
-	printf("\n");
+	if (shouldLog(LOG_INFO)) {
+		logMsg(LOG_INFO, "parsed_regexp\n");
+		printre(parsed_regexp);
+		printf("\n");
+	}
 		
 	r = reg(Paren, parsed_regexp, nil);	// $0 parens
 
-	/* Tack on the dotstars */
+	/* Tack on the trailing dotstar.
+	 * No leading one: unless the regex starts with an anchor, the backtracker tries each start in turn (Prog.bolAnchor). */
 	combine = r;
-	/* This is imperfect, e.g. (^...), but it should cover most regexes. */
+	/* This is imperfect, e.g. (^...), but a miss only costs us the search over later starts. */
 	logMsg(LOG_INFO, "parsed_regexp type %d\n", parsed_regexp->type);
 	int startAnchor = startsWithAnchor(parsed_regexp);
 	if (startAnchor) {
 		logMsg(LOG_INFO, "Starts with anchor\n");
 	} else {
-		logMsg(LOG_INFO, "No ^, tacking on leading .*");
-		Regexp *bolDotstar = reg(Star, reg(Dot, nil, nil), nil);
-		bolDotstar->n = 1;	// non-greedy
-		combine = reg(Cat, bolDotstar, combine);
+		logMsg(LOG_INFO, "No ^, unanchored search");
 	}
 
 	int endAnchor = endsWithAnchor(parsed_regexp);
@@ -672,7 +676,7 @@ parse(char *s)
 		eolDotstar->n = 1;	// non-greedy
 		combine = reg(Cat, combine, eolDotstar);
 	}
-	combine->bolAnchor = parsed_regexp->bolAnchor;
+	combine->bolAnchor = startAnchor;
 	combine->eolAnchor = parsed_regexp->eolAnchor;
 
 	return combine;
@@ -3,133 +3,316 @@
 // license that can be found in the LICENSE file.
 
 #include "regexp.h"
+#include "log.h"
+
+/* Threads are run in lockstep over the input, in the backtracker's priority order,
+ * so the first thread to reach Match has backtrack()'s submatches.
+ * At most one thread per position (an Inst, or for a String, an offset into it): O(|Q|) memory.
+ * Backreferences are not supported.
+ * A lookahead is a sub-simulation from each position a thread reaches it at, which may run to the end of the input:
+ * with lookahead the time is O(|Q| |w|^2), not linear. */
 
 typedef struct Thread Thread;
 struct Thread
 {
 	Inst *pc;
-	Sub *sub;
+	int off; /* String: bytes matched so far */
+	int pos; /* Position of <pc, off> */
+	Sub *sub; /* nil for the Insts addthread has already followed */
 };
 
+/* A sparse set of positions: pos is on the list iff t[sparse[pos]].pos == pos */
 typedef struct ThreadList ThreadList;
 struct ThreadList
 {
 	int n;
+	int *sparse;
 	Thread t[1];
 };
 
 static Thread
-thread(Inst *pc, Sub *sub)
+thread(Inst *pc, int off, Sub *sub)
 {
-	Thread t = {pc, sub};
+	Thread t = {pc, off, 0, sub};
 	return t;
 }
 
+/* Per-match state, so that one Prog can be simulated by many threads at once */
+typedef struct PikeCtx PikeCtx;
+struct PikeCtx
+{
+	Prog *prog;
+	char *input;
+	char *inputEOL;
+	SubPool subs;
+	int nPos;
+	int *instPos; /* Inst number -> its first position */
+	Thread *stack; /* addthread's, so its depth is not the C stack's */
+	int nStack;
+	int maxStack;
+};
+
 static ThreadList*
-threadlist(int n)
+threadlist(PikeCtx *ctx)
+{
+	ThreadList *l = mal(sizeof(ThreadList)+ctx->nPos*sizeof(Thread));
+	l->sparse = mal(ctx->nPos * sizeof l->sparse[0]);
+	return l;
+}
+
+static void
+freethreadlist(PikeCtx *ctx, ThreadList *l)
 {
-	return mal(sizeof(ThreadList)+n*sizeof(Thread));
+	int i;
+
+	for(i=0; i<l->n; i++)
+		if(l->t[i].sub != nil)
+			decref(&ctx->subs, l->t[i].sub);
+	free(l->sparse);
+	free(l);
 }
 
+static Sub *pikerun(PikeCtx*, Inst*, char*, Sub*, int);
+
 static void
-addthread(ThreadList *l, Thread t, char *sp)
+pushthread(PikeCtx *ctx, Thread t)
 {
-	if(t.pc->gen == gen) {
-		decref(t.sub);
-		return;	// already on list
+	Thread *stack;
+
+	if(ctx->nStack == ctx->maxStack) {
+		ctx->maxStack *= 2;
+		stack = mal(ctx->maxStack * sizeof stack[0]);
+		memcpy(stack, ctx->stack, ctx->nStack * sizeof stack[0]);
+		free(ctx->stack);
+		ctx->stack = stack;
 	}
-	t.pc->gen = gen;
-	
-	switch(t.pc->opcode) {
-	default:
-		l->t[l->n] = t;
-		l->n++;
-		break;
-	case Jmp:
-		addthread(l, thread(t.pc->x, t.sub), sp);
-		break;
-	case Split:
-		addthread(l, thread(t.pc->x, incref(t.sub)), sp);
-		addthread(l, thread(t.pc->y, t.sub), sp);
-		break;
-	case Save:
-		addthread(l, thread(t.pc+1, update(t.sub, t.pc->n, sp)), sp);
-		break;
+	ctx->stack[ctx->nStack++] = t;
+}
+
+/* Add t, and the threads its zero-width edges lead to, to l in priority order.
+ * The edges are followed depth-first from an explicit stack: the higher-priority edge is pushed last.
+ * A lookahead's sub-simulation uses the stack above this call's part of it. */
+static void
+addthread(PikeCtx *ctx, ThreadList *l, Thread t, char *sp)
+{
+	Thread *lt;
+	Inst *pc;
+	Sub *sub;
+	int i, pos, base;
+
+	base = ctx->nStack;
+	pushthread(ctx, t);
+	while(ctx->nStack > base) {
+		t = ctx->stack[--ctx->nStack];
+		pos = ctx->instPos[t.pc - ctx->prog->start] + t.off;
+		if(l->sparse[pos] < l->n && l->t[l->sparse[pos]].pos == pos) {
+			decref(&ctx->subs, t.sub);
+			continue;	// already on list
+		}
+		l->sparse[pos] = l->n;
+		lt = &l->t[l->n++];
+		*lt = t;
+		lt->pos = pos;
+		if(t.off > 0)
+			continue;	// partway through a String
+
+		pc = t.pc;
+		sub = t.sub;
+		switch(pc->opcode) {
+		default:
+			break;
+		case Jmp:
+			lt->sub = nil;
+			pushthread(ctx, thread(pc->x, 0, sub));
+			break;
+		case Split:
+			lt->sub = nil;
+			pushthread(ctx, thread(pc->y, 0, sub));
+			pushthread(ctx, thread(pc->x, 0, incref(sub)));
+			break;
+		case SplitMany:
+			// backtrack() tries edges[0], then the others from the last down: push edges[1] first
+			lt->sub = nil;
+			for(i=1; i<pc->n; i++)
+				pushthread(ctx, thread(pc->edges[i], 0, incref(sub)));
+			pushthread(ctx, thread(pc->edges[0], 0, sub));
+			break;
+		case Save:
+			lt->sub = nil;
+			pushthread(ctx, thread(pc+1, 0, update(&ctx->subs, sub, pc->n, sp)));
+			break;
+		case InlineZeroWidthAssertion:
+			lt->sub = nil;
+			if(testInlineZeroWidthAssertion(pc, sp, sp == ctx->input, sp == ctx->inputEOL))
+				pushthread(ctx, thread(pc+1, 0, sub));
+			else
+				decref(&ctx->subs, sub);
+			break;
+		case RecursiveZeroWidthAssertion:
+			// Lookahead: a sub-simulation from here to its RecursiveMatch. Like backtrack()'s, it keeps the first way through.
+			lt->sub = nil;
+			sub = pikerun(ctx, pc+1, sp, sub, 1);
+			if(sub != nil) {
+				while(pc->opcode != RecursiveMatch)
+					pc++;
+				pushthread(ctx, thread(pc+1, 0, sub));
+			}
+			break;
+		}
 	}
 }
 
-int
-pikevm(Prog *prog, char *input, char **subp, int nsubp)
+/* Run from start at sp0 until the highest-priority thread reaches Match (RecursiveMatch for a lookahead).
+ * Takes sub's reference. Returns the winner's Sub, or nil. */
+static Sub*
+pikerun(PikeCtx *ctx, Inst *start, char *sp0, Sub *sub, int lookahead)
 {
-	int i, len;
+	Prog *prog = ctx->prog;
+	char *inputEOL = ctx->inputEOL;
 	ThreadList *clist, *nlist, *tmp;
 	Inst *pc;
+	Sub *matched, *s;
 	char *sp;
-	Sub *sub, *matched;
-	
-	matched = nil;	
-	for(i=0; i<nsubp; i++)
-		subp[i] = nil;
-	sub = newsub(nsubp, input);
-	for(i=0; i<nsubp; i++)
-		sub->sub[i] = nil;
+	int i, j, final;
 
-	len = prog->len;
-	clist = threadlist(len);
-	nlist = threadlist(len);
-	
-	gen++;
-	addthread(clist, thread(prog->start, sub), input);
-	matched = 0;
-	for(sp=input;; sp++) {
+	final = lookahead ? RecursiveMatch : Match;
+	matched = nil;
+	clist = threadlist(ctx);
+	nlist = threadlist(ctx);
+
+	addthread(ctx, clist, thread(start, 0, sub), sp0);
+	for(sp=sp0;; sp++) {
+		// Unanchored: a match may also begin here, at the lowest priority
+		if(!lookahead && !prog->bolAnchor && matched == nil && sp > sp0) {
+			s = newsub(&ctx->subs, MAXSUB, ctx->input);
+			for(i=0; i<MAXSUB; i++)
+				s->sub[i] = nil;
+			addthread(ctx, clist, thread(prog->start, 0, s), sp);
+		}
 		if(clist->n == 0)
 			break;
-		// printf("%d(%02x).", (int)(sp - input), *sp & 0xFF);
-		gen++;
 		for(i=0; i<clist->n; i++) {
 			pc = clist->t[i].pc;
-			sub = clist->t[i].sub;
-			// printf(" %d", (int)(pc - prog->start));
+			s = clist->t[i].sub;
+			if(s == nil)
+				continue;	// Jmp, Split, ...: followed by addthread
+			clist->t[i].sub = nil;
+			if(clist->t[i].off > 0 || pc->opcode == String) {
+				j = clist->t[i].off;
+				if(sp == inputEOL || *sp != pc->str[j]) {
+					decref(&ctx->subs, s);
+				} else if(j+1 < pc->n) {
+					addthread(ctx, nlist, thread(pc, j+1, s), sp+1);
+				} else {
+					addthread(ctx, nlist, thread(pc+1, 0, s), sp+1);
+				}
+				continue;
+			}
 			switch(pc->opcode) {
 			case Char:
-				if(*sp != pc->c) {
-					decref(sub);
+				if(sp == inputEOL || *sp != pc->c) {
+					decref(&ctx->subs, s);
 					break;
 				}
+				addthread(ctx, nlist, thread(pc+1, 0, s), sp+1);
+				break;
 			case Any:
-				if(*sp == 0) {
-					decref(sub);
+				if(sp == inputEOL || *sp == '\n' || *sp == '\r') {
+					decref(&ctx->subs, s);
+					break;
+				}
+				addthread(ctx, nlist, thread(pc+1, 0, s), sp+1);
+				break;
+			case CharClass:
+				if(sp == inputEOL || !CCMAP_HAS(pc->ccMap, *sp)) {
+					decref(&ctx->subs, s);
 					break;
 				}
-				addthread(nlist, thread(pc+1, sub), sp+1);
+				addthread(ctx, nlist, thread(pc+1, 0, s), sp+1);
 				break;
 			case Match:
+			case RecursiveMatch:
+				if(pc->opcode != final || (final == Match && prog->eolAnchor && sp != inputEOL)) {
+					decref(&ctx->subs, s);
+					break;
+				}
+				// Threads after this one have lower priority
 				if(matched)
-					decref(matched);
-				matched = sub;
-				for(i++; i < clist->n; i++)
-					decref(clist->t[i].sub);
+					decref(&ctx->subs, matched);
+				matched = s;
+				for(i++; i < clist->n; i++) {
+					if(clist->t[i].sub != nil)
+						decref(&ctx->subs, clist->t[i].sub);
+					clist->t[i].sub = nil;
+				}
 				goto BreakFor;
-			// Jmp, Split, Save handled in addthread, so that
-			// machine execution matches what a backtracker would do.
-			// This is discussed (but not shown as code) in
-			// Regular Expression Matching: the Virtual Machine Approach.
+			default:
+				fatal("pikevm: unsupported opcode %d", pc->opcode);
 			}
 		}
 	BreakFor:
-		// printf("\n");
 		tmp = clist;
 		clist = nlist;
 		nlist = tmp;
 		nlist->n = 0;
-		if(*sp == '\0')
+		if(sp == inputEOL)
 			break;
 	}
+	freethreadlist(ctx, clist);
+	freethreadlist(ctx, nlist);
+	return matched;
+}
+
+int
+pikevm(Prog *prog, char *input, int inputLen, char **subp, int nsubp)
+{
+	return pikevmFrom(prog, input, inputLen, 0, subp, nsubp);
+}
+
+int
+pikevmFrom(Prog *prog, char *input, int inputLen, int from, char **subp, int nsubp)
+{
+	int i, nsub;
+	Sub *sub, *matched;
+	PikeCtx ctx;
+
+	if(usesBackreferences(prog))
+		fatal("pikevm: backreferences are not supported");
+	if(prog->nCounters > 0)
+		fatal("pikevm: counted loops are not supported (compile with countedLoops off)");
+
+	for(i=0; i<nsubp; i++)
+		subp[i] = nil;
+	if(prog->bolAnchor && from > 0)
+		return 0;
+	ctx.prog = prog;
+	ctx.input = input;
+	ctx.inputEOL = input + inputLen;
+	SubPool_init(&ctx.subs);
+	ctx.instPos = mal((prog->len + 1) * sizeof ctx.instPos[0]);
+	ctx.nPos = 0;
+	for(i=0; i<prog->len; i++) {
+		ctx.instPos[i] = ctx.nPos;
+		ctx.nPos += prog->start[i].opcode == String ? prog->start[i].n : 1;
+	}
+	ctx.instPos[prog->len] = ctx.nPos;
+	ctx.maxStack = prog->len + 1;
+	ctx.stack = mal(ctx.maxStack * sizeof ctx.stack[0]);
+	ctx.nStack = 0;
+
+	nsub = MAXSUB;
+	sub = newsub(&ctx.subs, nsub, input);
+	for(i=0; i<nsub; i++)
+		sub->sub[i] = nil;
+
+	matched = pikerun(&ctx, prog->start, input + from, sub, 0);
 	if(matched) {
-		for(i=0; i<nsubp; i++)
+		for(i=0; i<nsubp && i<nsub; i++)
 			subp[i] = matched->sub[i];
-		decref(matched);
-		return 1;
+		decref(&ctx.subs, matched);
 	}
-	return 0;
+	free(ctx.instPos);
+	free(ctx.stack);
+	SubPool_destroy(&ctx.subs);
+	return matched != nil;
 }
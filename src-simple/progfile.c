@@ -0,0 +1,322 @@
+// Copyright 2020 James C. Davis.  All Rights Reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "regexp.h"
+#include "memoize.h"
+#include "log.h"
+
+/* A Prog as bytes: the header, the Prog's own fields, then each Inst with its memo annotations.
+ * Insts name each other by index (-1 for none). A SplitMany's edges and a String's bytes follow the Inst;
+ * so does a CharClass's byte map, unless it is a built-in class, which is named by its escape.
+ * Ints are 32 bits and sizes 64 bits, in host byte order: the file is for the machine that wrote it. */
+
+#define PROG_FILE_MAGIC "memoprog"
+#define PROG_FILE_VERSION 1
+#define PROG_FILE_BYTE_ORDER 0x01020304
+
+typedef struct ProgWriter ProgWriter;
+struct ProgWriter
+{
+	char *buf;
+	size_t len;
+	size_t cap;
+};
+
+static void
+_put(ProgWriter *w, const void *bytes, size_t n)
+{
+	if (w->len + n > w->cap) {
+		w->cap = w->cap * 2 > w->len + n ? w->cap * 2 : w->len + n;
+		w->buf = realloc(w->buf, w->cap);
+		if (w->buf == NULL)
+			fatal("Prog_serialize: out of memory");
+	}
+	memcpy(w->buf + w->len, bytes, n);
+	w->len += n;
+}
+
+static void
+_put32(ProgWriter *w, int32_t v)
+{
+	_put(w, &v, sizeof v);
+}
+
+static void
+_put64(ProgWriter *w, uint64_t v)
+{
+	_put(w, &v, sizeof v);
+}
+
+/* Reads past the end, or values out of range, set bad; the caller checks once at the end of each part */
+typedef struct ProgReader ProgReader;
+struct ProgReader
+{
+	const char *at;
+	const char *end;
+	int bad;
+};
+
+static const char *
+_get(ProgReader *r, size_t n)
+{
+	const char *p = r->at;
+
+	if ((size_t) (r->end - r->at) < n) {
+		r->bad = 1;
+		return NULL;
+	}
+	r->at += n;
+	return p;
+}
+
+static int32_t
+_get32(ProgReader *r)
+{
+	int32_t v = 0;
+	const char *p = _get(r, sizeof v);
+
+	if (p != NULL)
+		memcpy(&v, p, sizeof v);
+	return v;
+}
+
+static uint64_t
+_get64(ProgReader *r)
+{
+	uint64_t v = 0;
+	const char *p = _get(r, sizeof v);
+
+	if (p != NULL)
+		memcpy(&v, p, sizeof v);
+	return v;
+}
+
+/* lo <= v < hi, or the reader goes bad */
+static int32_t
+_getIn(ProgReader *r, int32_t lo, int32_t hi)
+{
+	int32_t v = _get32(r);
+
+	if (v < lo || v >= hi) {
+		r->bad = 1;
+		return lo;
+	}
+	return v;
+}
+
+#define EDGE_NUM(p, e) ((e) != NULL ? INST_NUM(p, e) : -1)
+
+void *
+Prog_serialize(Prog *p, size_t *len)
+{
+	ProgWriter w = { NULL, 0, 0 };
+	InstInfoForMemoSelPolicy *info;
+	int i, j, nSetStarts;
+	Inst *pc;
+
+	_put(&w, PROG_FILE_MAGIC, 8);
+	_put32(&w, PROG_FILE_VERSION);
+	_put32(&w, PROG_FILE_BYTE_ORDER);
+
+	nSetStarts = p->setStarts != NULL ? p->setStartsAt[257] : 0;
+	_put32(&w, p->len);
+	_put32(&w, p->memoMode);
+	_put32(&w, p->memoEncoding);
+	_put32(&w, p->nMemoizedStates);
+	_put64(&w, p->memoBudgetBytes);
+	_put32(&w, p->memoWindow);
+	_put64(&w, p->budget.maxSteps);
+	_put64(&w, p->budget.maxMemoBytes);
+	_put64(&w, p->budget.timeoutUS);
+	_put32(&w, p->eolAnchor);
+	_put32(&w, p->bolAnchor);
+	_put32(&w, p->statsMode);
+	_put32(&w, p->statsAggregate);
+	_put32(&w, p->nCounters);
+	_put32(&w, p->litPrefixLen);
+	_put(&w, p->litPrefix, p->litPrefixLen);
+	_put32(&w, p->litRequiredLen);
+	_put(&w, p->litRequired, p->litRequiredLen);
+	_put32(&w, p->nBackrefCGs);
+	for (i = 0; i < p->nBackrefCGs; i++)
+		_put32(&w, p->backrefCGs[i]);
+	_put32(&w, p->nPatterns);
+	for (i = 0; i < p->nPatterns; i++) {
+		_put32(&w, p->patterns[i].litRequiredLen);
+		_put(&w, p->patterns[i].litRequired, p->patterns[i].litRequiredLen);
+	}
+	_put32(&w, nSetStarts);
+	if (nSetStarts > 0) {
+		for (i = 0; i < (int) nelem(p->setStartsAt); i++)
+			_put32(&w, p->setStartsAt[i]);
+		for (i = 0; i < nSetStarts; i++)
+			_put32(&w, p->setStarts[i]);
+	}
+
+	for (i = 0, pc = p->start; i < p->len; i++, pc++) {
+		_put32(&w, pc->opcode);
+		_put32(&w, pc->c);
+		_put32(&w, pc->n);
+		_put32(&w, pc->memoStateNum);
+		_put32(&w, EDGE_NUM(p, pc->x));
+		switch (pc->opcode) {
+		case Split:
+		case CountLoop:
+			_put32(&w, EDGE_NUM(p, pc->y));
+			break;
+		case SplitMany:
+			for (j = 0; j < pc->n; j++)
+				_put32(&w, INST_NUM(p, pc->edges[j]));
+			break;
+		case String:
+			_put(&w, pc->str, pc->n);
+			break;
+		case CharClass:
+			_put32(&w, CharClassMap_builtinEscape(pc->ccMap));
+			if (CharClassMap_builtinEscape(pc->ccMap) == 0)
+				_put(&w, pc->ccMap, sizeof *pc->ccMap);
+			break;
+		}
+		info = &p->aux[i].memoInfo;
+		_put32(&w, info->shouldMemo);
+		_put32(&w, info->inDegree);
+		_put32(&w, info->isAncestorLoopDestination);
+		_put32(&w, info->liveBackrefs);
+		_put32(&w, info->visitInterval);
+	}
+
+	logMsg(LOG_INFO, "Serialized the Prog into %zu bytes", w.len);
+	*len = w.len;
+	return w.buf;
+}
+
+Prog *
+Prog_deserialize(const void *buf, size_t len)
+{
+	ProgReader r = { buf, (const char *) buf + len, 0 };
+	InstInfoForMemoSelPolicy *info;
+	int i, j, nSetStarts, ch;
+	const char *bytes;
+	Arena arena;
+	Prog *p, *packed = NULL;
+	Inst *pc;
+
+	bytes = _get(&r, 8);
+	if (r.bad || memcmp(bytes, PROG_FILE_MAGIC, 8) != 0 || _get32(&r) != PROG_FILE_VERSION || _get32(&r) != PROG_FILE_BYTE_ORDER) {
+		logMsg(LOG_WARN, "Prog_deserialize: not a Prog of this version");
+		return NULL;
+	}
+
+	/* An unpacked Prog in an arena, for Prog_pack to lay out as compile's are */
+	Arena_init(&arena);
+	p = Arena_alloc(&arena, sizeof *p);
+	p->len = _getIn(&r, 1, INT32_MAX / 2);
+	p->memoMode = _getIn(&r, MEMO_NONE, MEMO_ADAPTIVE + 1);
+	p->memoEncoding = _getIn(&r, ENCODING_NONE, ENCODING_BITSET + 1);
+	p->nMemoizedStates = _getIn(&r, 0, p->len + 1);
+	p->memoBudgetBytes = _get64(&r);
+	p->memoWindow = _get32(&r);
+	p->budget.maxSteps = _get64(&r);
+	p->budget.maxMemoBytes = _get64(&r);
+	p->budget.timeoutUS = _get64(&r);
+	p->eolAnchor = _get32(&r);
+	p->bolAnchor = _get32(&r);
+	p->statsMode = _getIn(&r, STATS_VISITS, STATS_NONE + 1);
+	p->statsAggregate = _get32(&r);
+	p->nCounters = _getIn(&r, 0, MAXCOUNT + 1);
+	p->litPrefixLen = _getIn(&r, 0, PROG_MAX_LITERAL + 1);
+	if ((bytes = _get(&r, p->litPrefixLen)) != NULL)
+		memcpy(p->litPrefix, bytes, p->litPrefixLen);
+	p->litRequiredLen = _getIn(&r, 0, PROG_MAX_LITERAL + 1);
+	if ((bytes = _get(&r, p->litRequiredLen)) != NULL)
+		memcpy(p->litRequired, bytes, p->litRequiredLen);
+	p->nBackrefCGs = _getIn(&r, 0, MAXSUB/2 + 1);
+	for (i = 0; i < p->nBackrefCGs; i++)
+		p->backrefCGs[i] = _getIn(&r, 0, MAXSUB/2);
+	p->nPatterns = _getIn(&r, 0, p->len + 1);
+	if (r.bad)
+		goto Bad;
+	if (p->nPatterns > 0) {
+		p->patterns = Arena_alloc(&arena, p->nPatterns * sizeof p->patterns[0]);
+		for (i = 0; i < p->nPatterns; i++) {
+			p->patterns[i].litRequiredLen = _getIn(&r, 0, PROG_MAX_LITERAL + 1);
+			if ((bytes = _get(&r, p->patterns[i].litRequiredLen)) != NULL)
+				memcpy(p->patterns[i].litRequired, bytes, p->patterns[i].litRequiredLen);
+		}
+	}
+	nSetStarts = _getIn(&r, 0, INT32_MAX / 2);
+	if (nSetStarts > 0) {
+		for (i = 0; i < (int) nelem(p->setStartsAt); i++)
+			p->setStartsAt[i] = _getIn(&r, 0, nSetStarts + 1);
+		if (r.bad || p->setStartsAt[257] != nSetStarts)
+			goto Bad;
+		p->setStarts = Arena_alloc(&arena, nSetStarts * sizeof p->setStarts[0]);
+		for (i = 0; i < nSetStarts; i++)
+			p->setStarts[i] = _getIn(&r, 0, p->nPatterns);
+	}
+	if (r.bad)
+		goto Bad;
+
+	p->start = Arena_alloc(&arena, p->len * sizeof p->start[0]);
+	p->aux = Arena_alloc(&arena, p->len * sizeof p->aux[0]);
+	for (i = 0, pc = p->start; i < p->len && !r.bad; i++, pc++) {
+		pc->opcode = _getIn(&r, Char, CountLoop + 1);
+		pc->c = _get32(&r);
+		pc->n = _get32(&r);
+		pc->memoStateNum = _getIn(&r, -1, p->nMemoizedStates);
+		j = _getIn(&r, -1, p->len);
+		pc->x = j >= 0 ? &p->start[j] : NULL;
+		switch (pc->opcode) {
+		case Split:
+		case CountLoop:
+			pc->y = &p->start[_getIn(&r, 0, p->len)];
+			break;
+		case SplitMany:
+			if (pc->n < 0 || pc->n > p->len) {
+				r.bad = 1;
+				break;
+			}
+			pc->edges = Arena_alloc(&arena, pc->n * sizeof pc->edges[0]);
+			for (j = 0; j < pc->n; j++)
+				pc->edges[j] = &p->start[_getIn(&r, 0, p->len)];
+			break;
+		case String:
+			if (pc->n <= 0 || (bytes = _get(&r, pc->n)) == NULL) {
+				r.bad = 1;
+				break;
+			}
+			pc->str = Arena_alloc(&arena, pc->n);
+			memcpy(pc->str, bytes, pc->n);
+			break;
+		case CharClass:
+			ch = _get32(&r);
+			pc->ccMap = CharClassMap_builtin(ch);
+			if (ch == 0 && (bytes = _get(&r, sizeof *pc->ccMap)) != NULL) {
+				CharClassMap *map = Arena_alloc(&arena, sizeof *map);
+				memcpy(map, bytes, sizeof *map);
+				pc->ccMap = map;
+			}
+			if (pc->ccMap == NULL)
+				r.bad = 1;
+			break;
+		}
+		info = &p->aux[i].memoInfo;
+		info->shouldMemo = _get32(&r);
+		info->inDegree = _get32(&r);
+		info->isAncestorLoopDestination = _get32(&r);
+		info->liveBackrefs = _get32(&r);
+		info->visitInterval = _get32(&r);
+	}
+	if (r.bad || r.at != r.end)
+		goto Bad;
+
+	packed = Prog_pack(p);
+	Arena_free(&arena);
+	return packed;
+
+Bad:
+	logMsg(LOG_WARN, "Prog_deserialize: malformed Prog");
+	Arena_free(&arena);
+	return NULL;
+}
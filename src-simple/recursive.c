@@ -5,32 +5,32 @@
 #include "regexp.h"
 
 int
-recursive(Inst *pc, char *sp, char **subp, int nsubp)
+recursive(Inst *pc, char *sp, char *eol, char **subp, int nsubp)
 {
 	char *old;
 
 	switch(pc->opcode) {
 	case Char:
-		if(*sp != pc->c)
+		if(sp == eol || *sp != pc->c)
 			return 0;
 	case Any:
-		if(*sp == '\0')
+		if(sp == eol)
 			return 0;
-		return recursive(pc+1, sp+1, subp, nsubp);
+		return recursive(pc+1, sp+1, eol, subp, nsubp);
 	case Match:
 		return 1;
 	case Jmp:
-		return recursive(pc->x, sp, subp, nsubp);
+		return recursive(pc->x, sp, eol, subp, nsubp);
 	case Split:
-		if(recursive(pc->x, sp, subp, nsubp))
+		if(recursive(pc->x, sp, eol, subp, nsubp))
 			return 1;
-		return recursive(pc->y, sp, subp, nsubp);
+		return recursive(pc->y, sp, eol, subp, nsubp);
 	case Save:
 		if(pc->n >= nsubp)
-			return recursive(pc+1, sp, subp, nsubp);
+			return recursive(pc+1, sp, eol, subp, nsubp);
 		old = subp[pc->n];
 		subp[pc->n] = sp;
-		if(recursive(pc+1, sp, subp, nsubp))
+		if(recursive(pc+1, sp, eol, subp, nsubp))
 			return 1;
 		subp[pc->n] = old;
 		return 0;
@@ -40,22 +40,24 @@ recursive(Inst *pc, char *sp, char **subp, int nsubp)
 }
 
 int
-recursiveprog(Prog *prog, char *input, char **subp, int nsubp)
+recursiveprog(Prog *prog, char *input, int len, char **subp, int nsubp)
 {
-	return recursive(prog->start, input, subp, nsubp);
+	return recursive(prog->start, input, input+len, subp, nsubp);
 }
 
 int
-recursiveloop(Inst *pc, char *sp, char **subp, int nsubp)
+recursiveloop(Inst *pc, char *sp, char *eol, char **subp, int nsubp)
 {
 	char *old;
 	
 	for(;;) {
 		switch(pc->opcode) {
 		case Char:
-			if(*sp != pc->c)
+			if(sp == eol || *sp != pc->c)
 				return 0;
 		case Any:
+			if(sp == eol)
+				return 0;
 			pc++;
 			sp++;
 			continue;
@@ -65,7 +67,7 @@ recursiveloop(Inst *pc, char *sp, char **subp, int nsubp)
 			pc = pc->x;
 			continue;
 		case Split:
-			if(recursiveloop(pc->x, sp, subp, nsubp))
+			if(recursiveloop(pc->x, sp, eol, subp, nsubp))
 				return 1;
 			pc = pc->y;
 			continue;
@@ -76,7 +78,7 @@ recursiveloop(Inst *pc, char *sp, char **subp, int nsubp)
 			}
 			old = subp[pc->n];
 			subp[pc->n] = sp;
-			if(recursiveloop(pc+1, sp, subp, nsubp))
+			if(recursiveloop(pc+1, sp, eol, subp, nsubp))
 				return 1;
 			subp[pc->n] = old;
 			return 0;
@@ -86,7 +88,7 @@ recursiveloop(Inst *pc, char *sp, char **subp, int nsubp)
 }
 
 int
-recursiveloopprog(Prog *prog, char *input, char **subp, int nsubp)
+recursiveloopprog(Prog *prog, char *input, int len, char **subp, int nsubp)
 {
-	return recursiveloop(prog->start, input, subp, nsubp);
+	return recursiveloop(prog->start, input, input+len, subp, nsubp);
 }
@@ -1,12 +1,27 @@
 #include "regexp.h"
 #include "log.h"
 
+static Arena *compileArena;
+
+void
+setCompileArena(Arena *a)
+{
+	compileArena = a;
+}
+
+void*
+amal(int n)
+{
+	assert(compileArena != NULL);
+	return Arena_alloc(compileArena, n);
+}
+
 Regexp*
 reg(int type, Regexp *left, Regexp *right)
 {
 	Regexp *r;
 	
-	r = mal(sizeof *r);
+	r = amal(sizeof *r);
 	r->type = type;
 	r->left = left;
 	r->right = right;
@@ -18,7 +33,7 @@ reg(int type, Regexp *left, Regexp *right)
 Regexp*
 copyreg(Regexp *r)
 {
-	Regexp *reg = mal(sizeof(*reg));
+	Regexp *reg = amal(sizeof(*reg));
 	memcpy(reg, r, sizeof(*reg));
 
 	reg->left = r->left == NULL ? NULL : copyreg(r->left);
@@ -26,7 +41,7 @@ copyreg(Regexp *r)
 
 	if (r->children != NULL) {
 		int i;
-		reg->children = mal(sizeof(*r->children) * r->arity);
+		reg->children = amal(sizeof(*r->children) * r->arity);
 		for (i = 0; i < r->arity; i++) {
 			reg->children[i] = copyreg(r->children[i]);
 		}
@@ -34,42 +49,13 @@ copyreg(Regexp *r)
 
 	if (r->ccLow != NULL)
 		reg->ccLow = copyreg(r->ccLow);
-	// I assume there's no problem if r->ccLow != r->ccHigh (as pointers) but they are "equals"? Some regexes end up with identical pointers, see code in freereg.
+	// I assume there's no problem if r->ccLow != r->ccHigh (as pointers) but they are "equals"? Some regexes end up with identical pointers.
 	if (r->ccHigh != NULL)
 		reg->ccHigh = copyreg(r->ccHigh);
 
 	return reg;
 }
 
-void
-freereg(Regexp *r)
-{
-	if (r->left != NULL) {
-		freereg(r->left);
-	}
-
-	if (r->right != NULL) {
-		freereg(r->right);
-	}
-	
-	if (r->children != NULL) {
-		int i;
-		for (i = 0; i < r->arity; i++) {
-			freereg(r->children[i]);
-		}
-		free(r->children);
-	}
-
-	if (r->ccLow != NULL) {
-		freereg(r->ccLow);
-	}
-	if (r->ccHigh != NULL && r->ccHigh != r->ccLow) {
-		freereg(r->ccHigh);
-	}
-
-	free(r);
-}
-
 void
 printre(Regexp *r)
 {
@@ -10,18 +10,30 @@
 #include <string.h>
 #include <stdarg.h>
 #include <assert.h>
-#include "uthash.h"
+#include <stdint.h>
 #include "rle.h"
+#include "arena.h"
 
 #define nil ((void*)0)
 #define nelem(x) (sizeof(x)/sizeof((x)[0]))
 
+/* Support for captures -- this covers \0-\9 */
+enum {
+	MAXSUB = 20,
+	MAXCOUNT = 4 /* Counted loops (CountLoop) nested this deep; deeper ones are expanded */
+};
+
 typedef struct Regexp Regexp;
 typedef struct Prog Prog;
 typedef struct Inst Inst;
 typedef struct InstCharRange InstCharRange;
+typedef struct InstCharClass InstCharClass;
+typedef struct InstAux InstAux;
+typedef struct CharClassMap CharClassMap;
 typedef struct LanguageLengthInfo LanguageLengthInfo;
 typedef struct InstInfoForMemoSelPolicy InstInfoForMemoSelPolicy;
+typedef struct InstEpsilonInfo InstEpsilonInfo;
+typedef struct ProgPattern ProgPattern;
 
 /* Possible lengths of "simple" strings in the language of this regex.
  * "simple" strings correspond to simple paths in the corresponding automaton. */
@@ -46,7 +58,7 @@ struct Regexp
 	Regexp **children;
 	int arity;
 
-	/* Anchored search? (applied to the root Regexp) */
+	/* Anchored search? (applied to the root Regexp). bolAnchor: every match starts with ^ or \A */
 	int bolAnchor;
 	int eolAnchor;
 
@@ -59,7 +71,7 @@ struct Regexp
 	Regexp *ccLow;  /* Lit or CharEscape */
 	Regexp *ccHigh; /* Lit or CharEscape */
 
-	/* Curly */
+	/* Curly. One that transform leaves in place is a counted loop: 0 <= curlyMin <= curlyMax, curlyMax > 0 */
 	int curlyMin; /* Use -1 if no lower bound */
 	int curlyMax; /* Use -1 if no upper bound */
 
@@ -77,8 +89,11 @@ Regexp *reg(int type, Regexp *left, Regexp *right);
 Regexp *copyreg(Regexp *r);
 // Print the AST represented by this Regexp
 void printre(Regexp *r);
-// Recursively free the AST represented by this Regexp
-void freereg(Regexp *r);
+
+/* Regexps, and what compile builds, come from the compilation arena; there is no freereg.
+ * The arena lives from parse until Prog_pack has copied the Prog out of it. */
+void setCompileArena(Arena *a);
+void *amal(int n); /* Like mal, from the compilation arena */
 
 enum	/* Regexp.type */
 {
@@ -100,8 +115,6 @@ enum	/* Regexp.type */
 	InlineZWA, /* ^, \A, \b, \B, $, \z, \Z */
 };
 
-// Used to support InlineZWA: \b \B 
-#define IS_WORD_CHAR(c) (('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || ('0' <= c && c <= '9'))
 
 Regexp *parse(char*);
 Regexp *reg(int type, Regexp *left, Regexp *right);
@@ -109,17 +122,74 @@ void printre(Regexp*);
 void fatal(char*, ...);
 void *mal(int);
 
-/* Transformation pass */
-Regexp *transform(Regexp *r);
+/* Longest literal the prefilter keeps (Prog.litPrefix, Prog.litRequired) */
+#define PROG_MAX_LITERAL 64
+
+/* Transformation pass. countedLoops: a large A{m,n} may become a CountLoop instead of n copies of A. */
+Regexp *transform(Regexp *r, int countedLoops);
+/* About how many Insts a transformed r would compile to, were its counted loops expanded */
+long long expandedCount(Regexp *r);
+
+/* One pattern of a compileSet Prog: every match of it contains litRequired */
+struct ProgPattern
+{
+	char litRequired[PROG_MAX_LITERAL];
+	int litRequiredLen;
+};
+
+/* Limits on one backtracking search; 0 for none. Checked every MATCH_BUDGET_CHECK_STEPS steps. */
+typedef struct MatchBudget MatchBudget;
+struct MatchBudget
+{
+	uint64_t maxSteps; /* Simulation steps: Insts run, memo hits included */
+	size_t maxMemoBytes; /* As in the statistics' memory costs */
+	uint64_t timeoutUS; /* Wall clock, from the start of the simulation */
+};
+
+#ifndef MATCH_BUDGET_CHECK_STEPS
+#define MATCH_BUDGET_CHECK_STEPS 1024
+#endif
 
 struct Prog
 {
 	Inst *start;
+	InstAux *aux; /* Parallel to start */
 	int len;
 	int memoMode; /* Memo.mode */
 	int memoEncoding; /* Memo.encoding */
 	int nMemoizedStates;
+	size_t memoBudgetBytes; /* MEMO_ADAPTIVE: bound on the memo bit vectors; 0 for none */
+	int memoWindow; /* Release memo storage behind the backtracking watermark (Memo.windowed). No MEMO_ADAPTIVE, no backrefs. */
+	MatchBudget budget;
 	int eolAnchor;
+	int bolAnchor; /* Matches can only start at input[0]. Otherwise backtrack() searches from each start in turn */
+	int nPatterns; /* compileSet: a RegexSet of this many patterns, each ending in a Match whose c is its index. 0 otherwise. */
+	ProgPattern *patterns; /* compileSet: nPatterns of them */
+	int *setStarts; /* Prog_determineSetStarts: by first byte, the patterns a match could begin with it */
+	int setStartsAt[257 + 1];
+
+	/* Prefilter: every match begins with litPrefix and contains litRequired (either may be empty) */
+	char litPrefix[PROG_MAX_LITERAL];
+	int litPrefixLen;
+	char litRequired[PROG_MAX_LITERAL];
+	int litRequiredLen;
+
+	int statsMode; /* STATS_* */
+	int statsAggregate; /* Add each match's statistics to its MatchCtx's StatsTotals instead of printing them */
+
+	/* Backreferences: the CGs named by some StringCompare. Memo keys index CGs by position here. */
+	int backrefCGs[MAXSUB/2];
+	int nBackrefCGs;
+
+	/* Counted loops: memo keys include the counters of the CountLoops around the search state */
+	int nCounters; /* Deepest nesting of CountLoops, at most MAXCOUNT */
+};
+
+enum /* Prog.statsMode */
+{
+	STATS_VISITS,  /* Count every visit in a VisitTable, print full statistics (default) */
+	STATS_SUMMARY, /* No VisitTable; print only time and memo table costs */
+	STATS_NONE,    /* No VisitTable; print nothing */
 };
 
 struct InstCharRange
@@ -131,48 +201,82 @@ struct InstCharRange
 	int invert; // For \W, \S, \D
 };
 
+/* Byte membership for a CharClass: bit b is set iff byte b is in the class */
+struct CharClassMap
+{
+	uint64_t bits[4];
+};
+
+#define CCMAP_HAS(map, c) ( ((map)->bits[(unsigned char) (c) >> 6] >> ((unsigned char) (c) & 63)) & 1 )
+
+/* Interned maps for the built-in classes \w \W \s \S \d \D. NULL for any other escape. */
+const CharClassMap *CharClassMap_builtin(int ch);
+/* The escape whose interned map this is, or 0 */
+int CharClassMap_builtinEscape(const CharClassMap *map);
+
 struct InstInfoForMemoSelPolicy
 {
 	int shouldMemo;
 	int inDegree;
 	int isAncestorLoopDestination;
-	int memoStateNum; /* -1 if "don't memo", else 0 to |Phi_memo| */
+	int liveBackrefs; /* Bit j set if a StringCompare of Prog.backrefCGs[j] is reachable from here */
 
-	/*  (NOT WORKING). These are the intervals at which this vertex may be visited
-	 *    during the automaton simulation.
-	 *  Use to determine RLE lengths if we memoize this Inst.
+	/* The interval at which this vertex may be visited during the automaton simulation:
+	 *   every offset at which it is visited is congruent mod visitInterval.
+	 * The RLE run length if we memoize this Inst with ENCODING_RLE_TUNED.
+	 * Set by compile (one k for all) or by Prog_determineVisitIntervals (per vertex).
 	 */
 	int visitInterval;
 };
 
-struct Inst
+/* An Inst's epsilon closure (the Insts it reaches without consuming a character), summarized.
+ * Set by Prog_summarizeEpsilons: Prog_pack calls it, so every packed Prog has it. */
+struct InstEpsilonInfo
 {
-	int opcode; /* Instruction. Determined by the corresponding Regex node */
-	int c; /* For Lit or Boundary: The literal character */
-	int n; /* Quant: 1 means greedy. Save: 2*n and 2*n + 1 are paired. */
-	int stateNum; /* 0 to Prog->len-1 */
-	Inst *x; /* Outgoing edge -- destination 1 (default option) */
-	Inst *y; /* Outgoing edge -- destination 2 (backup) */
-	int gen;	// global state, oooh!
+	int order; /* A topological order of the zero-width edges: each leads to a lower order */
+	int entry; /* The start, or the target of a consuming edge: a closure is entered here */
+	int acceptsEmpty; /* A Match (in a lookahead, its RecursiveMatch) is in the closure. Zero-width assertions may still fail */
+};
 
-	Inst **edges; /* Outgoing edges for case of *-arity */
-	int arity;
-	
-	/* For CharClass */
+/* The ranges a CharClass was compiled from. Only printprog reads them after compile. */
+struct InstCharClass
+{
 	InstCharRange charRanges[32];
 	int charRangeCounts; /* Number of used slots */
 	int invert;
+	CharClassMap ccMapOwn; /* Inst.ccMap points here unless it is an interned built-in */
+};
 
-	/* For StringCompare */
-	int cgNum;
+/* What the simulations touch on every step. Kept to 32 bytes so a Prog is a dense array.
+ * Everything else about an Inst is in its InstAux. */
+struct Inst
+{
+	int opcode; /* Instruction. Determined by the corresponding Regex node */
+	int c; /* Char, InlineZWA: the literal character. StringCompare: the CG number. CountLoop: the least number of iterations */
+	int n; /* Save: 2*n and 2*n + 1 are paired. SplitMany: the number of edges. String: its length. CountLoop: the most iterations */
+	int memoStateNum; /* -1 if "don't memo", else 0 to |Phi_memo| */
+	Inst *x; /* Outgoing edge -- destination 1 (default option) */
+	union {
+		Inst *y; /* Split, CountLoop: outgoing edge -- destination 2 (backup) */
+		Inst **edges; /* SplitMany: outgoing edges, in priority order */
+		const CharClassMap *ccMap; /* CharClass: InstCharClass.ccMapOwn, or an interned built-in */
+		char *str; /* String: the n bytes to match */
+	};
+};
 
-	/* Debug */
-	int startMark;
-	int visitMark;
+/* Cold per-Inst data, in a side table parallel to Prog.start: Prog.aux[i] describes Prog.start[i] */
+struct InstAux
+{
+	InstCharClass *cc; /* For CharClass */
 
 	InstInfoForMemoSelPolicy memoInfo;
+	InstEpsilonInfo eps;
 };
 
+/* The index of pc in p, and its side-table entry */
+#define INST_NUM(p, pc) ((int) ((pc) - (p)->start))
+#define INST_AUX(p, pc) (&(p)->aux[INST_NUM(p, pc)])
+
 
 enum	/* Inst.opcode */
 {
@@ -188,18 +292,35 @@ enum	/* Inst.opcode */
 	StringCompare,
 	InlineZeroWidthAssertion,
 	RecursiveZeroWidthAssertion,
+	String, /* A run of Chars, fused by Prog_peephole */
+	/* A counted loop A{m,n}:  CountInit; L: CountLoop m, n; A; Jmp L
+	 * CountInit pushes a counter of 0 onto the thread's Sub. CountLoop either enters the body, counting one more
+	 * iteration, or pops the counter and exits: it must enter below m iterations and must exit at n.
+	 * Otherwise x is tried first and y second, as for a Split. The body is whichever of the two comes first. */
+	CountInit,
+	CountLoop,
 };
 
 Prog *compile(Regexp*, int, int, int*, int, int);
+/* One Prog for a set of parsed and transformed regexes: a SplitMany into each, ending in its own Match */
+Prog *compileSet(Regexp**, int, int, int, int);
+/* After Prog_peephole: index a set's patterns by the bytes their matches can begin with */
+void Prog_determineSetStarts(Prog *p);
 void Prog_assertNoInfiniteLoops(Prog *p);
+/* Fill in each Inst's InstEpsilonInfo. Returns an Inst on a loop that consumes no character, or -1 */
+int Prog_summarizeEpsilons(Prog *p);
+/* Thread Jmp chains, fold Splits whose arms agree, drop unreachable Jmps, and fuse Char runs into Strings */
+void Prog_peephole(Prog *p);
+/* Copy a Prog built in the compilation arena into one malloc'd block, fixing up its pointers */
+Prog *Prog_pack(Prog *p);
 void printprog(Prog*);
+void freeprog(Prog*);
+/* A packed Prog as bytes (progfile.c), for Prog_deserialize to rebuild without parsing or compiling.
+ * Insts name each other by index. The bytes are for this build and machine. */
+void *Prog_serialize(Prog *p, size_t *len);
+/* NULL if buf is not a Prog_serialize of this version, or is malformed */
+Prog *Prog_deserialize(const void *buf, size_t len);
 
-extern int gen;
-
-/* Support for captures -- this covers \0-\9 */
-enum {
-	MAXSUB = 20
-};
 
 typedef struct Sub Sub;
 struct Sub
@@ -208,13 +329,36 @@ struct Sub
 	int nsub;
 	char *start; /* Easy way to calculate w[i] vs. char * */
 	char *sub[MAXSUB]; /* Two slots for each CG, \0 (whole string) - \9 */
+	int nCount; /* The counters of the CountLoops we are in, innermost last */
+	int count[MAXCOUNT];
+	int cgVecId; /* The memo's id for the spans of the backref'd CGs in cgVecLive, or -1 if a Save changed them */
+	int cgVecLive;
+};
+
+/* Subs for one match at a time: a freelist over chunks.
+ * SubPool_reset returns every Sub to the pool at once. */
+typedef struct SubPool SubPool;
+typedef struct SubChunk SubChunk;
+struct SubPool
+{
+	Sub *free;
+	SubChunk *chunks;
+	SubChunk *cur; /* Chunk we are carving Subs from */
+	int curUsed;
 };
 
-Sub *newsub(int n, char *start);
+void SubPool_init(SubPool*);
+void SubPool_reset(SubPool*);
+void SubPool_destroy(SubPool*);
+
+Sub *newsub(SubPool*, int n, char *start);
 Sub *incref(Sub*);
-Sub *copy(Sub*);
-Sub *update(Sub*, int, char*);
-void decref(Sub*);
+Sub *update(SubPool*, Sub*, int, char*);
+/* Like update, for the CountLoop counters: push a 0, count one more iteration of the innermost, or pop it */
+Sub *countPush(SubPool*, Sub*);
+Sub *countIncr(SubPool*, Sub*);
+Sub *countPop(SubPool*, Sub*);
+void decref(SubPool*, Sub*);
 int isgroupset(Sub*, int);
 
 /* Backreference helpers */
@@ -227,11 +371,55 @@ int usesBackreferences(Prog *p);
 #define CGID_TO_STARTP(s, cgid)   ((s)->sub[ CGID_TO_SUB_STARTP_IX( (cgid) )])
 #define CGID_TO_ENDP(s, cgid)   ((s)->sub[ CGID_TO_SUB_ENDP_IX( (cgid) )])
 
-/* (Extended-)NFA simulations */
-int backtrack(Prog*, char*, char**, int);
-int pikevm(Prog*, char*, char**, int);
-int recursiveloopprog(Prog*, char*, char**, int);
-int recursiveprog(Prog*, char*, char**, int);
-int thompsonvm(Prog*, char*, char**, int);
+/* (Extended-)NFA simulations.
+ * Each takes the input as (input, len): it need not be NUL-terminated, and NULs in it are ordinary chars. */
+int backtrack(Prog*, char*, int, char**, int);
+/* Does the InlineZeroWidthAssertion pc hold at sp? */
+int testInlineZeroWidthAssertion(Inst *pc, char *sp, int isBegin, int isEnd);
+
+/* Backtracking scratch that can be reused across matches (one at a time) */
+typedef struct MatchCtx MatchCtx;
+MatchCtx *MatchCtx_create(void);
+void MatchCtx_free(MatchCtx*);
+int backtrackCtx(Prog*, MatchCtx*, char*, int, char**, int);
+/* Matches start at or after input + from: the bytes before it are context for \b, and ^ cannot hold there */
+int backtrackCtxFrom(Prog*, MatchCtx*, char*, int, int, char**, int);
+/* For a compileSet Prog: every pattern that matches, one search with one memo table.
+ * Fills ids (room for Prog.nPatterns) with their indices in ascending order and returns how many (or MATCH_BUDGET_EXCEEDED). */
+int backtrackSetCtx(Prog*, MatchCtx*, char*, int, int*);
+typedef struct StatsTotals StatsTotals;
+const StatsTotals *MatchCtx_totals(MatchCtx*);
+void MatchCtx_mergeTotals(MatchCtx *into, MatchCtx *from);
+
+/* backtrack*() return this instead of a result when the search runs into a Prog.budget limit */
+#define MATCH_BUDGET_EXCEEDED (-1)
+
+enum /* MatchUsage.exceeded */
+{
+	MATCH_BUDGET_OK,
+	MATCH_BUDGET_STEPS,
+	MATCH_BUDGET_MEMORY,
+	MATCH_BUDGET_TIME,
+};
+
+/* What the last search on a MatchCtx spent: up to the limit, if it ran into one */
+typedef struct MatchUsage MatchUsage;
+struct MatchUsage
+{
+	uint64_t steps;
+	size_t memoBytes;
+	uint64_t timeUS;
+	int exceeded; /* MATCH_BUDGET_* */
+	uint64_t memoInitNS; /* Getting the memo table (and any visit table) ready for the input */
+	uint64_t simNS; /* The simulation: timeUS, in nanoseconds */
+};
+const MatchUsage *MatchCtx_usage(MatchCtx*);
+/* Memo-free, O(|Q|) memory: the backtracker's submatches in linear time, quadratic with lookahead. No backreferences. */
+int pikevm(Prog*, char*, int, char**, int);
+/* As backtrackCtxFrom */
+int pikevmFrom(Prog*, char*, int, int, char**, int);
+int recursiveloopprog(Prog*, char*, int, char**, int);
+int recursiveprog(Prog*, char*, int, char**, int);
+int thompsonvm(Prog*, char*, int, char**, int);
 
 #endif /* REGEXP_H */
@@ -31,10 +31,10 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "rle.h"
 
-void testSetGet() {
-  logMsg(LOG_INFO, "Test begins: testSetGet");
+void testSetGet(int backend) {
+  logMsg(LOG_INFO, "Test begins: testSetGet (backend %d)", backend);
 
-  RLEVector *vec = RLEVector_create(1, 1);
+  RLEVector *vec = RLEVector_createBackend(1, 1, backend);
 
   logMsg(LOG_INFO, "get from empty");
   assert(RLEVector_get(vec, 5) == 0);
@@ -59,14 +59,14 @@ void testSetGet() {
   logMsg(LOG_INFO, "...test passed");
 }
 
-void testRuns() {
-  logMsg(LOG_INFO, "Test begins: testRuns");
+void testRuns(int backend) {
+  logMsg(LOG_INFO, "Test begins: testRuns (backend %d)", backend);
   int i, j;
   RLEVector *vec;
 
   /* Runs of length 1 are compressible */
   logMsg(LOG_INFO, "  1-length runs work");
-  vec = RLEVector_create(1, 1);
+  vec = RLEVector_createBackend(1, 1, backend);
   for (i = 0; i < 100; i++) {
     RLEVector_set(vec, i);
     assert(RLEVector_currSize(vec) == 1);
@@ -74,7 +74,7 @@ void testRuns() {
 
   /* Runs of length 1 can't compress 10101010... */
   logMsg(LOG_INFO, "  1-length runs work but fail to compress");
-  vec = RLEVector_create(1, 1);
+  vec = RLEVector_createBackend(1, 1, backend);
   j = 0;
   for (i = 0; i < 100; i += 2) {
     j++;
@@ -95,7 +95,7 @@ void testRuns() {
 
   /* Runs of length 3 can compress 011011... */
   logMsg(LOG_INFO, "  runs of length 3 work");
-  vec = RLEVector_create(3, 1);
+  vec = RLEVector_createBackend(3, 1, backend);
   j = 0;
   for (i = 0; i < 100; i += 3) {
     j++;
@@ -107,11 +107,80 @@ void testRuns() {
   logMsg(LOG_INFO, "...test passed");
 }
 
+/* Same sets on both backends, in a scrambled order: same bits, same sizes */
+void testBackendsAgree() {
+  logMsg(LOG_INFO, "Test begins: testBackendsAgree");
+  int i, k, ix, n = 500;
+  RLEVector *arr, *avl;
+
+  for (k = 1; k <= 5; k++) {
+    logMsg(LOG_INFO, "  runs of length %d", k);
+    arr = RLEVector_createBackend(k, 1, RLE_BACKEND_ARRAY);
+    avl = RLEVector_createBackend(k, 0, RLE_BACKEND_AVL);
+    for (i = 0; i < n; i++) {
+      /* A permutation of [0, n) that mixes sequential stretches with jumps */
+      ix = (i * 7 + (i / 50) * 13) % n;
+      if (RLEVector_get(arr, ix))
+        continue;
+      RLEVector_set(arr, ix);
+      RLEVector_set(avl, ix);
+      assert(RLEVector_currSize(arr) == RLEVector_currSize(avl));
+      assert(RLEVector_maxObservedSize(arr) == RLEVector_maxObservedSize(avl));
+    }
+    for (i = 0; i < n + 10; i++)
+      assert(RLEVector_get(arr, i) == RLEVector_get(avl, i));
+    RLEVector_destroy(arr);
+    RLEVector_destroy(avl);
+  }
+  logMsg(LOG_INFO, "...test passed");
+}
+
+/* Runs that end at or before the release point go; the others keep their bits */
+void testReleaseBelow(int backend) {
+  logMsg(LOG_INFO, "Test begins: testReleaseBelow (backend %d)", backend);
+  int i;
+  RLEVector *vec = RLEVector_createBackend(3, backend == RLE_BACKEND_ARRAY, backend);
+
+  /* 110 110 ... over [0, 30), then 100 100 ... over [30, 60) */
+  for (i = 0; i < 30; i += 3) {
+    RLEVector_set(vec, i);
+    RLEVector_set(vec, i+1);
+  }
+  for (i = 30; i < 60; i += 3)
+    RLEVector_set(vec, i);
+  assert(RLEVector_currSize(vec) == 2);
+
+  /* Mid-run: nothing goes */
+  RLEVector_releaseBelow(vec, 29);
+  assert(RLEVector_currSize(vec) == 2);
+  assert(RLEVector_get(vec, 27) == 1);
+
+  RLEVector_releaseBelow(vec, 30);
+  assert(RLEVector_currSize(vec) == 1);
+  assert(RLEVector_maxObservedSize(vec) >= 2); /* The peak stays */
+  for (i = 30; i < 60; i++)
+    assert(RLEVector_get(vec, i) == (i % 3 == 0));
+
+  /* Still usable after */
+  RLEVector_set(vec, 61);
+  assert(RLEVector_get(vec, 61) == 1);
+  RLEVector_releaseBelow(vec, 100);
+  assert(RLEVector_currSize(vec) == 0);
+  assert(RLEVector_get(vec, 61) == 0);
+  RLEVector_destroy(vec);
+  logMsg(LOG_INFO, "...test passed");
+}
+
 int main(int argc, char** argv) {
   logMsg(LOG_INFO, "Running the RLE unit test suite...");
 
-  testSetGet();
-  testRuns();
+  testSetGet(RLE_BACKEND_ARRAY);
+  testSetGet(RLE_BACKEND_AVL);
+  testRuns(RLE_BACKEND_ARRAY);
+  testRuns(RLE_BACKEND_AVL);
+  testBackendsAgree();
+  testReleaseBelow(RLE_BACKEND_ARRAY);
+  testReleaseBelow(RLE_BACKEND_AVL);
 
   return 0;
 }
\ No newline at end of file
@@ -28,6 +28,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #define BIT_ISSET(x, i) ( ( (x) & ( (1) << (i) ) ) != 0 )
 #define BIT_SET(x, i) ( (x) | ( (1) << (i) ) ) /* Returns with bit set */
@@ -115,11 +116,35 @@ RLENode_create(int offset, int nRuns, unsigned long long run, int nBitsInRun)
   return node;
 }
 
+/* RLE Run -- an element of the RLE_BACKEND_ARRAY run array. Same fields as RLENode, less the tree links. */
+typedef struct RLERun RLERun;
+struct RLERun
+{
+  int offset;
+  int nRuns;
+  unsigned long long run;
+};
+
+static void _RLEArray_validate(RLEVector *vec);
+static void _RLEArray_set(RLEVector *vec, int ix);
+static int _RLEArray_get(RLEVector *vec, int ix);
+static void _RLEArray_shift(RLEVector *vec, int at, int n);
+static int RLERun_end(RLEVector *vec, RLERun *r);
+
 /* External API: RLEVector */
 
 struct RLEVector
 {
+  int backend; /* RLE_BACKEND_* */
+
+  /* RLE_BACKEND_AVL */
   struct avl_tree_node *root;
+
+  /* RLE_BACKEND_ARRAY: runs[0..currNEntries) sorted by offset, in one allocation */
+  RLERun *runs;
+  int capRuns;
+  int finger; /* Index of the run last set or found; sequential accesses start here */
+
   int currNEntries;
   int mostNEntries; /* High water mark */
   int nBitsInRun; /* Length of the runs we encode */
@@ -128,21 +153,32 @@ struct RLEVector
 
 RLEVector *
 RLEVector_create(int runLength, int autoValidate)
+{
+  return RLEVector_createBackend(runLength, autoValidate, RLE_BACKEND_ARRAY);
+}
+
+RLEVector *
+RLEVector_createBackend(int runLength, int autoValidate, int backend)
 {
   RLENode node;
   RLEVector *vec = malloc(sizeof *vec);
+  assert(backend == RLE_BACKEND_ARRAY || backend == RLE_BACKEND_AVL);
+  vec->backend = backend;
   vec->root = NULL;
+  vec->runs = NULL;
+  vec->capRuns = 0;
+  vec->finger = 0;
   vec->currNEntries = 0;
   vec->mostNEntries = 0;
   vec->nBitsInRun = runLength;
 
-  if (runLength > 8 * sizeof(node.run)) {
+  if (runLength > RLE_MAX_RUN_LENGTH || runLength > 8 * sizeof(node.run)) {
     logMsg(LOG_INFO, "RLEVector_create: Need %d bits, only have %llu", runLength, 8llu * sizeof(node.run));
     vec->nBitsInRun = 1;
   }
   vec->autoValidate = autoValidate;
 
-  logMsg(LOG_VERBOSE, "RLEVector_create: vec %p nBitsInRun %d, autoValidate %d", vec, vec->nBitsInRun, vec->autoValidate);
+  logMsg(LOG_VERBOSE, "RLEVector_create: vec %p backend %d nBitsInRun %d, autoValidate %d", vec, vec->backend, vec->nBitsInRun, vec->autoValidate);
 
   return vec;
 }
@@ -155,6 +191,10 @@ _RLEVector_validate(RLEVector *vec)
   int nNodes = 0;
 
 	assert(vec != NULL);
+  if (vec->backend == RLE_BACKEND_ARRAY) {
+    _RLEArray_validate(vec);
+    return;
+  }
   logMsg(LOG_DEBUG, "  _RLEVector_validate: Validating vec %p (size %d, runs of length %d)", vec, vec->currNEntries, vec->nBitsInRun);
 
   if (vec->currNEntries == 0) {
@@ -288,6 +328,11 @@ RLEVector_set(RLEVector *vec, int ix)
 
   logMsg(LOG_VERBOSE, "RLEVector_set: %d", roundedIx);
 
+  if (vec->backend == RLE_BACKEND_ARRAY) {
+    _RLEArray_set(vec, ix);
+    return;
+  }
+
   if (vec->autoValidate)
     _RLEVector_validate(vec);
 
@@ -373,6 +418,9 @@ RLEVector_get(RLEVector *vec, int ix)
   if (vec->autoValidate)
     _RLEVector_validate(vec);
 
+  if (vec->backend == RLE_BACKEND_ARRAY)
+    return _RLEArray_get(vec, ix);
+
   target.offset = ix;
   target.nRuns = -1;
   match = avl_tree_entry(
@@ -402,17 +450,48 @@ RLEVector_maxObservedSize(RLEVector *vec)
 int
 RLEVector_maxBytes(RLEVector *vec)
 {
+  int bytesPerRun = vec->backend == RLE_BACKEND_ARRAY ? sizeof(RLERun) : sizeof(RLENode);
   return sizeof(RLEVector) /* Internal overhead */ \
-    + sizeof(RLENode) * RLEVector_maxObservedSize(vec) /* Cost per node */ \
+    + bytesPerRun * RLEVector_maxObservedSize(vec) /* Cost per node */ \
     ;
 }
 
+void
+RLEVector_releaseBelow(RLEVector *vec, int ix)
+{
+  RLENode *node;
+  int n;
+
+  logMsg(LOG_DEBUG, "RLEVector_releaseBelow: %d", ix);
+
+  if (vec->backend == RLE_BACKEND_ARRAY) {
+    /* The runs are sorted, so the dead ones are a prefix */
+    for (n = 0; n < vec->currNEntries && RLERun_end(vec, &vec->runs[n]) <= ix; n++)
+      ;
+    if (n > 0)
+      _RLEArray_shift(vec, 0, -n);
+    vec->finger = 0;
+    if (vec->autoValidate)
+      _RLEArray_validate(vec);
+    return;
+  }
+
+  while (vec->root != NULL) {
+    node = avl_tree_entry(avl_tree_first_in_order(vec->root), RLENode, node);
+    if (RLENode_end(node) > ix)
+      break;
+    _RLEVector_removeRun(vec, node);
+    free(node);
+  }
+}
+
 void
 RLEVector_destroy(RLEVector *vec)
 {
   RLENode *node = NULL;
   avl_tree_for_each_in_postorder(node, vec->root, RLENode, node)
     free(node);
+  free(vec->runs);
   free(vec);
 
   return;
@@ -428,9 +507,11 @@ static void ullToBinaryString(unsigned long long value, char *buffer, int buffer
 }
 static void _RLEVector_addRun(RLEVector *vec, RLENode *node)
 {
-  char runBinary[65]; // 64 bits + 1 for null terminator
+  if (shouldLog(LOG_DEBUG)) {
+    char runBinary[65]; // 64 bits + 1 for null terminator
     ullToBinaryString(node->run, runBinary, sizeof(runBinary));
-  logMsg(LOG_DEBUG, "Adding run (%d,%d,%s)", node->offset, node->nRuns, runBinary);
+    logMsg(LOG_DEBUG, "Adding run (%d,%d,%s)", node->offset, node->nRuns, runBinary);
+  }
 
 	assert(avl_tree_insert(&vec->root, &node->node, RLENode_avl_tree_cmp) == NULL);
   vec->currNEntries++;
@@ -449,3 +530,167 @@ static void _RLEVector_removeRun(RLEVector *vec, RLENode *node)
   if (vec->autoValidate)
     _RLEVector_validate(vec);
 }
+
+
+/* RLE_BACKEND_ARRAY
+ * The runs live in one sorted array. Backtracking mostly marks offsets in increasing order,
+ * so most sets extend or append to the last run: the finger finds it in O(1) and the memmoves are short. */
+
+static int
+RLERun_end(RLEVector *vec, RLERun *r)
+{
+  return r->offset + r->nRuns * vec->nBitsInRun;
+}
+
+/* Index of the last run with offset <= ix, or -1 if there is none */
+static int
+_RLEArray_find(RLEVector *vec, int ix)
+{
+  int f = vec->finger, lo, hi, mid;
+  int n = vec->currNEntries;
+
+  if (n == 0 || ix < vec->runs[0].offset)
+    return -1;
+
+  /* The finger, or the run after it */
+  if (f < n && vec->runs[f].offset <= ix) {
+    if (f + 1 == n || ix < vec->runs[f+1].offset)
+      return f;
+    if (f + 2 == n || ix < vec->runs[f+2].offset)
+      return f + 1;
+  }
+
+  /* Binary search: runs[lo].offset <= ix < runs[hi].offset */
+  lo = 0;
+  hi = n;
+  while (hi - lo > 1) {
+    mid = lo + (hi - lo) / 2;
+    if (vec->runs[mid].offset <= ix)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Open (or, with negative n, close) -n slots at runs[at] */
+static void
+_RLEArray_shift(RLEVector *vec, int at, int n)
+{
+  if (n > 0 && vec->currNEntries + n > vec->capRuns) {
+    vec->capRuns = vec->capRuns ? 2 * vec->capRuns : 4;
+    while (vec->capRuns < vec->currNEntries + n)
+      vec->capRuns *= 2;
+    vec->runs = realloc(vec->runs, vec->capRuns * sizeof(*vec->runs));
+    assert(vec->runs != NULL);
+  }
+
+  if (n > 0)
+    memmove(vec->runs + at + n, vec->runs + at, (vec->currNEntries - at) * sizeof(*vec->runs));
+  else
+    memmove(vec->runs + at, vec->runs + at - n, (vec->currNEntries - at + n) * sizeof(*vec->runs));
+  vec->currNEntries += n;
+
+  /* As for the AVL tree, the high-water mark is taken before merging */
+  if (vec->mostNEntries < vec->currNEntries)
+    vec->mostNEntries = vec->currNEntries;
+}
+
+static void
+_RLEArray_set(RLEVector *vec, int ix)
+{
+  RLERun *r;
+  unsigned long long oldRunKernel;
+  int p, b, nRunsInPrefix, nRunsInSuffix, ixRunNumber;
+  int roundedIx = ix - RUN_OFFSET(ix, vec->nBitsInRun);
+  unsigned long long mask = MASK_FOR(ix, vec->nBitsInRun);
+
+  if (vec->autoValidate)
+    _RLEArray_validate(vec);
+  assert(_RLEArray_get(vec, ix) == 0); /* Shouldn't be set already */
+
+  p = _RLEArray_find(vec, ix);
+  if (p < 0 || RLERun_end(vec, &vec->runs[p]) <= ix) {
+    /* Case: creates a run, after runs[p] */
+    logMsg(LOG_DEBUG, "%d: Creating a run", roundedIx);
+    b = p + 1;
+    _RLEArray_shift(vec, b, 1);
+    vec->runs[b].offset = roundedIx;
+    vec->runs[b].nRuns = 1;
+    vec->runs[b].run = mask;
+  } else {
+    /* Case: splits runs[p] into prefix, the run with ix, and suffix */
+    r = &vec->runs[p];
+    logMsg(LOG_DEBUG, "%d: Splitting the run (%d,%d,%llu)", ix, r->offset, r->nRuns, r->run);
+    oldRunKernel = r->run;
+    ixRunNumber = RUN_NUMBER(ix, r->offset, vec->nBitsInRun);
+    nRunsInPrefix = ixRunNumber;
+    nRunsInSuffix = r->nRuns - (ixRunNumber + 1);
+
+    _RLEArray_shift(vec, p, (nRunsInPrefix > 0) + (nRunsInSuffix > 0));
+    b = p;
+    if (nRunsInPrefix > 0) {
+      vec->runs[b].offset = roundedIx - nRunsInPrefix * vec->nBitsInRun;
+      vec->runs[b].nRuns = nRunsInPrefix;
+      vec->runs[b].run = oldRunKernel;
+      b++;
+    }
+    vec->runs[b].offset = roundedIx;
+    vec->runs[b].nRuns = 1;
+    vec->runs[b].run = oldRunKernel | mask;
+    if (nRunsInSuffix > 0) {
+      vec->runs[b+1].offset = roundedIx + vec->nBitsInRun;
+      vec->runs[b+1].nRuns = nRunsInSuffix;
+      vec->runs[b+1].run = oldRunKernel;
+    }
+  }
+
+  /* Merge runs[b] with its neighbors */
+  if (b + 1 < vec->currNEntries && vec->runs[b].run == vec->runs[b+1].run && RLERun_end(vec, &vec->runs[b]) == vec->runs[b+1].offset) {
+    vec->runs[b].nRuns += vec->runs[b+1].nRuns;
+    _RLEArray_shift(vec, b + 1, -1);
+  }
+  if (b > 0 && vec->runs[b-1].run == vec->runs[b].run && RLERun_end(vec, &vec->runs[b-1]) == vec->runs[b].offset) {
+    vec->runs[b-1].nRuns += vec->runs[b].nRuns;
+    _RLEArray_shift(vec, b, -1);
+    b--;
+  }
+  vec->finger = b;
+
+  if (vec->autoValidate)
+    _RLEArray_validate(vec);
+}
+
+static int
+_RLEArray_get(RLEVector *vec, int ix)
+{
+  RLERun *r;
+  int p = _RLEArray_find(vec, ix);
+
+  if (p < 0)
+    return 0;
+  r = &vec->runs[p];
+  if (RLERun_end(vec, r) <= ix)
+    return 0;
+  vec->finger = p;
+  return BIT_ISSET(r->run, ix % vec->nBitsInRun);
+}
+
+/* Same invariants as the tree: in order, non-overlapping, and fully merged. O(n) steps. */
+static void
+_RLEArray_validate(RLEVector *vec)
+{
+  int i;
+
+  logMsg(LOG_DEBUG, "  _RLEArray_validate: Validating vec %p (size %d, runs of length %d)", vec, vec->currNEntries, vec->nBitsInRun);
+  assert(vec->currNEntries <= vec->capRuns);
+  for (i = 0; i < vec->currNEntries; i++) {
+    assert(vec->runs[i].nRuns > 0);
+    assert(vec->runs[i].offset % vec->nBitsInRun == 0);
+    if (i > 0) {
+      assert(RLERun_end(vec, &vec->runs[i-1]) <= vec->runs[i].offset); /* In-order */
+      if (RLERun_end(vec, &vec->runs[i-1]) == vec->runs[i].offset && vec->runs[i-1].run == vec->runs[i].run)
+        assert(!"_RLEArray_validate: Adjacent identical runs are not merged");
+    }
+  }
+}
@@ -26,10 +26,23 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 typedef struct RLEVector RLEVector;
 
+/* Longest supported run: the bits of one run live in a 64-bit word. Longer requests get 1. */
+#define RLE_MAX_RUN_LENGTH 64
+
+enum /* Storage for the runs */
+{
+  RLE_BACKEND_ARRAY, /* Sorted array of runs, with a finger on the last run touched. The default. */
+  RLE_BACKEND_AVL,   /* AVL tree of individually allocated runs */
+};
+
 /* Starts all zeros */
 RLEVector *
 RLEVector_create(int runLength, int autoValidate);
 
+/* RLEVector_create, with a choice of RLE_BACKEND_* */
+RLEVector *
+RLEVector_createBackend(int runLength, int autoValidate, int backend);
+
 /* Set this ix to 1 */
 void
 RLEVector_set(RLEVector *vec, int ix);
@@ -54,6 +67,10 @@ RLEVector_maxObservedSize(RLEVector *vec);
 int
 RLEVector_maxBytes(RLEVector *vec);
 
+/* Drop the runs that end at or before ix: no index below ix will be set or gotten again */
+void
+RLEVector_releaseBelow(RLEVector *vec, int ix);
+
 void
 RLEVector_destroy(RLEVector *vec);
 
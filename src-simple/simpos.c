@@ -0,0 +1,338 @@
+// Copyright 2020 James C. Davis.  All Rights Reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "simpos.h"
+#include "regexp.h"
+#include "log.h"
+
+#define SIMPOS_INIT_SLOTS 64 /* Power of 2 */
+#define SIMPOS_ARENA_MIN_INTS 1024
+
+/* Packed keys: q+1 in the high half so that 0 marks an empty slot */
+#define PACK(q, i) ( ((uint64_t) ((uint32_t) (q) + 1) << 32) | (uint32_t) (i) )
+#define PACKED_STATE(k) ( (int) ((k) >> 32) - 1 )
+
+typedef struct WideSlot WideSlot;
+typedef struct ArenaChunk ArenaChunk;
+
+struct WideSlot
+{
+  uint64_t hash;
+  int *key; /* Into the arena. NULL if empty. An interning set's id follows the key. */
+};
+
+/* Bump allocator for wide keys. Chunks double, so there are O(log n) of them. */
+struct ArenaChunk
+{
+  ArenaChunk *prev;
+  int nInts;
+  int used;
+  int ints[];
+};
+
+struct SimPosSet
+{
+  int nInts;
+  int interning; /* 1 if each key carries its id, else 0 */
+  int count;
+  int nSlots;  /* Power of 2 */
+  uint64_t *packed; /* IS_PACKED */
+  WideSlot *wide;   /* Otherwise */
+  ArenaChunk *arena;
+  size_t arenaBytes;
+};
+
+/* Interning sets are never packed: there is no room for the id */
+#define IS_PACKED(set) ((set)->nInts == 2 && !(set)->interning)
+
+/* splitmix64 finalizer */
+static uint64_t
+mix64(uint64_t x)
+{
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+static uint64_t
+hashWide(const int *key, int nInts)
+{
+  uint64_t h = 0;
+  int i;
+  for (i = 0; i < nInts; i++)
+    h = mix64(h ^ (uint32_t) key[i]);
+  return h;
+}
+
+/* Tables can outgrow mal()'s int */
+static void *
+zalloc(size_t n)
+{
+  void *v = calloc(1, n);
+  if (v == NULL)
+    fatal("out of memory");
+  return v;
+}
+
+static int *
+arenaCopy(SimPosSet *set, const int *key)
+{
+  ArenaChunk *chunk = set->arena;
+  int stride = set->nInts + set->interning;
+  if (chunk == NULL || chunk->used + stride > chunk->nInts) {
+    int nInts = (chunk == NULL) ? SIMPOS_ARENA_MIN_INTS : 2 * chunk->nInts;
+    if (nInts < stride)
+      nInts = stride;
+    chunk = zalloc(sizeof(*chunk) + (size_t) nInts * sizeof(int));
+    chunk->prev = set->arena;
+    chunk->nInts = nInts;
+    chunk->used = 0;
+    set->arena = chunk;
+    set->arenaBytes += sizeof(*chunk) + (size_t) nInts * sizeof(int);
+  }
+
+  int *copy = chunk->ints + chunk->used;
+  chunk->used += stride;
+  memcpy(copy, key, set->nInts * sizeof(int));
+  return copy;
+}
+
+static void
+allocSlots(SimPosSet *set, int nSlots)
+{
+  set->nSlots = nSlots;
+  if (IS_PACKED(set))
+    set->packed = zalloc((size_t) nSlots * sizeof(*set->packed));
+  else
+    set->wide = zalloc((size_t) nSlots * sizeof(*set->wide));
+}
+
+/* Double the table. Wide keys stay where they are in the arena. */
+static void
+grow(SimPosSet *set)
+{
+  int i, oldNSlots = set->nSlots;
+  uint64_t *oldPacked = set->packed;
+  WideSlot *oldWide = set->wide;
+  uint64_t mask = 2 * oldNSlots - 1;
+
+  logMsg(LOG_DEBUG, "SimPosSet: %d keys, growing to %d slots", set->count, 2 * oldNSlots);
+  allocSlots(set, 2 * oldNSlots);
+  for (i = 0; i < oldNSlots; i++) {
+    if (IS_PACKED(set)) {
+      if (oldPacked[i] != 0) {
+        uint64_t s = mix64(oldPacked[i]) & mask;
+        while (set->packed[s] != 0)
+          s = (s + 1) & mask;
+        set->packed[s] = oldPacked[i];
+      }
+    } else {
+      if (oldWide[i].key != NULL) {
+        uint64_t s = oldWide[i].hash & mask;
+        while (set->wide[s].key != NULL)
+          s = (s + 1) & mask;
+        set->wide[s] = oldWide[i];
+      }
+    }
+  }
+  free(oldPacked);
+  free(oldWide);
+}
+
+static SimPosSet *
+_create(int nInts, int interning)
+{
+  SimPosSet *set = mal(sizeof(*set));
+
+  set->nInts = nInts;
+  set->interning = interning;
+  set->count = 0;
+  set->packed = NULL;
+  set->wide = NULL;
+  set->arena = NULL;
+  set->arenaBytes = 0;
+  allocSlots(set, SIMPOS_INIT_SLOTS);
+  return set;
+}
+
+SimPosSet *
+SimPosSet_create(int nInts)
+{
+  assert(nInts >= 2);
+  return _create(nInts, 0);
+}
+
+SimPosSet *
+SimPosSet_createInterning(int nInts)
+{
+  assert(nInts >= 1);
+  return _create(nInts, 1);
+}
+
+/* Linear probe for key. Returns the slot holding it, or the empty slot where it belongs. */
+static uint64_t
+probe(SimPosSet *set, const int *key, uint64_t *hashOut)
+{
+  uint64_t mask = set->nSlots - 1;
+  uint64_t s;
+
+  if (IS_PACKED(set)) {
+    uint64_t k = PACK(key[0], key[1]);
+    for (s = mix64(k) & mask; set->packed[s] != 0 && set->packed[s] != k; s = (s + 1) & mask)
+      ;
+    return s;
+  }
+
+  *hashOut = hashWide(key, set->nInts);
+  for (s = *hashOut & mask; set->wide[s].key != NULL; s = (s + 1) & mask) {
+    if (set->wide[s].hash == *hashOut && memcmp(set->wide[s].key, key, set->nInts * sizeof(int)) == 0)
+      break;
+  }
+  return s;
+}
+
+int
+SimPosSet_insert(SimPosSet *set, const int *key)
+{
+  uint64_t hash = 0;
+  uint64_t s;
+
+  /* Keep the load factor below 3/4 */
+  if (4 * (set->count + 1) > 3 * set->nSlots)
+    grow(set);
+
+  assert(!set->interning);
+  s = probe(set, key, &hash);
+  if (IS_PACKED(set)) {
+    if (set->packed[s] != 0)
+      return 1;
+    set->packed[s] = PACK(key[0], key[1]);
+  } else {
+    if (set->wide[s].key != NULL)
+      return 1;
+    set->wide[s].hash = hash;
+    set->wide[s].key = arenaCopy(set, key);
+  }
+
+  set->count++;
+  return 0;
+}
+
+int
+SimPosSet_intern(SimPosSet *set, const int *key)
+{
+  uint64_t hash = 0;
+  uint64_t s;
+
+  assert(set->interning);
+  if (4 * (set->count + 1) > 3 * set->nSlots)
+    grow(set);
+
+  s = probe(set, key, &hash);
+  if (set->wide[s].key == NULL) {
+    set->wide[s].hash = hash;
+    set->wide[s].key = arenaCopy(set, key);
+    set->wide[s].key[set->nInts] = set->count++;
+  }
+  return set->wide[s].key[set->nInts];
+}
+
+int
+SimPosSet_contains(SimPosSet *set, const int *key)
+{
+  uint64_t hash = 0;
+  uint64_t s = probe(set, key, &hash);
+
+  if (IS_PACKED(set))
+    return set->packed[s] != 0;
+  return set->wide[s].key != NULL;
+}
+
+void
+SimPosSet_clear(SimPosSet *set)
+{
+  /* Clearing costs O(nSlots), so size to this use rather than the high-water mark */
+  int nSlots = SIMPOS_INIT_SLOTS;
+  while (4 * (set->count + 1) > 3 * nSlots)
+    nSlots *= 2;
+
+  if (nSlots == set->nSlots) {
+    if (IS_PACKED(set))
+      memset(set->packed, 0, (size_t) nSlots * sizeof(*set->packed));
+    else
+      memset(set->wide, 0, (size_t) nSlots * sizeof(*set->wide));
+  } else {
+    free(set->packed);
+    free(set->wide);
+    set->packed = NULL;
+    set->wide = NULL;
+    allocSlots(set, nSlots);
+  }
+
+  /* Keep only the newest (largest) arena chunk */
+  if (set->arena != NULL) {
+    ArenaChunk *chunk, *prev;
+    for (chunk = set->arena->prev; chunk != NULL; chunk = prev) {
+      prev = chunk->prev;
+      free(chunk);
+    }
+    set->arena->prev = NULL;
+    set->arena->used = 0;
+    set->arenaBytes = sizeof(*set->arena) + (size_t) set->arena->nInts * sizeof(int);
+  }
+
+  set->count = 0;
+}
+
+int
+SimPosSet_count(SimPosSet *set)
+{
+  return set->count;
+}
+
+void
+SimPosSet_countByState(SimPosSet *set, int *counts)
+{
+  int i;
+  for (i = 0; i < set->nSlots; i++) {
+    if (IS_PACKED(set)) {
+      if (set->packed[i] != 0)
+        counts[ PACKED_STATE(set->packed[i]) ]++;
+    } else if (set->wide[i].key != NULL) {
+      counts[ set->wide[i].key[0] ]++;
+    }
+  }
+}
+
+size_t
+SimPosSet_bytesPerEntry(SimPosSet *set)
+{
+  if (IS_PACKED(set))
+    return sizeof(*set->packed);
+  return sizeof(*set->wide) + (set->nInts + set->interning) * sizeof(int);
+}
+
+size_t
+SimPosSet_overheadBytes(SimPosSet *set)
+{
+  size_t slotBytes = IS_PACKED(set) ? sizeof(*set->packed) : sizeof(*set->wide);
+  size_t total = (size_t) set->nSlots * slotBytes + set->arenaBytes + sizeof(*set);
+  return total - (size_t) set->count * SimPosSet_bytesPerEntry(set);
+}
+
+void
+SimPosSet_destroy(SimPosSet *set)
+{
+  ArenaChunk *chunk, *prev;
+  for (chunk = set->arena; chunk != NULL; chunk = prev) {
+    prev = chunk->prev;
+    free(chunk);
+  }
+  free(set->packed);
+  free(set->wide);
+  free(set);
+}
@@ -0,0 +1,60 @@
+// Copyright 2020 James C. Davis.  All Rights Reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef SIMPOS_H
+#define SIMPOS_H
+
+#include <stddef.h>
+
+/* A set of simulation positions for ENCODING_NEGATIVE.
+ *
+ * A key is nInts ints: < q, i [, CG vector id ] [, counters ] >.
+ * Two-int keys are packed into one 8-byte slot of an open-addressed table.
+ * Wider keys live in a bump arena and the table holds (hash, pointer) slots.
+ * Either way there is no per-entry malloc, and destroy is O(1) in the number of entries.
+ *
+ * An interning set (SimPosSet_createInterning) numbers its keys instead: the k'th distinct key gets id k.
+ * The memo uses one for the spans of the backref'd CGs. */
+typedef struct SimPosSet SimPosSet;
+
+SimPosSet *
+SimPosSet_create(int nInts);
+
+SimPosSet *
+SimPosSet_createInterning(int nInts);
+
+/* Probe-and-insert: adds key, and returns 1 if it was already present. */
+int
+SimPosSet_insert(SimPosSet *set, const int *key);
+
+/* Interning sets: probe-and-insert, returning key's id */
+int
+SimPosSet_intern(SimPosSet *set, const int *key);
+
+/* Returns 1 if key is present */
+int
+SimPosSet_contains(SimPosSet *set, const int *key);
+
+/* Remove all keys. The table is resized for about as many keys as it held. */
+void
+SimPosSet_clear(SimPosSet *set);
+
+/* Number of keys */
+int
+SimPosSet_count(SimPosSet *set);
+
+/* Adds the number of keys with key[0] == q to counts[q] */
+void
+SimPosSet_countByState(SimPosSet *set, int *counts);
+
+/* Bytes that grow with each key, and bytes of the table beyond that */
+size_t
+SimPosSet_bytesPerEntry(SimPosSet *set);
+size_t
+SimPosSet_overheadBytes(SimPosSet *set);
+
+void
+SimPosSet_destroy(SimPosSet *set);
+
+#endif /* SIMPOS_H */
@@ -1,9 +1,8 @@
 #include "statistics.h"
 #include "log.h"
-#include "uthash.h"
 
 #include <stdio.h>
-#include <sys/time.h>
+#include <time.h>
 #include <math.h>
 
 static void
@@ -29,11 +28,107 @@ vec_strcat(char **dest, int *dAlloc, char *src)
   return;
 }
 
+/* JSON (quoted) names for the memo configuration */
+static const char *
+_vertexSelectionName(int mode)
+{
+  switch (mode) {
+  case MEMO_NONE:
+    return "\"NONE\"";
+  case MEMO_FULL:
+    return "\"ALL\"";
+  case MEMO_IN_DEGREE_GT1:
+    return "\"INDEG>1\"";
+  case MEMO_LOOP_DEST:
+    return "\"LOOP\"";
+  case MEMO_ADAPTIVE:
+    return "\"ADAPTIVE\"";
+  default:
+    assert(!"Unknown memo mode\n");
+    return NULL;
+  }
+}
+
+static const char *
+_encodingName(int encoding)
+{
+  switch (encoding) {
+  case ENCODING_NONE:
+    return "\"NONE\"";
+  case ENCODING_NEGATIVE:
+    return "\"NEGATIVE\"";
+  case ENCODING_RLE:
+    return "\"RLE\"";
+  case ENCODING_RLE_TUNED:
+    return "\"RLE_TUNED\"";
+  case ENCODING_BITSET:
+    return "\"BITSET\"";
+  default:
+    logMsg(LOG_ERROR, "Encoding %d", encoding);
+    assert(!"Unknown encoding\n");
+    return NULL;
+  }
+}
+
+static const char *
+_budgetName(int exceeded)
+{
+  switch (exceeded) {
+  case MATCH_BUDGET_STEPS:
+    return "\"STEPS\"";
+  case MATCH_BUDGET_MEMORY:
+    return "\"MEMORY\"";
+  case MATCH_BUDGET_TIME:
+    return "\"TIME\"";
+  default:
+    assert(!"Unknown budget\n");
+    return NULL;
+  }
+}
+
+/* MEMO_ADAPTIVE: what memo state q has cost so far. Vertices that never got hot cost nothing.
+ * entries: SimPosSet_countByState, for ENCODING_NEGATIVE */
+static void
+_adaptiveVertexCosts(Memo *memo, int q, const int *entries, int *asymptotic, size_t *bytes)
+{
+  MemoAdaptiveVertex *v = &memo->adaptive[q];
+
+  *asymptotic = 0;
+  *bytes = 0;
+  if (v->bits != NULL) {
+    *asymptotic = memo->nChars;
+    *bytes = sizeof(*v->bits) * ((memo->nChars + 63) / 64);
+  } else if (v->rle != NULL) {
+    *asymptotic = RLEVector_maxObservedSize(v->rle);
+    *bytes = RLEVector_maxBytes(v->rle);
+  } else if (v->hot && entries != NULL) {
+    *asymptotic = entries[q];
+    *bytes = entries[q] * SimPosSet_bytesPerEntry(memo->simPosSet);
+  }
+}
+
+/* Memo.windowed, except ENCODING_RLE*, whose vectors keep their own peaks: memo state q's share of the window at its peak.
+ * entries: SimPosSet_countByState over both generations, for ENCODING_NEGATIVE */
+static void
+_windowVertexCosts(Memo *memo, int q, const int *entries, int *asymptotic, size_t *bytes)
+{
+  MemoWindow *w = &memo->window;
+
+  if (memo->encoding == ENCODING_NEGATIVE) {
+    *asymptotic = entries[q];
+    *bytes = entries[q] * SimPosSet_bytesPerEntry(memo->simPosSet);
+  } else {
+    *asymptotic = w->pageBytes > 0 ? (int) (w->peakBytes / w->pageBytes) * MEMO_WINDOW_PAGE_CHARS : 0;
+    *bytes = memo->nStates > 0 ? w->peakBytes / memo->nStates : 0;
+  }
+}
+
 /* Prints human-readable to stdout, and JSON to stderr */
 void
-printStats(Prog *prog, Memo *memo, VisitTable *visitTable, uint64_t startTime, Sub *sub)
+printStats(Prog *prog, Memo *memo, VisitTable *visitTable, uint64_t startTime, Sub *sub, const MatchUsage *usage)
 {
   int i, j, n, count;
+  int nEntries, *entriesPerMemoVertex = NULL;
 
   uint64_t endTime = now();
   uint64_t elapsed_US = endTime - startTime;
@@ -63,39 +158,8 @@ printStats(Prog *prog, Memo *memo, VisitTable *visitTable, uint64_t startTime, S
   char *csv_maxObservedMemoryBytesPerMemoizedVertex = mal(csv_memoryBytesLen * sizeof(char));
   vec_strcat(&csv_maxObservedMemoryBytesPerMemoizedVertex, &csv_memoryBytesLen, "");
 
-  switch (memo->mode) {
-  case MEMO_NONE:
-    strcpy(memoConfig_vertexSelection, "\"NONE\"");
-    break;
-  case MEMO_FULL:
-    strcpy(memoConfig_vertexSelection, "\"ALL\"");
-    break;
-  case MEMO_IN_DEGREE_GT1:
-    strcpy(memoConfig_vertexSelection, "\"INDEG>1\"");
-    break;
-  case MEMO_LOOP_DEST:
-    strcpy(memoConfig_vertexSelection, "\"LOOP\"");
-    break;
-	default: assert(!"Unknown memo mode\n");
-  }
-
-  switch (memo->encoding) {
-  case ENCODING_NONE:
-    strcpy(memoConfig_encoding, "\"NONE\"");
-    break;
-  case ENCODING_NEGATIVE:
-    strcpy(memoConfig_encoding, "\"NEGATIVE\"");
-    break;
-  case ENCODING_RLE:
-    strcpy(memoConfig_encoding, "\"RLE\"");
-    break;
-  case ENCODING_RLE_TUNED:
-    strcpy(memoConfig_encoding, "\"RLE_TUNED\"");
-    break;
-  default:
-    logMsg(LOG_ERROR, "Encoding %d", memo->encoding);
-    assert(!"Unknown encoding\n");
-  }
+  strcpy(memoConfig_vertexSelection, _vertexSelectionName(memo->mode));
+  strcpy(memoConfig_encoding, _encodingName(memo->encoding));
 
   fprintf(stderr, "{");
   /* Info about input */
@@ -103,6 +167,12 @@ printStats(Prog *prog, Memo *memo, VisitTable *visitTable, uint64_t startTime, S
     visitTable->nStates,
     visitTable->nChars);
 
+  if (visitTable->visitVectors == NULL) {
+    /* STATS_SUMMARY: no visit counts, just the time and the memo table costs */
+    fprintf(stderr, ", \"simulationInfo\": { \"simTimeUS\": %llu }", (unsigned long long) elapsed_US);
+    goto MemoCosts;
+  }
+
   /* Most-visited vertex */
   visitsPerVertex = mal(sizeof(int) * visitTable->nStates);
   for (i = 0; i < visitTable->nStates; i++) {
@@ -131,16 +201,60 @@ printStats(Prog *prog, Memo *memo, VisitTable *visitTable, uint64_t startTime, S
   logMsg(LOG_INFO, "%s: Most-visited vertex: %d (%d visits over all its search states)", prefix, mostVisitedVertex, maxVisitsPerVertex);
   /* Info about simulation */
   fprintf(stderr, ", \"simulationInfo\": { \"nTotalVisits\": %d, \"nPossibleTotalVisitsWithMemoization\": %d, \"visitsToMostVisitedSimPos\": %d, \"visitsToMostVisitedVertex\": %d, \"simTimeUS\": %llu }",
-    nTotalVisits, visitTable->nStates * visitTable->nChars, maxVisitsPerSimPos, maxVisitsPerVertex, elapsed_US);
+    nTotalVisits, visitTable->nStates * visitTable->nChars, maxVisitsPerSimPos, maxVisitsPerVertex, (unsigned long long) elapsed_US);
 
   if (memo->mode == MEMO_FULL || memo->mode == MEMO_IN_DEGREE_GT1) {
-    if (maxVisitsPerSimPos > 1 && !usesBackreferences(prog)) {
-      /* I have proved this is impossible. */
+    if (maxVisitsPerSimPos > 1 && !usesBackreferences(prog) && prog->nCounters == 0) {
+      /* I have proved this is impossible (without the extra key state of backrefs and counters). */
       assert(!"Error, too many visits per search state\n");
     }
   }
 
-  switch (memo->encoding) {
+MemoCosts:
+  if (memo->mode == MEMO_ADAPTIVE) {
+    size_t bytes;
+    int asymptotic;
+
+    logMsg(LOG_INFO, "%s: Adaptive, %zu bytes of bit vectors (budget %zu)", prefix, memo->usedBytes, memo->budgetBytes);
+    if (memo->encoding == ENCODING_NEGATIVE) {
+      entriesPerMemoVertex = mal(sizeof(int) * (memo->nStates + 1));
+      SimPosSet_countByState(memo->simPosSet, entriesPerMemoVertex);
+    }
+    for (i = 0; i < memo->nStates; i++) {
+      _adaptiveVertexCosts(memo, i, entriesPerMemoVertex, &asymptotic, &bytes);
+      sprintf(numBufForSprintf, "%d", asymptotic);
+      vec_strcat(&csv_maxObservedAsymptoticCostsPerMemoizedVertex, &csv_asymptoteLen, numBufForSprintf);
+      sprintf(numBufForSprintf, "%zu", bytes);
+      vec_strcat(&csv_maxObservedMemoryBytesPerMemoizedVertex, &csv_memoryBytesLen, numBufForSprintf);
+      if (i + 1 != memo->nStates) {
+        vec_strcat(&csv_maxObservedAsymptoticCostsPerMemoizedVertex, &csv_asymptoteLen, ",");
+        vec_strcat(&csv_maxObservedMemoryBytesPerMemoizedVertex, &csv_memoryBytesLen, ",");
+      }
+    }
+    free(entriesPerMemoVertex);
+  } else if (memo->windowed && memo->encoding != ENCODING_RLE && memo->encoding != ENCODING_RLE_TUNED) {
+    size_t bytes;
+    int asymptotic;
+
+    logMsg(LOG_INFO, "%s: Memo window, last released below offset %d of |w| = %d", prefix, memo->window.low, memo->nChars);
+    if (memo->encoding == ENCODING_NEGATIVE) {
+      entriesPerMemoVertex = mal(sizeof(int) * (memo->nStates + 1));
+      SimPosSet_countByState(memo->simPosSet, entriesPerMemoVertex);
+      SimPosSet_countByState(memo->window.oldSimPosSet, entriesPerMemoVertex);
+    }
+    for (i = 0; i < memo->nStates; i++) {
+      _windowVertexCosts(memo, i, entriesPerMemoVertex, &asymptotic, &bytes);
+      sprintf(numBufForSprintf, "%d", asymptotic);
+      vec_strcat(&csv_maxObservedAsymptoticCostsPerMemoizedVertex, &csv_asymptoteLen, numBufForSprintf);
+      sprintf(numBufForSprintf, "%zu", bytes);
+      vec_strcat(&csv_maxObservedMemoryBytesPerMemoizedVertex, &csv_memoryBytesLen, numBufForSprintf);
+      if (i + 1 != memo->nStates) {
+        vec_strcat(&csv_maxObservedAsymptoticCostsPerMemoizedVertex, &csv_asymptoteLen, ",");
+        vec_strcat(&csv_maxObservedMemoryBytesPerMemoizedVertex, &csv_memoryBytesLen, ",");
+      }
+    }
+    free(entriesPerMemoVertex);
+  } else switch (memo->encoding) {
   case ENCODING_NONE:
     /* All memoized states cost |w| */
     logMsg(LOG_INFO, "%s: No encoding, so all memoized vertices paid the full cost of |w| = %d slots", prefix, memo->nChars);
@@ -166,37 +280,50 @@ printStats(Prog *prog, Memo *memo, VisitTable *visitTable, uint64_t startTime, S
     break;
   case ENCODING_NEGATIVE:
   {
+    nEntries = SimPosSet_count(memo->simPosSet);
     logMsg(LOG_INFO, "%s: %d slots used (out of %d possible)",
-      prefix, HASH_COUNT(memo->simPosTable), memo->nStates * memo->nChars);
+      prefix, nEntries, memo->nStates * memo->nChars);
 
     /* Memoized state costs vary by number of visits to each node. */
-    int UT_overheadPerVertex = UT_TABLE_OVERHEAD(hh, memo->simPosTable) / memo->nStates;
-    logMsg(LOG_INFO, "%s: distributing the table overhead of %d over the %d memo states",
-      prefix, UT_TABLE_OVERHEAD(hh, memo->simPosTable), memo->nStates);
+    size_t overheadPerVertex = memo->nStates > 0 ? SimPosSet_overheadBytes(memo->simPosSet) / memo->nStates : 0;
+    logMsg(LOG_INFO, "%s: distributing the table overhead of %zu over the %d memo states",
+      prefix, SimPosSet_overheadBytes(memo->simPosSet), memo->nStates);
+
+    /* Entries per memoized vertex, read off the table itself (the visit table may be absent) */
+    entriesPerMemoVertex = mal(sizeof(int) * (memo->nStates + 1));
+    SimPosSet_countByState(memo->simPosSet, entriesPerMemoVertex);
 
     count = 0;
-    for (i = 0; i < prog->len; i++) {
-      if (prog->start[i].memoInfo.shouldMemo) {
-        count += visitsPerVertex[i];
-
-        // Asymptotically, 1 per entry
-        sprintf(numBufForSprintf, "%d", visitsPerVertex[i]);
-        vec_strcat(&csv_maxObservedAsymptoticCostsPerMemoizedVertex, &csv_asymptoteLen, numBufForSprintf);
-        if (prog->start[i].memoInfo.memoStateNum + 1 != memo->nStates) {
-          vec_strcat(&csv_maxObservedAsymptoticCostsPerMemoizedVertex, &csv_asymptoteLen, ",");
-        }
+    for (i = 0; i < memo->nStates; i++) {
+      count += entriesPerMemoVertex[i];
 
-        // In implementation, count the cost of each sim table entry associated with this vertex
-        sprintf(numBufForSprintf, "%ld", UT_overheadPerVertex + (visitsPerVertex[i] * sizeof(SimPosTable)) );
-        vec_strcat(&csv_maxObservedMemoryBytesPerMemoizedVertex, &csv_memoryBytesLen, numBufForSprintf);
-        if (prog->start[i].memoInfo.memoStateNum + 1 != memo->nStates) {
-          vec_strcat(&csv_maxObservedMemoryBytesPerMemoizedVertex, &csv_memoryBytesLen, ",");
-        }
+      // Asymptotically, 1 per entry
+      sprintf(numBufForSprintf, "%d", entriesPerMemoVertex[i]);
+      vec_strcat(&csv_maxObservedAsymptoticCostsPerMemoizedVertex, &csv_asymptoteLen, numBufForSprintf);
+      if (i + 1 != memo->nStates) {
+        vec_strcat(&csv_maxObservedAsymptoticCostsPerMemoizedVertex, &csv_asymptoteLen, ",");
+      }
+
+      // In implementation, count the cost of each sim table entry associated with this vertex
+      sprintf(numBufForSprintf, "%zu", overheadPerVertex + (entriesPerMemoVertex[i] * SimPosSet_bytesPerEntry(memo->simPosSet)) );
+      vec_strcat(&csv_maxObservedMemoryBytesPerMemoizedVertex, &csv_memoryBytesLen, numBufForSprintf);
+      if (i + 1 != memo->nStates) {
+        vec_strcat(&csv_maxObservedMemoryBytesPerMemoizedVertex, &csv_memoryBytesLen, ",");
       }
     }
+    assert(count == nEntries);
 
-    if (!memo->backrefs) {
-      /* Sanity check: HASH_COUNT does correspond to the number of marked search states
+    if (visitsPerVertex != NULL) {
+      /* Each memoized search state is visited once, when its entry is made */
+      for (i = 0; i < prog->len; i++) {
+        if (prog->aux[i].memoInfo.shouldMemo)
+          assert(visitsPerVertex[i] == entriesPerMemoVertex[prog->start[i].memoStateNum]);
+      }
+    }
+    free(entriesPerMemoVertex);
+
+    if (!memo->backrefs && memo->nCounters == 0 && visitsPerVertex != NULL) {
+      /* Sanity check: the set size does correspond to the number of marked search states
       * This count will be inaccurate if backrefs are enabled, because we don't know all of the subs that we encountered.
       * TODO We could enumerate them another way. */
       n = 0;
@@ -207,13 +334,32 @@ printStats(Prog *prog, Memo *memo, VisitTable *visitTable, uint64_t startTime, S
           }
         }
       }
-      logMsg(LOG_DEBUG, "HASH_COUNT %d n %d count %d", HASH_COUNT(memo->simPosTable), n, count);
-      assert(n == HASH_COUNT(memo->simPosTable));
+      logMsg(LOG_DEBUG, "nEntries %d n %d count %d", nEntries, n, count);
+      assert(n == nEntries);
       assert(n == count);
     }
 
     break;
   }
+  case ENCODING_BITSET:
+    /* All memoized states cost |w| bits, padded out to whole cache lines */
+    logMsg(LOG_INFO, "%s: Bitset encoding, so all memoized vertices paid %d words for |w| = %d slots", prefix, memo->bitRowWords, memo->nChars);
+    for (i = 0; i < memo->nStates; i++) {
+      // Asymptotically, cost of 1 bit * |w|
+      sprintf(numBufForSprintf, "%d", memo->nChars);
+      vec_strcat(&csv_maxObservedAsymptoticCostsPerMemoizedVertex, &csv_asymptoteLen, numBufForSprintf);
+      if (i + 1 != memo->nStates) {
+        vec_strcat(&csv_maxObservedAsymptoticCostsPerMemoizedVertex, &csv_asymptoteLen, ",");
+      }
+
+      // In the implementation, count the whole (padded) row
+      sprintf(numBufForSprintf, "%zu", memo->bitRowWords * sizeof(*memo->bitVectors));
+      vec_strcat(&csv_maxObservedMemoryBytesPerMemoizedVertex, &csv_memoryBytesLen, numBufForSprintf);
+      if (i + 1 != memo->nStates) {
+        vec_strcat(&csv_maxObservedMemoryBytesPerMemoizedVertex, &csv_memoryBytesLen, ",");
+      }
+    }
+    break;
   case ENCODING_RLE:
   case ENCODING_RLE_TUNED:
     logMsg(LOG_INFO, "%s: |w| = %d", prefix, memo->nChars);
@@ -252,6 +398,10 @@ printStats(Prog *prog, Memo *memo, VisitTable *visitTable, uint64_t startTime, S
     csv_maxObservedMemoryBytesPerMemoizedVertex
   );
 
+  if (usage->exceeded != MATCH_BUDGET_OK)
+    fprintf(stderr, ", \"budgetInfo\": { \"exceeded\": %s, \"nSteps\": %llu, \"memoBytes\": %zu, \"timeUS\": %llu }",
+      _budgetName(usage->exceeded), (unsigned long long) usage->steps, usage->memoBytes, (unsigned long long) usage->timeUS);
+
   fprintf(stderr, "}\n");
 
   free(csv_maxObservedAsymptoticCostsPerMemoizedVertex);
@@ -259,10 +409,146 @@ printStats(Prog *prog, Memo *memo, VisitTable *visitTable, uint64_t startTime, S
   free(visitsPerVertex);
 }
 
+size_t
+memoTableBytes(Memo *memo)
+{
+  size_t bytes = 0, vertexBytes;
+  int i, asymptotic;
+
+  if (memo->mode == MEMO_ADAPTIVE) {
+    /* The hot vertices' entries are all of the set's */
+    if (memo->encoding == ENCODING_NEGATIVE)
+      bytes = SimPosSet_overheadBytes(memo->simPosSet) + SimPosSet_count(memo->simPosSet) * SimPosSet_bytesPerEntry(memo->simPosSet);
+    for (i = 0; i < memo->nStates; i++) {
+      _adaptiveVertexCosts(memo, i, NULL, &asymptotic, &vertexBytes);
+      bytes += vertexBytes;
+    }
+    return bytes;
+  }
+
+  if (memo->windowed && memo->encoding != ENCODING_RLE && memo->encoding != ENCODING_RLE_TUNED) {
+    bytes = memo->window.peakBytes;
+    if (memo->encoding == ENCODING_NEGATIVE) {
+      /* The peak is taken when a generation is cleared; the table may have grown since */
+      vertexBytes = SimPosSet_overheadBytes(memo->simPosSet) + SimPosSet_count(memo->simPosSet) * SimPosSet_bytesPerEntry(memo->simPosSet)
+        + SimPosSet_overheadBytes(memo->window.oldSimPosSet) + SimPosSet_count(memo->window.oldSimPosSet) * SimPosSet_bytesPerEntry(memo->window.oldSimPosSet);
+      if (vertexBytes > bytes)
+        bytes = vertexBytes;
+    }
+    return bytes;
+  }
+
+  switch (memo->encoding) {
+  case ENCODING_NONE:
+    bytes = (size_t) memo->nStates * ((memo->nChars + 7) / 8);
+    break;
+  case ENCODING_NEGATIVE:
+    if (memo->simPosSet != NULL)
+      bytes = SimPosSet_overheadBytes(memo->simPosSet) + SimPosSet_count(memo->simPosSet) * SimPosSet_bytesPerEntry(memo->simPosSet);
+    break;
+  case ENCODING_BITSET:
+    bytes = (size_t) memo->nStates * memo->bitRowWords * sizeof(*memo->bitVectors);
+    break;
+  case ENCODING_RLE:
+  case ENCODING_RLE_TUNED:
+    for (i = 0; i < memo->nStates; i++)
+      bytes += RLEVector_maxBytes(memo->rleVectors[i]);
+    break;
+  default:
+    assert(!"Unexpected encoding\n");
+  }
+  return bytes;
+}
+
+void
+StatsTotals_init(StatsTotals *totals)
+{
+  memset(totals, 0, sizeof *totals);
+  totals->maxVisitsPerSimPos = -1;
+}
+
+void
+StatsTotals_add(StatsTotals *totals, Memo *memo, VisitTable *visitTable, uint64_t startTime, int matched)
+{
+  int i, j;
+  size_t memoBytes;
+
+  totals->simTimeUS += now() - startTime;
+  if (matched == MATCH_BUDGET_EXCEEDED) {
+    totals->nBudgetExceeded++;
+    goto MemoBytes;
+  }
+  totals->nInputs++;
+  totals->nMatches += matched ? 1 : 0;
+  totals->totalLenW += visitTable->nChars;
+  if (visitTable->nChars > totals->maxLenW)
+    totals->maxLenW = visitTable->nChars;
+
+  if (visitTable->visitVectors != NULL) {
+    for (i = 0; i < visitTable->nStates; i++) {
+      for (j = 0; j < visitTable->nChars; j++) {
+        totals->nTotalVisits += visitTable->visitVectors[i][j];
+        if (visitTable->visitVectors[i][j] > totals->maxVisitsPerSimPos)
+          totals->maxVisitsPerSimPos = visitTable->visitVectors[i][j];
+      }
+    }
+  }
+
+MemoBytes:
+  memoBytes = memoTableBytes(memo);
+  if (memoBytes > totals->maxMemoBytes)
+    totals->maxMemoBytes = memoBytes;
+}
+
+void
+StatsTotals_merge(StatsTotals *into, const StatsTotals *from)
+{
+  into->nInputs += from->nInputs;
+  into->nMatches += from->nMatches;
+  into->totalLenW += from->totalLenW;
+  if (from->maxLenW > into->maxLenW)
+    into->maxLenW = from->maxLenW;
+  into->nTotalVisits += from->nTotalVisits;
+  if (from->maxVisitsPerSimPos > into->maxVisitsPerSimPos)
+    into->maxVisitsPerSimPos = from->maxVisitsPerSimPos;
+  into->simTimeUS += from->simTimeUS;
+  if (from->maxMemoBytes > into->maxMemoBytes)
+    into->maxMemoBytes = from->maxMemoBytes;
+  into->nBudgetExceeded += from->nBudgetExceeded;
+}
+
+void
+printStatsTotals(Prog *prog, const StatsTotals *totals)
+{
+  fprintf(stderr, "{");
+  fprintf(stderr, "\"batchInfo\": { \"nStates\": %d, \"nInputs\": %d, \"nMatches\": %d, \"totalLenW\": %llu, \"maxLenW\": %d }",
+    prog->len, totals->nInputs, totals->nMatches, (unsigned long long) totals->totalLenW, totals->maxLenW);
+  if (totals->nBudgetExceeded > 0)
+    fprintf(stderr, ", \"budgetInfo\": { \"nBudgetExceeded\": %d }", totals->nBudgetExceeded);
+
+  if (prog->statsMode == STATS_VISITS)
+    fprintf(stderr, ", \"simulationInfo\": { \"nTotalVisits\": %llu, \"visitsToMostVisitedSimPos\": %d, \"simTimeUS\": %llu }",
+      (unsigned long long) totals->nTotalVisits, totals->maxVisitsPerSimPos, (unsigned long long) totals->simTimeUS);
+  else
+    fprintf(stderr, ", \"simulationInfo\": { \"simTimeUS\": %llu }", (unsigned long long) totals->simTimeUS);
+
+  fprintf(stderr, ", \"memoizationInfo\": { \"config\": { \"vertexSelection\": %s, \"encoding\": %s }, \"results\": { \"nSelectedVertices\": %d, \"maxMemoryBytes\": %zu }}",
+    _vertexSelectionName(prog->memoMode), _encodingName(prog->memoEncoding),
+    prog->nMemoizedStates, totals->maxMemoBytes);
+
+  fprintf(stderr, "}\n");
+}
+
 uint64_t
 now(void)
 {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  return tv.tv_sec*(uint64_t)1000000 + tv.tv_usec;
+  return nowNS() / 1000;
+}
+
+uint64_t
+nowNS(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*(uint64_t)1000000000 + ts.tv_nsec;
 }
@@ -8,9 +8,37 @@
 #include "regexp.h"
 #include "memoize.h"
 
+/* A monotonic clock, in microseconds and in nanoseconds */
 uint64_t
 now(void);
+uint64_t
+nowNS(void);
+
+/* usage: the search's, with budgetInfo added if it ran into a limit */
+void printStats(Prog *prog, Memo *memo, VisitTable *visitTable, uint64_t startTime, Sub *sub, const MatchUsage *usage);
+
+/* The implementation cost of the memo table so far, as summed in printStats' maxObservedMemoryBytesPerMemoizedVertex.
+ * O(|Phi|) at most, so cheap enough for MatchBudget.maxMemoBytes. */
+size_t memoTableBytes(Memo *memo);
+
+/* Running totals over many matches of one Prog, for batch mode (Prog.statsAggregate) */
+struct StatsTotals
+{
+  int nInputs;
+  int nMatches;
+  uint64_t totalLenW;  /* Sum of |w| */
+  int maxLenW;
+  uint64_t nTotalVisits; /* STATS_VISITS only */
+  int maxVisitsPerSimPos; /* STATS_VISITS only */
+  uint64_t simTimeUS;
+  size_t maxMemoBytes; /* Largest memo table over all inputs */
+  int nBudgetExceeded; /* Searches cut off by Prog.budget: not in nInputs, but in simTimeUS and maxMemoBytes */
+};
 
-void printStats(Prog *prog, Memo *memo, VisitTable *visitTable, uint64_t startTime, Sub *sub);
+void StatsTotals_init(StatsTotals *totals);
+void StatsTotals_add(StatsTotals *totals, Memo *memo, VisitTable *visitTable, uint64_t startTime, int matched);
+void StatsTotals_merge(StatsTotals *into, const StatsTotals *from);
+/* Same layout as printStats, with inputInfo replaced by batchInfo */
+void printStatsTotals(Prog *prog, const StatsTotals *totals);
 
 #endif /* STATISTICS_H */
\ No newline at end of file
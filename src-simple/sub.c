@@ -4,21 +4,82 @@
 
 #include "regexp.h"
 
-Sub *freesub;
+enum
+{
+	SUBS_PER_CHUNK = 64
+};
+
+struct SubChunk
+{
+	SubChunk *next;
+	Sub subs[SUBS_PER_CHUNK];
+};
+
+void
+SubPool_init(SubPool *pool)
+{
+	pool->free = nil;
+	pool->chunks = nil;
+	pool->cur = nil;
+	pool->curUsed = 0;
+}
+
+void
+SubPool_reset(SubPool *pool)
+{
+	pool->free = nil;
+	pool->cur = pool->chunks;
+	pool->curUsed = 0;
+}
+
+void
+SubPool_destroy(SubPool *pool)
+{
+	SubChunk *c, *next;
+
+	for(c=pool->chunks; c != nil; c=next) {
+		next = c->next;
+		free(c);
+	}
+	SubPool_init(pool);
+}
+
+static Sub*
+SubPool_alloc(SubPool *pool)
+{
+	Sub *s;
+	SubChunk *c;
+
+	s = pool->free;
+	if(s != nil) {
+		pool->free = (Sub*)s->sub[0];
+		return s;
+	}
+
+	if(pool->cur != nil && pool->curUsed == SUBS_PER_CHUNK) {
+		/* Move on to the next chunk, allocating it on first use */
+		if(pool->cur->next == nil)
+			pool->cur->next = mal(sizeof *c);
+		pool->cur = pool->cur->next;
+		pool->curUsed = 0;
+	} else if(pool->cur == nil) {
+		pool->chunks = pool->cur = mal(sizeof *c);
+		pool->curUsed = 0;
+	}
+	return &pool->cur->subs[pool->curUsed++];
+}
 
 Sub*
-newsub(int n, char *start)
+newsub(SubPool *pool, int n, char *start)
 {
 	Sub *s;
 	
-	s = freesub;
-	if(s != nil)
-		freesub = (Sub*)s->sub[0];
-	else
-		s = mal(sizeof *s);
+	s = SubPool_alloc(pool);
 	s->nsub = n;
 	s->start = start;
 	s->ref = 1;
+	s->nCount = 0;
+	s->cgVecId = -1;
 	return s;
 }
 
@@ -29,30 +90,70 @@ incref(Sub *s)
 	return s;
 }
 
-Sub*
-update(Sub *s, int i, char *p)
+/* s, or if it is shared, a copy of it that only the caller holds */
+static Sub*
+own(SubPool *pool, Sub *s)
 {
 	Sub *s1;
 	int j;
 
 	if(s->ref > 1) {
 		/* Fork */
-		s1 = newsub(s->nsub, s->start);
+		s1 = newsub(pool, s->nsub, s->start);
 		for(j=0; j<s->nsub; j++)
 			s1->sub[j] = s->sub[j];
+		s1->nCount = s->nCount;
+		for(j=0; j<s->nCount; j++)
+			s1->count[j] = s->count[j];
+		s1->cgVecId = s->cgVecId;
+		s1->cgVecLive = s->cgVecLive;
 		s->ref--;
 		s = s1;
 	}
+	return s;
+}
+
+Sub*
+update(SubPool *pool, Sub *s, int i, char *p)
+{
+	s = own(pool, s);
 	s->sub[i] = p;
 	return s;
 }
 
+Sub*
+countPush(SubPool *pool, Sub *s)
+{
+	s = own(pool, s);
+	assert(s->nCount < MAXCOUNT);
+	s->count[s->nCount++] = 0;
+	return s;
+}
+
+Sub*
+countIncr(SubPool *pool, Sub *s)
+{
+	s = own(pool, s);
+	assert(s->nCount > 0);
+	s->count[s->nCount - 1]++;
+	return s;
+}
+
+Sub*
+countPop(SubPool *pool, Sub *s)
+{
+	s = own(pool, s);
+	assert(s->nCount > 0);
+	s->nCount--;
+	return s;
+}
+
 void
-decref(Sub *s)
+decref(SubPool *pool, Sub *s)
 {
 	if(--s->ref == 0) {
-		s->sub[0] = (char*)freesub;
-		freesub = s;
+		s->sub[0] = (char*)pool->free;
+		pool->free = s;
 	}
 }
 
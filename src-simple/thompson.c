@@ -30,40 +30,55 @@ threadlist(int n)
 	return mal(sizeof(ThreadList)+n*sizeof(Thread));
 }
 
+/* mark[pc - start] == gen: pc is already on the list being built.
+ * Per-match, so that one Prog can be simulated by many threads at once. */
+typedef struct Marks Marks;
+struct Marks
+{
+	Inst *start;
+	int *mark;
+	int gen;
+};
+
 static void
-addthread(ThreadList *l, Thread t)
+addthread(Marks *m, ThreadList *l, Thread t)
 {
-	if(t.pc->gen == gen)
+	if(m->mark[t.pc - m->start] == m->gen)
 		return;	// already on list
 
-	t.pc->gen = gen;
+	m->mark[t.pc - m->start] = m->gen;
 	l->t[l->n] = t;
 	l->n++;
 	
 	switch(t.pc->opcode) {
 	case Jmp:
-		addthread(l, thread(t.pc->x));
+		addthread(m, l, thread(t.pc->x));
 		break;
 	case Split:
-		addthread(l, thread(t.pc->x));
-		addthread(l, thread(t.pc->y));
+		addthread(m, l, thread(t.pc->x));
+		addthread(m, l, thread(t.pc->y));
 		break;
 	case Save:
-		addthread(l, thread(t.pc+1));
+		addthread(m, l, thread(t.pc+1));
 		break;
 	}
 }
 
 int
-thompsonvm(Prog *prog, char *input, char **subp, int nsubp)
+thompsonvm(Prog *prog, char *input, int inputLen, char **subp, int nsubp)
 {
 	int i, len, matched;
+	char *inputEOL = input + inputLen;
 	ThreadList *clist, *nlist, *tmp;
 	Inst *pc;
 	char *sp;
+	Marks m;
 	
 	for(i=0; i<nsubp; i++)
 		subp[i] = nil;
+	m.start = prog->start;
+	m.mark = mal(prog->len * sizeof m.mark[0]);
+	m.gen = 0;
 
 	len = prog->len;
 	clist = threadlist(len);
@@ -71,25 +86,30 @@ thompsonvm(Prog *prog, char *input, char **subp, int nsubp)
 	
 	if(nsubp >= 1)
 		subp[0] = input;
-	gen++;
-	addthread(clist, thread(prog->start));
+	m.gen++;
+	addthread(&m, clist, thread(prog->start));
 	matched = 0;
 	for(sp=input;; sp++) {
 		if(clist->n == 0)
 			break;
 		// printf("%d(%02x).", (int)(sp - input), *sp & 0xFF);
-		gen++;
+		m.gen++;
 		for(i=0; i<clist->n; i++) {
 			pc = clist->t[i].pc;
 			// printf(" %d", (int)(pc - prog->start));
 			switch(pc->opcode) {
 			case Char:
-				if(*sp != pc->c)
+				if(sp == inputEOL || *sp != pc->c)
 					break;
 			case Any:
-				if(*sp == 0)
+				if(sp == inputEOL)
+					break;
+				addthread(&m, nlist, thread(pc+1));
+				break;
+			case CharClass:
+				if(sp == inputEOL || !CCMAP_HAS(pc->ccMap, *sp))
 					break;
-				addthread(nlist, thread(pc+1));
+				addthread(&m, nlist, thread(pc+1));
 				break;
 			case Match:
 				if(nsubp >= 2)
@@ -108,8 +128,11 @@ thompsonvm(Prog *prog, char *input, char **subp, int nsubp)
 		clist = nlist;
 		nlist = tmp;
 		nlist->n = 0;
-		if(*sp == '\0')
+		if(sp == inputEOL)
 			break;
 	}
+	free(clist);
+	free(nlist);
+	free(m.mark);
 	return matched;
 }